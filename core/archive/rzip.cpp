@@ -18,41 +18,94 @@
 */
 #include "rzip.h"
 #include <zlib.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
 
+#include <algorithm>
 #include <cstring>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
 
 const u8 RZipHeader[8] = { '#', 'R', 'Z', 'I', 'P', 'v', 1, '#' };
+// Set in the version byte of the header when the chunks are compressed with zstd
+constexpr u8 ZstdFlag = 0x80;
 
-bool RZipFile::Open(FILE *file, bool write)
+// Number of chunks compressed or decompressed in parallel
+static u32 workerCount()
+{
+	static const u32 count = std::clamp(std::thread::hardware_concurrency(), 1u, 8u);
+	return count;
+}
+
+// Calls f(i) for each i in [0, count). The first call is made on the calling thread.
+template<typename F>
+static void parallelFor(u32 count, F f)
+{
+	std::vector<std::future<void>> futures;
+	futures.reserve(count);
+	for (u32 i = 1; i < count; i++)
+		futures.push_back(std::async(std::launch::async, f, i));
+	if (count > 0)
+		f(0);
+	for (auto& future : futures)
+		future.get();
+}
+
+bool RZipFile::Open(FILE *file, bool write, Codec codec)
 {
 	verify(this->file == nullptr);
 	verify(file != nullptr);
 	startOffset = std::ftell(file);
+	unsupported = false;
 	if (!write)
 	{
 		u8 header[sizeof(RZipHeader)];
 		if (std::fread(header, sizeof(header), 1, file) != 1
-			|| memcmp(header, RZipHeader, sizeof(header))
+			|| memcmp(header, RZipHeader, 6)
+			|| (header[6] & ~ZstdFlag) != RZipHeader[6]
+			|| header[7] != RZipHeader[7]
 			|| std::fread(&maxChunkSize, sizeof(maxChunkSize), 1, file) != 1
 			|| std::fread(&size, sizeof(size), 1, file) != 1)
 		{
 			std::fseek(file, startOffset, SEEK_SET);
 			return false;
 		}
+		this->codec = (header[6] & ZstdFlag) != 0 ? Codec::Zstd : Codec::Zlib;
+#ifndef USE_ZSTD
+		if (this->codec == Codec::Zstd)
+		{
+			WARN_LOG(SAVESTATE, "zstd compression isn't supported");
+			unsupported = true;
+			std::fseek(file, startOffset, SEEK_SET);
+			return false;
+		}
+#endif
 		// savestates created on 32-bit platforms used to have a 32-bit size
 		if (size >> 32 != 0)
 		{
 			size &= 0xffffffff;
 			std::fseek(file, -4, SEEK_CUR);
 		}
-		chunk = new u8[maxChunkSize];
+		chunk = new u8[(size_t)maxChunkSize * workerCount()];
 		chunkIndex = 0;
 		chunkSize = 0;
 	}
 	else
 	{
 		maxChunkSize = 1_MB;
-		if (std::fwrite(RZipHeader, sizeof(RZipHeader), 1, file) != 1
+#ifdef USE_ZSTD
+		this->codec = codec;
+#else
+		this->codec = Codec::Zlib;
+#endif
+		u8 header[sizeof(RZipHeader)];
+		memcpy(header, RZipHeader, sizeof(header));
+		if (this->codec == Codec::Zstd)
+			header[6] |= ZstdFlag;
+		if (std::fwrite(header, sizeof(header), 1, file) != 1
 			|| std::fwrite(&maxChunkSize, sizeof(maxChunkSize), 1, file) != 1
 			|| std::fwrite(&size, sizeof(size), 1, file) != 1)
 		{
@@ -65,12 +118,12 @@ bool RZipFile::Open(FILE *file, bool write)
 	return true;
 }
 
-bool RZipFile::Open(const std::string& path, bool write)
+bool RZipFile::Open(const std::string& path, bool write, Codec codec)
 {
 	FILE *f = nowide::fopen(path.c_str(), write ? "wb" : "rb");
 	if (f == nullptr)
 		return false;
-	if (!Open(f, write)) {
+	if (!Open(f, write, codec)) {
 		Close();
 		return false;
 	}
@@ -96,6 +149,82 @@ void RZipFile::Close()
 	}
 }
 
+// Returns the compressed size, or 0 on error
+size_t RZipFile::compressChunk(u8 *dst, size_t dstSize, const u8 *src, u32 srcSize) const
+{
+#ifdef USE_ZSTD
+	if (codec == Codec::Zstd)
+	{
+		size_t rc = ZSTD_compress(dst, dstSize, src, srcSize, ZSTD_CLEVEL_DEFAULT);
+		if (ZSTD_isError(rc))
+		{
+			WARN_LOG(SAVESTATE, "Compression error: %s", ZSTD_getErrorName(rc));
+			return 0;
+		}
+		return rc;
+	}
+#endif
+	uLongf zippedSize = dstSize;
+	int rc = compress(dst, &zippedSize, src, srcSize);
+	if (rc != Z_OK)
+	{
+		WARN_LOG(SAVESTATE, "Compression error: %d", rc);
+		return 0;
+	}
+	return zippedSize;
+}
+
+// Returns the uncompressed size, or -1 on error
+size_t RZipFile::uncompressChunk(u8 *dst, const u8 *src, u32 srcSize) const
+{
+#ifdef USE_ZSTD
+	if (codec == Codec::Zstd)
+	{
+		size_t rc = ZSTD_decompress(dst, maxChunkSize, src, srcSize);
+		return ZSTD_isError(rc) ? (size_t)-1 : rc;
+	}
+#endif
+	uLongf tl = maxChunkSize;
+	if (uncompress(dst, &tl, src, srcSize) != Z_OK)
+		return (size_t)-1;
+	return tl;
+}
+
+// Reads and decompresses up to count chunks in parallel. Returns false if no data could be read.
+bool RZipFile::readChunks(u32 count)
+{
+	chunkSize = 0;
+	chunkIndex = 0;
+	std::vector<std::vector<u8>> zipped;
+	zipped.reserve(count);
+	while (zipped.size() < count)
+	{
+		u32 zippedSize;
+		if (std::fread(&zippedSize, sizeof(zippedSize), 1, file) != 1)
+			break;
+		if (zippedSize == 0)
+			continue;
+		std::vector<u8>& data = zipped.emplace_back(zippedSize);
+		if (std::fread(data.data(), zippedSize, 1, file) != 1)
+		{
+			zipped.pop_back();
+			break;
+		}
+	}
+	std::vector<size_t> sizes(zipped.size());
+	parallelFor(zipped.size(), [&](u32 i) {
+		sizes[i] = uncompressChunk(&chunk[(size_t)i * maxChunkSize], zipped[i].data(), zipped[i].size());
+	});
+	for (u32 i = 0; i < zipped.size() && sizes[i] != (size_t)-1; i++)
+	{
+		// only the last chunk is expected to be smaller
+		if (chunkSize != (size_t)i * maxChunkSize)
+			memmove(&chunk[chunkSize], &chunk[(size_t)i * maxChunkSize], sizes[i]);
+		chunkSize += (u32)sizes[i];
+	}
+	return chunkSize != 0;
+}
+
 size_t RZipFile::Read(void *data, size_t length)
 {
 	verify(file != nullptr);
@@ -107,29 +236,12 @@ size_t RZipFile::Read(void *data, size_t length)
 	{
 		if (chunkIndex == chunkSize)
 		{
-			chunkSize = 0;
-			chunkIndex = 0;
-			u32 zippedSize;
-			if (std::fread(&zippedSize, sizeof(zippedSize), 1, file) != 1)
+			// decompress the chunks needed for the rest of the request, up to one per worker
+			const size_t chunks = (length - rv + maxChunkSize - 1) / maxChunkSize;
+			if (!readChunks((u32)std::min<size_t>(chunks, workerCount())))
 				break;
-			if (zippedSize == 0)
-				continue;
-			u8 *zipped = new u8[zippedSize];
-			if (std::fread(zipped, zippedSize, 1, file) != 1)
-			{
-				delete [] zipped;
-				break;
-			}
-			uLongf tl = maxChunkSize;
-			if (uncompress(chunk, &tl, zipped, zippedSize) != Z_OK)
-			{
-				delete [] zipped;
-				break;
-			}
-			delete [] zipped;
-			chunkSize = (u32)tl;
 		}
-		u32 l = std::min(chunkSize - chunkIndex, (u32)(length - rv));
+		u32 l = std::min(chunkSize - chunkIndex, (u32)std::min<size_t>(length - rv, UINT32_MAX));
 		memcpy(p, chunk + chunkIndex, l);
 		p += l;
 		chunkIndex += l;
@@ -146,31 +258,40 @@ size_t RZipFile::Write(const void *data, size_t length)
 
 	size += length;
 	const u8 *p = (const u8 *)data;
-	// compression output buffer must be 0.1% larger + 12 bytes
-	uLongf maxZippedSize = maxChunkSize + maxChunkSize / 1000 + 12;
-	u8 *zipped = new u8[maxZippedSize];
+	size_t maxZippedSize;
+#ifdef USE_ZSTD
+	if (codec == Codec::Zstd)
+		maxZippedSize = ZSTD_compressBound(maxChunkSize);
+	else
+#endif
+		// compression output buffer must be 0.1% larger + 12 bytes
+		maxZippedSize = maxChunkSize + maxChunkSize / 1000 + 12;
+	// chunks are compressed in parallel and written in order
+	const u32 workers = (u32)std::min<size_t>((length + maxChunkSize - 1) / maxChunkSize, workerCount());
+	std::vector<std::unique_ptr<u8[]>> zipped(workers);
+	for (auto& buffer : zipped)
+		buffer.reset(new u8[maxZippedSize]);
+	std::vector<size_t> zippedSizes(workers);
 	size_t rv = 0;
 	while (rv < length)
 	{
-		uLongf zippedSize = maxZippedSize;
-		uLongf uncompressedSize = std::min(maxChunkSize, (u32)(length - rv));
-		u32 rc = compress(zipped, &zippedSize, p, uncompressedSize);
-		if (rc != Z_OK)
+		const u32 count = (u32)std::min<size_t>((length - rv + maxChunkSize - 1) / maxChunkSize, workers);
+		parallelFor(count, [&](u32 i) {
+			const size_t offset = rv + (size_t)i * maxChunkSize;
+			const u32 uncompressedSize = (u32)std::min<size_t>(maxChunkSize, length - offset);
+			zippedSizes[i] = compressChunk(zipped[i].get(), maxZippedSize, p + offset, uncompressedSize);
+		});
+		for (u32 i = 0; i < count; i++)
 		{
-			WARN_LOG(SAVESTATE, "Compression error: %d", rc);
-			break;
+			if (zippedSizes[i] == 0)
+				return rv;
+			u32 sz = (u32)zippedSizes[i];
+			if (std::fwrite(&sz, sizeof(sz), 1, file) != 1
+				|| std::fwrite(zipped[i].get(), sz, 1, file) != 1)
+				return 0;
+			rv += std::min<size_t>(maxChunkSize, length - rv);
 		}
-		u32 sz = (u32)zippedSize;
-		if (std::fwrite(&sz, sizeof(sz), 1, file) != 1
-			|| std::fwrite(zipped, zippedSize, 1, file) != 1)
-		{
-			rv = 0;
-			break;
-		}
-		p += uncompressedSize;
-		rv += uncompressedSize;
 	}
-	delete [] zipped;
-	
+
 	return rv;
 }
@@ -25,23 +25,39 @@
 class RZipFile
 {
 public:
+	enum class Codec {
+		Zlib,
+		// not supported by libretro
+		Zstd,
+	};
+
 	~RZipFile() { Close(); }
 
-	bool Open(const std::string& path, bool write);
-	bool Open(FILE *file, bool write);
+	// The codec is only used when writing
+	bool Open(const std::string& path, bool write, Codec codec = Codec::Zlib);
+	bool Open(FILE *file, bool write, Codec codec = Codec::Zlib);
 	void Close();
 	size_t Size() const { return size; }
 	size_t Read(void *data, size_t length);
 	size_t Write(const void *data, size_t length);
 	FILE *rawFile() const { return file; }
+	// Open failed because the file is compressed with an unsupported codec
+	bool Unsupported() const { return unsupported; }
 
 private:
+	bool readChunks(u32 count);
+	size_t compressChunk(u8 *dst, size_t dstSize, const u8 *src, u32 srcSize) const;
+	size_t uncompressChunk(u8 *dst, const u8 *src, u32 srcSize) const;
+
 	FILE *file = nullptr;
 	u64 size = 0;
 	u32 maxChunkSize = 0;
+	Codec codec = Codec::Zlib;
+	// holds up to one uncompressed chunk per worker thread
 	u8 *chunk = nullptr;
 	u32 chunkSize = 0;
 	u32 chunkIndex = 0;
 	bool write = false;
+	bool unsupported = false;
 	long startOffset = 0;
 };
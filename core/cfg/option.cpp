@@ -25,6 +25,20 @@ namespace config {
 // Dynarec
 
 Option<bool> DynarecEnabled("Dynarec.Enabled", true);
+Option<bool> DynarecTieredCompilation("Dynarec.TieredCompilation", false);
+Option<bool> DynarecGlobalRegAlloc("Dynarec.GlobalRegAlloc", false);
+Option<bool> DynarecSubPageSmc("Dynarec.SubPageSmc", false);
+Option<bool> DynarecBackgroundCompilation("Dynarec.BackgroundCompilation", false);
+Option<bool> DynarecPrecompile("Dynarec.Precompile", false);
+Option<bool> DynarecMemSpecialization("Dynarec.MemSpecialization", false);
+Option<bool> DynarecCodeEviction("Dynarec.CodeEviction", false);
+Option<bool> DynarecFpscrSpeculation("Dynarec.FpscrSpeculation", false);
+Option<bool> DynarecIdleLoops("Dynarec.IdleLoops", false);
+Option<bool> InterpreterPredecode("Dynarec.InterpreterPredecode", false);
+Option<bool> EventBatching("Dynarec.EventBatching", false);
+Option<bool> OperandCacheEmulation("Dynarec.OperandCache", false);
+Option<bool> DynarecPersistentCache("Dynarec.PersistentCache", false);
+Option<int> DynarecPersistentCacheSize("Dynarec.PersistentCacheSize", 64);	// MB
 Option<int> Sh4Clock("Sh4Clock", 200);
 
 // General
@@ -36,6 +50,10 @@ Option<int> Language("Dreamcast.Language", 1);		// English
 Option<bool> AutoLoadState("Dreamcast.AutoLoadState");
 Option<bool> AutoSaveState("Dreamcast.AutoSaveState");
 Option<int, false> SavestateSlot("Dreamcast.SavestateSlot");
+Option<bool> SavestateZstd("Dreamcast.SavestateZstd");
+Option<bool> Rewind("Rewind", false);
+Option<int> RewindInterval("RewindInterval", 4);	// frames
+Option<int> RewindBudget("RewindBudget", 256);		// MB
 Option<bool> ForceFreePlay("ForceFreePlay", true);
 Option<bool, false> FetchBoxart("FetchBoxart", true);
 Option<bool, false> BoxartDisplayMode("BoxartDisplayMode", true);
@@ -177,6 +195,7 @@ Option<int> GGPOAnalogAxes("GGPOAnalogAxes", 0, "network");
 Option<bool> GGPOChat("GGPOChat", true, "network");
 Option<bool> GGPOChatTimeoutToggle("GGPOChatTimeoutToggle", true, "network");
 Option<int> GGPOChatTimeout("GGPOChatTimeout", 10, "network");
+Option<bool> GGPOSoftDirty("GGPOSoftDirty", false, "network");
 Option<bool> NetworkOutput("NetworkOutput", false, "network");
 Option<int> MultiboardSlaves("MultiboardSlaves", 1, "network");
 Option<bool> BattleCableEnable("BattleCable", false, "network");
@@ -350,6 +350,20 @@ using OptionString = Option<std::string>;
 // Dynarec
 
 extern Option<bool> DynarecEnabled;
+extern Option<bool> DynarecTieredCompilation;
+extern Option<bool> DynarecGlobalRegAlloc;
+extern Option<bool> DynarecSubPageSmc;
+extern Option<bool> DynarecBackgroundCompilation;
+extern Option<bool> DynarecPrecompile;
+extern Option<bool> DynarecMemSpecialization;
+extern Option<bool> DynarecCodeEviction;
+extern Option<bool> DynarecFpscrSpeculation;
+extern Option<bool> DynarecIdleLoops;
+extern Option<bool> InterpreterPredecode;
+extern Option<bool> EventBatching;
+extern Option<bool> OperandCacheEmulation;
+extern Option<bool> DynarecPersistentCache;
+extern Option<int> DynarecPersistentCacheSize;
 #ifndef LIBRETRO
 extern Option<int> Sh4Clock;
 #endif
@@ -363,6 +377,10 @@ extern Option<int> Language;	// 0 -> JP, 1 -> EN, 2 -> DE, 3 -> FR, 4 -> SP, 5 -
 extern Option<bool> AutoLoadState;
 extern Option<bool> AutoSaveState;
 extern Option<int, false> SavestateSlot;
+extern Option<bool> SavestateZstd;
+extern Option<bool> Rewind;
+extern Option<int> RewindInterval;	// frames between snapshots
+extern Option<int> RewindBudget;		// MB
 extern Option<bool> ForceFreePlay;
 extern Option<bool, false> FetchBoxart;
 extern Option<bool, false> BoxartDisplayMode;
@@ -533,6 +551,7 @@ extern Option<int> GGPOAnalogAxes;
 extern Option<bool> GGPOChat;
 extern Option<bool> GGPOChatTimeoutToggle;
 extern Option<int> GGPOChatTimeout;
+extern Option<bool> GGPOSoftDirty;
 extern Option<bool> NetworkOutput;
 extern Option<int> MultiboardSlaves;
 extern Option<bool> BattleCableEnable;
@@ -30,6 +30,7 @@
 #include "hw/sh4/sh4_sched.h"
 #include "hw/flashrom/nvmem.h"
 #include "cheats.h"
+#include "rewind.h"
 #include "audio/audiostream.h"
 #include "debug/gdb_server.h"
 #include "hw/pvr/Renderer_if.h"
@@ -424,6 +425,7 @@ void Emulator::dc_reset(bool hard)
 		NetworkHandshake::term();
 		memwatch::unprotect();
 		memwatch::reset();
+		rewinder::reset();
 	}
 	sh4_sched_reset(hard);
 	pvr::reset(hard);
@@ -902,6 +904,7 @@ void Emulator::loadstate(Deserializer& deser)
 #endif
 	memwatch::unprotect();
 	memwatch::reset();
+	rewinder::reset();
 
 	dc_deserialize(deser);
 
@@ -960,6 +963,8 @@ void Emulator::run()
 		runInternal();
 		if (ggpo::active())
 			ggpo::nextFrame();
+		else if (rewinder::active())
+			rewinder::nextFrame();
 	} catch (const std::exception& e) {
 		ERROR_LOG(COMMON, "Exception: %s\n", e.what());
 		setNetworkState(false);
@@ -980,8 +985,8 @@ void Emulator::start()
 	}
 	state = Running;
 	SetMemoryHandlers();
-	if (config::GGPOEnable && config::ThreadedRendering)
-		// Not supported with GGPO
+	if ((config::GGPOEnable || config::Rewind) && config::ThreadedRendering)
+		// Not supported with GGPO or rewinding
 		config::EmulateFramebuffer.override(false);
 	setupPtyPipe();
 
@@ -1001,6 +1006,8 @@ void Emulator::start()
 						startTime = sh4_sched_now64();
 						renderTimeout = false;
 						runInternal();
+						if (rewinder::nextFrame())
+							continue;
 						if (!ggpo::nextFrame())
 							break;
 					}
@@ -1084,6 +1091,8 @@ void Emulator::vblank()
 	renderTimeout = true;
 	if (ggpo::active())
 		ggpo::endOfFrame();
+	else if (rewinder::active())
+		rewinder::endOfFrame();
 	else if (!config::ThreadedRendering)
 		getSh4Executor()->Stop();
 }
@@ -18,15 +18,141 @@
 */
 #include "mem_watch.h"
 #include "oslib/virtmem.h"
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <array>
+#endif
 
 namespace memwatch
 {
 
+Tracking tracking = Tracking::Mprotect;
 VramWatcher vramWatcher;
 RamWatcher ramWatcher;
 AicaRamWatcher aramWatcher;
 ElanRamWatcher elanWatcher;
 
+PageRing savedPages;
+
+void PageRing::grow(u32 newCapacity)
+{
+	std::unique_ptr<Page[]> newPages = std::make_unique<Page[]>(newCapacity);
+	std::unique_ptr<u8[]> newBuffer = std::make_unique<u8[]>((size_t)newCapacity * PAGE_SIZE);
+	for (u64 pos = _tail; pos < _head; pos++)
+	{
+		newPages[pos % newCapacity] = page(pos);
+		memcpy(&newBuffer[(size_t)(pos % newCapacity) * PAGE_SIZE], data(pos), PAGE_SIZE);
+	}
+	pages = std::move(newPages);
+	buffer = std::move(newBuffer);
+	capacity = newCapacity;
+	totalAllocated += memorySize();
+	DEBUG_LOG(NETWORK, "Saved page ring grown to %d pages", capacity);
+}
+
+void PageRing::term()
+{
+	pages.reset();
+	buffer.reset();
+	capacity = 0;
+	_head = _tail = 0;
+}
+
+namespace softdirty
+{
+#if defined(__linux__)
+
+constexpr u64 SoftDirtyBit = 1ull << 55;
+static int pagemapFd = -1;
+static int clearRefsFd = -1;
+
+static bool isDirty(const void *p)
+{
+	u64 entry;
+	if (pread(pagemapFd, &entry, sizeof(entry), (uintptr_t)p / PAGE_SIZE * sizeof(entry)) != sizeof(entry))
+		return false;
+	return (entry & SoftDirtyBit) != 0;
+}
+
+static bool probe()
+{
+	pagemapFd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+	clearRefsFd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+	if (pagemapFd == -1 || clearRefsFd == -1)
+		return false;
+	// the emulated memory is shared so that it can be mirrored
+	volatile u8 *page = (volatile u8 *)mmap(nullptr, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED)
+		return false;
+	page[0] = 1;
+	clear();
+	bool rc = !isDirty((const void *)page);
+	page[0] = 2;
+	rc = rc && isDirty((const void *)page);
+	munmap((void *)page, PAGE_SIZE);
+
+	return rc;
+}
+
+bool available()
+{
+	static int status = -1;
+	if (status == -1)
+	{
+		status = probe();
+		if (status)
+			INFO_LOG(NETWORK, "Soft-dirty page tracking available");
+		else
+			WARN_LOG(NETWORK, "Soft-dirty page tracking isn't supported by the kernel");
+	}
+	return status;
+}
+
+void clear()
+{
+	if (write(clearRefsFd, "4", 1) != 1)
+		WARN_LOG(NETWORK, "Can't clear soft-dirty bits: errno %d", errno);
+}
+
+void getDirtyPages(const void *start, u32 size, std::vector<u64>& bitmap)
+{
+	std::array<u64, 512> entries;
+	const u64 firstPage = (uintptr_t)start / PAGE_SIZE;
+	const u32 pageCount = size / PAGE_SIZE;
+	for (u32 page = 0; page < pageCount; )
+	{
+		const u32 count = std::min<u32>(entries.size(), pageCount - page);
+		ssize_t rc = pread(pagemapFd, entries.data(), count * sizeof(u64), (firstPage + page) * sizeof(u64));
+		if (rc < (ssize_t)sizeof(u64))
+		{
+			// consider all remaining pages dirty
+			WARN_LOG(NETWORK, "Page map read failed: errno %d", errno);
+			for (; page < pageCount; page++)
+				bitmap[page / 64] |= 1ull << (page % 64);
+			break;
+		}
+		const u32 read = rc / sizeof(u64);
+		for (u32 i = 0; i < read; i++, page++)
+			if (entries[i] & SoftDirtyBit)
+				bitmap[page / 64] |= 1ull << (page % 64);
+	}
+}
+
+#else
+
+bool available() {
+	return false;
+}
+void clear() {
+}
+void getDirtyPages(const void *start, u32 size, std::vector<u64>& bitmap) {
+}
+
+#endif
+}
+
 void AicaRamWatcher::protectMem(u32 addr, u32 size)
 {
 	size = std::min(ARAM_SIZE - addr, size) & ~PAGE_MASK;
@@ -25,48 +25,198 @@
 #include "hw/pvr/pvr_mem.h"
 #include "hw/pvr/elan.h"
 #include "rend/TexCache.h"
-#include <unordered_map>
+#include "log/BitSet.h"
 #include <memory>
+#include <vector>
 
 namespace memwatch
 {
 
-struct Page
+enum class Tracking
 {
-	std::unique_ptr<u8[]> data = std::make_unique<u8[]>(PAGE_SIZE);
+	// The watched memory is write-protected and each page is saved on its first write fault
+	Mprotect,
+	// A copy of the watched memory is kept and the pages written to are found
+	// with the soft-dirty bits of the linux page map
+	SoftDirty,
 };
-using PageMap = std::unordered_map<u32, Page>;
+extern Tracking tracking;
+
+namespace softdirty
+{
+// Returns true if the kernel tracks writes to shared memory with soft-dirty bits
+bool available();
+// Clears the soft-dirty bits of the whole process
+void clear();
+// Sets the bit of each page of the given range that has been written to since the last clear()
+void getDirtyPages(const void *start, u32 size, std::vector<u64>& bitmap);
+}
+
+enum class Region : u8
+{
+	Ram,
+	Vram,
+	Aram,
+	ElanRam,
+};
+
+/*
+	Pages saved by the watchers with their contents before being written to,
+	in the order they are saved. Pages are identified by their position, which
+	always increases. The page buffers are preallocated and reused. The ring
+	only grows when more pages are kept than it can hold.
+*/
+class PageRing
+{
+public:
+	struct Page
+	{
+		Region region;
+		u32 offset;
+	};
+
+	// Saves a copy of the given page
+	void add(Region region, u32 offset, const void *data)
+	{
+		if (_head - _tail == capacity)
+			// 16 MB to start with
+			grow(std::max<u32>(capacity * 2, 4096));
+		const u32 slot = _head % capacity;
+		pages[slot] = { region, offset };
+		memcpy(&buffer[(size_t)slot * PAGE_SIZE], data, PAGE_SIZE);
+		_head++;
+	}
+
+	const Page& page(u64 pos) const {
+		return pages[pos % capacity];
+	}
+	const u8 *data(u64 pos) const {
+		return &buffer[(size_t)(pos % capacity) * PAGE_SIZE];
+	}
+
+	// position of the next page to be saved
+	u64 head() const { return _head; }
+	// position of the oldest page kept
+	u64 tail() const { return _tail; }
+	// Discards the pages saved at and after the given position
+	void truncate(u64 pos) {
+		_head = std::max(pos, _tail);
+	}
+	// Discards the pages saved before the given position
+	void release(u64 pos) {
+		_tail = std::min(pos, _head);
+	}
+	// Makes room for the given number of pages
+	void reserve(u32 pages)
+	{
+		if (pages > capacity)
+			grow(pages);
+	}
+	// Discards all pages and frees the buffers
+	void term();
+
+	size_t memorySize() const {
+		return (size_t)capacity * (PAGE_SIZE + sizeof(Page));
+	}
+	// Total number of bytes allocated since the ring was created
+	u64 allocatedBytes() const {
+		return totalAllocated;
+	}
+
+private:
+	void grow(u32 newCapacity);
+
+	std::unique_ptr<Page[]> pages;
+	std::unique_ptr<u8[]> buffer;
+	u32 capacity = 0;
+	u64 _head = 0;
+	u64 _tail = 0;
+	u64 totalAllocated = 0;
+};
+extern PageRing savedPages;
 
 template<typename T>
 class Watcher
 {
 	bool started;
-	PageMap pages;
+	// offsets of the pages saved since the last protect()
+	std::vector<u32> pages;
+	std::vector<u64> savedBits;
+	// soft-dirty tracking: contents of the memory at the last protect()
+	std::unique_ptr<u8[]> shadow;
+	u32 shadowSize = 0;
+	std::vector<u64> dirtyPages;
+
+	// Saves the previous contents of the pages written to since the last call and updates the copy
+	void snapshot()
+	{
+		T& self = static_cast<T&>(*this);
+		const u32 size = self.getMemSize();
+		if (size == 0)
+			return;
+		if (shadowSize != size)
+		{
+			shadow = std::make_unique<u8[]>(size);
+			memcpy(&shadow[0], self.getMemPage(0), size);
+			shadowSize = size;
+			started = true;
+			return;
+		}
+		dirtyPages.assign((size / PAGE_SIZE + 63) / 64, 0);
+		self.forEachMapping([this](const void *p, u32 size) {
+			softdirty::getDirtyPages(p, size, dirtyPages);
+		});
+		for (u32 i = 0; i < dirtyPages.size(); i++)
+		{
+			for (u64 bits = dirtyPages[i]; bits != 0; bits &= bits - 1)
+			{
+				const u32 offset = (i * 64 + Common::LeastSignificantSetBit(bits)) * PAGE_SIZE;
+				// pages written to before the first protect() after a reset only need to be copied
+				if (started)
+					savedPages.add(T::region, offset, &shadow[offset]);
+				memcpy(&shadow[offset], self.getMemPage(offset), PAGE_SIZE);
+			}
+		}
+		started = true;
+	}
 
 public:
 	void protect()
 	{
-		if (!started)
+		if (tracking == Tracking::SoftDirty)
+			snapshot();
+		else if (!started)
 		{
 			static_cast<T&>(*this).protectMem(0, 0xffffffff);
 			started = true;
 		}
 		else
 		{
-			for (const auto& pair : pages)
-				static_cast<T&>(*this).protectMem(pair.first, PAGE_SIZE);
+			for (u32 offset : pages)
+			{
+				static_cast<T&>(*this).protectMem(offset, PAGE_SIZE);
+				savedBits[offset / PAGE_SIZE / 64] = 0;
+			}
 		}
+		pages.clear();
 	}
 
 	void unprotect()
 	{
-		static_cast<T&>(*this).unprotectMem(0, 0xffffffff);
+		if (tracking == Tracking::Mprotect)
+			static_cast<T&>(*this).unprotectMem(0, 0xffffffff);
 	}
 
 	void reset()
 	{
 		started = false;
 		pages.clear();
+		savedBits.clear();
+		if (tracking == Tracking::Mprotect)
+		{
+			shadow.reset();
+			shadowSize = 0;
+		}
 	}
 
 	bool hit(void *addr)
@@ -75,26 +225,25 @@ public:
 		if (offset == (u32)-1)
 			return false;
 		offset &= ~PAGE_MASK;
-	    auto rv = pages.try_emplace(offset);
-	    if (!rv.second)
-	      // already saved
-	      return true;
-	    Page& page = rv.first->second;
-	    memcpy(&page.data[0], static_cast<T&>(*this).getMemPage(offset), PAGE_SIZE);
+		const u32 page = offset / PAGE_SIZE;
+		if (savedBits.size() <= page / 64)
+			savedBits.resize(page / 64 + 1);
+		u64& bits = savedBits[page / 64];
+		if (bits & (1ull << (page % 64)))
+			// already saved
+			return true;
+		bits |= 1ull << (page % 64);
+		pages.push_back(offset);
+		savedPages.add(T::region, offset, static_cast<T&>(*this).getMemPage(offset));
 		static_cast<T&>(*this).unprotectMem(offset, PAGE_SIZE);
 		return true;
 	}
-
-	void getPages(PageMap& other)
-	{
-		std::swap(pages, other);
-		pages = PageMap();
-	}
 };
 
 class VramWatcher : public Watcher<VramWatcher>
 {
 	friend class Watcher<VramWatcher>;
+	static constexpr Region region = Region::Vram;
 
 protected:
 	void protectMem(u32 addr, u32 size)
@@ -112,6 +261,28 @@ protected:
 		return addrspace::getVramOffset(p);
 	}
 
+	u32 getMemSize() {
+		return VRAM_SIZE;
+	}
+
+	template<typename F>
+	void forEachMapping(F f)
+	{
+		if (addrspace::virtmemEnabled())
+		{
+			// area 1 and its mirror
+			for (u32 addr = 0x04000000; addr < 0x05000000; addr += VRAM_SIZE)
+			{
+				f(addrspace::ram_base + addr, VRAM_SIZE);
+				f(addrspace::ram_base + addr + 0x02000000, VRAM_SIZE);
+			}
+		}
+		else
+		{
+			f(&vram[0], VRAM_SIZE);
+		}
+	}
+
 public:
 	void *getMemPage(u32 addr)
 	{
@@ -122,6 +293,7 @@ public:
 class RamWatcher : public Watcher<RamWatcher>
 {
 	friend class Watcher<RamWatcher>;
+	static constexpr Region region = Region::Ram;
 
 protected:
 	void protectMem(u32 addr, u32 size)
@@ -139,6 +311,25 @@ protected:
 		return bm_getRamOffset(p);
 	}
 
+	u32 getMemSize() {
+		return RAM_SIZE;
+	}
+
+	template<typename F>
+	void forEachMapping(F f)
+	{
+		if (addrspace::virtmemEnabled())
+		{
+			// area 3 mirrors
+			for (u32 addr = 0x0C000000; addr < 0x10000000; addr += RAM_SIZE)
+				f(addrspace::ram_base + addr, RAM_SIZE);
+		}
+		else
+		{
+			f(&mem_b[0], RAM_SIZE);
+		}
+	}
+
 public:
 	void *getMemPage(u32 addr)
 	{
@@ -149,12 +340,32 @@ public:
 class AicaRamWatcher : public Watcher<AicaRamWatcher>
 {
 	friend class Watcher<AicaRamWatcher>;
+	static constexpr Region region = Region::Aram;
 
 protected:
 	void protectMem(u32 addr, u32 size);
 	void unprotectMem(u32 addr, u32 size);
 	u32 getMemOffset(void *p);
 
+	u32 getMemSize() {
+		return ARAM_SIZE;
+	}
+
+	template<typename F>
+	void forEachMapping(F f)
+	{
+		if (addrspace::virtmemEnabled())
+		{
+			// writable mapping
+			for (u32 addr = 0x20000000; addr < 0x20800000; addr += ARAM_SIZE)
+				f(addrspace::ram_base + addr, ARAM_SIZE);
+		}
+		else
+		{
+			f(&aica::aica_ram[0], ARAM_SIZE);
+		}
+	}
+
 public:
 	void *getMemPage(u32 addr)
 	{
@@ -165,11 +376,30 @@ public:
 class ElanRamWatcher : public Watcher<ElanRamWatcher>
 {
 	friend class Watcher<ElanRamWatcher>;
+	static constexpr Region region = Region::ElanRam;
 
 protected:
 	void protectMem(u32 addr, u32 size);
 	u32 getMemOffset(void *p);
 
+	u32 getMemSize() {
+		return elan::ERAM_SIZE;
+	}
+
+	template<typename F>
+	void forEachMapping(F f)
+	{
+		if (addrspace::virtmemEnabled())
+		{
+			for (u32 addr = 0x0A000000; addr < 0x0C000000; addr += elan::ERAM_SIZE)
+				f(addrspace::ram_base + addr, elan::ERAM_SIZE);
+		}
+		else
+		{
+			f(elan::RAM, elan::ERAM_SIZE);
+		}
+	}
+
 public:
 	void unprotectMem(u32 addr, u32 size);
 	void *getMemPage(u32 addr)
@@ -183,9 +413,30 @@ extern RamWatcher ramWatcher;
 extern AicaRamWatcher aramWatcher;
 extern ElanRamWatcher elanWatcher;
 
+inline static void *getMemPage(Region region, u32 offset)
+{
+	switch (region)
+	{
+	case Region::Ram:
+		return ramWatcher.getMemPage(offset);
+	case Region::Vram:
+		return vramWatcher.getMemPage(offset);
+	case Region::Aram:
+		return aramWatcher.getMemPage(offset);
+	case Region::ElanRam:
+	default:
+		return elanWatcher.getMemPage(offset);
+	}
+}
+
+// Pages are saved for GGPO rollbacks and for rewinding
+inline static bool enabled() {
+	return config::GGPOEnable || config::Rewind;
+}
+
 inline static bool writeAccess(void *p)
 {
-	if (!config::GGPOEnable)
+	if (!enabled() || tracking != Tracking::Mprotect)
 		return false;
 	if (ramWatcher.hit(p))
 	{
@@ -204,12 +455,14 @@ inline static bool writeAccess(void *p)
 
 inline static void protect()
 {
-	if (!config::GGPOEnable)
+	if (!enabled())
 		return;
 	vramWatcher.protect();
 	ramWatcher.protect();
 	aramWatcher.protect();
 	elanWatcher.protect();
+	if (tracking == Tracking::SoftDirty)
+		softdirty::clear();
 }
 
 inline static void unprotect()
@@ -222,6 +475,7 @@ inline static void unprotect()
 
 inline static void reset()
 {
+	tracking = config::GGPOSoftDirty && softdirty::available() ? Tracking::SoftDirty : Tracking::Mprotect;
 	vramWatcher.reset();
 	ramWatcher.reset();
 	aramWatcher.reset();
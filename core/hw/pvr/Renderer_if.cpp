@@ -10,6 +10,7 @@
 #include "hw/sh4/sh4_core.h"
 #include "profiler/fc_profiler.h"
 #include "network/ggpo.h"
+#include "rewind.h"
 
 #include <mutex>
 #include <deque>
@@ -234,7 +235,7 @@ private:
 		if (renderer->Present())
 		{
 			presented = true;
-			if (!config::ThreadedRendering && !ggpo::active())
+			if (!config::ThreadedRendering && !ggpo::active() && !rewinder::active())
 				emu.getSh4Executor()->Stop();
 #ifdef LIBRETRO
 			retro_rend_present();
@@ -412,6 +413,7 @@ void rend_start_render()
 			ctx->rend.clearFramebuffer = false;
 		}
 		ggpo::endOfFrame();
+		rewinder::endOfFrame();
 	}
 
 	if (QueueRender(ctx))
@@ -215,6 +215,17 @@ static int spg_line_sched(int tag, int cycles, int jitter, void *arg)
 					mspdf, spd_cpu * 100 / 200, spd_vbs,
 					spd_vbs / full_rps, mode, res, fullvbs,
 					spd_fps, fskip / ts);
+
+				// timeslices and scheduler ticks per frame
+				static u64 lastSlices, lastTicks;
+				const u64 slices = sh4_sched_slice_count();
+				const u64 ticks = sh4_sched_tick_count();
+				const double vblanks = spd_vbs * ts;
+				if (vblanks != 0 && slices >= lastSlices)
+					INFO_LOG(COMMON, "SH4 - slices/frame %.1f ticks/frame %.1f",
+						(slices - lastSlices) / vblanks, (ticks - lastTicks) / vblanks);
+				lastSlices = slices;
+				lastTicks = ticks;
 				
 				fskip = 0;
 				last_fps = getTimeMs();
@@ -0,0 +1,251 @@
+/*
+	Background block compilation.
+
+	When the dynarec doesn't find a block, the block is queued to the compiler
+	thread and the emulation thread interprets the guest code until the next
+	branch. The compiler thread decodes, optimizes and emits the block at the
+	end of the code buffer while holding the compiler mutex, which is also held
+	by the emulation thread when it compiles synchronously or flushes the cache.
+
+	Compiled blocks aren't visible until the emulation thread publishes them:
+	page protection, block manager insertion and the FPCB update are only done
+	on the emulation thread. The guest code can be modified by the emulation
+	thread while it is being decoded, so blocks are dropped if the memory they
+	may have been decoded from changed during their compilation. Blocks compiled
+	without code checks are also dropped if their code changed before they are
+	published, or if their page can't be protected anymore.
+*/
+#include "bgcompile.h"
+
+#if FEAT_SHREC != DYNAREC_NONE
+#include "blockmanager.h"
+#include "decoder.h"
+#include "ngen.h"
+#include "globalregs.h"
+#include "hw/sh4/sh4_mem.h"
+#include "hw/sh4/modules/mmu.h"
+#include "cfg/option.h"
+#include "util/worker_thread.h"
+#include <xxhash.h>
+
+#include <unordered_set>
+#include <vector>
+
+namespace bgcompile
+{
+
+struct Job
+{
+	RuntimeBlockInfo *block;
+	u32 pc;
+	fpscr_t fpscr;
+	u32 generation;
+	u64 codeHash;
+	bool compiled;
+	// the code was modified while being compiled
+	bool codeChanged;
+};
+
+static WorkerThread worker("SH4 compiler");
+static Sh4CodeBuffer *codeBuffer;
+static std::mutex compMutex;
+// Compiled jobs waiting to be published. Locked after compMutex.
+static std::mutex doneMutex;
+static std::vector<Job> done;
+// Incremented when the code cache is flushed to invalidate the queued jobs
+static u32 generation;
+// Emulation thread only
+static std::unordered_set<u32> pending;
+static std::unordered_set<u32> synchronous;
+static std::vector<Job> publishing;
+static bool initialized;
+static Stats stats;
+
+// Memory that may be read when decoding and optimizing a block: from the start of its first page,
+// which the optimizer may read, to its traces and the opcodes aggregated by the decoder.
+constexpr u32 MaxCodeSpan = 0x1000 + TRACE_MAX_SPAN + 16_KB;
+
+static bool hashCode(const RuntimeBlockInfo *block, u64& hash)
+{
+	const u8 *p = GetMemPtr(block->addr, block->sh4_code_size);
+	if (p == nullptr)
+		return false;
+	hash = XXH64(p, block->sh4_code_size, 0);
+	return true;
+}
+
+// Hashes the memory a block at pc can be decoded from. Returns false if it isn't in ram.
+static bool hashSpan(u32 pc, u32& end, u64& hash)
+{
+	const u32 start = pc & ~0xfff;
+	if (GetMemPtr(start, 2) == nullptr)
+		return false;
+	const u32 size = std::min<u32>(MaxCodeSpan, RAM_SIZE - (start & RAM_MASK));
+	end = start + size;
+	hash = XXH64(GetMemPtr(start, size), size, 0);
+	return true;
+}
+
+// Runs on the compiler thread
+static void compile(Job job)
+{
+	std::lock_guard<std::mutex> _(compMutex);
+	if (job.generation == generation && codeBuffer->getFreeSpace() >= 32_KB)
+	{
+		RuntimeBlockInfo *block = job.block;
+		try {
+			u32 spanEnd = 0;
+			u64 spanHash = 0;
+			const bool inRam = hashSpan(job.pc, spanEnd, spanHash);
+			if (block->Setup(job.pc, job.fpscr, false, false, true))
+			{
+				block->blockcheck_failures = 0;
+				sh4Dynarec->compile(block, !block->read_only, true);
+				job.compiled = block->code != nullptr;
+				// The decoder and the code checks must have used the same code
+				u32 end;
+				u64 hash;
+				if (inRam && block->vaddr + block->sh4_code_size > spanEnd)
+					// can't be checked
+					job.compiled = false;
+				else if (inRam && (!hashSpan(job.pc, end, hash) || hash != spanHash))
+					job.codeChanged = true;
+				else if (block->read_only && !hashCode(block, job.codeHash))
+					job.compiled = false;
+			}
+		} catch (const FlycastException& e) {
+			// The error will be raised again when compiling synchronously
+			DEBUG_LOG(DYNAREC, "Background compilation of %08x failed: %s", job.pc, e.what());
+		}
+	}
+	std::lock_guard<std::mutex> lock(doneMutex);
+	done.push_back(job);
+}
+
+static void drop(RuntimeBlockInfo *block)
+{
+	// Not accounted for in the block manager counters
+	block->sh4_code_size = 0;
+	delete block;
+	stats.dropped++;
+}
+
+bool enabled() {
+	return initialized && config::DynarecBackgroundCompilation && !mmu_enabled()
+			&& sh4Dynarec->supportsBackgroundCompilation();
+}
+
+std::mutex& compilerMutex() {
+	return compMutex;
+}
+
+bool request(u32 pc, fpscr_t fpscr)
+{
+	if ((pc & 1) || Sh4cntx.sr.FD == 1 || synchronous.count(pc) != 0)
+		return false;
+	if (pending.insert(pc).second)
+	{
+		Job job{};
+		job.block = sh4Dynarec->allocateBlock();
+		job.pc = pc;
+		job.fpscr = fpscr;
+		job.generation = generation;
+		worker.run([job]() { compile(job); });
+	}
+	stats.interpreted++;
+	return true;
+}
+
+void publish()
+{
+	{
+		std::lock_guard<std::mutex> _(doneMutex);
+		if (done.empty())
+			return;
+		std::swap(done, publishing);
+	}
+	for (const Job& job : publishing)
+	{
+		RuntimeBlockInfo *block = job.block;
+		if (job.generation != generation)
+		{
+			drop(block);
+			continue;
+		}
+		pending.erase(job.pc);
+		if (job.codeChanged)
+		{
+			// Compiled again when next executed
+			drop(block);
+			continue;
+		}
+		if (!job.compiled)
+		{
+			synchronous.insert(job.pc);
+			drop(block);
+			continue;
+		}
+		u64 hash;
+		if (bm_GetCodeByVAddr(block->vaddr) != (DynarecCodeEntryPtr)ngen_FailedToFindBlock
+				|| (block->read_only && (!block->IsProtectable() || !hashCode(block, hash) || hash != job.codeHash)))
+		{
+			// Already compiled synchronously, or the code may have changed
+			drop(block);
+			continue;
+		}
+		block->SetProtectedFlags();
+		globalregs::recordBlock(block);
+		bm_AddBlock(block);
+		stats.compiled++;
+	}
+	publishing.clear();
+#if HOST_CPU == CPU_ARM64 && defined(__GNUC__)
+	// The code has been written by another core
+	__asm__ __volatile__("isb" ::: "memory");
+#endif
+}
+
+void reset()
+{
+	generation++;
+	{
+		std::lock_guard<std::mutex> _(doneMutex);
+		for (const Job& job : done)
+			drop(job.block);
+		done.clear();
+	}
+	pending.clear();
+	synchronous.clear();
+}
+
+const Stats& getStats() {
+	return stats;
+}
+
+void resetStats() {
+	stats = {};
+}
+
+void init(Sh4CodeBuffer& buffer)
+{
+	codeBuffer = &buffer;
+	initialized = true;
+}
+
+void term()
+{
+	{
+		std::lock_guard<std::mutex> _(compMutex);
+		reset();
+	}
+	// Queued jobs are skipped since the generation has changed
+	worker.stop();
+	for (const Job& job : done)
+		drop(job.block);
+	done.clear();
+	initialized = false;
+	codeBuffer = nullptr;
+}
+
+}
+#endif	// FEAT_SHREC != DYNAREC_NONE
@@ -0,0 +1,43 @@
+/*
+	Background block compilation.
+	New blocks are decoded, optimized and compiled on a worker thread while
+	the emulation thread runs them in the interpreter. Compiled blocks are
+	published by the emulation thread the next time it looks up a missing block.
+*/
+#pragma once
+#include "types.h"
+#include "hw/sh4/sh4_if.h"
+#include <mutex>
+
+class Sh4CodeBuffer;
+
+namespace bgcompile
+{
+
+struct Stats
+{
+	u32 compiled = 0;
+	u32 dropped = 0;
+	u32 interpreted = 0;
+};
+
+void init(Sh4CodeBuffer& codeBuffer);
+void term();
+
+// Background compilation is enabled and usable in the current cpu mode
+bool enabled();
+// Held whenever the decoder, the optimizer or the code emitter are running
+std::mutex& compilerMutex();
+
+// Queues the compilation of the block at pc.
+// Returns false if the block must be compiled synchronously.
+bool request(u32 pc, fpscr_t fpscr);
+// Adds the blocks compiled in the background to the block manager
+void publish();
+// Discards all queued and compiled blocks. The compiler mutex must be held.
+void reset();
+
+const Stats& getStats();
+void resetStats();
+
+}
@@ -0,0 +1,439 @@
+/*
+	Persistent SHIL block cache.
+
+	Blocks are indexed by their physical address and the fpscr bits used by the decoder.
+	Each entry keeps a hash of the guest code so that stale translations are never reused.
+	Protected (read-only) blocks may embed constants read from any of their pages during
+	constant propagation, so the whole page range is hashed for them.
+*/
+#include "blockcache.h"
+
+#if FEAT_SHREC != DYNAREC_NONE
+#include "blockmanager.h"
+#include "hw/sh4/sh4_core.h"
+#include "hw/sh4/sh4_mem.h"
+#include "hw/sh4/sh4_cache.h"
+#include "hw/sh4/modules/mmu.h"
+#include "cfg/option.h"
+#include "oslib/oslib.h"
+#include "stdclass.h"
+
+#include <xxhash.h>
+#include <algorithm>
+#include <unordered_map>
+
+namespace shilcache
+{
+
+constexpr u32 FileMagic = 0x4c494853;	// SHIL
+constexpr u32 FileVersion = 3;
+// Approximate memory used by an entry, excluding its serialized oplist
+constexpr u32 EntryOverhead = 96;
+
+enum EntryFlags : u8
+{
+	FlagFpuOp = 1,
+	FlagJCond = 2,
+	FlagReadOnly = 4,
+	FlagOCache = 8,		// decoded with operand cache emulation
+};
+
+struct Entry
+{
+	u32 codeSize;
+	u32 guestCycles;
+	u32 guestOpcodes;
+	u32 branchBlock;
+	u32 nextBlock;
+	u32 blockType;
+	u32 traceBranches;
+	u8 flags;
+	u64 dataLines[RuntimeBlockInfo::MaxPages];
+	u64 hash;
+	u64 lastUse;
+	std::vector<u8> ops;
+
+	u64 byteSize() const {
+		return EntryOverhead + ops.size();
+	}
+};
+
+static std::unordered_map<u64, Entry> cache;
+static std::string cacheFile;
+static u64 useCounter;
+static bool dirty;
+static Stats stats;
+
+static u64 makeKey(u32 addr, fpscr_t fpu_cfg)
+{
+	const u32 fpu = fpu_cfg.PR | (fpu_cfg.SZ << 1) | ((fpu_cfg.RM == 1) << 2);
+	return ((u64)fpu << 32) | addr;
+}
+
+static bool enabled()
+{
+	return config::DynarecPersistentCache && !cacheFile.empty() && !mmu_enabled();
+}
+
+static u64 maxSize()
+{
+	return (u64)std::max(1, config::DynarecPersistentCacheSize.get()) * 1_MB;
+}
+
+static bool hashGuestCode(u32 addr, u32 size, bool readOnly, u64& hash)
+{
+	if (readOnly)
+	{
+		const u32 end = addr + size;
+		addr &= ~PAGE_MASK;
+		size = ((end + PAGE_MASK) & ~PAGE_MASK) - addr;
+	}
+	const u8 *p = GetMemPtr(addr, size);
+	if (p == nullptr)
+		return false;
+	hash = XXH64(p, size, 0);
+	return true;
+}
+
+template<typename T>
+static void put(std::vector<u8>& data, T v)
+{
+	size_t pos = data.size();
+	data.resize(pos + sizeof(T));
+	memcpy(&data[pos], &v, sizeof(T));
+}
+
+template<typename T>
+static bool get(const u8 *&p, const u8 *end, T& v)
+{
+	if (p + sizeof(T) > end)
+		return false;
+	memcpy(&v, p, sizeof(T));
+	p += sizeof(T);
+	return true;
+}
+
+static void serializeParam(std::vector<u8>& data, const shil_param& param)
+{
+	put<u8>(data, param.type);
+	if (param.is_null())
+		return;
+	put<u32>(data, param._imm);
+	if (param.is_reg())
+		for (u32 i = 0; i < param.count(); i++)
+			put<u16>(data, param.version[i]);
+}
+
+static bool deserializeParam(const u8 *&p, const u8 *end, shil_param& param)
+{
+	u8 type;
+	if (!get(p, end, type) || type > FMT_V16)
+		return false;
+	param = shil_param();
+	param.type = type;
+	if (param.is_null())
+		return true;
+	if (!get(p, end, param._imm))
+		return false;
+	if (param.is_reg())
+		for (u32 i = 0; i < param.count(); i++)
+			if (!get(p, end, param.version[i]))
+				return false;
+	return true;
+}
+
+static void serializeOps(std::vector<u8>& data, const std::vector<shil_opcode>& oplist)
+{
+	put<u16>(data, (u16)oplist.size());
+	for (const shil_opcode& op : oplist)
+	{
+		put<u16>(data, (u16)op.op);
+		put<u8>(data, (u8)op.size);
+		serializeParam(data, op.rd);
+		serializeParam(data, op.rd2);
+		serializeParam(data, op.rs1);
+		serializeParam(data, op.rs2);
+		serializeParam(data, op.rs3);
+		put<u16>(data, op.guest_offs);
+		put<u8>(data, op.delay_slot);
+	}
+}
+
+static bool deserializeOps(const std::vector<u8>& data, std::vector<shil_opcode>& oplist)
+{
+	const u8 *p = data.data();
+	const u8 *end = p + data.size();
+	u16 count;
+	if (!get(p, end, count) || count > BLOCK_MAX_SH_OPS_HARD)
+		return false;
+	oplist.resize(count);
+	for (shil_opcode& op : oplist)
+	{
+		u16 opcode;
+		u8 size;
+		u8 delaySlot;
+		if (!get(p, end, opcode) || opcode >= shop_max || !get(p, end, size))
+			return false;
+		op.op = (shilop)opcode;
+		op.size = size;
+		if (!deserializeParam(p, end, op.rd)
+				|| !deserializeParam(p, end, op.rd2)
+				|| !deserializeParam(p, end, op.rs1)
+				|| !deserializeParam(p, end, op.rs2)
+				|| !deserializeParam(p, end, op.rs3)
+				|| !get(p, end, op.guest_offs)
+				|| !get(p, end, delaySlot))
+			return false;
+		op.delay_slot = delaySlot != 0;
+		op.host_offs = 0;
+	}
+	return p == end;
+}
+
+static void erase(std::unordered_map<u64, Entry>::iterator it)
+{
+	stats.bytes -= it->second.byteSize();
+	cache.erase(it);
+	stats.entries = cache.size();
+}
+
+// Evict the least recently used entries until the cache fits in the given size
+static void evict(u64 targetSize)
+{
+	if (stats.bytes <= targetSize)
+		return;
+	std::vector<std::pair<u64, u64>> byUse;	// (last use, key)
+	byUse.reserve(cache.size());
+	for (const auto& pair : cache)
+		byUse.emplace_back(pair.second.lastUse, pair.first);
+	std::sort(byUse.begin(), byUse.end());
+	for (const auto& [lastUse, key] : byUse)
+	{
+		if (stats.bytes <= targetSize)
+			break;
+		erase(cache.find(key));
+		stats.evictions++;
+	}
+	dirty = true;
+}
+
+bool lookup(RuntimeBlockInfo *block)
+{
+	if (!enabled())
+		return false;
+	auto it = cache.find(makeKey(block->addr, block->fpu_cfg));
+	if (it == cache.end())
+	{
+		stats.misses++;
+		return false;
+	}
+	Entry& entry = it->second;
+	const bool readOnly = (entry.flags & FlagReadOnly) != 0;
+	u64 hash;
+	block->sh4_code_size = entry.codeSize;
+	if (readOnly != block->IsProtectable()
+			// Let the decoder raise the exception
+			|| ((entry.flags & FlagFpuOp) && Sh4cntx.sr.FD == 1)
+			|| ((entry.flags & FlagOCache) != 0) != ocache.isEmulated()
+			|| !hashGuestCode(block->addr, entry.codeSize, readOnly, hash)
+			|| hash != entry.hash)
+	{
+		block->sh4_code_size = 0;
+		stats.misses++;
+		return false;
+	}
+	if (!deserializeOps(entry.ops, block->oplist))
+	{
+		WARN_LOG(DYNAREC, "Invalid cached block %08x", block->addr);
+		block->oplist.clear();
+		block->sh4_code_size = 0;
+		erase(it);
+		stats.misses++;
+		return false;
+	}
+	block->guest_cycles = entry.guestCycles;
+	block->guest_opcodes = entry.guestOpcodes;
+	block->BranchBlock = entry.branchBlock;
+	block->NextBlock = entry.nextBlock;
+	block->BlockType = (BlockEndType)entry.blockType;
+	block->trace_branches = entry.traceBranches;
+	block->has_fpu_op = (entry.flags & FlagFpuOp) != 0;
+	block->has_jcond = (entry.flags & FlagJCond) != 0;
+	memcpy(block->data_lines, entry.dataLines, sizeof(entry.dataLines));
+	entry.lastUse = ++useCounter;
+	stats.hits++;
+
+	return true;
+}
+
+void store(const RuntimeBlockInfo *block)
+{
+	if (!enabled())
+		return;
+	Entry entry;
+	if (!hashGuestCode(block->addr, block->sh4_code_size, block->read_only, entry.hash))
+		return;
+	entry.codeSize = block->sh4_code_size;
+	entry.guestCycles = block->guest_cycles;
+	entry.guestOpcodes = block->guest_opcodes;
+	entry.branchBlock = block->BranchBlock;
+	entry.nextBlock = block->NextBlock;
+	entry.blockType = block->BlockType;
+	entry.traceBranches = block->trace_branches;
+	entry.flags = (block->has_fpu_op ? FlagFpuOp : 0)
+			| (block->has_jcond ? FlagJCond : 0)
+			| (block->read_only ? FlagReadOnly : 0)
+			| (ocache.isEmulated() ? FlagOCache : 0);
+	memcpy(entry.dataLines, block->data_lines, sizeof(entry.dataLines));
+	entry.lastUse = ++useCounter;
+	serializeOps(entry.ops, block->oplist);
+
+	const u64 key = makeKey(block->addr, block->fpu_cfg);
+	auto it = cache.find(key);
+	if (it != cache.end())
+		erase(it);
+	stats.bytes += entry.byteSize();
+	cache[key] = std::move(entry);
+	stats.entries = cache.size();
+	dirty = true;
+
+	if (stats.bytes > maxSize())
+		// leave some room to avoid evicting on each new block
+		evict(maxSize() * 7 / 8);
+}
+
+void clear()
+{
+	cache.clear();
+	cacheFile.clear();
+	useCounter = 0;
+	dirty = false;
+	stats = {};
+}
+
+void load(const std::string& gameId)
+{
+	clear();
+	if (!config::DynarecPersistentCache || gameId.empty())
+		return;
+	std::string name = gameId;
+	for (char& c : name)
+		if (!std::isalnum((u8)c) && c != '-' && c != '_')
+			c = '_';
+	cacheFile = hostfs::getShaderCachePath(name + ".shilcache");
+
+	FILE *fp = nowide::fopen(cacheFile.c_str(), "rb");
+	if (fp == nullptr)
+		return;
+	u32 header[5];
+	if (std::fread(header, sizeof(header), 1, fp) != 1
+			|| header[0] != FileMagic || header[1] != FileVersion
+			|| header[2] != shop_max || header[3] != (u32)config::Sh4Clock)
+	{
+		INFO_LOG(DYNAREC, "Ignoring outdated block cache %s", cacheFile.c_str());
+		std::fclose(fp);
+		return;
+	}
+	const u32 count = header[4];
+	if (std::fread(&useCounter, sizeof(useCounter), 1, fp) != 1)
+		useCounter = 0;
+	for (u32 i = 0; i < count; i++)
+	{
+		u64 key;
+		Entry entry;
+		u32 opsSize;
+		if (std::fread(&key, sizeof(key), 1, fp) != 1
+				|| std::fread(&entry.codeSize, sizeof(entry.codeSize), 1, fp) != 1
+				|| std::fread(&entry.guestCycles, sizeof(entry.guestCycles), 1, fp) != 1
+				|| std::fread(&entry.guestOpcodes, sizeof(entry.guestOpcodes), 1, fp) != 1
+				|| std::fread(&entry.branchBlock, sizeof(entry.branchBlock), 1, fp) != 1
+				|| std::fread(&entry.nextBlock, sizeof(entry.nextBlock), 1, fp) != 1
+				|| std::fread(&entry.blockType, sizeof(entry.blockType), 1, fp) != 1
+				|| std::fread(&entry.traceBranches, sizeof(entry.traceBranches), 1, fp) != 1
+				|| std::fread(&entry.flags, sizeof(entry.flags), 1, fp) != 1
+				|| std::fread(entry.dataLines, sizeof(entry.dataLines), 1, fp) != 1
+				|| std::fread(&entry.hash, sizeof(entry.hash), 1, fp) != 1
+				|| std::fread(&entry.lastUse, sizeof(entry.lastUse), 1, fp) != 1
+				|| std::fread(&opsSize, sizeof(opsSize), 1, fp) != 1
+				|| opsSize > 64_KB)
+		{
+			WARN_LOG(DYNAREC, "Error loading block cache %s", cacheFile.c_str());
+			break;
+		}
+		entry.ops.resize(opsSize);
+		if (std::fread(entry.ops.data(), 1, opsSize, fp) != opsSize)
+		{
+			WARN_LOG(DYNAREC, "Error loading block cache %s", cacheFile.c_str());
+			break;
+		}
+		stats.bytes += entry.byteSize();
+		cache[key] = std::move(entry);
+	}
+	std::fclose(fp);
+	stats.entries = cache.size();
+	evict(maxSize());
+	dirty = false;
+	NOTICE_LOG(DYNAREC, "Loaded %d blocks (%d KB) from %s", (int)cache.size(), (int)(stats.bytes / 1024), cacheFile.c_str());
+}
+
+void save()
+{
+	if (cacheFile.empty())
+		return;
+	NOTICE_LOG(DYNAREC, "Block cache: %d hits, %d misses, %d evictions", stats.hits, stats.misses, stats.evictions);
+	if (!dirty)
+		return;
+	evict(maxSize());
+	FILE *fp = nowide::fopen(cacheFile.c_str(), "wb");
+	if (fp == nullptr)
+	{
+		WARN_LOG(DYNAREC, "Cannot save block cache to %s", cacheFile.c_str());
+		return;
+	}
+	const u32 header[5] = { FileMagic, FileVersion, shop_max, (u32)config::Sh4Clock, (u32)cache.size() };
+	bool error = std::fwrite(header, sizeof(header), 1, fp) != 1
+			|| std::fwrite(&useCounter, sizeof(useCounter), 1, fp) != 1;
+	for (auto it = cache.begin(); it != cache.end() && !error; ++it)
+	{
+		const Entry& entry = it->second;
+		const u32 opsSize = entry.ops.size();
+		error = std::fwrite(&it->first, sizeof(it->first), 1, fp) != 1
+				|| std::fwrite(&entry.codeSize, sizeof(entry.codeSize), 1, fp) != 1
+				|| std::fwrite(&entry.guestCycles, sizeof(entry.guestCycles), 1, fp) != 1
+				|| std::fwrite(&entry.guestOpcodes, sizeof(entry.guestOpcodes), 1, fp) != 1
+				|| std::fwrite(&entry.branchBlock, sizeof(entry.branchBlock), 1, fp) != 1
+				|| std::fwrite(&entry.nextBlock, sizeof(entry.nextBlock), 1, fp) != 1
+				|| std::fwrite(&entry.blockType, sizeof(entry.blockType), 1, fp) != 1
+				|| std::fwrite(&entry.traceBranches, sizeof(entry.traceBranches), 1, fp) != 1
+				|| std::fwrite(&entry.flags, sizeof(entry.flags), 1, fp) != 1
+				|| std::fwrite(entry.dataLines, sizeof(entry.dataLines), 1, fp) != 1
+				|| std::fwrite(&entry.hash, sizeof(entry.hash), 1, fp) != 1
+				|| std::fwrite(&entry.lastUse, sizeof(entry.lastUse), 1, fp) != 1
+				|| std::fwrite(&opsSize, sizeof(opsSize), 1, fp) != 1
+				|| std::fwrite(entry.ops.data(), 1, opsSize, fp) != opsSize;
+	}
+	std::fclose(fp);
+	if (error)
+	{
+		WARN_LOG(DYNAREC, "Error saving block cache to %s", cacheFile.c_str());
+		nowide::remove(cacheFile.c_str());
+	}
+	else
+	{
+		NOTICE_LOG(DYNAREC, "Saved %d blocks (%d KB) to %s", (int)cache.size(), (int)(stats.bytes / 1024), cacheFile.c_str());
+		dirty = false;
+	}
+}
+
+const Stats& getStats()
+{
+	return stats;
+}
+
+void term()
+{
+	clear();
+}
+
+}
+#endif	// FEAT_SHREC != DYNAREC_NONE
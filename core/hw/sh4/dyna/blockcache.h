@@ -0,0 +1,37 @@
+/*
+	Persistent SHIL block cache.
+	Decoded and optimized blocks are saved per game and reused on the next run,
+	skipping the decoder and SSA passes when the guest code hasn't changed.
+*/
+#pragma once
+#include "types.h"
+#include <string>
+
+struct RuntimeBlockInfo;
+
+namespace shilcache
+{
+
+struct Stats
+{
+	u32 hits = 0;
+	u32 misses = 0;
+	u32 evictions = 0;
+	u32 entries = 0;
+	u64 bytes = 0;
+};
+
+void term();
+
+void load(const std::string& gameId);
+void save();
+void clear();
+
+// Fills the block from the cache. The block addr, vaddr and fpu_cfg must be set.
+bool lookup(RuntimeBlockInfo *block);
+// Adds a decoded and optimized block to the cache
+void store(const RuntimeBlockInfo *block);
+
+const Stats& getStats();
+
+}
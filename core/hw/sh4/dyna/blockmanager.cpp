@@ -4,18 +4,23 @@
 */
 
 #include <algorithm>
-#include <set>
-#include <map>
+#include <memory>
+#include <unordered_map>
 #include "blockmanager.h"
 #include "ngen.h"
+#include "ssa.h"
+#include "idleloop.h"
 
 #include "hw/sh4/sh4_core.h"
 #include "hw/sh4/sh4_interrupts.h"
 #include "hw/sh4/sh4_mem.h"
 #include "hw/sh4/sh4_opcode_list.h"
 #include "hw/sh4/sh4_sched.h"
+#include "hw/sh4/interpr/sh4_decodecache.h"
 #include "hw/sh4/modules/mmu.h"
 #include "oslib/virtmem.h"
+#include "cfg/option.h"
+#include <xxhash.h>
 
 #if defined(__unix__) && defined(DYNA_OPROF)
 #include <opagent.h>
@@ -25,18 +30,128 @@ op_agent_t          oprofHandle;
 #if FEAT_SHREC != DYNAREC_NONE
 
 
-typedef std::vector<RuntimeBlockInfoPtr> bm_List;
-typedef std::set<RuntimeBlockInfoPtr> bm_Set;
-typedef std::map<void*, RuntimeBlockInfoPtr> bm_Map;
+typedef std::vector<RuntimeBlockInfo*> bm_List;
 
-static bm_Set all_temp_blocks;
+static bm_List all_temp_blocks;
 static bm_List del_blocks;
 
 static u32 pageCount;
 bool *unprotected_pages;
-static std::set<RuntimeBlockInfo*> *blocks_per_page;
+// Head of the intrusive list of protected blocks in each ram page
+static RuntimeBlockInfo **blocks_per_page;
+
+// Blocks sorted by host code address.
+// Discarded blocks leave a hole (null block) until the index is compacted.
+struct CodeIndexEntry
+{
+	void *code;
+	RuntimeBlockInfo *block;
+
+	bool operator<(const void *p) const {
+		return code < p;
+	}
+};
+static std::vector<CodeIndexEntry> blkmap;
+static size_t blkmapHoles;
+
+// With the mmu, the code at a physical address may be executed at several virtual addresses
+// (WinCE maps the current process in slot 0 and in its own slot). Only the block compiled for
+// the last virtual address is in the jump table. The others are parked here, keyed by physical
+// and virtual address, so that they can be reused when the process or address changes again.
+static std::unordered_map<u64, RuntimeBlockInfo*> parked_blocks;
+
+static u64 bm_ParkKey(u32 addr, u32 vaddr) {
+	return ((u64)addr << 32) | vaddr;
+}
+
+static CodeCacheStats cacheStats;
+// Flushes and evictions in the current minute
+static u32 minuteSeconds;
+static u32 minuteFlushes;
+static u32 minuteEvictions;
+
+// Fixed-size allocator for block infos.
+// Blocks are mostly allocated and freed in bursts (cache flush, self-modifying code)
+// so freed blocks are kept in per-size free lists for reuse.
+class BlockArena
+{
+public:
+	void *alloc(size_t size)
+	{
+		size = roundUp(size);
+		if (size > MaxSize)
+			return ::operator new(size);
+		FreeBlock *& freeList = freeLists[size / Granularity - 1];
+		if (freeList != nullptr)
+		{
+			FreeBlock *p = freeList;
+			freeList = p->next;
+			return p;
+		}
+		if (chunkUsed + size > ChunkSize)
+		{
+			chunks.push_back(std::make_unique<u8[]>(ChunkSize));
+			chunkUsed = 0;
+		}
+		void *p = chunks.back().get() + chunkUsed;
+		chunkUsed += size;
+		return p;
+	}
+
+	void free(void *p, size_t size)
+	{
+		size = roundUp(size);
+		if (size > MaxSize)
+		{
+			::operator delete(p);
+			return;
+		}
+		FreeBlock *block = (FreeBlock *)p;
+		FreeBlock *& freeList = freeLists[size / Granularity - 1];
+		block->next = freeList;
+		freeList = block;
+	}
+
+private:
+	struct FreeBlock {
+		FreeBlock *next;
+	};
+	static constexpr size_t Granularity = 16;
+	static constexpr size_t MaxSize = 1024;
+	static constexpr size_t ChunkSize = 64_KB;
+
+	static size_t roundUp(size_t size) {
+		return (size + Granularity - 1) & ~(Granularity - 1);
+	}
+
+	FreeBlock *freeLists[MaxSize / Granularity] {};
+	std::vector<std::unique_ptr<u8[]>> chunks;
+	size_t chunkUsed = ChunkSize;
+};
+static BlockArena blockArena;
+
+// Sub-page code tracking.
+// Writes to a protected page only discard the blocks of the written line. The page is made
+// writable and the current timeslice is ended, so that the page is re-protected (and its
+// code lines checked) before another block is executed.
+constexpr u32 CODE_LINE_SIZE = 256;
+// Beyond this number of write faults per second, the page is unprotected for good
+constexpr u32 MAX_PAGE_FAULTS = 100;
+static_assert(MAX_PAGE_SIZE / CODE_LINE_SIZE <= 64, "Code line bitmap too small");
+// Lines of each page holding code of protected blocks, or data they read when compiled.
+// Bits are cleared lazily.
+static u64 *page_code_lines;
+static u16 *page_faults;
+struct PendingPage
+{
+	u32 page;
+	u64 lines;	// code lines when the page was unlocked
+	u64 hash;	// hash of the code lines
+};
+static std::vector<PendingPage> pending_pages;
+static bool *pending_page;
+bool bm_pendingPages;
 
-static bm_Map blkmap;
 // Stats
 u32 protected_blocks;
 u32 unprotected_blocks;
@@ -103,15 +218,52 @@ DynarecCodeEntryPtr DYNACALL bm_GetCodeByVAddr(u32 addr)
 	if (rv != MmuError::NONE)
 	{
 		DoMMUException(addr, rv, MMU_TT_IREAD);
-		mmu_instruction_translation(Sh4cntx.pc, paddr);
+		addr = Sh4cntx.pc;
+		mmu_instruction_translation(addr, paddr);
+	}
+
+	DynarecCodeEntryPtr code = bm_GetCode(paddr);
+	if (code == ngen_FailedToFindBlock && !parked_blocks.empty())
+	{
+		auto it = parked_blocks.find(bm_ParkKey(paddr, addr));
+		if (it != parked_blocks.end())
+		{
+			RuntimeBlockInfo *block = it->second;
+			parked_blocks.erase(it);
+			code = (DynarecCodeEntryPtr)CC_RW2RX(block->code);
+			FPCA(paddr) = code;
+		}
 	}
+	return code;
+}
 
-	return bm_GetCode(paddr);
+RuntimeBlockInfo *bm_SwapVAddrBlock(RuntimeBlockInfo *block, u32 vaddr)
+{
+	verify((void*)bm_GetCode(block->addr) == CC_RW2RX((void*)block->code));
+	verify(parked_blocks.emplace(bm_ParkKey(block->addr, block->vaddr), block).second);
+	FPCA(block->addr) = ngen_FailedToFindBlock;
+
+	auto it = parked_blocks.find(bm_ParkKey(block->addr, vaddr));
+	if (it == parked_blocks.end())
+		return nullptr;
+	RuntimeBlockInfo *other = it->second;
+	parked_blocks.erase(it);
+	FPCA(other->addr) = (DynarecCodeEntryPtr)CC_RW2RX(other->code);
+	return other;
+}
+
+// Removes a block from the jump table or from the parked blocks
+static void bm_RemoveFromJumpTable(RuntimeBlockInfo* block)
+{
+	if ((void*)bm_GetCode(block->addr) == CC_RW2RX((void*)block->code))
+		FPCA(block->addr) = ngen_FailedToFindBlock;
+	else
+		verify(parked_blocks.erase(bm_ParkKey(block->addr, block->vaddr)) == 1);
 }
 
 // addr must be a physical address
 // This returns an executable address
-RuntimeBlockInfoPtr DYNACALL bm_GetBlock(u32 addr)
+RuntimeBlockInfo* DYNACALL bm_GetBlock(u32 addr)
 {
 	DynarecCodeEntryPtr cde = bm_GetCode(addr);  // Returns RX ptr
 
@@ -122,32 +274,66 @@ RuntimeBlockInfoPtr DYNACALL bm_GetBlock(u32 addr)
 }
 
 // This takes a RX address and returns the info block ptr (RW space)
-RuntimeBlockInfoPtr bm_GetBlock(void* dynarec_code)
+RuntimeBlockInfo* bm_GetBlock(void* dynarec_code)
 {
-	if (blkmap.empty())
-		return NULL;
-
 	void *dynarecrw = CC_RX2RW(dynarec_code);
 	// Returns a block who's code addr is bigger than dynarec_code (or end)
-	auto iter = blkmap.upper_bound(dynarecrw);
-	if (iter == blkmap.begin())
-		return NULL;
-	iter--;  // Need to go back to find the potential candidate
+	auto iter = std::upper_bound(blkmap.begin(), blkmap.end(), dynarecrw,
+			[](const void *p, const CodeIndexEntry& entry) { return p < entry.code; });
+	// Need to go back to find the potential candidate, skipping discarded blocks
+	while (iter != blkmap.begin())
+	{
+		iter--;
+		if (iter->block == nullptr)
+			continue;
+		// However it might be out of bounds, check for that
+		if (!iter->block->containsCode(dynarecrw))
+			return NULL;
+		return iter->block;
+	}
+	return NULL;
+}
 
-	// However it might be out of bounds, check for that
-	if (!iter->second->containsCode(dynarecrw))
-		return NULL;
+static void bm_CompactIndex()
+{
+	blkmap.erase(std::remove_if(blkmap.begin(), blkmap.end(),
+			[](const CodeIndexEntry& entry) { return entry.block == nullptr; }), blkmap.end());
+	blkmapHoles = 0;
+}
 
-	return iter->second;
+static void bm_RemoveFromIndex(RuntimeBlockInfo *block)
+{
+	auto it = std::lower_bound(blkmap.begin(), blkmap.end(), (void *)block->code);
+	verify(it != blkmap.end() && it->block == block);
+	it->block = nullptr;
+	blkmapHoles++;
+	if (blkmapHoles > 64 && blkmapHoles > blkmap.size() / 2)
+		bm_CompactIndex();
+}
+
+// Removes the block from the pre_refs of the blocks it is linked to
+static void bm_UnlinkSuccessors(RuntimeBlockInfo *block)
+{
+	if (block->pNextBlock != nullptr)
+		block->pNextBlock->RemRef(block);
+	if (block->pBranchBlock != nullptr)
+		block->pBranchBlock->RemRef(block);
+	block->pNextBlock = nullptr;
+	block->pBranchBlock = nullptr;
 }
 
 static void bm_CleanupDeletedBlocks()
 {
+	// stale blocks may have been linked after being discarded
+	for (RuntimeBlockInfo *block : del_blocks)
+		bm_UnlinkSuccessors(block);
+	for (RuntimeBlockInfo *block : del_blocks)
+		delete block;
 	del_blocks.clear();
 }
 
 // Takes RX pointer and returns a RW pointer
-RuntimeBlockInfoPtr bm_GetStaleBlock(void* dynarec_code)
+RuntimeBlockInfo* bm_GetStaleBlock(void* dynarec_code)
 {
 	void *dynarecrw = CC_RX2RW(dynarec_code);
 	if (del_blocks.empty())
@@ -164,17 +350,34 @@ RuntimeBlockInfoPtr bm_GetStaleBlock(void* dynarec_code)
 	return NULL;
 }
 
-void bm_AddBlock(RuntimeBlockInfo* blk)
+void bm_AddBlock(RuntimeBlockInfo* block)
 {
-	RuntimeBlockInfoPtr block(blk);
 	if (block->temp_block)
-		all_temp_blocks.insert(block);
-	auto iter = blkmap.find((void*)blk->code);
-	if (iter != blkmap.end()) {
-		ERROR_LOG(DYNAREC, "DUP: %08X %p %08X %p", iter->second->addr, iter->second->code, block->addr, block->code);
-		die("Duplicated block");
+		all_temp_blocks.push_back(block);
+	void *code = (void *)block->code;
+	// Blocks are usually allocated at increasing addresses
+	if (blkmap.empty() || blkmap.back().code < code)
+	{
+		blkmap.push_back({ code, block });
+	}
+	else
+	{
+		auto iter = std::lower_bound(blkmap.begin(), blkmap.end(), code);
+		if (iter != blkmap.end() && iter->code == code)
+		{
+			if (iter->block != nullptr) {
+				ERROR_LOG(DYNAREC, "DUP: %08X %p %08X %p", iter->block->addr, iter->block->code, block->addr, block->code);
+				die("Duplicated block");
+			}
+			// Reuse the hole left by a discarded block
+			iter->block = block;
+			blkmapHoles--;
+		}
+		else
+		{
+			blkmap.insert(iter, { code, block });
+		}
 	}
-	blkmap[(void*)block->code] = block;
 
 	verify((void*)bm_GetCode(block->addr) == (void*)ngen_FailedToFindBlock);
 	FPCA(block->addr) = (DynarecCodeEntryPtr)CC_RW2RX(block->code);
@@ -195,33 +398,69 @@ void bm_AddBlock(RuntimeBlockInfo* blk)
 
 }
 
+static void bm_RemoveTempBlock(RuntimeBlockInfo *block)
+{
+	auto it = std::find(all_temp_blocks.begin(), all_temp_blocks.end(), block);
+	if (it != all_temp_blocks.end())
+	{
+		*it = all_temp_blocks.back();
+		all_temp_blocks.pop_back();
+	}
+}
+
 void bm_DiscardBlock(RuntimeBlockInfo* block)
 {
 	// Remove from block map
-	auto it = blkmap.find((void*)block->code);
-	verify(it != blkmap.end());
-	RuntimeBlockInfoPtr block_ptr = it->second;
-
-	blkmap.erase(it);
+	bm_RemoveFromIndex(block);
 
-	block_ptr->pNextBlock = NULL;
-	block_ptr->pBranchBlock = NULL;
-	block_ptr->Relink();
+	bm_UnlinkSuccessors(block);
+	block->Relink();
 
 	// Remove from jump table
-	verify((void*)bm_GetCode(block_ptr->addr) == CC_RW2RX((void*)block_ptr->code));
-	FPCA(block_ptr->addr) = ngen_FailedToFindBlock;
+	bm_RemoveFromJumpTable(block);
 
-	if (block_ptr->temp_block)
-		all_temp_blocks.erase(block_ptr);
+	if (block->temp_block)
+		bm_RemoveTempBlock(block);
 
-	del_blocks.push_back(block_ptr);
-	block_ptr->Discard();
+	del_blocks.push_back(block);
+	block->Discard();
+}
+
+u32 bm_DiscardCode(void *start, void *end)
+{
+	// Collect the blocks first since discarding them modifies the index
+	std::vector<RuntimeBlockInfo *> blocks;
+	for (auto it = std::lower_bound(blkmap.begin(), blkmap.end(), start);
+			it != blkmap.end() && it->code < end; ++it)
+		if (it->block != nullptr)
+			blocks.push_back(it->block);
+	for (RuntimeBlockInfo *block : blocks)
+		bm_DiscardBlock(block);
+	cacheStats.evictions++;
+	cacheStats.evictedBlocks += blocks.size();
+	minuteEvictions++;
+
+	return blocks.size();
+}
+
+const CodeCacheStats& bm_GetCodeCacheStats() {
+	return cacheStats;
 }
 
 void bm_Periodical_1s()
 {
 	bm_CleanupDeletedBlocks();
+	if (++minuteSeconds == 60)
+	{
+		cacheStats.flushesPerMinute = minuteFlushes;
+		cacheStats.evictionsPerMinute = minuteEvictions;
+		if (minuteFlushes != 0 || minuteEvictions != 0)
+			INFO_LOG(DYNAREC, "Code cache: %d flushes, %d evictions in the last minute", minuteFlushes, minuteEvictions);
+		minuteSeconds = 0;
+		minuteFlushes = 0;
+		minuteEvictions = 0;
+	}
+	memset(page_faults, 0, pageCount * sizeof(page_faults[0]));
 }
 
 void bm_vmem_pagefill(void** ptr, u32 size_bytes)
@@ -237,6 +476,12 @@ void bm_Reset()
 	bm_CleanupDeletedBlocks();
 	protected_blocks = 0;
 	unprotected_blocks = 0;
+	cacheStats = {};
+	SSAOptimizer::resetMemStats();
+	minuteSeconds = 0;
+	minuteFlushes = 0;
+	minuteEvictions = 0;
+	decodeCache.invalidate(0, RAM_SIZE_MAX);
 
 #ifndef __SWITCH__
 	if (addrspace::virtmemEnabled())
@@ -275,6 +520,7 @@ void bm_LockPage(u32 addr, u32 size)
 void bm_UnlockPage(u32 addr, u32 size)
 {
 	addr = addr & (RAM_MASK - PAGE_MASK);
+	decodeCache.invalidate(addr, size);
 	if (addrspace::virtmemEnabled())
 		virtmem::region_unlock(addrspace::ram_base + 0x0C000000 + addr, size);
 	else
@@ -285,10 +531,17 @@ void bm_ResetCache()
 {
 	sh4Dynarec->reset();
 	addrspace::bm_reset();
+	if (blkmap.size() != blkmapHoles)
+	{
+		cacheStats.flushes++;
+		minuteFlushes++;
+	}
 
 	for (const auto& it : blkmap)
 	{
-		RuntimeBlockInfoPtr block = it.second;
+		RuntimeBlockInfo *block = it.block;
+		if (block == nullptr)
+			continue;
 		block->relink_data = 0;
 		block->pNextBlock = NULL;
 		block->pBranchBlock = NULL;
@@ -300,13 +553,18 @@ void bm_ResetCache()
 	}
 
 	blkmap.clear();
+	blkmapHoles = 0;
+	parked_blocks.clear();
 	// blkmap includes temp blocks as well
 	all_temp_blocks.clear();
 
-	for (size_t i = 0; i < pageCount; i++)
-		blocks_per_page[i].clear();
+	memset(blocks_per_page, 0, pageCount * sizeof(blocks_per_page[0]));
 
 	memset(unprotected_pages, 0, pageCount);
+	memset(page_code_lines, 0, pageCount * sizeof(page_code_lines[0]));
+	memset(pending_page, 0, pageCount);
+	pending_pages.clear();
+	bm_pendingPages = false;
 
 #ifdef DYNA_OPROF
 	if (oprofHandle)
@@ -326,10 +584,16 @@ void bm_ResetTempCache(bool full)
 {
 	if (!full)
 	{
-		for (const auto& block : all_temp_blocks)
+		for (RuntimeBlockInfo *block : all_temp_blocks)
+		{
+			bm_RemoveFromJumpTable(block);
+			bm_RemoveFromIndex(block);
+		}
+		// Unlink them once they're all out of the jump table
+		for (RuntimeBlockInfo *block : all_temp_blocks)
 		{
-			FPCA(block->addr) = ngen_FailedToFindBlock;
-			blkmap.erase((void*)block->code);
+			bm_UnlinkSuccessors(block);
+			block->Discard();
 		}
 	}
 	del_blocks.insert(del_blocks.begin(),all_temp_blocks.begin(),all_temp_blocks.end());
@@ -340,7 +604,10 @@ void bm_Init()
 {
 	pageCount = RAM_SIZE_MAX / PAGE_SIZE;
 	unprotected_pages = new bool[pageCount];
-	blocks_per_page = new std::set<RuntimeBlockInfo*>[pageCount];
+	blocks_per_page = new RuntimeBlockInfo*[pageCount]();
+	page_code_lines = new u64[pageCount]();
+	page_faults = new u16[pageCount]();
+	pending_page = new bool[pageCount]();
 
 #ifdef DYNA_OPROF
 	oprofHandle=op_open_agent();
@@ -361,6 +628,9 @@ void bm_Term()
 	bm_Reset();
 	delete[] unprotected_pages;
 	delete[] blocks_per_page;
+	delete[] page_code_lines;
+	delete[] page_faults;
+	delete[] pending_page;
 }
 
 void bm_WriteBlockMap(const std::string& file)
@@ -369,12 +639,40 @@ void bm_WriteBlockMap(const std::string& file)
 	if (f)
 	{
 		INFO_LOG(DYNAREC, "Writing block map !");
+		u32 hot_blocks = 0;
+		u32 traces = 0;
+		u32 trace_branches = 0;
+		u32 idle_loops = 0;
 		for (const auto& [_, block] : blkmap)
 		{
-			fprintf(f, "block: %d:%08X:%p:%d:%d:%d\n", block->BlockType, block->addr, block->code, block->host_code_size, block->guest_cycles, block->guest_opcodes);
+			if (block == nullptr)
+				continue;
+			fprintf(f, "block: %d:%08X:%p:%d:%d:%d:%d\n", block->BlockType, block->addr, block->code, block->host_code_size, block->guest_cycles, block->guest_opcodes,
+					block->trace_branches);
 			for(size_t j = 0; j < block->oplist.size(); j++)
 				fprintf(f,"\top: %zd:%d:%s\n", j, block->oplist[j].guest_offs, block->oplist[j].dissasm().c_str());
+			if (!block->oplist.empty() && block->oplist.back().op == shop_idle)
+			{
+				fprintf(f, "\tidle loop: %d fast-forwards\n", idleloop::getFastForwards(block->addr));
+				idle_loops++;
+			}
+			if (!block->baseline)
+				hot_blocks++;
+			if (block->trace_branches != 0)
+			{
+				traces++;
+				trace_branches += block->trace_branches;
+			}
 		}
+		fprintf(f, "traces: %d/%d optimized blocks (%.1f%%), %d branches followed\n", traces, hot_blocks,
+				hot_blocks == 0 ? 0.f : traces * 100.f / hot_blocks, trace_branches);
+		fprintf(f, "code cache: %d flushes, %d evictions (%d blocks), last minute: %d flushes, %d evictions\n",
+				cacheStats.flushes, cacheStats.evictions, cacheStats.evictedBlocks,
+				cacheStats.flushesPerMinute, cacheStats.evictionsPerMinute);
+		fprintf(f, "memory ops removed: %d loads forwarded from stores, %d redundant loads\n",
+				SSAOptimizer::getMemStats().forwardedLoads, SSAOptimizer::getMemStats().redundantLoads);
+		fprintf(f, "idle loops: %d blocks, %d fast-forwards, %.1f s skipped\n", idle_loops,
+				idleloop::getStats().fastForwards, idleloop::getStats().skippedCycles / (float)SH4_MAIN_CLOCK);
 		fclose(f);
 		INFO_LOG(DYNAREC, "Finished writing block map");
 	}
@@ -384,10 +682,21 @@ void sh4_jitsym(FILE* out)
 {
 	for (const auto& [_, block] : blkmap)
 	{
+		if (block == nullptr)
+			continue;
 		fprintf(out, "%p %d %08X\n", block->code, block->host_code_size, block->addr);
 	}
 }
 
+static RuntimeBlockInfo::PageLink& bm_PageLink(RuntimeBlockInfo *block, u32 page)
+{
+	for (u32 i = 0; i < block->page_count; i++)
+		if (block->page_links[i].page == page)
+			return block->page_links[i];
+	die("Block not in page list");
+	return block->page_links[0];
+}
+
 RuntimeBlockInfo::~RuntimeBlockInfo()
 {
 	if (sh4_code_size != 0)
@@ -399,12 +708,22 @@ RuntimeBlockInfo::~RuntimeBlockInfo()
 	}
 }
 
-void RuntimeBlockInfo::AddRef(const RuntimeBlockInfoPtr& other)
+void *RuntimeBlockInfo::operator new(size_t size)
+{
+	return blockArena.alloc(size);
+}
+
+void RuntimeBlockInfo::operator delete(void *p, size_t size)
+{
+	blockArena.free(p, size);
+}
+
+void RuntimeBlockInfo::AddRef(RuntimeBlockInfo *other)
 { 
 	pre_refs.push_back(other); 
 }
 
-void RuntimeBlockInfo::RemRef(const RuntimeBlockInfoPtr& other)
+void RuntimeBlockInfo::RemRef(RuntimeBlockInfo *other)
 {
 	auto it = std::find(pre_refs.begin(), pre_refs.end(), other);
 	if (it != pre_refs.end())
@@ -414,7 +733,7 @@ void RuntimeBlockInfo::RemRef(const RuntimeBlockInfoPtr& other)
 void RuntimeBlockInfo::Discard()
 {
 	// Update references
-	for (RuntimeBlockInfoPtr& ref : pre_refs)
+	for (RuntimeBlockInfo *ref : pre_refs)
 	{
 		if (ref->pNextBlock == this)
 			ref->pNextBlock = nullptr;
@@ -428,40 +747,170 @@ void RuntimeBlockInfo::Discard()
 	if (read_only)
 	{
 		// Remove this block from the per-page block lists
-		for (u32 addr = this->addr & ~PAGE_MASK; addr < this->addr + this->sh4_code_size; addr += PAGE_SIZE)
+		for (u32 i = 0; i < page_count; i++)
 		{
-			auto& block_list = blocks_per_page[(addr & RAM_MASK) / PAGE_SIZE];
-			block_list.erase(this);
+			PageLink& link = page_links[i];
+			if (link.prev != nullptr)
+				bm_PageLink(link.prev, link.page).next = link.next;
+			else
+				blocks_per_page[link.page] = link.next;
+			if (link.next != nullptr)
+				bm_PageLink(link.next, link.page).prev = link.prev;
 		}
+		page_count = 0;
 	}
 }
 
-void RuntimeBlockInfo::SetProtectedFlags()
+bool RuntimeBlockInfo::IsProtectable() const
 {
 	// Don't write protect rom and BIOS/IP.BIN (Grandia II)
 	if (!IsOnRam(addr) || (addr & 0x1FFF0000) == 0x0c000000)
+		return false;
+	for (u32 addr = this->addr & ~PAGE_MASK; addr < this->addr + sh4_code_size; addr += PAGE_SIZE)
+		if (unprotected_pages[(addr & RAM_MASK) / PAGE_SIZE])
+			return false;
+	return ((this->addr & PAGE_MASK) + sh4_code_size + PAGE_MASK) / PAGE_SIZE <= MaxPages;
+}
+
+// Returns the code lines of the given page that hold code of the block
+static u64 bm_BlockCodeLines(const RuntimeBlockInfo *block, u32 page)
+{
+	u32 pageStart = page * PAGE_SIZE;
+	u32 start = std::max(block->addr & RAM_MASK, pageStart);
+	u32 end = std::min((block->addr & RAM_MASK) + std::max(block->sh4_code_size, 2u), pageStart + (u32)PAGE_SIZE);
+	if (start >= end)
+		// The block wraps around the end of ram
+		return ~0ull;
+	u32 first = (start - pageStart) / CODE_LINE_SIZE;
+	u32 last = (end - 1 - pageStart) / CODE_LINE_SIZE;
+	u64 lines = 0;
+	for (u32 line = first; line <= last; line++)
+		lines |= 1ull << line;
+	return lines;
+}
+
+bool RuntimeBlockInfo::AddDataRead(u32 addr, u32 size)
+{
+	const u32 firstPage = (this->addr & RAM_MASK) / PAGE_SIZE;
+	const u32 pages = ((this->addr & PAGE_MASK) + sh4_code_size + PAGE_MASK) / PAGE_SIZE;
+	for (u32 a : { addr, addr + size - 1 })
 	{
-		this->read_only = false;
-		unprotected_blocks++;
-		return;
+		const u32 index = (a & RAM_MASK) / PAGE_SIZE - firstPage;
+		if (index >= std::min(pages, MaxPages))
+			return false;
+		data_lines[index] |= 1ull << ((a & PAGE_MASK) / CODE_LINE_SIZE);
 	}
-	for (u32 addr = this->addr & ~PAGE_MASK; addr < this->addr + sh4_code_size; addr += PAGE_SIZE)
+	return true;
+}
+
+static u64 bm_HashCodeLines(u32 page, u64 lines)
+{
+	u64 hash = 0;
+	for (u32 line = 0; lines != 0; line++, lines >>= 1)
+		if (lines & 1)
+			hash = XXH64(&mem_b[page * PAGE_SIZE + line * CODE_LINE_SIZE], CODE_LINE_SIZE, hash);
+	return hash;
+}
+
+static void bm_AddPendingPage(u32 page, u64 lines)
+{
+	pending_pages.push_back({ page, lines, bm_HashCodeLines(page, lines) });
+	pending_page[page] = true;
+	bm_pendingPages = true;
+}
+
+// Called when a write hits a protected page in sub-page mode.
+// Returns false if the page should be unprotected.
+static bool bm_SubPageWrite(u32 addr)
+{
+	u32 page = addr / PAGE_SIZE;
+	if (++page_faults[page] > MAX_PAGE_FAULTS)
+		return false;
+	u64 lineMask = 1ull << ((addr & PAGE_MASK) / CODE_LINE_SIZE);
+
+	if (page_code_lines[page] & lineMask)
 	{
-		if (unprotected_pages[(addr & RAM_MASK) / PAGE_SIZE])
+		// Discard the blocks overlapping the written line and rebuild the page bitmap
+		u64 lines = 0;
+		RuntimeBlockInfo *block = blocks_per_page[page];
+		while (block != nullptr)
 		{
-			this->read_only = false;
-			unprotected_blocks++;
-			return;
+			RuntimeBlockInfo *next = bm_PageLink(block, page).next;
+			u64 blockLines = bm_PageLink(block, page).lines;
+			if (blockLines & lineMask)
+			{
+				DEBUG_LOG(DYNAREC, "bm_RamWriteAccess write access to %08x pc %08x discards block %08x", addr, Sh4cntx.pc, block->addr);
+				bm_DiscardBlock(block);
+			}
+			else
+			{
+				lines |= blockLines;
+			}
+			block = next;
+		}
+		page_code_lines[page] = lines;
+	}
+	bm_UnlockPage(addr);
+	if (blocks_per_page[page] != nullptr)
+	{
+		bm_AddPendingPage(page, page_code_lines[page]);
+		// Writes to the other code lines aren't detected until the page is locked again,
+		// so this must be done before another block is executed.
+		sh4_sched_end_slice_now();
+	}
+
+	return true;
+}
+
+void bm_ReprotectPendingPages()
+{
+	for (const PendingPage& pending : pending_pages)
+	{
+		pending_page[pending.page] = false;
+		RuntimeBlockInfo *& head = blocks_per_page[pending.page];
+		if (head == nullptr)
+			continue;
+		if (bm_HashCodeLines(pending.page, pending.lines) != pending.hash)
+		{
+			// Code has been modified while the page was writable
+			DEBUG_LOG(DYNAREC, "Code modified in unlocked page %08x", pending.page * PAGE_SIZE);
+			while (head != nullptr)
+				bm_DiscardBlock(head);
+			page_code_lines[pending.page] = 0;
+			continue;
 		}
+		bm_LockPage(pending.page * PAGE_SIZE);
+	}
+	pending_pages.clear();
+	bm_pendingPages = false;
+}
+
+void RuntimeBlockInfo::SetProtectedFlags()
+{
+	if (!IsProtectable())
+	{
+		this->read_only = false;
+		unprotected_blocks++;
+		return;
 	}
 	this->read_only = true;
 	protected_blocks++;
+	page_count = 0;
 	for (u32 addr = this->addr & ~PAGE_MASK; addr < this->addr + sh4_code_size; addr += PAGE_SIZE)
 	{
-		auto& block_list = blocks_per_page[(addr & RAM_MASK) / PAGE_SIZE];
-		if (block_list.empty())
+		u32 page = (addr & RAM_MASK) / PAGE_SIZE;
+		RuntimeBlockInfo *& head = blocks_per_page[page];
+		if (head == nullptr)
 			bm_LockPage(addr);
-		block_list.insert(this);
+		else
+			bm_PageLink(head, page).prev = this;
+		u64 lines = bm_BlockCodeLines(this, page) | data_lines[page_count];
+		page_links[page_count++] = { page, nullptr, head, lines };
+		head = this;
+		page_code_lines[page] |= lines;
+		// The page is writable until the end of the timeslice
+		if (pending_page[page])
+			bm_AddPendingPage(page, lines);
 	}
 }
 
@@ -470,19 +919,18 @@ void bm_RamWriteAccess(u32 addr)
 	addr &= RAM_MASK;
 	if (unprotected_pages[addr / PAGE_SIZE])
 		return;
+	if (config::DynarecSubPageSmc && bm_SubPageWrite(addr))
+		return;
 
 	unprotected_pages[addr / PAGE_SIZE] = true;
 	bm_UnlockPage(addr);
-	std::set<RuntimeBlockInfo*>& block_list = blocks_per_page[addr / PAGE_SIZE];
-	if (!block_list.empty())
+	RuntimeBlockInfo *& head = blocks_per_page[addr / PAGE_SIZE];
+	if (head != nullptr)
 	{
-		std::vector<RuntimeBlockInfo*> list_copy;
-		list_copy.insert(list_copy.begin(), block_list.begin(), block_list.end());
-		if (!list_copy.empty())
-			DEBUG_LOG(DYNAREC, "bm_RamWriteAccess write access to %08x pc %08x", addr, Sh4cntx.pc);
-		for (auto& block : list_copy)
-			bm_DiscardBlock(block);
-		verify(block_list.empty());
+		DEBUG_LOG(DYNAREC, "bm_RamWriteAccess write access to %08x pc %08x", addr, Sh4cntx.pc);
+		// Discarding a block removes it from the list
+		while (head != nullptr)
+			bm_DiscardBlock(head);
 	}
 }
 
@@ -555,9 +1003,9 @@ void print_blocks()
 
 	for (const auto& [_, blk] : blkmap)
 	{
-		if (f)
+		if (f && blk != nullptr)
 		{
-			fprintf(f,"block: %p\n",blk.get());
+			fprintf(f,"block: %p\n",blk);
 			fprintf(f,"vaddr: %08X\n",blk->vaddr);
 			fprintf(f,"paddr: %08X\n",blk->addr);
 			fprintf(f,"code: %p\n",blk->code);
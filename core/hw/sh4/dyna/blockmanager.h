@@ -5,15 +5,12 @@
 #include "shil.h"
 #include "stdclass.h"
 
-#include <memory>
-
 typedef void (*DynarecCodeEntryPtr)();
-struct RuntimeBlockInfo;
-typedef std::shared_ptr<RuntimeBlockInfo> RuntimeBlockInfoPtr;
 
 struct RuntimeBlockInfo
 {
-	bool Setup(u32 pc,fpscr_t fpu_cfg);
+	// background: called by the background compiler. The block isn't protected until it is published.
+	bool Setup(u32 pc,fpscr_t fpu_cfg,bool baseline = false,bool trace = false,bool background = false);
 
 	u32 addr;
 	u32 vaddr;
@@ -28,6 +25,10 @@ struct RuntimeBlockInfo
 	u32 host_opcodes;	// set by host code generator, optional
 	bool has_fpu_op;
 	bool temp_block;
+	bool baseline;		// compiled with minimal optimizations, recompiled once hot
+	u32 hot_counter;	// executions left before a baseline block is recompiled
+	u32 trace_branches;	// number of static branches followed by the decoder
+	u32 fpscr_guards;	// number of fpscr writes decoded with a speculated fpu mode
 	u32 blockcheck_failures;
 
 	u32 BranchBlock; //if not 0xFFFFFFFF then jump target
@@ -46,7 +47,23 @@ struct RuntimeBlockInfo
 
 	std::vector<shil_opcode> oplist;
 	//predecessors references
-	std::vector<RuntimeBlockInfoPtr> pre_refs;
+	std::vector<RuntimeBlockInfo*> pre_refs;
+
+	// Maximum number of ram pages a protected block can span
+	static constexpr u32 MaxPages = 4;
+	// Links in the per-page lists of protected blocks
+	struct PageLink
+	{
+		u32 page;
+		RuntimeBlockInfo *prev;
+		RuntimeBlockInfo *next;
+		u64 lines;	// sub-page lines of the block code and data
+	};
+	PageLink page_links[MaxPages];
+	u32 page_count;
+	// Sub-page lines of guest memory read at compile time, such as folded constants.
+	// Indexed from the first page of the block.
+	u64 data_lines[MaxPages];
 
 	bool containsCode(const void *ptr)
 	{
@@ -55,26 +72,50 @@ struct RuntimeBlockInfo
 
 	virtual ~RuntimeBlockInfo();
 
+	// Block infos are allocated from the block manager arena
+	static void *operator new(size_t size);
+	static void operator delete(void *p, size_t size);
+
 	virtual u32 Relink() {
 		return 0;
 	}
 	
-	void AddRef(const RuntimeBlockInfoPtr& other);
-	void RemRef(const RuntimeBlockInfoPtr& other);
+	void AddRef(RuntimeBlockInfo *other);
+	void RemRef(RuntimeBlockInfo *other);
 
 	void Discard();
+	bool IsProtectable() const;
+	// Records a compile-time read of the block pages. addr must be a physical address.
+	// Returns false if it isn't in the pages protected with the block.
+	bool AddDataRead(u32 addr, u32 size);
 	void SetProtectedFlags();
 };
 
+struct CodeCacheStats
+{
+	u32 flushes = 0;
+	u32 evictions = 0;
+	u32 evictedBlocks = 0;
+	// Updated every minute
+	u32 flushesPerMinute = 0;
+	u32 evictionsPerMinute = 0;
+};
+
 void bm_WriteBlockMap(const std::string& file);
 
 DynarecCodeEntryPtr DYNACALL bm_GetCodeByVAddr(u32 addr);
-RuntimeBlockInfoPtr bm_GetBlock(void* dynarec_code);
-RuntimeBlockInfoPtr bm_GetStaleBlock(void* dynarec_code);
-RuntimeBlockInfoPtr DYNACALL bm_GetBlock(u32 addr);
+// With the mmu, parks the block of a physical address when it's executed at another virtual address.
+// Returns the block previously compiled for vaddr, which is now in the jump table, or nullptr.
+RuntimeBlockInfo *bm_SwapVAddrBlock(RuntimeBlockInfo *block, u32 vaddr);
+RuntimeBlockInfo* bm_GetBlock(void* dynarec_code);
+RuntimeBlockInfo* bm_GetStaleBlock(void* dynarec_code);
+RuntimeBlockInfo* DYNACALL bm_GetBlock(u32 addr);
 
 void bm_AddBlock(RuntimeBlockInfo* blk);
 void bm_DiscardBlock(RuntimeBlockInfo* block);
+// Discards the blocks whose code starts in [start, end). Returns the number of blocks discarded.
+u32 bm_DiscardCode(void *start, void *end);
+const CodeCacheStats& bm_GetCodeCacheStats();
 void bm_Reset();
 void bm_ResetCache();
 void bm_ResetTempCache(bool full);
@@ -95,6 +136,14 @@ static inline bool bm_IsRamPageProtected(u32 addr)
 
 bool bm_RamWriteAccess(void *p);
 void bm_RamWriteAccess(u32 addr);
+void bm_ReprotectPendingPages();
+// Re-protects the code pages made writable by sub-page write tracking
+static inline void bm_ReprotectPages()
+{
+	extern bool bm_pendingPages;
+	if (bm_pendingPages)
+		bm_ReprotectPendingPages();
+}
 void bm_LockPage(u32 addr, u32 size = PAGE_SIZE);
 void bm_UnlockPage(u32 addr, u32 size = PAGE_SIZE);
 u32 bm_getRamOffset(void *p);
@@ -105,6 +154,7 @@ inline static bool bm_RamWriteAccess(void *p) {
 	return false;
 }
 inline static void bm_RamWriteAccess(u32 addr) {}
+inline static void bm_ReprotectPages() {}
 inline static void bm_LockPage(u32 addr, u32 size = PAGE_SIZE) {}
 inline static void bm_UnlockPage(u32 addr, u32 size = PAGE_SIZE) {}
 inline static u32 bm_getRamOffset(void *p) {
@@ -15,14 +15,16 @@
 #include "hw/sh4/sh4_interrupts.h"
 #include "hw/sh4/sh4_mem.h"
 #include "hw/sh4/sh4_cycles.h"
+#include "hw/sh4/sh4_cache.h"
 #include "hw/sh4/modules/mmu.h"
 #include "decoder_opcodes.h"
+#include "fpscrspec.h"
 #include "cfg/option.h"
 
-#define BLOCK_MAX_SH_OPS_SOFT 500
-#define BLOCK_MAX_SH_OPS_HARD 511
+#include <array>
 
 static RuntimeBlockInfo* blk;
+static bool speculateFpscr;
 static Sh4Cycles cycleCounter;
 
 static inline shil_param mk_imm(u32 immv)
@@ -89,6 +91,7 @@ static void dec_End(u32 dst, BlockEndType flags, bool delaySlot)
 	state.NextOp = delaySlot ? NDO_Delayslot : NDO_End;
 	state.DelayOp = NDO_End;
 	state.JumpAddr = dst;
+	state.StaticBranch = false;
 	if (flags != BET_StaticCall && flags != BET_StaticJump)
 		state.NextAddr = state.cpu.rpc + 2 + (delaySlot ? 2 : 0);
 	else
@@ -142,6 +145,7 @@ sh4dec(i1000_1101_iiii_iiii)
 sh4dec(i1010_iiii_iiii_iiii)
 {
 	dec_End(dec_jump_simm12(op),BET_StaticJump,true);
+	state.StaticBranch = true;
 }
 //braf <REG_N>
 sh4dec(i0000_nnnn_0010_0011)
@@ -164,6 +168,7 @@ sh4dec(i1011_iiii_iiii_iiii)
 {
 	dec_set_pr();
 	dec_End(dec_jump_simm12(op), BET_StaticCall, true);
+	state.StaticBranch = true;
 }
 //bsrf <REG_N>
 sh4dec(i0000_nnnn_0000_0011)
@@ -245,13 +250,37 @@ sh4dec(i0100_nnnn_0000_0111)
 		dec_End(state.cpu.rpc + 2, BET_StaticIntr, false);
 }
 
+// Ends the block after an fpscr write, or continues decoding with the predicted fpu mode
+static void dec_EndFPSCR()
+{
+	if (state.cpu.is_delayslot)
+	{
+		state.FpscrUnknown = true;
+		return;
+	}
+	const u32 next_pc = state.cpu.rpc + 2;
+	fpscr_t fpscr;
+	if (!speculateFpscr || !fpscrspec::predict(next_pc, fpscr))
+	{
+		dec_End(next_pc, BET_StaticJump, false);
+		return;
+	}
+	// Exit the block at next_pc if the fpu mode isn't the predicted one.
+	// The cycles of the instructions decoded so far are fixed up at the end of the block.
+	Emit(shop_guard_fpscr, shil_param(), mk_imm(next_pc), mk_imm(fpscr.full & fpscrspec::ModeMask), blk->guest_cycles,
+			mk_imm(fpscrspec::ModeMask));
+	state.cpu.FPR64 = fpscr.PR;
+	state.cpu.FSZ64 = fpscr.SZ;
+	state.cpu.RoundToZero = fpscr.RM == 1;
+	blk->fpscr_guards++;
+}
+
 //ldc.l <REG_N>,FPSCR
 sh4dec(i0100_nnnn_0110_1010)
 {
 	Emit(shop_mov32, reg_fpscr, mk_regi(reg_r0 + GetN(op)));
 	Emit(shop_sync_fpscr);
-	if (!state.cpu.is_delayslot)
-		dec_End(state.cpu.rpc + 2, BET_StaticJump, false);
+	dec_EndFPSCR();
 }
 
 //ldc.l @<REG_N>+,FPSCR
@@ -262,8 +291,7 @@ sh4dec(i0100_nnnn_0110_0110)
 	Emit(shop_readm, reg_fpscr, rn, shil_param(), 4);
 	Emit(shop_add, rn, rn, mk_imm(4));
 	Emit(shop_sync_fpscr);
-	if (!state.cpu.is_delayslot)
-		dec_End(state.cpu.rpc + 2, BET_StaticJump, false);
+	dec_EndFPSCR();
 }
 
 //stc.l SR,@-<REG_N>
@@ -294,6 +322,24 @@ sh4dec(i0000_0000_0000_1001)
 {
 }
 
+//ocbi, ocbp and ocbwb @<REG_N>
+sh4dec(i0000_nnnn_1001_0011)
+{
+	// nops unless the operand cache is emulated
+	if (ocache.isEmulated())
+		dec_fallback(op);
+}
+
+//pref @<REG_N>
+sh4dec(i0000_nnnn_1000_0011)
+{
+	if (ocache.isEmulated())
+		// the interpreter handles both store queues and cache prefetches
+		dec_fallback(op);
+	else
+		Emit(shop_pref, shil_param(), mk_regi(reg_r0 + GetN(op)));
+}
+
 //fschg
 sh4dec(i1111_0011_1111_1101)
 {
@@ -939,6 +985,8 @@ static void state_Setup(u32 rpc,fpscr_t fpu_cfg)
 	state.BlockType = BET_SCL_Intr;
 	state.JumpAddr = NullAddress;
 	state.NextAddr = NullAddress;
+	state.StaticBranch = false;
+	state.FpscrUnknown = false;
 
 	state.info.has_readm=false;
 	state.info.has_writem=false;
@@ -950,13 +998,48 @@ void dec_updateBlockCycles(RuntimeBlockInfo *block, u16 op)
 	block->guest_cycles += cycleCounter.countCycles(op);
 }
 
-bool dec_DecodeBlock(RuntimeBlockInfo* rbi,u32 max_cycles)
+// Continue decoding at the target of a bra or bsr to form a trace.
+// The target must be close to the block start so that the block code range,
+// which is used for write protection and SMC checks, covers all the decoded code.
+// segments holds the code ranges already decoded.
+static bool dec_FollowBranch(std::array<std::pair<u32, u32>, TRACE_MAX_BRANCHES + 1>& segments)
+{
+	const u32 target = state.JumpAddr;
+	if (!state.StaticBranch || state.FpscrUnknown || blk->trace_branches >= TRACE_MAX_BRANCHES
+			|| target < blk->vaddr || target - blk->vaddr >= TRACE_MAX_SPAN)
+		return false;
+	segments[blk->trace_branches].second = state.cpu.rpc;
+	// Stop if the target is inside a segment of this trace, which also stops loops.
+	// The same code can still be part of other blocks or traces.
+	for (u32 i = 0; i <= blk->trace_branches; i++)
+		if (target >= segments[i].first && target < segments[i].second)
+			return false;
+	blk->trace_branches++;
+	segments[blk->trace_branches] = { target, target };
+
+	state.cpu.rpc = target;
+	state.cpu.is_delayslot = false;
+	state.NextOp = NDO_NextOp;
+	state.BlockType = BET_SCL_Intr;
+	state.JumpAddr = NullAddress;
+	state.NextAddr = NullAddress;
+	state.StaticBranch = false;
+
+	return true;
+}
+
+bool dec_DecodeBlock(RuntimeBlockInfo* rbi,u32 max_cycles,bool trace,bool background,bool speculate)
 {
 	blk=rbi;
+	speculateFpscr = speculate;
 	state_Setup(blk->vaddr, blk->fpu_cfg);
 	
 	blk->guest_opcodes = 0;
+	blk->trace_branches = 0;
 	cycleCounter.reset();
+	std::array<std::pair<u32, u32>, TRACE_MAX_BRANCHES + 1> segments;
+	segments[0] = { blk->vaddr, blk->vaddr };
+	u32 code_end = blk->vaddr;
 	// If full MMU, don't allow the block to extend past the end of the current 4K page
 	u32 max_pc = mmu_enabled() ? ((state.cpu.rpc >> 12) + 1) << 12 : 0xFFFFFFFF;
 	
@@ -984,7 +1067,8 @@ bool dec_DecodeBlock(RuntimeBlockInfo* rbi,u32 max_cycles)
 
 					if (!blk->has_fpu_op && OpDesc[op]->IsFloatingPoint())
 					{
-						if (Sh4cntx.sr.FD == 1)
+						// Background blocks are only requested when the FPU is enabled
+						if (!background && Sh4cntx.sr.FD == 1)
 						{
 							// We need to know FPSCR to compile the block, so let the exception handler run first
 							// as it may change the fp registers
@@ -1048,22 +1132,38 @@ bool dec_DecodeBlock(RuntimeBlockInfo* rbi,u32 max_cycles)
 				}
 			}
 #endif
+			if (trace)
+			{
+				const u32 rpc = state.cpu.rpc;
+				if (dec_FollowBranch(segments))
+				{
+					code_end = std::max(code_end, rpc);
+					continue;
+				}
+			}
 			goto _end;
 		}
 	}
 
 _end:
-	blk->sh4_code_size=state.cpu.rpc-blk->vaddr;
+	code_end = std::max(code_end, state.cpu.rpc);
+	blk->sh4_code_size=code_end-blk->vaddr;
 	blk->NextBlock=state.NextAddr;
 	blk->BranchBlock=state.JumpAddr;
 	blk->BlockType=state.BlockType;
 
 	verify(blk->oplist.size() <= BLOCK_MAX_SH_OPS_HARD);
 	
-	blk->guest_cycles = std::round(blk->guest_cycles * 200.f / std::max(1.f, (float)config::Sh4Clock));
+	const float cycleRatio = 200.f / std::max(1.f, (float)config::Sh4Clock);
+	blk->guest_cycles = std::round(blk->guest_cycles * cycleRatio);
 
 	//make sure we don't use wayy-too-few cycles
 	blk->guest_cycles = std::max(1U, blk->guest_cycles);
+
+	// A failed fpscr guard only charges the instructions before it
+	for (shil_opcode& op : blk->oplist)
+		if (op.op == shop_guard_fpscr)
+			op.size = blk->guest_cycles - std::min(blk->guest_cycles, (u32)std::round(op.size * cycleRatio));
 	blk = nullptr;
 
 	return true;
@@ -1,6 +1,13 @@
 #pragma once
 #include "../sh4_if.h"
 
+#define BLOCK_MAX_SH_OPS_SOFT 500
+#define BLOCK_MAX_SH_OPS_HARD 511
+// Max number of static branches followed when forming a trace
+#define TRACE_MAX_BRANCHES 4
+// Max distance between the start of a trace and the code it includes
+#define TRACE_MAX_SPAN 4096
+
 #define mkbet(c,s,v) ((c<<3)|(s<<1)|v)
 #define BET_GET_CLS(x) (x>>3)
 
@@ -37,7 +44,9 @@ enum NextDecoderOperation
 };
 
 struct RuntimeBlockInfo;
-bool dec_DecodeBlock(RuntimeBlockInfo* rbi,u32 max_cycles);
+// background: decoding on the background compiler thread. The cpu context must not be used.
+// speculate: fpscr writes don't end the block if the next fpu mode can be predicted
+bool dec_DecodeBlock(RuntimeBlockInfo* rbi,u32 max_cycles,bool trace = false,bool background = false,bool speculate = false);
 void dec_updateBlockCycles(RuntimeBlockInfo *block, u16 op);
 
 struct state_t
@@ -47,6 +56,8 @@ struct state_t
 	u32 JumpAddr;
 	u32 NextAddr;
 	BlockEndType BlockType;
+	bool StaticBranch;	// bra or bsr: JumpAddr can be followed to form a trace
+	bool FpscrUnknown;	// fpscr written in a delay slot: the fpu mode of the branch target isn't known
 
 	struct
 	{
@@ -6,18 +6,34 @@
 #include "hw/sh4/sh4_interrupts.h"
 
 #include "hw/sh4/sh4_mem.h"
+#include "hw/sh4/sh4_cache.h"
 #include "hw/sh4/modules/mmu.h"
 
 #include "blockmanager.h"
+#include "blockcache.h"
+#include "bgcompile.h"
+#include "precompile.h"
+#include "globalregs.h"
+#include "memprofile.h"
+#include "fpscrspec.h"
+#include "idleloop.h"
 #include "ngen.h"
 #include "decoder.h"
 #include "oslib/virtmem.h"
+#include "cfg/option.h"
+#include "emulator.h"
+
+#include <cinttypes>
 
 #if FEAT_SHREC != DYNAREC_NONE
 
 constexpr u32 CODE_SIZE = 10_MB;
 constexpr u32 TEMP_CODE_SIZE = 1_MB;
 constexpr u32 FULL_SIZE = CODE_SIZE + TEMP_CODE_SIZE;
+// Number of code regions when the oldest code is evicted instead of flushing the whole cache
+constexpr u32 CODE_REGIONS = 8;
+// Number of executions of a baseline block before it is recompiled with all optimizations
+constexpr u32 HOT_BLOCK_THRESHOLD = 100;
 DECLARE_CODE_CACHE(SH4_TCB, FULL_SIZE)
 
 static u8* CodeCache;
@@ -48,7 +64,12 @@ u32 Sh4CodeBuffer::getFreeSpace()
 	if (tempBuffer)
 		return TEMP_CODE_SIZE - tempLastAddr;
 	else
-		return CODE_SIZE - lastAddr;
+		return (region + 1) * regionSize() - lastAddr;
+}
+
+u32 Sh4CodeBuffer::regionSize() const
+{
+	return CODE_SIZE / regionCount;
 }
 
 void *Sh4CodeBuffer::getBase()
@@ -64,9 +85,25 @@ u32 Sh4CodeBuffer::getSize()
 void Sh4CodeBuffer::reset(bool temporary)
 {
 	if (temporary)
+	{
 		tempLastAddr = 0;
+	}
 	else
+	{
 		lastAddr = 0;
+		region = 0;
+		regionCount = nextRegionCount;
+	}
+}
+
+bool Sh4CodeBuffer::nextRegion()
+{
+	if (regionCount <= 1)
+		return false;
+	// The first region holds the main loop and the code compiled right after a flush. It's never recycled.
+	region = region + 1 == regionCount ? 1 : region + 1;
+	lastAddr = region * regionSize();
+	return true;
 }
 
 void Sh4Recompiler::clear_temp_cache(bool full)
@@ -79,12 +116,52 @@ void Sh4Recompiler::clear_temp_cache(bool full)
 void Sh4Recompiler::ResetCache()
 {
 	INFO_LOG(DYNAREC, "recSh4:Dynarec Cache clear at %08X free space %d", getContext()->pc, codeBuffer.getFreeSpace());
+	std::lock_guard<std::mutex> _(bgcompile::compilerMutex());
+	bgcompile::reset();
+	codeBuffer.setRegions(config::DynarecCodeEviction ? CODE_REGIONS : 1);
 	codeBuffer.reset(false);
+	// the global register convention can only change when all blocks are discarded
+	globalregs::update();
 	bm_ResetCache();
+	memprofile::reset();
+	fpscrspec::reset();
 	smc_hotspots.clear();
 	clear_temp_cache(true);
 }
 
+bool Sh4Recompiler::EvictCode()
+{
+	std::lock_guard<std::mutex> _(bgcompile::compilerMutex());
+	if (!codeBuffer.nextRegion())
+		return false;
+	// Blocks compiled in the background may be in the evicted region
+	bgcompile::reset();
+	u8 *start = (u8 *)codeBuffer.get();
+	u32 blocks = bm_DiscardCode(start, start + codeBuffer.getFreeSpace());
+	DEBUG_LOG(DYNAREC, "recSh4:Evicted %d blocks at %08X", blocks, getContext()->pc);
+
+	return true;
+}
+
+void Sh4Recompiler::InterpretBlock()
+{
+	// Used by the delay slot handlers
+	Sh4Interpreter::Instance = this;
+	try {
+		// Stop at the first branch, or when the block would be split by the decoder
+		for (u32 i = 0; i < BLOCK_MAX_SH_OPS_SOFT && ctx->cycle_counter > 0; i++)
+		{
+			const u32 pc = ctx->pc;
+			ExecuteOpcode(ReadNexOp());
+			if (ctx->pc != pc + 2)
+				break;
+		}
+	} catch (const SH4ThrownException& ex) {
+		Do_Exception(ex.epc, ex.expEvn);
+	}
+	Sh4Interpreter::Instance = nullptr;
+}
+
 void Sh4Recompiler::Run()
 {
 	getContext()->restoreHostRoundingMode();
@@ -99,8 +176,9 @@ void Sh4Recompiler::Run()
 }
 
 void AnalyseBlock(RuntimeBlockInfo* blk);
+void AnalyseBlockBaseline(RuntimeBlockInfo* blk);
 
-bool RuntimeBlockInfo::Setup(u32 rpc,fpscr_t rfpu_cfg)
+bool RuntimeBlockInfo::Setup(u32 rpc,fpscr_t rfpu_cfg,bool baseline,bool trace,bool background)
 {
 	addr = host_code_size = 0;
 	guest_cycles = guest_opcodes = host_opcodes = 0;
@@ -113,6 +191,12 @@ bool RuntimeBlockInfo::Setup(u32 rpc,fpscr_t rfpu_cfg)
 	BlockType = BET_SCL_Intr;
 	has_fpu_op = false;
 	temp_block = false;
+	this->baseline = false;
+	hot_counter = 0;
+	trace_branches = 0;
+	fpscr_guards = 0;
+	for (u64& lines : data_lines)
+		lines = 0;
 	
 	vaddr = rpc;
 	if (vaddr & 1)
@@ -138,35 +222,83 @@ bool RuntimeBlockInfo::Setup(u32 rpc,fpscr_t rfpu_cfg)
 	
 	oplist.clear();
 
+	// cached blocks are fully optimized
+	if (!background && shilcache::lookup(this))
+	{
+		SetProtectedFlags();
+		return true;
+	}
+
 	try {
-		if (!dec_DecodeBlock(this, SH4_TIMESLICE / 2))
+		const bool speculate = !baseline && !background && fpscrspec::enabled();
+		if (!dec_DecodeBlock(this, SH4_TIMESLICE / 2, trace, background, speculate))
 			return false;
 	}
 	catch (const SH4ThrownException& ex) {
-		Do_Exception(rpc, ex.expEvn);
+		if (!background)
+			Do_Exception(rpc, ex.expEvn);
 		return false;
 	}
-	SetProtectedFlags();
+	// The pages are protected once the data lines read by the optimizer are known.
+	// When compiling in the background, this is done on the emulation thread when the block is published.
+	read_only = IsProtectable();
 
-	AnalyseBlock(this);
+	if (baseline)
+	{
+		this->baseline = true;
+		hot_counter = HOT_BLOCK_THRESHOLD;
+		AnalyseBlockBaseline(this);
+	}
+	else
+	{
+		AnalyseBlock(this);
+	}
+	if (!background)
+	{
+		SetProtectedFlags();
+		// Speculated fpu modes may be disabled later so these blocks aren't cached
+		if (!baseline && fpscr_guards == 0)
+			shilcache::store(this);
+	}
 
 	return true;
 }
 
-DynarecCodeEntryPtr rdv_CompilePC(u32 blockcheck_failures)
+DynarecCodeEntryPtr rdv_CompilePC(u32 blockcheck_failures, bool hot)
 {
 	const u32 pc = Sh4cntx.pc;
 
-	if (codeBuffer.getFreeSpace() < 32_KB || pc == 0x8c0000e0 || pc == 0xac010000 || pc == 0xac008300)
+	if (pc == 0x8c0000e0 || pc == 0xac010000 || pc == 0xac008300)
 		Sh4Recompiler::Instance->ResetCache();
 
+	std::unique_lock<std::mutex> lock(bgcompile::compilerMutex());
+	// The background compiler may use the free space until the lock is held
+	while (codeBuffer.getFreeSpace() < 32_KB)
+	{
+		lock.unlock();
+		if (!Sh4Recompiler::Instance->EvictCode())
+			Sh4Recompiler::Instance->ResetCache();
+		lock.lock();
+	}
+	if (precompile::isEntry(pc))
+	{
+		precompile::run(pc, Sh4cntx.fpscr);
+		RuntimeBlockInfo *block = bm_GetBlock(pc);
+		if (block != nullptr)
+			return block->code;
+	}
 	RuntimeBlockInfo* rbi = sh4Dynarec->allocateBlock();
+	const bool baseline = !hot && config::DynarecTieredCompilation
+			&& sh4Dynarec->supportsTieredCompilation() && !mmu_enabled();
 
-	if (!rbi->Setup(pc, Sh4cntx.fpscr))
+	// Hot blocks are decoded as traces
+	if (!rbi->Setup(pc, Sh4cntx.fpscr, baseline, hot && !mmu_enabled()))
 	{
 		delete rbi;
 		return nullptr;
 	}
+	if (!rbi->baseline)
+		globalregs::recordBlock(rbi);
 	rbi->blockcheck_failures = blockcheck_failures;
 	if (smc_hotspots.find(rbi->addr) != smc_hotspots.end())
 	{
@@ -198,6 +330,20 @@ DynarecCodeEntryPtr DYNACALL rdv_FailedToFindBlock(u32 pc)
 {
 	//DEBUG_LOG(DYNAREC, "rdv_FailedToFindBlock %08x", pc);
 	Sh4cntx.pc=pc;
+	if (bgcompile::enabled())
+	{
+		bgcompile::publish();
+		DynarecCodeEntryPtr code = bm_GetCodeByVAddr(pc);
+		if (code != (DynarecCodeEntryPtr)ngen_FailedToFindBlock)
+			return code;
+		// Interpret the block while it's being compiled.
+		// Compile it synchronously if the timeslice is over so that interrupts are serviced.
+		if (Sh4cntx.cycle_counter > 0 && bgcompile::request(pc, Sh4cntx.fpscr))
+		{
+			Sh4Recompiler::Instance->InterpretBlock();
+			return bm_GetCodeByVAddr(Sh4cntx.pc);
+		}
+	}
 	DynarecCodeEntryPtr code = rdv_CompilePC(0);
 	if (code == NULL)
 		code = bm_GetCodeByVAddr(Sh4cntx.pc);
@@ -219,8 +365,16 @@ DynarecCodeEntryPtr DYNACALL rdv_BlockCheckFail(u32 addr)
 	u32 blockcheck_failures = 0;
 	if (mmu_enabled())
 	{
-		RuntimeBlockInfoPtr block = bm_GetBlock(addr);
-		if (block)
+		RuntimeBlockInfo *block = bm_GetBlock(addr);
+		if (block != nullptr && block->vaddr != Sh4cntx.pc)
+		{
+			// Same physical code at another virtual address. Keep the block for when
+			// it's executed at its address again.
+			RuntimeBlockInfo *other = bm_SwapVAddrBlock(block, Sh4cntx.pc);
+			if (other != nullptr)
+				return (DynarecCodeEntryPtr)CC_RW2RX(other->code);
+		}
+		else if (block)
 		{
 			blockcheck_failures = block->blockcheck_failures + 1;
 			if (blockcheck_failures > 5)
@@ -229,7 +383,7 @@ DynarecCodeEntryPtr DYNACALL rdv_BlockCheckFail(u32 addr)
 				if (inserted)
 					DEBUG_LOG(DYNAREC, "rdv_BlockCheckFail SMC hotspot @ %08x fails %d", addr, blockcheck_failures);
 			}
-			bm_DiscardBlock(block.get());
+			bm_DiscardBlock(block);
 		}
 	}
 	else
@@ -240,10 +394,54 @@ DynarecCodeEntryPtr DYNACALL rdv_BlockCheckFail(u32 addr)
 	return (DynarecCodeEntryPtr)CC_RW2RX(rdv_CompilePC(blockcheck_failures));
 }
 
+DynarecCodeEntryPtr DYNACALL rdv_HotBlock(u32 addr)
+{
+	u32 blockcheck_failures = 0;
+	RuntimeBlockInfo *block = bm_GetBlock(addr);
+	if (block)
+	{
+		if (!block->baseline)
+			return (DynarecCodeEntryPtr)CC_RW2RX(block->code);
+		blockcheck_failures = block->blockcheck_failures;
+		bm_DiscardBlock(block);
+	}
+	Sh4cntx.pc = addr;
+	return (DynarecCodeEntryPtr)CC_RW2RX(rdv_CompilePC(blockcheck_failures, true));
+}
+
+DynarecCodeEntryPtr DYNACALL rdv_FpscrMismatch(u32 addr)
+{
+	{
+		// read by the background compiler
+		std::lock_guard<std::mutex> _(bgcompile::compilerMutex());
+		fpscrspec::entryMismatch(addr);
+	}
+	u32 blockcheck_failures = 0;
+	RuntimeBlockInfo *block = bm_GetBlock(addr);
+	if (block)
+	{
+		blockcheck_failures = block->blockcheck_failures;
+		bm_DiscardBlock(block);
+	}
+	Sh4cntx.pc = addr;
+	return (DynarecCodeEntryPtr)CC_RW2RX(rdv_CompilePC(blockcheck_failures));
+}
+
+void DYNACALL rdv_FpscrGuardFail(u32 addr, u32 pc)
+{
+	DEBUG_LOG(DYNAREC, "rdv_FpscrGuardFail @ %08x block %08x", pc, addr);
+	if (!fpscrspec::guardFailed(pc))
+		return;
+	// The block is still running but its code is only released when the cache is flushed or evicted
+	RuntimeBlockInfo *block = bm_GetBlock(addr);
+	if (block != nullptr && block->fpscr_guards != 0)
+		bm_DiscardBlock(block);
+}
+
 DynarecCodeEntryPtr rdv_FindOrCompile()
 {
 	DynarecCodeEntryPtr rv = bm_GetCodeByVAddr(Sh4cntx.pc);  // Returns exec addr
-	if (rv == ngen_FailedToFindBlock)
+	if (rv == ngen_FailedToFindBlock && !bgcompile::enabled())
 		rv = (DynarecCodeEntryPtr)CC_RW2RX(rdv_CompilePC(0));  // Returns rw addr
 	
 	return rv;
@@ -253,7 +451,7 @@ void* DYNACALL rdv_LinkBlock(u8* code,u32 dpc)
 {
 	// code is the RX addr to return after, however bm_GetBlock returns RW
 	//DEBUG_LOG(DYNAREC, "rdv_LinkBlock %p pc %08x", code, dpc);
-	RuntimeBlockInfoPtr rbi = bm_GetBlock(code);
+	RuntimeBlockInfo *rbi = bm_GetBlock(code);
 	bool stale_block = false;
 	if (!rbi)
 	{
@@ -285,9 +483,15 @@ void* DYNACALL rdv_LinkBlock(u8* code,u32 dpc)
 	}
 
 	DynarecCodeEntryPtr rv = rdv_FindOrCompile();  // Returns rx ptr
+	// The block may have been evicted or flushed to make room for the new one
+	if (!stale_block && bm_GetBlock(code) != rbi)
+		stale_block = true;
 
 	if (mmu_enabled())
 		return (void *)rv;
+	if (rv == ngen_FailedToFindBlock)
+		// Compiled in the background. The block will be linked once published.
+		return (void *)rv;
 	if (!stale_block)
 	{
 		if (bcls == BET_CLS_Dynamic)
@@ -302,13 +506,13 @@ void* DYNACALL rdv_LinkBlock(u8* code,u32 dpc)
 			}
 			else if (rbi->relink_data == 0)
 			{
-				rbi->pBranchBlock = bm_GetBlock(Sh4cntx.pc).get();
+				rbi->pBranchBlock = bm_GetBlock(Sh4cntx.pc);
 				rbi->pBranchBlock->AddRef(rbi);
 			}
 		}
 		else
 		{
-			RuntimeBlockInfo* nxt = bm_GetBlock(Sh4cntx.pc).get();
+			RuntimeBlockInfo* nxt = bm_GetBlock(Sh4cntx.pc);
 
 			if (rbi->BranchBlock == Sh4cntx.pc)
 				rbi->pBranchBlock = nxt;
@@ -337,6 +541,58 @@ void Sh4Recompiler::Reset(bool hard)
 		bm_Reset();
 }
 
+// Loads the per-game state of the dynarec passes and logs their statistics when the game is unloaded
+static void eventCallback(Event event, void *)
+{
+	static std::string gameId;
+	switch (event)
+	{
+	case Event::Start:
+		gameId = settings.content.gameId;
+		shilcache::load(gameId);
+		precompile::start();
+		globalregs::resetStats();
+		bgcompile::resetStats();
+		precompile::resetStats();
+		memprofile::resetStats();
+		fpscrspec::resetStats();
+		idleloop::resetStats();
+		break;
+	case Event::Terminate:
+		{
+			const globalregs::Stats& regs = globalregs::getStats();
+			if (regs.blocks != 0)
+				NOTICE_LOG(DYNAREC, "%s: global registers saved %" PRIu64 " fills in %d blocks", gameId.c_str(),
+						regs.fillsSaved, regs.blocks);
+			const bgcompile::Stats& bg = bgcompile::getStats();
+			if (bg.interpreted != 0)
+				NOTICE_LOG(DYNAREC, "%s: background compiler published %d blocks, dropped %d, interpreted %d blocks", gameId.c_str(),
+						bg.compiled, bg.dropped, bg.interpreted);
+			const precompile::Stats& pre = precompile::getStats();
+			if (pre.blocks != 0)
+				NOTICE_LOG(DYNAREC, "%s: precompiled %d blocks in %d ms", gameId.c_str(), pre.blocks, pre.timeMs);
+			const memprofile::Stats& mem = memprofile::getStats();
+			if (mem.profiledOps != 0)
+				NOTICE_LOG(DYNAREC, "%s: memory profile: %d ops profiled, %d specialized", gameId.c_str(),
+						mem.profiledOps, mem.specializedOps);
+			const fpscrspec::Stats& fpu = fpscrspec::getStats();
+			if (fpu.speculatedWrites != 0 || fpu.entryMismatches != 0)
+				NOTICE_LOG(DYNAREC, "%s: fpu mode speculation: %d fpscr writes speculated, %d guard failures, %d entry mismatches",
+						gameId.c_str(), fpu.speculatedWrites, fpu.guardFailures, fpu.entryMismatches);
+			const idleloop::Stats& idle = idleloop::getStats();
+			if (idle.fastForwards != 0)
+				NOTICE_LOG(DYNAREC, "%s: idle loops: %d fast-forwards, %d loops, %.1f s skipped", gameId.c_str(),
+						idle.fastForwards, idle.loops, idle.skippedCycles / (float)SH4_MAIN_CLOCK);
+		}
+		shilcache::save();
+		shilcache::clear();
+		precompile::stop();
+		break;
+	default:
+		break;
+	}
+}
+
 void Sh4Recompiler::Init()
 {
 	INFO_LOG(DYNAREC, "Sh4Recompiler::Init");
@@ -359,12 +615,24 @@ void Sh4Recompiler::Init()
 
 	TempCodeCache = CodeCache + CODE_SIZE;
 	sh4Dynarec->init(*getContext(), codeBuffer);
+	globalregs::init();
 	bm_ResetCache();
+	bgcompile::init(codeBuffer);
+	precompile::init(codeBuffer);
+	EventManager::listen(Event::Start, eventCallback);
+	EventManager::listen(Event::Terminate, eventCallback);
 }
 
 void Sh4Recompiler::Term()
 {
 	INFO_LOG(DYNAREC, "Sh4Recompiler::Term");
+	EventManager::unlisten(Event::Start, eventCallback);
+	EventManager::unlisten(Event::Terminate, eventCallback);
+	bgcompile::term();
+	precompile::term();
+	memprofile::term();
+	fpscrspec::term();
+	idleloop::term();
 #ifdef FEAT_NO_RWX_PAGES
 	if (CodeCache != nullptr)
 		virtmem::release_jit_block(CodeCache, (u8 *)CodeCache + cc_rx_offset, FULL_SIZE);
@@ -374,6 +642,8 @@ void Sh4Recompiler::Term()
 #endif
 	CodeCache = nullptr;
 	TempCodeCache = nullptr;
+	shilcache::term();
+	globalregs::term();
 	bm_Term();
 	super::Term();
 }
@@ -413,6 +683,9 @@ static bool translateAddress(u32 addr, int size, u32 access, u32& outAddr, Runti
 bool rdv_readMemImmediate(u32 addr, int size, void*& ptr, bool& isRam, u32& physAddr, RuntimeBlockInfo* block)
 {
 	size = std::min(size, 4);
+	if (ocache.isEmulated() && cachedArea(addr >> 29))
+		// must go through the operand cache
+		return false;
 	if (!translateAddress(addr, size, MMU_TT_DREAD, physAddr, block))
 		return false;
 	ptr = addrspace::readConst(physAddr, isRam, size);
@@ -423,6 +696,8 @@ bool rdv_readMemImmediate(u32 addr, int size, void*& ptr, bool& isRam, u32& phys
 bool rdv_writeMemImmediate(u32 addr, int size, void*& ptr, bool& isRam, u32& physAddr, RuntimeBlockInfo* block)
 {
 	size = std::min(size, 4);
+	if (ocache.isEmulated() && cachedArea(addr >> 29))
+		return false;
 	if (!translateAddress(addr, size, MMU_TT_DWRITE, physAddr, block))
 		return false;
 	ptr = addrspace::writeConst(physAddr, isRam, size);
@@ -0,0 +1,94 @@
+/*
+	FPU mode speculation.
+
+	The mode following an fpscr write (lds or lds.l) is predicted from the fpu
+	configuration of the block that was compiled at the next instruction, which
+	is what the first execution of the write led to. The guard emitted after the
+	write compares the actual mode with the prediction and leaves the block at
+	the next instruction if they differ. Guards that keep failing disable the
+	speculation at their address and their block is recompiled.
+
+	Blocks that are entered with another mode are recompiled for the new mode.
+	Code that is alternately run in different modes stops checking the mode on
+	entry after a few recompilations and runs as compiled, as it did without
+	speculation.
+*/
+#include "fpscrspec.h"
+
+#if FEAT_SHREC != DYNAREC_NONE
+#include "blockmanager.h"
+#include "ngen.h"
+#include "hw/sh4/modules/mmu.h"
+#include "cfg/option.h"
+
+#include <unordered_map>
+
+namespace fpscrspec
+{
+
+constexpr u32 MaxGuardFailures = 4;
+constexpr u32 MaxEntryMismatches = 8;
+
+static std::unordered_map<u32, u32> guardFailures;
+static std::unordered_map<u32, u32> entryMismatches;
+static Stats stats;
+
+bool enabled() {
+	return config::DynarecFpscrSpeculation && !mmu_enabled() && sh4Dynarec->supportsFpscrSpeculation();
+}
+
+void reset()
+{
+	guardFailures.clear();
+	entryMismatches.clear();
+}
+
+bool predict(u32 pc, fpscr_t& fpscr)
+{
+	auto it = guardFailures.find(pc);
+	if (it != guardFailures.end() && it->second >= MaxGuardFailures)
+		return false;
+	RuntimeBlockInfo *block = bm_GetBlock(pc);
+	if (block == nullptr)
+		return false;
+	fpscr = block->fpu_cfg;
+	stats.speculatedWrites++;
+	return true;
+}
+
+bool guardFailed(u32 pc)
+{
+	stats.guardFailures++;
+	return ++guardFailures[pc] == MaxGuardFailures;
+}
+
+bool guardEntry(const RuntimeBlockInfo *block)
+{
+	if (!block->has_fpu_op || !enabled())
+		return false;
+	auto it = entryMismatches.find(block->addr);
+	return it == entryMismatches.end() || it->second < MaxEntryMismatches;
+}
+
+void entryMismatch(u32 addr)
+{
+	stats.entryMismatches++;
+	if (++entryMismatches[addr] == MaxEntryMismatches)
+		DEBUG_LOG(DYNAREC, "fpscrspec: block %08x is run in several fpu modes", addr);
+}
+
+const Stats& getStats() {
+	return stats;
+}
+
+void resetStats() {
+	stats = {};
+}
+
+void term()
+{
+	reset();
+}
+
+}
+#endif	// FEAT_SHREC != DYNAREC_NONE
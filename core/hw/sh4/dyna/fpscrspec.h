@@ -0,0 +1,46 @@
+/*
+	FPU mode speculation.
+	Blocks are compiled for the FPSCR.PR, SZ and RM bits found on entry. With
+	speculation enabled, they check these bits on entry and are recompiled if
+	they don't match. FPSCR writes don't end blocks anymore: decoding continues
+	with the mode that was seen after the write, guarded by a mode check that
+	exits the block if the prediction is wrong.
+*/
+#pragma once
+#include "types.h"
+#include "hw/sh4/sh4_if.h"
+
+struct RuntimeBlockInfo;
+
+namespace fpscrspec
+{
+
+// FPSCR bits used by the decoder: RM, PR and SZ
+constexpr u32 ModeMask = 0x00180003;
+
+struct Stats
+{
+	u32 speculatedWrites = 0;
+	u32 guardFailures = 0;
+	u32 entryMismatches = 0;
+};
+
+void term();
+
+bool enabled();
+// Discards all failure counts. Must only be called when the code cache is flushed.
+void reset();
+
+// Returns true and the predicted fpscr value if decoding can continue at pc after an fpscr write
+bool predict(u32 pc, fpscr_t& fpscr);
+// A mode guard failed at pc. Returns true if the block should be recompiled without speculation at pc.
+bool guardFailed(u32 pc);
+// Returns true if the block must check the fpu mode on entry
+bool guardEntry(const RuntimeBlockInfo *block);
+// The block at addr has been entered with another fpu mode
+void entryMismatch(u32 addr);
+
+const Stats& getStats();
+void resetStats();
+
+}
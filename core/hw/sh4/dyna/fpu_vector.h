@@ -0,0 +1,93 @@
+/*
+	SH4 FIPR and FTRV using host SIMD instructions.
+
+	The interpreter computes each inner product in double precision as
+	((p0 + p1) + p2) + p3, where the products of two floats are exact.
+	The functions below, and the native code emitted by the x64 and arm64
+	dynarecs, convert the operands to double pairs, multiply them and add the
+	products in the same order so that the results are identical.
+*/
+#pragma once
+#include "types.h"
+#include "hw/sh4/sh4_core.h"
+
+#if HOST_CPU == CPU_X64
+#include <emmintrin.h>
+#elif HOST_CPU == CPU_ARM64
+#include <arm_neon.h>
+#endif
+
+// fn . fm
+static inline f32 fpu_fipr(const f32 *fn, const f32 *fm)
+{
+#if HOST_CPU == CPU_X64
+	const __m128 n = _mm_loadu_ps(fn);
+	const __m128 m = _mm_loadu_ps(fm);
+	const __m128d lo = _mm_mul_pd(_mm_cvtps_pd(n), _mm_cvtps_pd(m));
+	const __m128d hi = _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(n, n)), _mm_cvtps_pd(_mm_movehl_ps(m, m)));
+	__m128d s = _mm_add_sd(lo, _mm_unpackhi_pd(lo, lo));
+	s = _mm_add_sd(s, hi);
+	s = _mm_add_sd(s, _mm_unpackhi_pd(hi, hi));
+	return fixNaN(_mm_cvtss_f32(_mm_cvtsd_ss(_mm_setzero_ps(), s)));
+#elif HOST_CPU == CPU_ARM64
+	const float32x4_t n = vld1q_f32(fn);
+	const float32x4_t m = vld1q_f32(fm);
+	const float64x2_t lo = vmulq_f64(vcvt_f64_f32(vget_low_f32(n)), vcvt_f64_f32(vget_low_f32(m)));
+	const float64x2_t hi = vmulq_f64(vcvt_high_f64_f32(n), vcvt_high_f64_f32(m));
+	double s = vpaddd_f64(lo);
+	s += vgetq_lane_f64(hi, 0);
+	s += vgetq_lane_f64(hi, 1);
+	return fixNaN((f32)s);
+#else
+	double s = (double)fn[0] * fm[0];
+	s += (double)fn[1] * fm[1];
+	s += (double)fn[2] * fm[2];
+	s += (double)fn[3] * fm[3];
+	return fixNaN((f32)s);
+#endif
+}
+
+// fd = fm * fn
+// fm is a 4x4 column-major matrix. fd and fn can be the same vector.
+static inline void fpu_ftrv(f32 *fd, const f32 *fn, const f32 *fm)
+{
+#if HOST_CPU == CPU_X64
+	// converts 2 floats to doubles
+	const auto load = [fm](int i) {
+		return _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd((const double *)&fm[i])));
+	};
+	__m128d lo = _mm_mul_pd(load(0), _mm_set1_pd(fn[0]));
+	__m128d hi = _mm_mul_pd(load(2), _mm_set1_pd(fn[0]));
+	for (int i = 1; i < 4; i++)
+	{
+		const __m128d v = _mm_set1_pd(fn[i]);
+		lo = _mm_add_pd(lo, _mm_mul_pd(load(i * 4), v));
+		hi = _mm_add_pd(hi, _mm_mul_pd(load(i * 4 + 2), v));
+	}
+	_mm_storeu_ps(fd, _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi)));
+#elif HOST_CPU == CPU_ARM64
+	float64x2_t lo = vmulq_n_f64(vcvt_f64_f32(vld1_f32(&fm[0])), fn[0]);
+	float64x2_t hi = vmulq_n_f64(vcvt_f64_f32(vld1_f32(&fm[2])), fn[0]);
+	for (int i = 1; i < 4; i++)
+	{
+		lo = vaddq_f64(lo, vmulq_n_f64(vcvt_f64_f32(vld1_f32(&fm[i * 4])), fn[i]));
+		hi = vaddq_f64(hi, vmulq_n_f64(vcvt_f64_f32(vld1_f32(&fm[i * 4 + 2])), fn[i]));
+	}
+	vst1q_f32(fd, vcombine_f32(vcvt_f32_f64(lo), vcvt_f32_f64(hi)));
+#else
+	double v[4];
+	for (int j = 0; j < 4; j++)
+	{
+		v[j] = (double)fm[j] * fn[0];
+		v[j] += (double)fm[j + 4] * fn[1];
+		v[j] += (double)fm[j + 8] * fn[2];
+		v[j] += (double)fm[j + 12] * fn[3];
+	}
+	for (int j = 0; j < 4; j++)
+		fd[j] = (f32)v[j];
+#endif
+#ifdef STRICT_MODE
+	for (int j = 0; j < 4; j++)
+		fd[j] = fixNaN(fd[j]);
+#endif
+}
@@ -0,0 +1,135 @@
+/*
+	Global register allocation.
+
+	A histogram of the guest registers read before being written (live-in) is
+	built from the optimized blocks of the running game. When the code cache is
+	flushed, the most frequent live-in registers become the new convention:
+	the mainloop loads them into their host registers before entering a block,
+	blocks keep them up to date and linked blocks can use them without a fill.
+	They are still written back to the context so the rest of the emulator
+	always sees the current value.
+*/
+#include "globalregs.h"
+
+#if FEAT_SHREC != DYNAREC_NONE
+#include "blockmanager.h"
+#include "cfg/option.h"
+
+#include <algorithm>
+#include <array>
+
+namespace globalregs
+{
+
+static const Sh4RegType DefaultRegs[MaxRegs] = { reg_r15, reg_r14, reg_r4 };
+constexpr u32 GprCount = reg_r15 + 1;
+
+static bool active;
+static Sh4RegType regs[MaxRegs] = { reg_r15, reg_r14, reg_r4 };
+static std::array<u64, GprCount> liveIn;
+static Stats stats;
+
+void update()
+{
+	active = config::DynarecGlobalRegAlloc;
+	if (!active)
+		return;
+
+	u64 total = 0;
+	for (u64 count : liveIn)
+		total += count;
+	if (total == 0)
+	{
+		std::copy(std::begin(DefaultRegs), std::end(DefaultRegs), std::begin(regs));
+		return;
+	}
+	// Default registers first so that they win ties
+	std::array<Sh4RegType, GprCount> order;
+	std::copy(std::begin(DefaultRegs), std::end(DefaultRegs), order.begin());
+	u32 n = MaxRegs;
+	for (u32 i = 0; i < GprCount; i++)
+		if (std::find(std::begin(DefaultRegs), std::end(DefaultRegs), (Sh4RegType)i) == std::end(DefaultRegs))
+			order[n++] = (Sh4RegType)i;
+	std::stable_sort(order.begin(), order.end(), [](Sh4RegType a, Sh4RegType b) {
+		return liveIn[a] > liveIn[b];
+	});
+	std::copy(order.begin(), order.begin() + MaxRegs, std::begin(regs));
+	INFO_LOG(DYNAREC, "Global registers: r%d r%d r%d", regs[0], regs[1], regs[2]);
+
+	// Age the histogram so that the convention follows the game's current code
+	for (u64& count : liveIn)
+		count /= 2;
+}
+
+bool enabled() {
+	return active;
+}
+
+u32 count() {
+	return active ? MaxRegs : 0;
+}
+
+Sh4RegType reg(u32 index)
+{
+	verify(index < count());
+	return regs[index];
+}
+
+void recordBlock(const RuntimeBlockInfo *block)
+{
+	u32 defined = 0;
+	u32 used = 0;
+	auto addSource = [&](const shil_param& param) {
+		if (param.is_r32i() && param._reg < GprCount)
+		{
+			u32 mask = 1 << param._reg;
+			if ((defined & mask) == 0)
+				used |= mask;
+		}
+	};
+	auto addDest = [&](const shil_param& param) {
+		if (param.is_reg() && param._reg < GprCount)
+			for (u32 i = 0; i < param.count() && param._reg + i < GprCount; i++)
+				defined |= 1 << (param._reg + i);
+	};
+	for (const shil_opcode& op : block->oplist)
+	{
+		addSource(op.rs1);
+		addSource(op.rs2);
+		addSource(op.rs3);
+		addDest(op.rd);
+		addDest(op.rd2);
+	}
+	for (u32 i = 0; i < GprCount; i++)
+		if (used & (1 << i))
+			liveIn[i]++;
+}
+
+void addFillsSaved(u32 fills)
+{
+	stats.fillsSaved += fills;
+	stats.blocks++;
+}
+
+const Stats& getStats() {
+	return stats;
+}
+
+void resetStats()
+{
+	liveIn.fill(0);
+	stats = {};
+}
+
+void init()
+{
+	liveIn.fill(0);
+}
+
+void term()
+{
+	active = false;
+}
+
+}
+#endif	// FEAT_SHREC != DYNAREC_NONE
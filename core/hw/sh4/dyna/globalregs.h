@@ -0,0 +1,46 @@
+/*
+	Global register allocation.
+	The guest registers that are most often live on block entry are kept in
+	fixed host registers across linked blocks, so that blocks don't need to
+	reload them from the context.
+*/
+#pragma once
+#include "types.h"
+#include "shil.h"
+
+struct RuntimeBlockInfo;
+
+namespace globalregs
+{
+
+// Maximum number of guest registers kept in host registers across blocks
+constexpr u32 MaxRegs = 3;
+
+struct Stats
+{
+	u64 fillsSaved = 0;
+	u32 blocks = 0;
+};
+
+void init();
+void term();
+
+// Selects the guest registers to keep in host registers.
+// Must only be called when the code cache is flushed.
+void update();
+
+bool enabled();
+// Number of global registers of the current convention
+u32 count();
+Sh4RegType reg(u32 index);
+
+// Adds the live-in registers of an optimized block to the per-game histogram
+void recordBlock(const RuntimeBlockInfo *block);
+// Guest register loads avoided when compiling a block
+void addFillsSaved(u32 fills);
+
+const Stats& getStats();
+// Also clears the live-in histogram
+void resetStats();
+
+}
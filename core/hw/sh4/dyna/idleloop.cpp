@@ -0,0 +1,79 @@
+/*
+	Idle loop detection.
+
+	The SSA optimizer marks the idle loops with a shop_idle op at the end of
+	the block (see SSAOptimizer::IdleLoopPass), which calls fastForward() when
+	the loop branch is taken.
+
+	The scheduler is only updated at the end of each timeslice, when
+	sh4_sched_next is decremented by the timeslice length (slice_cycles). So
+	fast-forwarding ends the current timeslice and extends it by as many
+	SH4_TIMESLICE cycles as needed for the next event to be due. The event is
+	then handled at the same time as if the loop had been executed.
+	With config::EventBatching, the timeslices already last until the next event
+	so the current one is only ended. The following ones are batched as usual.
+*/
+#include "idleloop.h"
+
+#if FEAT_SHREC != DYNAREC_NONE
+#include "hw/sh4/sh4_if.h"
+#include "hw/sh4/sh4_sched.h"
+#include "hw/sh4/modules/mmu.h"
+#include "cfg/option.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+namespace idleloop
+{
+
+static std::unordered_map<u32, u32> fastForwards;
+static Stats stats;
+
+bool enabled() {
+	return config::DynarecIdleLoops && !mmu_enabled();
+}
+
+void DYNACALL fastForward(u32 addr)
+{
+	// Blocks may come from the persistent cache
+	if (!config::DynarecIdleLoops)
+		return;
+	u64 cycles = std::max(Sh4cntx.cycle_counter, 0);
+	Sh4cntx.cycle_counter = 0;
+	// the next event is handled at the end of the timeslice if it's due before then
+	if (!config::EventBatching && Sh4cntx.sh4_sched_next >= Sh4cntx.slice_cycles)
+	{
+		const int slices = (Sh4cntx.sh4_sched_next - Sh4cntx.slice_cycles) / SH4_TIMESLICE + 1;
+		Sh4cntx.slice_cycles += slices * SH4_TIMESLICE;
+		cycles += slices * SH4_TIMESLICE;
+	}
+	stats.fastForwards++;
+	stats.skippedCycles += cycles;
+	if (++fastForwards[addr] == 1)
+		stats.loops++;
+}
+
+u32 getFastForwards(u32 addr)
+{
+	auto it = fastForwards.find(addr);
+	return it == fastForwards.end() ? 0 : it->second;
+}
+
+const Stats& getStats() {
+	return stats;
+}
+
+void resetStats()
+{
+	stats = {};
+	fastForwards.clear();
+}
+
+void term()
+{
+	fastForwards.clear();
+}
+
+}
+#endif	// FEAT_SHREC != DYNAREC_NONE
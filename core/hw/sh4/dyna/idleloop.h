@@ -0,0 +1,36 @@
+/*
+	Idle loop detection.
+	Small blocks that branch to themselves and only read memory, such as a loop
+	polling a hardware status register or a RAM flag, can't exit before another
+	event modifies the memory they read. When they iterate, the emulated time is
+	fast-forwarded to the next scheduler event instead.
+*/
+#pragma once
+#include "types.h"
+
+namespace idleloop
+{
+
+// Maximum number of SH4 instructions of an idle loop
+constexpr u32 MaxOpcodes = 8;
+
+struct Stats
+{
+	u32 fastForwards = 0;
+	u32 loops = 0;
+	u64 skippedCycles = 0;
+};
+
+void term();
+
+bool enabled();
+
+// Called by an idle loop at addr when it iterates
+void DYNACALL fastForward(u32 addr);
+// Number of fast-forwards done by the idle loop at addr
+u32 getFastForwards(u32 addr);
+
+const Stats& getStats();
+void resetStats();
+
+}
@@ -0,0 +1,126 @@
+/*
+	Profile-guided memory access specialization.
+
+	Each memory instruction of a baseline block that doesn't use a constant
+	address gets a profile slot, keyed by its guest address. The profiling
+	handlers store the address page in the slot, or Mixed if the instruction
+	accessed more than one page.
+
+	Memory pages don't need specialization since they are already handled by
+	the fast memory path, so only handler pages are considered: the optimized
+	block compares the address page with the profiled one and calls the page
+	handler directly, skipping the address space lookup and the fast path fault
+	and rewrite. Other pages still use the generic path.
+*/
+#include "memprofile.h"
+
+#if FEAT_SHREC != DYNAREC_NONE
+#include "blockmanager.h"
+#include "hw/mem/addrspace.h"
+#include "hw/sh4/modules/mmu.h"
+#include "cfg/option.h"
+
+#include <unordered_map>
+
+namespace memprofile
+{
+
+constexpr u16 Seen = 0x100;
+constexpr u16 Mixed = 0xffff;
+
+// Node-based so that slot pointers stay valid
+static std::unordered_map<u32, u16> slots;
+static Stats stats;
+
+static u32 opAddress(const RuntimeBlockInfo *block, const shil_opcode& op) {
+	return block->vaddr + op.guest_offs - (op.delay_slot ? 1 : 0);
+}
+
+static inline void record(u16 *slot, u32 addr)
+{
+	u16 page = Seen | (addr >> 24);
+	if (*slot == 0)
+		*slot = page;
+	else if (*slot != page)
+		*slot = Mixed;
+}
+
+bool enabled() {
+	return config::DynarecMemSpecialization && !mmu_enabled();
+}
+
+void reset() {
+	slots.clear();
+}
+
+u16 *getSlot(const RuntimeBlockInfo *block, const shil_opcode& op)
+{
+	stats.profiledOps++;
+	return &slots[opAddress(block, op)];
+}
+
+void *getHandler(const RuntimeBlockInfo *block, const shil_opcode& op, bool write, u32& page)
+{
+	if (op.size > 4)
+		return nullptr;
+	auto it = slots.find(opAddress(block, op));
+	if (it == slots.end() || it->second == 0 || it->second == Mixed)
+		return nullptr;
+	bool isMem;
+	page = it->second & 0xff;
+	u32 addr = page << 24;
+	void *handler = write ? addrspace::writeConst(addr, isMem, op.size) : addrspace::readConst(addr, isMem, op.size);
+	if (isMem)
+		return nullptr;
+	stats.specializedOps++;
+	return handler;
+}
+
+s32 DYNACALL read8(u32 addr, u16 *slot) {
+	record(slot, addr);
+	return addrspace::read8SX32(addr);
+}
+s32 DYNACALL read16(u32 addr, u16 *slot) {
+	record(slot, addr);
+	return addrspace::read16SX32(addr);
+}
+u32 DYNACALL read32(u32 addr, u16 *slot) {
+	record(slot, addr);
+	return addrspace::read32(addr);
+}
+u64 DYNACALL read64(u32 addr, u16 *slot) {
+	record(slot, addr);
+	return addrspace::read64(addr);
+}
+void DYNACALL write8(u32 addr, u32 data, u16 *slot) {
+	record(slot, addr);
+	addrspace::write8(addr, (u8)data);
+}
+void DYNACALL write16(u32 addr, u32 data, u16 *slot) {
+	record(slot, addr);
+	addrspace::write16(addr, (u16)data);
+}
+void DYNACALL write32(u32 addr, u32 data, u16 *slot) {
+	record(slot, addr);
+	addrspace::write32(addr, data);
+}
+void DYNACALL write64(u32 addr, u64 data, u16 *slot) {
+	record(slot, addr);
+	addrspace::write64(addr, data);
+}
+
+const Stats& getStats() {
+	return stats;
+}
+
+void resetStats() {
+	stats = {};
+}
+
+void term()
+{
+	slots.clear();
+}
+
+}
+#endif	// FEAT_SHREC != DYNAREC_NONE
@@ -0,0 +1,48 @@
+/*
+	Profile-guided memory access specialization.
+	Baseline blocks record the 16 MB address page accessed by each memory
+	instruction. When a block is recompiled, instructions that always accessed
+	the same handler page (hardware registers, TA FIFO...) call the page handler
+	directly, guarded by a page check.
+*/
+#pragma once
+#include "types.h"
+
+struct RuntimeBlockInfo;
+struct shil_opcode;
+
+namespace memprofile
+{
+
+struct Stats
+{
+	u32 profiledOps = 0;
+	u32 specializedOps = 0;
+};
+
+void term();
+
+// Memory accesses are profiled and specialized
+bool enabled();
+// Discards all profiles. Must only be called when the code cache is flushed.
+void reset();
+
+// Returns the profile slot of a memory op. The pointer is valid until the next reset.
+u16 *getSlot(const RuntimeBlockInfo *block, const shil_opcode& op);
+// Returns the handler of the page always accessed by a memory op and the page number, or nullptr
+void *getHandler(const RuntimeBlockInfo *block, const shil_opcode& op, bool write, u32& page);
+
+// Profiling memory handlers used by baseline blocks
+s32 DYNACALL read8(u32 addr, u16 *slot);
+s32 DYNACALL read16(u32 addr, u16 *slot);
+u32 DYNACALL read32(u32 addr, u16 *slot);
+u64 DYNACALL read64(u32 addr, u16 *slot);
+void DYNACALL write8(u32 addr, u32 data, u16 *slot);
+void DYNACALL write16(u32 addr, u32 data, u16 *slot);
+void DYNACALL write32(u32 addr, u32 data, u16 *slot);
+void DYNACALL write64(u32 addr, u64 data, u16 *slot);
+
+const Stats& getStats();
+void resetStats();
+
+}
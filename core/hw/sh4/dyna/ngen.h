@@ -24,8 +24,14 @@ DynarecCodeEntryPtr DYNACALL rdv_FailedToFindBlock(u32 pc);
 DynarecCodeEntryPtr DYNACALL rdv_FailedToFindBlock_pc();
 //Called when a block check failed, and the block needs to be invalidated
 DynarecCodeEntryPtr DYNACALL rdv_BlockCheckFail(u32 addr);
+//Called when a baseline block has been executed enough times, to recompile it with all optimizations
+DynarecCodeEntryPtr DYNACALL rdv_HotBlock(u32 addr);
+//Called when a block is entered with another fpu mode than the one it was compiled for
+DynarecCodeEntryPtr DYNACALL rdv_FpscrMismatch(u32 addr);
+//Called when the fpu mode guard at pc failed in the block at addr. The block must then exit to pc.
+void DYNACALL rdv_FpscrGuardFail(u32 addr, u32 pc);
 //Called to compile code @pc
-DynarecCodeEntryPtr rdv_CompilePC(u32 blockcheck_failures);
+DynarecCodeEntryPtr rdv_CompilePC(u32 blockcheck_failures, bool hot = false);
 //Finds or compiles code @pc
 DynarecCodeEntryPtr rdv_FindOrCompile();
 // Registers a custom FailedToFindBlock handler function
@@ -75,11 +81,21 @@ public:
 	void useTempBuffer(bool enable) { tempBuffer = enable; }
 	// Reset main or temp code buffer position to 0 (internal use)
 	void reset(bool temporary);
+	// Split the main buffer into regions that are recycled in FIFO order, except the first one.
+	// Takes effect at the next reset (internal use)
+	void setRegions(u32 count) { nextRegionCount = count; }
+	// Move to the oldest region, whose blocks must be discarded. Returns false if the buffer has a single region (internal use)
+	bool nextRegion();
 
 private:
+	u32 regionSize() const;
+
 	u32 lastAddr = 0;
 	u32 tempLastAddr = 0;
 	bool tempBuffer = false;
+	u32 regionCount = 1;
+	u32 region = 0;
+	u32 nextRegionCount = 1;
 };
 
 class Sh4Dynarec
@@ -103,6 +119,26 @@ public:
 	// Rewrite the memory access at host PC address 'faultAddress'. This fast memory access failed and should be rewritten
 	// to use mem access handlers.
 	virtual bool rewrite(host_context_t& context, void *faultAddress) = 0;
+	// Return true if the dynarec supports baseline blocks: it must decrement block->hot_counter on each execution
+	// of a block with block->baseline set and call rdv_HotBlock when it reaches 0.
+	virtual bool supportsTieredCompilation() {
+		return false;
+	}
+	// Return true if the dynarec implements shop_guard_fpscr and checks the fpu mode on entry of the blocks
+	// for which fpscrspec::guardEntry() is true, calling rdv_FpscrMismatch if it doesn't match block->fpu_cfg.
+	virtual bool supportsFpscrSpeculation() {
+		return false;
+	}
+	// Return true if compile() can be called from another thread than the emulation thread, and if the
+	// block lookup handler reloads the next pc from the context after calling rdv_FailedToFindBlock.
+	virtual bool supportsBackgroundCompilation() {
+		return false;
+	}
+	// Return true if the dynarec goes through the operand cache for shop_readm and shop_writem when
+	// ocache.isEmulated() is true, using ReadCachedMemNoMmu and WriteCachedMemNoMmu.
+	virtual bool supportsOCacheEmulation() {
+		return false;
+	}
 	// Allocate a new block information structure.
 	virtual RuntimeBlockInfo *allocateBlock() {
 		return new RuntimeBlockInfo();
@@ -129,7 +165,7 @@ class Sh4Recompiler : public Sh4Interpreter
 	using super = Sh4Interpreter;
 
 public:
-	Sh4Recompiler() {
+	Sh4Recompiler() : super(1) {
 		Instance = this;
 	}
 	~Sh4Recompiler() {
@@ -142,6 +178,10 @@ public:
 	void Term() override;
 
 	void clear_temp_cache(bool full);
+	// Discard the oldest code region to make room for new blocks. Returns false if the whole cache must be flushed.
+	bool EvictCode();
+	// Interpret the current block while it's being compiled in the background
+	void InterpretBlock();
 
 	static Sh4Recompiler *Instance;
 };
@@ -0,0 +1,179 @@
+/*
+	Ahead-of-time compilation of the game code.
+
+	The game entry point is known when the game is loaded (0x8c010000 for
+	Dreamcast games, the ROM header entry point for Naomi) but the code is only
+	copied to ram by the BIOS. So the pass runs the first time the entry point
+	is compiled. Starting from it, blocks are decoded and compiled, and their
+	static successors (branch and call targets, and the fall-through of
+	conditional branches) are queued until the block or code buffer budget is
+	exhausted. The code after calls and dynamic branches isn't followed: it may
+	be data, and the fpu mode when returning to it is unknown.
+
+	The fpscr at the entry point is used for all the blocks. Successors of
+	blocks that change the fpscr aren't followed since their fpu mode is unknown.
+*/
+#include "precompile.h"
+
+#if FEAT_SHREC != DYNAREC_NONE
+#include "blockmanager.h"
+#include "ngen.h"
+#include "globalregs.h"
+#include "hw/sh4/sh4_mem.h"
+#include "hw/sh4/modules/mmu.h"
+#include "hw/naomi/naomi_cart.h"
+#include "cfg/option.h"
+#include "stdclass.h"
+
+#include <unordered_set>
+#include <vector>
+
+namespace precompile
+{
+
+constexpr u32 MaxBlocks = 8192;
+// Code buffer space left for the blocks compiled at runtime, unless old code can be evicted
+constexpr u32 MinFreeSpace = 2_MB;
+
+static Sh4CodeBuffer *codeBuffer;
+static u32 entryPoint;
+static bool pending;
+static Stats stats;
+
+// Returns true if the block changes the fpu mode
+static bool writesFpscr(const RuntimeBlockInfo *block)
+{
+	for (u32 i = 0; i < block->sh4_code_size; i += 2)
+	{
+		u16 op = IReadMem16(block->addr + i);
+		if ((op & 0xF0FF) == 0x406A		// lds Rm,FPSCR
+				|| (op & 0xF0FF) == 0x4066	// lds.l @Rm+,FPSCR
+				|| op == 0xF3FD				// fschg
+				|| op == 0xFBFD)			// frchg
+			return true;
+	}
+	return false;
+}
+
+static bool compileBlock(u32 pc, fpscr_t fpscr, std::vector<u32>& successors)
+{
+	RuntimeBlockInfo *block = sh4Dynarec->allocateBlock();
+	bool decoded = false;
+	try {
+		decoded = block->Setup(pc, fpscr, false, false, true);
+	} catch (const FlycastException& e) {
+		// Probably not code
+		DEBUG_LOG(DYNAREC, "Precompilation of %08x failed: %s", pc, e.what());
+	}
+	if (!decoded)
+	{
+		// Not accounted for in the block manager counters
+		block->sh4_code_size = 0;
+		delete block;
+		return false;
+	}
+	block->SetProtectedFlags();
+	block->blockcheck_failures = 0;
+	globalregs::recordBlock(block);
+	sh4Dynarec->compile(block, !block->read_only, true);
+	verify(block->code != nullptr);
+	bm_AddBlock(block);
+
+	if (!writesFpscr(block))
+	{
+		switch (BET_GET_CLS(block->BlockType))
+		{
+		case BET_CLS_Static:
+			if (block->BranchBlock != NullAddress)
+				successors.push_back(block->BranchBlock);
+			// NextBlock is the return address of calls
+			if (block->BlockType != BET_StaticCall && block->NextBlock != NullAddress)
+				successors.push_back(block->NextBlock);
+			break;
+		case BET_CLS_COND:
+			if (block->BranchBlock != NullAddress)
+				successors.push_back(block->BranchBlock);
+			if (block->NextBlock != NullAddress)
+				successors.push_back(block->NextBlock);
+			break;
+		default:
+			// dynamic branches, calls and returns
+			break;
+		}
+	}
+	return true;
+}
+
+bool isEntry(u32 pc)
+{
+	return pending && pc == entryPoint;
+}
+
+void run(u32 entryPc, fpscr_t fpscr)
+{
+	pending = false;
+	if (mmu_enabled() || Sh4cntx.sr.FD == 1)
+		return;
+	const u64 startTime = getTimeMs();
+	const u32 region = entryPc & 0xE0000000;
+	const u32 minFreeSpace = config::DynarecCodeEviction ? 32_KB : MinFreeSpace;
+	std::unordered_set<u32> visited;
+	std::vector<u32> queue { entryPc };
+	u32 blocks = 0;
+	while (!queue.empty() && blocks < MaxBlocks && codeBuffer->getFreeSpace() >= minFreeSpace)
+	{
+		u32 pc = queue.back();
+		queue.pop_back();
+		if ((pc & 1) || (pc & 0xE0000000) != region || !IsOnRam(pc) || !visited.insert(pc).second)
+			continue;
+		if (bm_GetCodeByVAddr(pc) != (DynarecCodeEntryPtr)ngen_FailedToFindBlock)
+			continue;
+		if (compileBlock(pc, fpscr, queue))
+			blocks++;
+	}
+	stats.blocks += blocks;
+	stats.timeMs += (u32)(getTimeMs() - startTime);
+	INFO_LOG(DYNAREC, "Precompiled %d blocks from %08x in %d ms", blocks, entryPc, stats.timeMs);
+}
+
+const Stats& getStats() {
+	return stats;
+}
+
+void resetStats() {
+	stats = {};
+}
+
+void start()
+{
+	entryPoint = 0;
+	if (settings.platform.isConsole())
+	{
+		entryPoint = 0x8c010000;
+	}
+	else if (CurrentCartridge != nullptr)
+	{
+		RomBootID bootId;
+		if (CurrentCartridge->GetBootId(&bootId))
+			entryPoint = bootId.gamePC;
+	}
+	pending = config::DynarecPrecompile && entryPoint != 0;
+}
+
+void stop() {
+	pending = false;
+}
+
+void init(Sh4CodeBuffer& buffer)
+{
+	codeBuffer = &buffer;
+}
+
+void term()
+{
+	pending = false;
+	codeBuffer = nullptr;
+}
+
+}
+#endif	// FEAT_SHREC != DYNAREC_NONE
@@ -0,0 +1,36 @@
+/*
+	Ahead-of-time compilation of the game code.
+	When the game entry point is first reached, the code reachable from it
+	through static branches is compiled at once to avoid compilation hitches
+	during the first seconds of gameplay.
+*/
+#pragma once
+#include "types.h"
+#include "hw/sh4/sh4_if.h"
+
+class Sh4CodeBuffer;
+
+namespace precompile
+{
+
+struct Stats
+{
+	u32 blocks = 0;
+	u32 timeMs = 0;
+};
+
+void init(Sh4CodeBuffer& codeBuffer);
+void term();
+// Looks up the entry point of the game being started
+void start();
+void stop();
+
+// Returns true if pc is the game entry point and it hasn't been precompiled yet
+bool isEntry(u32 pc);
+// Compiles the blocks reachable from the entry point. The compiler mutex must be held.
+void run(u32 entryPc, fpscr_t fpscr);
+
+const Stats& getStats();
+void resetStats();
+
+}
@@ -12,6 +12,12 @@ void AnalyseBlock(RuntimeBlockInfo* blk)
 	optim.Optimize();
 }
 
+void AnalyseBlockBaseline(RuntimeBlockInfo* blk)
+{
+	SSAOptimizer optim(blk);
+	optim.OptimizeBaseline();
+}
+
 u32 getRegOffset(Sh4RegType reg)
 {
 	if (reg >= reg_r0 && reg <= reg_r15) {
@@ -175,6 +181,44 @@ std::string shil_opcode::dissasm() const
 	return ss.str();
 }
 
+bool shil_opcode::preservesXmtrx() const
+{
+	for (const shil_param *param : { &rd, &rd2 })
+		if (param->is_reg() && param->_reg <= reg_xf_15 && param->_reg + param->count() > reg_xf_0)
+			return false;
+	switch (op)
+	{
+	case shop_mov32:
+	case shop_mov64:
+	case shop_neg:
+	case shop_not:
+	case shop_and:
+	case shop_or:
+	case shop_xor:
+	case shop_add:
+	case shop_sub:
+	case shop_shl:
+	case shop_shr:
+	case shop_sar:
+	case shop_ext_s8:
+	case shop_ext_s16:
+	case shop_fadd:
+	case shop_fsub:
+	case shop_fmul:
+	case shop_fdiv:
+	case shop_fabs:
+	case shop_fneg:
+	case shop_fsqrt:
+	case shop_fmac:
+	case shop_fipr:
+	case shop_ftrv:
+	case shop_guard_fpscr:
+		return true;
+	default:
+		return false;
+	}
+}
+
 const char* shil_opcode_name(int op)
 {
 	return shilop_str[op];
@@ -267,6 +267,9 @@ struct shil_opcode
 	bool delay_slot;
 
     std::string dissasm() const;
+	// The op doesn't change the xf bank and is compiled inline by the x64 and arm64 dynarecs,
+	// so host vector registers holding the xf matrix stay valid.
+	bool preservesXmtrx() const;
 };
 
 const char* shil_opcode_name(int op);
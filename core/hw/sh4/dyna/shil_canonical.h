@@ -88,6 +88,8 @@
 #include "shil.h"
 #include "decoder.h"
 #include "../sh4_rom.h"
+#include "fpu_vector.h"
+#include "idleloop.h"
 
 #define BIN_OP_I_BASE(code,type,rtype) \
 shil_canonical \
@@ -136,20 +138,6 @@ shil_compile( \
 	die("This opcode requires native dynarec implementation"); \
 )
 
-#if SHIL_MODE==1
-
-template<int Stride = 1>
-static inline float innerProduct(const float *f1, const float *f2)
-{
-	const double f = (double)f1[0] * f2[Stride * 0]
-				   + (double)f1[1] * f2[Stride * 1]
-				   + (double)f1[2] * f2[Stride * 2]
-				   + (double)f1[3] * f2[Stride * 3];
-	return fixNaN((float)f);
-}
-
-#endif
-
 #else
 
 #define BIN_OP_I(z)
@@ -907,7 +895,7 @@ shil_canonical
 (
 f32,f1,(const float* fn, const float* fm),
 
-	return innerProduct(fn, fm);
+	return fpu_fipr(fn, fm);
 )
 
 shil_compile
@@ -925,14 +913,7 @@ shil_canonical
 (
 void,f1,(float *fd, const float *fn, const float *fm),
 
-	float v1 = innerProduct<4>(fn, fm);
-	float v2 = innerProduct<4>(fn, fm + 1);
-	float v3 = innerProduct<4>(fn, fm + 2);
-	float v4 = innerProduct<4>(fn, fm + 3);
-	fd[0] = v1;
-	fd[1] = v2;
-	fd[2] = v3;
-	fd[3] = v4;
+	fpu_ftrv(fd, fn, fm);
 )
 
 shil_compile
@@ -1071,6 +1052,31 @@ shil_compile
 )
 shil_opc_end()
 
+//shop_guard_fpscr
+//Exits the block at pc rs1 if (fpscr & rs3) != rs2
+//and gives back the cycles of the instructions after it (size)
+shil_opc(guard_fpscr)
+shil_recimp()
+shil_opc_end()
+
+//shop_idle
+//Idle loop at address rs3: fast-forwards to the next scheduler event if the loop condition rs1 == rs2
+shil_opc(idle)
+shil_canonical
+(
+void,f1,(u32 cond, u32 loop, u32 addr),
+	if (cond == loop)
+		idleloop::fastForward(addr);
+)
+shil_compile
+(
+	shil_cf_arg_u32(rs3);
+	shil_cf_arg_u32(rs2);
+	shil_cf_arg_u32(rs1);
+	shil_cf(f1);
+)
+shil_opc_end()
+
 SHIL_END
 
 
@@ -26,6 +26,8 @@
 #define SHIL_MODE 2
 #include "shil_canonical.h"
 
+SSAOptimizer::MemStats SSAOptimizer::memStats;
+
 void SSAOptimizer::InsertMov32Op(const shil_param& rd, const shil_param& rs)
 {
 	shil_opcode op2(block->oplist[opnum]);
@@ -22,10 +22,13 @@
 #include <cstdio>
 #include <set>
 #include <map>
+#include <vector>
+#include <algorithm>
 #include "types.h"
 #include "decoder.h"
 #include "hw/sh4/modules/mmu.h"
 #include "hw/sh4/sh4_mem.h"
+#include "idleloop.h"
 
 class SSAOptimizer
 {
@@ -41,6 +44,7 @@ public:
 #endif
 
 		ConstPropPass();
+		MemoryForwardingPass();
 		// This should only be done for ram/vram/aram access
 		// Disabled for now and probably not worth the trouble
 		//WriteAfterWritePass();
@@ -50,18 +54,44 @@ public:
 		DeadRegisterPass();
 		IdentityMovePass();
 		SingleBranchTargetPass();
+		IdleLoopPass();
 
 #if DEBUG
 		if (stats.prop_constants > 0 || stats.dead_code_ops > 0 || stats.constant_ops_replaced > 0
-				|| stats.dead_registers > 0 || stats.dyn_to_stat_blocks > 0 || stats.waw_blocks > 0 || stats.combined_shifts > 0)
+				|| stats.dead_registers > 0 || stats.dyn_to_stat_blocks > 0 || stats.waw_blocks > 0 || stats.combined_shifts > 0
+				|| stats.forwarded_loads > 0 || stats.redundant_loads > 0)
 		{
 			//INFO_LOG(DYNAREC, "AFTER %08x", block->vaddr);
 			//PrintBlock();
-			INFO_LOG(DYNAREC, "STATS: %08x ops %zd constants %d constops replaced %d dead code %d dead regs %d dyn2stat blks %d waw %d shifts %d", block->vaddr, block->oplist.size(),
+			INFO_LOG(DYNAREC, "STATS: %08x ops %zd constants %d constops replaced %d dead code %d dead regs %d dyn2stat blks %d waw %d shifts %d fwd loads %d redundant loads %d",
+					block->vaddr, block->oplist.size(),
 					stats.prop_constants, stats.constant_ops_replaced,
-					stats.dead_code_ops, stats.dead_registers, stats.dyn_to_stat_blocks, stats.waw_blocks, stats.combined_shifts);
+					stats.dead_code_ops, stats.dead_registers, stats.dyn_to_stat_blocks, stats.waw_blocks, stats.combined_shifts,
+					stats.forwarded_loads, stats.redundant_loads);
 		}
 #endif
+		memStats.forwardedLoads += stats.forwarded_loads;
+		memStats.redundantLoads += stats.redundant_loads;
+	}
+
+	// Memory operations removed since the last reset, for all blocks
+	struct MemStats
+	{
+		u32 forwardedLoads = 0;
+		u32 redundantLoads = 0;
+	};
+	static const MemStats& getMemStats() {
+		return memStats;
+	}
+	static void resetMemStats() {
+		memStats = {};
+	}
+
+	// Minimal pass list for baseline blocks, which may not be executed often enough
+	// to amortize the cost of the full optimization
+	void OptimizeBaseline()
+	{
+		AddVersionPass();
 	}
 
 	void AddVersionPass()
@@ -224,6 +254,7 @@ private:
 					// If we know the address to read and it's in the same memory page(s) as the block
 					// and if those pages are read-only, then we can directly read the memory at compile time
 					// and propagate the read value as a constant.
+					// The line read is protected with the code lines of the block.
 					if (op.op == shop_readm  && block->read_only
 							&& (op.rs1._imm >> 12) >= (block->vaddr >> 12)
 							&& (op.rs1._imm >> 12) <= ((block->vaddr + block->sh4_code_size - 1) >> 12)
@@ -232,7 +263,8 @@ private:
 						void *ptr;
 						bool isRam;
 						u32 paddr;
-						if (rdv_readMemImmediate(op.rs1._imm, op.size, ptr, isRam, paddr, block) && isRam)
+						if (rdv_readMemImmediate(op.rs1._imm, op.size, ptr, isRam, paddr, block) && isRam
+								&& block->AddDataRead(paddr, op.size))
 						{
 							u32 v;
 							switch (op.size)
@@ -331,8 +363,9 @@ private:
 			shil_opcode& op = block->oplist[opnum];
 			bool dead_code = false;
 
-			if (op.op == shop_ifb || (mmu_enabled() && (op.op == shop_readm || op.op == shop_writem)))
+			if (op.op == shop_ifb || op.op == shop_guard_fpscr || (mmu_enabled() && (op.op == shop_readm || op.op == shop_writem)))
 			{
+				// fpscr guards can exit the block
 				// if mmu enabled, mem accesses can throw an exception
 				// so last_versions must be reset so the regs are correctly saved beforehand
 				memset(last_versions, -1, sizeof(last_versions));
@@ -719,6 +752,225 @@ private:
 		}
 	}
 
+	// Memory location of a ram access: a constant address, or an offset from a version of r15.
+	// Offsets from r15 are relative to the last version not computed by adding a constant to r15.
+	// Constant addresses are host addresses so that the mirrors of the same memory are the same location.
+	struct MemLocation
+	{
+		bool stack;
+		u32 base;	// r15 version if stack
+		u64 addr;	// offset if stack
+		u32 size;
+
+		bool sameSpace(const MemLocation& other) const {
+			return stack == other.stack && base == other.base;
+		}
+		bool sameLocation(const MemLocation& other) const {
+			return sameSpace(other) && addr == other.addr && size == other.size;
+		}
+		bool overlaps(const MemLocation& other) const {
+			return start() < other.start() + other.size && other.start() < start() + size;
+		}
+		// Stack offsets are signed: the first push is at offset -4
+		s64 start() const {
+			return stack ? (s64)(s32)addr : (s64)addr;
+		}
+	};
+	// Value known to be at a memory location
+	struct MemValue
+	{
+		MemLocation loc;
+		shil_param value;
+		// The value comes from a load and is already sign-extended
+		bool loaded;
+	};
+
+	bool GetMemLocation(const shil_opcode& op, MemLocation& loc)
+	{
+		if (op.rs3.is_reg())
+			return false;
+		loc.size = op.size;
+		if (op.rs1.is_imm())
+		{
+			void *ptr;
+			bool isRam;
+			u32 paddr;
+			if (!rdv_readMemImmediate(op.rs1.imm_value(), op.size, ptr, isRam, paddr, block) || !isRam)
+				return false;
+			loc.stack = false;
+			loc.base = 0;
+			loc.addr = (uintptr_t)ptr;
+			return true;
+		}
+		if (op.rs1.is_r32i() && op.rs1._reg == reg_r15)
+		{
+			auto it = stack_versions.find(op.rs1.version[0]);
+			if (it == stack_versions.end())
+				return false;
+			loc.stack = true;
+			loc.base = it->second.first;
+			loc.addr = it->second.second + (op.rs3.is_imm() ? op.rs3.imm_value() : 0);
+			return true;
+		}
+		return false;
+	}
+
+	bool IsCurrentValue(const shil_param& param, const u32 *versions)
+	{
+		if (!param.is_reg())
+			return param.is_imm();
+		for (u32 i = 0; i < param.count(); i++)
+			if (versions[param._reg + i] != param.version[i])
+				return false;
+		return true;
+	}
+
+	// Replaces memory reads by the value last written to or read from the same location.
+	// Only ram accesses at a constant address or relative to r15 are considered. A write
+	// that can't be proven not to alias a known location discards it.
+	void MemoryForwardingPass()
+	{
+		if (mmu_enabled())
+			return;
+		u32 versions[sh4_reg_count] {};
+		stack_versions.clear();
+		stack_versions[0] = { 0, 0 };
+		std::vector<MemValue> values;
+
+		for (shil_opcode& op : block->oplist)
+		{
+			if (op.op == shop_ifb || op.op == shop_pref || op.op == shop_sync_sr || op.op == shop_sync_fpscr)
+			{
+				// Interpreter fallbacks and store queue writes can write to memory.
+				// Register banks are swapped when sr or fpscr change.
+				values.clear();
+			}
+			else if (op.op == shop_writem)
+			{
+				MemLocation loc;
+				if (!GetMemLocation(op, loc))
+				{
+					values.clear();
+				}
+				else
+				{
+					values.erase(std::remove_if(values.begin(), values.end(), [&loc](const MemValue& v) {
+							return !v.loc.sameSpace(loc) || (v.loc.overlaps(loc) && !v.loc.sameLocation(loc));
+						}), values.end());
+					auto it = std::find_if(values.begin(), values.end(), [&loc](const MemValue& v) {
+							return v.loc.sameLocation(loc);
+						});
+					if (op.rs2.is_reg() || op.size <= 4)
+					{
+						if (it != values.end())
+							*it = { loc, op.rs2, false };
+						else
+							values.push_back({ loc, op.rs2, false });
+					}
+					else if (it != values.end())
+					{
+						values.erase(it);
+					}
+				}
+			}
+			else if (op.op == shop_readm && op.rd.is_reg())
+			{
+				MemLocation loc;
+				if (GetMemLocation(op, loc))
+				{
+					auto it = std::find_if(values.begin(), values.end(), [&loc](const MemValue& v) {
+							return v.loc.sameLocation(loc);
+						});
+					if (it != values.end() && IsCurrentValue(it->value, versions) && ForwardValue(op, *it))
+					{
+						if (it->loaded)
+							stats.redundant_loads++;
+						else
+							stats.forwarded_loads++;
+					}
+					else if (it != values.end())
+					{
+						*it = { loc, op.rd, true };
+					}
+					else
+					{
+						values.push_back({ loc, op.rd, true });
+					}
+				}
+			}
+			// Track the register versions and r15 offsets
+			for (const shil_param *rd : { &op.rd, &op.rd2 })
+			{
+				if (!rd->is_reg())
+					continue;
+				for (u32 i = 0; i < rd->count(); i++)
+					versions[rd->_reg + i] = rd->version[i];
+				if (rd->_reg <= reg_r15 && reg_r15 < rd->_reg + rd->count())
+				{
+					const u32 version = rd->version[reg_r15 - rd->_reg];
+					if ((op.op == shop_add || op.op == shop_sub) && rd == &op.rd && op.rd.is_r32i()
+							&& op.rs1.is_r32i() && op.rs1._reg == reg_r15 && op.rs2.is_imm())
+					{
+						auto it = stack_versions.find(op.rs1.version[0]);
+						std::pair<u32, u32> sp { version, 0 };
+						if (it != stack_versions.end())
+						{
+							sp = it->second;
+							sp.second += op.op == shop_add ? op.rs2.imm_value() : -op.rs2.imm_value();
+						}
+						stack_versions[version] = sp;
+					}
+					else
+					{
+						stack_versions[version] = { version, 0 };
+					}
+				}
+			}
+		}
+	}
+
+	// Replaces the memory read op by a move of the known value
+	bool ForwardValue(shil_opcode& op, const MemValue& mv)
+	{
+		const shil_param& value = mv.value;
+		if (op.size == 8)
+		{
+			if (!value.is_r64f() || !op.rd.is_r64f())
+				return false;
+			op.op = shop_mov64;
+		}
+		else if (value.is_imm())
+		{
+			u32 v = value.imm_value();
+			if (op.size == 1)
+				v = (s32)(::s8)v;
+			else if (op.size == 2)
+				v = (s32)(::s16)v;
+			op.op = shop_mov32;
+			op.rs1 = shil_param(v);
+			op.rs2.type = FMT_NULL;
+			op.rs3.type = FMT_NULL;
+			return true;
+		}
+		else if (op.size == 4 || mv.loaded)
+		{
+			if (value.count() != 1)
+				return false;
+			op.op = shop_mov32;
+		}
+		else
+		{
+			// Truncate and sign-extend the stored value
+			if (!value.is_r32i() || !op.rd.is_r32i())
+				return false;
+			op.op = op.size == 1 ? shop_ext_s8 : shop_ext_s16;
+		}
+		op.rs1 = value;
+		op.rs2.type = FMT_NULL;
+		op.rs3.type = FMT_NULL;
+		return true;
+	}
+
 	bool skipSingleBranchTarget(u32& addr, bool updateCycles)
 	{
 		if (addr == NullAddress)
@@ -744,6 +996,9 @@ private:
 			if (disp == 0)
 				// infiniloop
 				break;
+			// The skipped branch must be protected with the block code
+			if (!block->AddDataRead(block->addr + (addr - block->vaddr), 4))
+				break;
 			addr += disp;
 			if (updateCycles)
 			{
@@ -764,6 +1019,106 @@ private:
 		}
 	}
 
+	bool IsIdleLoopOp(const shil_opcode& op)
+	{
+		switch (op.op)
+		{
+		case shop_readm:
+			{
+				// Only main ram can be polled. Timer and other registers change with time,
+				// and a register address may point to them.
+				if (op.size > 4 || !op.rs1.is_imm() || !op.rs3.is_null())
+					return false;
+				void *ptr;
+				bool isRam;
+				u32 paddr;
+				return rdv_readMemImmediate(op.rs1.imm_value(), op.size, ptr, isRam, paddr, block) && isRam && IsOnRam(paddr);
+			}
+		case shop_mov32:
+		case shop_and:
+		case shop_or:
+		case shop_xor:
+		case shop_not:
+		case shop_add:
+		case shop_sub:
+		case shop_neg:
+		case shop_shl:
+		case shop_shr:
+		case shop_sar:
+		case shop_ext_s8:
+		case shop_ext_s16:
+		case shop_swaplb:
+		case shop_test:
+		case shop_seteq:
+		case shop_setge:
+		case shop_setgt:
+		case shop_setae:
+		case shop_setab:
+		case shop_setpeq:
+		case shop_jcond:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	// A small block that branches to itself is an idle loop if it only reads memory and
+	// doesn't modify the registers it reads: each iteration then computes the same values
+	// until something else writes to the memory it polls.
+	void IdleLoopPass()
+	{
+		if (!idleloop::enabled() || block->BranchBlock != block->vaddr || block->trace_branches != 0
+				|| block->guest_opcodes > idleloop::MaxOpcodes)
+			return;
+		shil_param cond;
+		u32 loop;
+		switch (block->BlockType)
+		{
+		case BET_StaticJump:
+			cond = shil_param(1);
+			loop = 1;
+			break;
+		case BET_Cond_0:
+		case BET_Cond_1:
+			cond = shil_param(block->has_jcond ? reg_pc_dyn : reg_sr_T);
+			loop = block->BlockType & 1;
+			break;
+		default:
+			return;
+		}
+		u32 last_versions[sh4_reg_count] {};
+		std::set<Sh4RegType> inputs;
+		for (const shil_opcode& op : block->oplist)
+		{
+			if (!IsIdleLoopOp(op))
+				return;
+			for (const shil_param *param : { &op.rs1, &op.rs2, &op.rs3 })
+				if (param->is_reg())
+					for (u32 i = 0; i < param->count(); i++)
+						if (param->version[i] == 0)
+							inputs.insert((Sh4RegType)(param->_reg + i));
+			for (const shil_param *param : { &op.rd, &op.rd2 })
+				if (param->is_reg())
+					for (u32 i = 0; i < param->count(); i++)
+						last_versions[param->_reg + i] = param->version[i];
+		}
+		for (Sh4RegType reg : inputs)
+			if (last_versions[reg] != 0)
+				return;
+
+		shil_opcode op;
+		op.op = shop_idle;
+		if (cond.is_reg())
+			cond.version[0] = last_versions[cond._reg];
+		op.rs1 = cond;
+		op.rs2 = shil_param(loop);
+		op.rs3 = shil_param(block->vaddr);
+		op.guest_offs = block->oplist.empty() ? 0 : block->oplist.back().guest_offs;
+		op.delay_slot = false;
+		block->oplist.push_back(op);
+		DEBUG_LOG(DYNAREC, "Idle loop at %08x", block->vaddr);
+	}
+
 	RuntimeBlockInfo* block;
 	std::set<RegValue> writeback_values;
 
@@ -775,7 +1130,10 @@ private:
 		u32 dyn_to_stat_blocks = 0;
 		u32 waw_blocks = 0;
 		u32 combined_shifts = 0;
+		u32 forwarded_loads = 0;
+		u32 redundant_loads = 0;
 	} stats;
+	static MemStats memStats;
 
 	// transient vars
 	// add version pass
@@ -783,4 +1141,6 @@ private:
 	// const prop pass
 	std::map<RegValue, u32> constprop_values;	// (reg num, version) -> value
 	int opnum = 0;
+	// memory forwarding pass
+	std::map<u32, std::pair<u32, u32>> stack_versions;	// r15 version -> (base r15 version, offset)
 };
@@ -26,6 +26,7 @@
 
 #include <deque>
 #include <map>
+#include <set>
 #include <vector>
 
 #define ssa_printf(...) DEBUG_LOG(DYNAREC, __VA_ARGS__)
@@ -50,6 +51,17 @@ public:
 		verify(host_fregs.empty());
 		while (*regsf_avail != (nregf_t)-1)
 			host_fregs.push_back(*regsf_avail++);
+
+		stale_global_regs.clear();
+		fills_saved = 0;
+	}
+
+	// Keeps a guest register in the given host register across blocks.
+	// The host register must not be part of the available registers passed to DoAlloc().
+	void SetGlobalReg(Sh4RegType reg, nreg_t host_reg)
+	{
+		verify(!IsFloat(reg));
+		global_regs[reg] = host_reg;
 	}
 
 	void OpBegin(shil_opcode* op, int opid)
@@ -59,7 +71,7 @@ public:
 		{
 			FlushAllRegs(true);
 		}
-		else if (mmu_enabled() && (op->op == shop_readm || op->op == shop_writem || op->op == shop_pref))
+		else if (op->op == shop_guard_fpscr || (mmu_enabled() && (op->op == shop_readm || op->op == shop_writem || op->op == shop_pref)))
 		{
 			FlushAllRegs(false);
 		}
@@ -151,6 +163,14 @@ public:
 		if (op >= &block->oplist.back())
 		{
 			FlushAllRegs(false);
+			// Global regs must hold the current value of the guest reg when leaving the block
+			for (Sh4RegType reg : stale_global_regs)
+				if (!fast_forwarding)
+				{
+					ssa_printf("PL %s -> %cx (global)", name_reg(reg).c_str(), 'a' + global_regs[reg]);
+					Preload(reg, global_regs[reg]);
+				}
+			stale_global_regs.clear();
 			final_opend = true;
 		}
 	}
@@ -253,6 +273,7 @@ public:
 		block = NULL;
 		host_fregs.clear();
 		host_gregs.clear();
+		global_regs.clear();
 	}
 
 	virtual void Preload(u32 reg, nreg_t nreg) = 0;
@@ -306,6 +327,11 @@ private:
 		return IsAllocg(reg) || IsAllocf(reg);
 	}
 
+	bool IsGlobal(Sh4RegType reg)
+	{
+		return global_regs.find(reg) != global_regs.end();
+	}
+
 	void WriteBackReg(Sh4RegType reg_num, struct reg_alloc& reg_alloc)
 	{
 		if (reg_alloc.write_back)
@@ -338,12 +364,16 @@ private:
 			{
 				u32 host_reg = reg->second.host_reg;
 				reg_alloced.erase(reg);
+				// Global regs keep their host reg
 				if (IsFloat(reg_num))
 					host_fregs.push_front((nregf_t)host_reg);
-				else
+				else if (!IsGlobal(reg_num))
 					host_gregs.push_front((nreg_t)host_reg);
 			}
 		}
+		// The context may be modified after a hard flush so global regs must be reloaded
+		if (hard && IsGlobal(reg_num))
+			stale_global_regs.insert(reg_num);
 	}
 
 	void FlushAllRegs(bool hard)
@@ -352,6 +382,8 @@ private:
 		{
 			while (!reg_alloced.empty())
 				FlushReg(reg_alloced.begin()->first, true);
+			for (auto const& reg : global_regs)
+				stale_global_regs.insert(reg.first);
 		}
 		else
 		{
@@ -370,6 +402,23 @@ private:
 			auto it = reg_alloced.find(sh4reg);
 			if (it == reg_alloced.end())
 			{
+				auto global = global_regs.find(sh4reg);
+				if (global != global_regs.end())
+				{
+					reg_alloced[sh4reg] = { (u32)global->second, param.version[i], false, false };
+					if (stale_global_regs.erase(sh4reg) == 0)
+					{
+						// already loaded by the mainloop or the previous block
+						if (!fast_forwarding)
+							fills_saved++;
+					}
+					else if (!fast_forwarding)
+					{
+						ssa_printf("PL %s.%d -> %cx (global)", name_reg(sh4reg).c_str(), param.version[i], 'a' + global->second);
+						Preload(sh4reg, global->second);
+					}
+					continue;
+				}
 				u32 host_reg;
 				if (param.is_r32i())
 				{
@@ -416,7 +465,8 @@ private:
 			shil_opcode* op = &block->oplist[i];
 			// if a subsequent op needs all or some regs flushed to mem
 			// TODO we could look at the ifb op to optimize what to flush
-			if (op->op == shop_ifb || (mmu_enabled() && (op->op == shop_readm || op->op == shop_writem || op->op == shop_pref)))
+			if (op->op == shop_ifb || op->op == shop_guard_fpscr
+					|| (mmu_enabled() && (op->op == shop_readm || op->op == shop_writem || op->op == shop_pref)))
 				return true;
 			if (op->op == shop_sync_sr && (/*reg == reg_sr_T ||*/ reg == reg_sr_status || (reg >= reg_r0 && reg <= reg_r7)
 					|| (reg >= reg_r0_Bank && reg <= reg_r7_Bank)))
@@ -449,7 +499,13 @@ private:
 			if (it == reg_alloced.end())
 			{
 				u32 host_reg;
-				if (param.is_r32i())
+				auto global = global_regs.find(sh4reg);
+				if (global != global_regs.end())
+				{
+					host_reg = global->second;
+					stale_global_regs.erase(sh4reg);
+				}
+				else if (param.is_r32i())
 				{
 					if (host_gregs.empty())
 					{
@@ -496,6 +552,9 @@ private:
 		{
 			if (IsFloat(reg.first) != freg)
 				continue;
+			// Spilling global regs doesn't free any host reg
+			if (IsGlobal(reg.first))
+				continue;
 			// Don't spill already spilled regs
 			bool pending = false;
 			for (auto& pending_reg : pending_flushes)
@@ -658,10 +717,15 @@ private:
 	std::deque<nregf_t> host_fregs;
 	std::vector<Sh4RegType> pending_flushes;
 	std::map<Sh4RegType, reg_alloc> reg_alloced;
+	std::map<Sh4RegType, nreg_t> global_regs;
+	// Global regs whose host reg doesn't hold the current value
+	std::set<Sh4RegType> stale_global_regs;
 	int opnum = 0;
 
 	bool final_opend = false;
 	bool fast_forwarding = false;
 public:
 	u32 spills = 0;
+	// Global reg loads avoided in the current block
+	u32 fills_saved = 0;
 };
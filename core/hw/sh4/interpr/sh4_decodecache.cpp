@@ -0,0 +1,60 @@
+#include "sh4_decodecache.h"
+#include "hw/sh4/dyna/blockmanager.h"
+
+#include <algorithm>
+
+Sh4DecodeCache decodeCache;
+
+void Sh4DecodeCache::init(DecodedOp::Handler decoder)
+{
+	this->decoder = decoder;
+	if (pages != nullptr)
+		return;
+	pageCount = RAM_SIZE_MAX / PAGE_SIZE;
+	pages = std::make_unique<Page[]>(pageCount);
+}
+
+void Sh4DecodeCache::term()
+{
+	pages.reset();
+	pageCount = 0;
+}
+
+bool Sh4DecodeCache::validate(u32 offset)
+{
+#if FEAT_SHREC != DYNAREC_NONE
+	// Don't cache the pages that the block manager doesn't protect: the
+	// first 64 KB of ram (BIOS/IP.BIN) and the pages written to
+	if (offset < 0x10000 || !bm_IsRamPageProtected(offset))
+		return false;
+	Page& page = pages[offset / PAGE_SIZE];
+	if (page.ops == nullptr)
+		page.ops = std::make_unique<DecodedOp[]>(PAGE_SIZE / 2);
+	std::fill(&page.ops[0], &page.ops[PAGE_SIZE / 2], DecodedOp{ decoder, 0, 0 });
+	bm_LockPage(offset);
+	page.valid = true;
+	return true;
+#else
+	// Code writes can't be detected without the block manager
+	return false;
+#endif
+}
+
+void Sh4DecodeCache::invalidate(u32 offset, u32 size)
+{
+	if (pages == nullptr)
+		return;
+	u32 end = std::min((offset + size + PAGE_MASK) / PAGE_SIZE, pageCount);
+	for (u32 page = offset / PAGE_SIZE; page < end; page++)
+		pages[page].valid = false;
+}
+
+void Sh4DecodeCache::reset()
+{
+	for (u32 page = 0; page < pageCount; page++)
+		if (pages[page].valid)
+		{
+			pages[page].valid = false;
+			bm_UnlockPage(page * PAGE_SIZE);
+		}
+}
@@ -0,0 +1,73 @@
+/*
+	Pre-decoded instruction cache of the interpreter.
+
+	Instructions in system ram are decoded once into a handler pointer and
+	their opcode, per physical page. The interpreter calls the handler of the
+	instruction at pc directly instead of fetching the opcode through the memory
+	handlers and looking up its implementation. Some common pairs, such as stack
+	pops and dt/bf loops, are fused into a single handler.
+
+	Cached pages are write-protected like the pages holding dynarec blocks.
+	When a cached page is unlocked by the block manager, after a write or when
+	the protection is reset, its decoded instructions are discarded.
+	Interpreter-only builds (FEAT_SHREC == DYNAREC_NONE) have no block manager
+	to protect the pages, so nothing is cached and the decode cache isn't used.
+*/
+#pragma once
+#include "types.h"
+#include "hw/sh4/sh4_mem.h"
+
+#include <memory>
+
+class Sh4Interpreter;
+
+struct DecodedOp
+{
+	// Executes the instruction(s) at pc and updates pc and the cycle counter
+	using Handler = void (*)(Sh4Interpreter *sh4, DecodedOp& dop);
+
+	Handler handler;
+	u16 op;
+	u16 op2;	// second instruction of a fused pair
+};
+
+class Sh4DecodeCache
+{
+public:
+	// decoder is the initial handler of all instructions of a cached page
+	void init(DecodedOp::Handler decoder);
+	void term();
+
+	// Returns the decoded instruction at addr or nullptr if it isn't cacheable.
+	// The mmu must be disabled.
+	DecodedOp *get(u32 addr)
+	{
+		if ((addr & 1) || !IsOnRam(addr))
+			return nullptr;
+		u32 offset = addr & RAM_MASK;
+		Page& page = pages[offset / PAGE_SIZE];
+		if (!page.valid && !validate(offset))
+			return nullptr;
+		return &page.ops[(offset & PAGE_MASK) / 2];
+	}
+
+	// Discards the pages in the given ram range. Called when they are unlocked.
+	void invalidate(u32 offset, u32 size);
+	// Discards and unlocks all pages
+	void reset();
+
+private:
+	struct Page
+	{
+		std::unique_ptr<DecodedOp[]> ops;
+		bool valid = false;
+	};
+
+	bool validate(u32 offset);
+
+	std::unique_ptr<Page[]> pages;
+	u32 pageCount = 0;
+	DecodedOp::Handler decoder = nullptr;
+};
+
+extern Sh4DecodeCache decodeCache;
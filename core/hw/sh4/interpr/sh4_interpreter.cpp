@@ -13,6 +13,8 @@
 #include "../sh4_cache.h"
 #include "debug/gdb_server.h"
 #include "../sh4_cycles.h"
+#include "hw/sh4/dyna/blockmanager.h"
+#include "cfg/option.h"
 
 Sh4ICache icache;
 Sh4OCache ocache;
@@ -38,6 +40,99 @@ u16 Sh4Interpreter::ReadNexOp()
 	return IReadMem16(addr);
 }
 
+// mov.l @r15+,Rn with n != 15
+static bool isPop(u16 op) {
+	return (op & 0xf0ff) == 0x60f6 && (op & 0x0f00) != 0x0f00;
+}
+
+void Sh4Interpreter::decodeOp(Sh4Interpreter *sh4, DecodedOp& dop)
+{
+	u32 offset = sh4->ctx->pc & RAM_MASK;
+	u16 op = *(const u16 *)&mem_b[offset];
+	dop.op = op;
+	dop.op2 = 0;
+	dop.handler = OpDesc[op]->IsFloatingPoint() ? execFpuOp : execOp;
+	// Fuse with the next instruction if it's in the same page
+	if (((offset + 2) & PAGE_MASK) != 0)
+	{
+		u16 op2 = *(const u16 *)&mem_b[offset + 2];
+		if (isPop(op) && isPop(op2))
+		{
+			dop.handler = execPopPair;
+			dop.op2 = op2;
+		}
+		// dt Rn; bf <bdisp8>
+		else if ((op & 0xf0ff) == 0x4010 && (op2 & 0xff00) == 0x8b00)
+		{
+			dop.handler = execDtBf;
+			dop.op2 = op2;
+		}
+	}
+	dop.handler(sh4, dop);
+}
+
+void Sh4Interpreter::execOp(Sh4Interpreter *sh4, DecodedOp& dop)
+{
+	sh4->ctx->pc += 2;
+	OpPtr[dop.op](sh4->ctx, dop.op);
+	sh4->sh4cycles.executeCycles(dop.op);
+}
+
+void Sh4Interpreter::execFpuOp(Sh4Interpreter *sh4, DecodedOp& dop)
+{
+	Sh4Context *ctx = sh4->ctx;
+	ctx->pc += 2;
+	if (ctx->sr.FD == 1)
+		throw SH4ThrownException(ctx->pc - 2, Sh4Ex_FpuDisabled);
+	OpPtr[dop.op](ctx, dop.op);
+	sh4->sh4cycles.executeCycles(dop.op);
+}
+
+// The second instruction of a pair is only executed if the timeslice isn't over,
+// as it would be by the main loop.
+void Sh4Interpreter::execPopPair(Sh4Interpreter *sh4, DecodedOp& dop)
+{
+	Sh4Context *ctx = sh4->ctx;
+	ctx->pc += 2;
+	ctx->r[(dop.op >> 8) & 0xf] = ReadMem32(ctx->r[15]);
+	ctx->r[15] += 4;
+	sh4->sh4cycles.executeCycles(dop.op);
+	if (ctx->cycle_counter <= 0)
+		return;
+	ctx->pc += 2;
+	ctx->r[(dop.op2 >> 8) & 0xf] = ReadMem32(ctx->r[15]);
+	ctx->r[15] += 4;
+	sh4->sh4cycles.executeCycles(dop.op2);
+}
+
+void Sh4Interpreter::execDtBf(Sh4Interpreter *sh4, DecodedOp& dop)
+{
+	Sh4Context *ctx = sh4->ctx;
+	ctx->pc += 2;
+	u32& rn = ctx->r[(dop.op >> 8) & 0xf];
+	rn--;
+	ctx->sr.T = rn == 0;
+	sh4->sh4cycles.executeCycles(dop.op);
+	if (ctx->cycle_counter <= 0)
+		return;
+	ctx->pc += 2;
+	if (ctx->sr.T == 0)
+		ctx->pc += (s8)dop.op2 * 2 + 2;
+	sh4->sh4cycles.executeCycles(dop.op2);
+}
+
+void Sh4Interpreter::ExecuteDecoded()
+{
+	do
+	{
+		DecodedOp *dop = mmu_enabled() ? nullptr : decodeCache.get(ctx->pc);
+		if (dop != nullptr)
+			dop->handler(this, *dop);
+		else
+			ExecuteOpcode(ReadNexOp());
+	} while (ctx->cycle_counter > 0);
+}
+
 void Sh4Interpreter::Run()
 {
 	Instance = this;
@@ -47,6 +142,11 @@ void Sh4Interpreter::Run()
 		do
 		{
 			try {
+#if !defined(STRICT_MODE) && FEAT_SHREC != DYNAREC_NONE
+				if (config::InterpreterPredecode)
+					ExecuteDecoded();
+				else
+#endif
 				do
 				{
 					u32 op = ReadNexOp();
@@ -122,12 +222,19 @@ void Sh4Interpreter::Reset(bool hard)
 
 	icache.Reset(hard);
 	ocache.Reset(hard);
+	decodeCache.reset();
 	sh4cycles.reset();
 	ctx->cycle_counter = SH4_TIMESLICE;
+	ctx->slice_cycles = SH4_TIMESLICE;
 
 	INFO_LOG(INTERPRETER, "Sh4 Reset");
 }
 
+void Sh4Interpreter::ResetCache()
+{
+	decodeCache.reset();
+}
+
 bool Sh4Interpreter::IsCpuRunning()
 {
 	return ctx->CpuRunning;
@@ -170,18 +277,38 @@ void Sh4Interpreter::ExecuteDelayslot_RTE()
 	}
 }
 
-// every SH4_TIMESLICE cycles
-int UpdateSystem_INTC()
+static int UpdateSystem(int cycles)
 {
-	Sh4cntx.sh4_sched_next -= SH4_TIMESLICE;
+	Sh4cntx.sh4_sched_next -= cycles;
 	if (Sh4cntx.sh4_sched_next < 0)
-		sh4_sched_tick(SH4_TIMESLICE);
+		sh4_sched_tick(cycles);
+	// after the callbacks, which may write to code pages
+	bm_ReprotectPages();
 	if (Sh4cntx.interrupt_pend)
 		return UpdateINTC();
 	else
 		return 0;
 }
 
+// at the end of each timeslice
+int UpdateSystem_INTC()
+{
+	const int cycles = Sh4cntx.slice_cycles;
+	Sh4cntx.slice_cycles = SH4_TIMESLICE;
+	int rc = UpdateSystem(cycles);
+	// The executor adds SH4_TIMESLICE cycles to the cycle counter before calling this function
+	// and reloads it afterwards
+	Sh4cntx.slice_cycles = sh4_sched_slice(config::EventBatching && !Sh4cntx.interrupt_pend);
+	Sh4cntx.cycle_counter += Sh4cntx.slice_cycles - SH4_TIMESLICE;
+	return rc;
+}
+
+// while sleeping. The current timeslice isn't affected.
+int UpdateSystem_Sleep()
+{
+	return UpdateSystem(sh4_sched_slice(config::EventBatching));
+}
+
 void Sh4Interpreter::Init()
 {
 	ctx = &p_sh4rcb->cntx;
@@ -189,11 +316,13 @@ void Sh4Interpreter::Init()
 	sh4cycles.init(ctx);
 	icache.init(ctx);
 	ocache.init(ctx);
+	decodeCache.init(decodeOp);
 }
 
 void Sh4Interpreter::Term()
 {
 	Stop();
+	decodeCache.term();
 	INFO_LOG(INTERPRETER, "Sh4 Term");
 }
 
@@ -11,10 +11,7 @@
 #include "debug/gdb_server.h"
 #include "hw/sh4/dyna/decoder.h"
 #include "emulator.h"
-
-#ifdef STRICT_MODE
 #include "hw/sh4/sh4_cache.h"
-#endif
 
 //Read Mem macros
 
@@ -962,7 +959,7 @@ sh4op(i0000_0000_0001_1011)
 	//just wait for an Interrupt
 	int i = 0, s = 1;
 
-	while (!UpdateSystem_INTC())//448
+	while (!UpdateSystem_Sleep())
 	{
 		if (i++>1000)
 		{
@@ -1121,25 +1118,28 @@ sh4op(i0000_0000_0011_1000)
 //ocbi @<REG_N>
 sh4op(i0000_nnnn_1001_0011)
 {
-#ifdef STRICT_MODE
-	ocache.WriteBack(ctx->r[GetN(op)], false, true);
+#ifndef STRICT_MODE
+	if (ocache.isEmulated())
 #endif
+		ocache.WriteBack(ctx->r[GetN(op)], false, true);
 }
 
 //ocbp @<REG_N>
 sh4op(i0000_nnnn_1010_0011)
 {
-#ifdef STRICT_MODE
-	ocache.WriteBack(ctx->r[GetN(op)], true, true);
+#ifndef STRICT_MODE
+	if (ocache.isEmulated())
 #endif
+		ocache.WriteBack(ctx->r[GetN(op)], true, true);
 }
 
 //ocbwb @<REG_N>
 sh4op(i0000_nnnn_1011_0011)
 {
-#ifdef STRICT_MODE
-	ocache.WriteBack(ctx->r[GetN(op)], true, false);
+#ifndef STRICT_MODE
+	if (ocache.isEmulated())
 #endif
+		ocache.WriteBack(ctx->r[GetN(op)], true, false);
 }
 
 //pref @<REG_N>
@@ -1154,9 +1154,10 @@ sh4op(i0000_nnnn_1000_0011)
 	}
 	else
 	{
-#ifdef STRICT_MODE
-		ocache.Prefetch(Dest);
+#ifndef STRICT_MODE
+		if (ocache.isEmulated())
 #endif
+			ocache.Prefetch(Dest);
 	}
 }
 
@@ -28,8 +28,7 @@ static void CCN_PTEH_write(u32 addr, u32 value)
 	CCN_PTEH_type temp;
 	temp.reg_data = value & 0xfffffcff;
 #ifdef FAST_MMU
-	if (temp.ASID != CCN_PTEH.ASID)
-		mmuAddressLUTFlush(false);
+	mmuTlb.asid = temp.ASID;
 #endif
 
 	CCN_PTEH = temp;
@@ -73,12 +72,14 @@ static void CCN_CCR_write(u32 addr, u32 value)
 	}
 	if (temp.OCI) {
 		DEBUG_LOG(SH4, "Sh4: o-cache invalidation %08X", Sh4cntx.pc);
-		if (!config::DynarecEnabled)
+		if (!config::DynarecEnabled || ocache.isEmulated())
 			ocache.Invalidate();
 		temp.OCI = 0;
 	}
 
 	CCN_CCR=temp;
+	// the cache mode or index mode may have changed
+	ocache.resetKeys();
 }
 
 static u32 CPU_VERSION_read(u32 addr)
@@ -189,6 +189,8 @@ bool UTLB_Sync(u32 entry)
 	lru_address = tlb_entry.Address.VPN << 10;
 
 	cache_entry(tlb_entry);
+	// The previous translations of these pages may still be in the software TLB
+	mmuTlb.invalidate(lru_address, ~lru_mask + 1, tlb_entry.Address.ASID, tlb_entry.Data.SH);
 
 	if (!mmu_enabled() && (tlb_entry.Address.VPN & (0xFC000000 >> 10)) == (0xE0000000 >> 10))
 	{
@@ -321,6 +323,6 @@ void mmu_flush_table()
 {
 	lru_entry = nullptr;
 	flush_cache();
-	mmuAddressLUTFlush(true);
+	mmuTlb.flush(CCN_PTEH.ASID);
 }
 #endif 	// FAST_MMU
@@ -460,7 +460,7 @@ void mmu_set_state()
 }
 
 #ifdef FAST_MMU
-u32 mmuAddressLUT[0x100000];
+MmuTlb mmuTlb;
 #endif
 
 void MMU_init()
@@ -481,9 +481,7 @@ void MMU_init()
 	}
 	mmu_set_state();
 #ifdef FAST_MMU
-	// pre-fill kernel memory
-	for (u32 vpn = std::size(mmuAddressLUT) / 2; vpn < std::size(mmuAddressLUT); vpn++)
-		mmuAddressLUT[vpn] = vpn << 12;
+	mmuTlb.flush(CCN_PTEH.ASID);
 #endif
 }
 
@@ -593,4 +591,7 @@ void mmu_deserialize(Deserializer& deser)
 
 	deser >> sq_remap;
 	deser.skip(64 * 4, Deserializer::V23); // ITLB_LRU_USE
+#ifdef FAST_MMU
+	mmuTlb.flush(CCN_PTEH.ASID);
+#endif
 }
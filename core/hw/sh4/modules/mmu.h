@@ -117,19 +117,86 @@ template<typename T> void DYNACALL mmu_WriteMem(u32 adr, T data);
 void mmu_TranslateSQW(u32 adr, u32* out);
 
 #ifdef FAST_MMU
-// maps 4K virtual page number to physical address
-extern u32 mmuAddressLUT[0x100000];
-
-static inline void mmuAddressLUTFlush(bool full)
+/*
+	Direct-mapped software TLB probed inline by the dynarecs. It maps 4 KB pages
+	of user memory (P0/U0) to their physical address. Kernel addresses aren't
+	translated.
+	Entries are tagged with the virtual page and the ASID they were filled with,
+	so they don't need to be flushed when the ASID changes. Reads and writes have
+	separate tags: a page is only writable once a write to it has been translated.
+	Misses go through mmuDynarecLookup.
+*/
+struct MmuTlb
 {
-	if (full)
-		memset(mmuAddressLUT, 0, sizeof(mmuAddressLUT) / 2);	// flush user memory
-	else
+	static constexpr u32 Size = 4096;
+	// Never matches: ASIDs are 8 bits
+	static constexpr u32 InvalidTag = 0xfff;
+
+	struct Entry
 	{
-		constexpr u32 slotPages = (32 * 1024 * 1024) >> 12;
-		memset(mmuAddressLUT, 0, slotPages * sizeof(u32));		// flush slot 0
+		u32 tag[2];	// read and write tags
+		u32 paddr;	// physical address of the page
+		u32 _pad;
+	};
+	u32 asid;	// current ASID
+	u32 _pad[3];
+	Entry entries[Size];
+
+	static u32 index(u32 vaddr)
+	{
+		// WinCE maps the current process in slot 0 and in its own 32 MB slot
+		u32 vpn = vaddr >> 12;
+		return (vpn ^ (vpn >> 12)) & (Size - 1);
 	}
-}
+	u32 tag(u32 vaddr) const {
+		return (vaddr & ~0xfff) | asid;
+	}
+
+	// Same as the code generated by the dynarecs
+	bool lookup(u32 vaddr, u32 write, u32& paddr) const
+	{
+		const Entry& entry = entries[index(vaddr)];
+		if (entry.tag[write] != tag(vaddr))
+			return false;
+		paddr = entry.paddr | (vaddr & 0xfff);
+		return true;
+	}
+
+	void fill(u32 vaddr, u32 write, u32 paddr)
+	{
+		Entry& entry = entries[index(vaddr)];
+		const u32 t = tag(vaddr);
+		if (entry.tag[0] != t)
+			entry.tag[1] = InvalidTag;
+		entry.tag[0] = t;
+		if (write)
+			entry.tag[1] = t;
+		entry.paddr = paddr & ~0xfff;
+	}
+
+	// Invalidates the entries of the pages in [vaddr, vaddr + size) for the given ASID, or for all ASIDs if shared
+	void invalidate(u32 vaddr, u32 size, u32 asid, bool shared)
+	{
+		if (vaddr >> 31)
+			// Only user space addresses are cached
+			return;
+		for (u32 page = vaddr & ~0xfff; page < vaddr + size; page += 4096)
+		{
+			Entry& entry = entries[index(page)];
+			if ((entry.tag[0] & ~0xfff) == page && (shared || (entry.tag[0] & 0xfff) == asid))
+				entry.tag[0] = entry.tag[1] = InvalidTag;
+		}
+	}
+
+	// Invalidates all entries and sets the current ASID
+	void flush(u32 asid)
+	{
+		this->asid = asid;
+		for (Entry& entry : entries)
+			entry.tag[0] = entry.tag[1] = InvalidTag;
+	}
+};
+extern MmuTlb mmuTlb;
 #endif
 
 #if FEAT_SHREC == DYNAREC_JIT
@@ -154,7 +221,7 @@ static inline u32 DYNACALL mmuDynarecLookup(u32 vaddr, u32 write, u32 pc)
 	}
 #ifdef FAST_MMU
 	if (vaddr >> 31 == 0)
-		mmuAddressLUT[vaddr >> 12] = paddr & ~0xfff;
+		mmuTlb.fill(vaddr, write, paddr);
 #endif
 
 	return paddr;
@@ -79,12 +79,12 @@ static u64 tmu_ch_base64[3];
 
 static u32 read_TMU_TCNTch(u32 ch)
 {
-	return tmu_ch_base[ch] - ((sh4_sched_now64() >> tmu_shift[ch])&tmu_mask[ch]);
+	return tmu_ch_base[ch] - ((sh4_sched_cpu_now64() >> tmu_shift[ch])&tmu_mask[ch]);
 }
 
 static s64 read_TMU_TCNTch64(u32 ch)
 {
-	return tmu_ch_base64[ch] - ((sh4_sched_now64() >> tmu_shift[ch])&tmu_mask64[ch]);
+	return tmu_ch_base64[ch] - ((sh4_sched_cpu_now64() >> tmu_shift[ch])&tmu_mask64[ch]);
 }
 
 static void sched_chan_tick(int ch)
@@ -111,8 +111,8 @@ static void sched_chan_tick(int ch)
 static void write_TMU_TCNTch(u32 ch, u32 data)
 {
 	//u32 TCNT=read_TMU_TCNTch(ch);
-	tmu_ch_base[ch]=data+((sh4_sched_now64()>>tmu_shift[ch])&tmu_mask[ch]);
-	tmu_ch_base64[ch] = data + ((sh4_sched_now64() >> tmu_shift[ch])&tmu_mask64[ch]);
+	tmu_ch_base[ch]=data+((sh4_sched_cpu_now64()>>tmu_shift[ch])&tmu_mask[ch]);
+	tmu_ch_base64[ch] = data + ((sh4_sched_cpu_now64() >> tmu_shift[ch])&tmu_mask64[ch]);
 
 	sched_chan_tick(ch);
 }
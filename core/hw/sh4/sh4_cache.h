@@ -235,14 +235,64 @@ extern Sh4ICache icache;
 //
 // SH4 operand cache
 //
+// The tag store is kept in flat arrays indexed by line, apart from the line data.
+// Outside of STRICT_MODE, the cache is only emulated when the game needs it and the mmu is off
+// (see SetMemoryHandlers). Each line then also keeps the virtual address through which it was
+// last accessed, in readKeys and writeKeys. Accesses through the same address range hit with
+// a single compare, without address translation. The dynarecs inline this check.
+//
 class Sh4OCache
 {
 public:
+	static constexpr u32 Lines = 512;
+	static constexpr u32 LineSize = 32;
+	// Address bits kept in readKeys and writeKeys
+	static constexpr u32 KeyMask = 0xfffffc00;
+	static constexpr u32 InvalidKey = 0xffffffff;
+
+	Sh4OCache() {
+		resetKeys();
+	}
+
 	void init(Sh4Context *ctx) {
 		this->ctx = ctx;
 		sh4cycles.init(ctx);
 	}
 
+	// Key of an access to the given address. Unaligned accesses don't match any line.
+	template<class T>
+	static u32 key(u32 address) {
+		return address & (KeyMask | (sizeof(T) - 1));
+	}
+
+	// Line of an address when keys are used (CCR.OIX and CCR.ORA are 0)
+	static u32 keyIndex(u32 address) {
+		return (address >> 5) & (Lines - 1);
+	}
+
+	// Reads from the line last accessed through the same address range, if any
+	template<class T>
+	bool fastRead(u32 address, T& value) const
+	{
+		const u32 index = keyIndex(address);
+		if (readKeys[index] != key<T>(address))
+			return false;
+		value = *(const T *)&lineData[index][address & (LineSize - 1)];
+		return true;
+	}
+
+	// Writes to the line last written through the same address range in copy-back mode, if any
+	template<class T>
+	bool fastWrite(u32 address, T value)
+	{
+		const u32 index = keyIndex(address);
+		if (writeKeys[index] != key<T>(address))
+			return false;
+		dirty[index] = true;
+		*(T *)&lineData[index][address & (LineSize - 1)] = value;
+		return true;
+	}
+
 	template<class T>
 	T ReadMem(u32 address)
 	{
@@ -259,19 +309,19 @@ public:
 		}
 
 		const u32 index = lineIndex(address);
-		cache_line& line = lines[index];
 		const u32 tag = (physAddr >> 10) & 0x7ffff;
-		if (!line.valid || tag != line.address)
+		if (!valid[index] || tag != tags[index])
 		{
 			// miss
-			if (line.dirty && line.valid)
+			if (dirty[index] && valid[index])
 				// write-back needed
-				doWriteBack(index, line);
-			line.address = tag;
-			readCacheLine(physAddr, line);
+				doWriteBack(index);
+			tags[index] = tag;
+			readCacheLine(physAddr, index);
 		}
+		setKeys(index, address, false);
 
-		return *(T*)&line.data[physAddr & 0x1f];
+		return *(T*)&lineData[index][physAddr & 0x1f];
 	}
 
 	template<class T>
@@ -292,30 +342,31 @@ public:
 		}
 
 		const u32 index = lineIndex(address);
-		cache_line& line = lines[index];
 		const u32 tag = (physAddr >> 10) & 0x7ffff;
-		if (!line.valid || tag != line.address)
+		if (!valid[index] || tag != tags[index])
 		{
 			// miss and copy-back => read cache line
 			if (copyBack)
 			{
-				if (line.dirty && line.valid)
+				if (dirty[index] && valid[index])
 					// write-back needed
-					doWriteBack(index, line);
-				line.address = tag;
-				readCacheLine(physAddr, line);
+					doWriteBack(index);
+				tags[index] = tag;
+				readCacheLine(physAddr, index);
 			}
 		}
 		else if (!copyBack)
 		{
 			// hit and write-through => update cache
-			*(T*)&line.data[physAddr & 0x1f] = data;
+			*(T*)&lineData[index][physAddr & 0x1f] = data;
+			setKeys(index, address, false);
 		}
 		if (copyBack)
 		{
 			// copy-back => update cache and mark line as dirty
-			line.dirty = true;
-			*(T*)&line.data[physAddr & 0x1f] = data;
+			dirty[index] = true;
+			*(T*)&lineData[index][physAddr & 0x1f] = data;
+			setKeys(index, address, true);
 		}
 		else
 		{
@@ -338,14 +389,15 @@ public:
 			return;
 
 		const u32 index = lineIndex(address);
-		cache_line& line = lines[index];
 		const u32 tag = (physAddr >> 10) & 0x7ffff;
-		if (!line.valid || tag != line.address)
+		if (!valid[index] || tag != tags[index])
 			return;
-		if (write_back && line.dirty)
-			doWriteBack(index, line);
-		line.valid = !invalidate;
-		line.dirty = false;
+		if (write_back && dirty[index])
+			doWriteBack(index);
+		valid[index] = !invalidate;
+		dirty[index] = false;
+		if (invalidate)
+			resetKeys(index);
 	}
 
 	void Prefetch(u32 address)
@@ -360,62 +412,82 @@ public:
 			return;
 
 		const u32 index = lineIndex(address);
-		cache_line& line = lines[index];
 		const u32 tag = (physAddr >> 10) & 0x7ffff;
-		if (line.valid && tag == line.address)
+		if (valid[index] && tag == tags[index])
 			return;
-		if (line.valid && line.dirty)
-			doWriteBack(index, line);
-		line.address = tag;
-		readCacheLine(physAddr, line);
+		if (valid[index] && dirty[index])
+			doWriteBack(index);
+		tags[index] = tag;
+		readCacheLine(physAddr, index);
 	}
 
 	void Invalidate()
 	{
-		for (auto& line : lines)
-		{
-			line.dirty = false;
-			line.valid = false;
-		}
+		valid.fill(false);
+		dirty.fill(false);
+		resetKeys();
 	}
 
 	void Reset(bool hard)
 	{
 		if (hard)
-			memset(&lines[0], 0, sizeof(lines));
+		{
+			tags.fill(0);
+			valid.fill(false);
+			dirty.fill(false);
+			memset(lineData, 0, sizeof(lineData));
+		}
+		resetKeys();
 	}
 
 	void Serialize(Serializer& ser)
 	{
-		ser << lines;
+		// same layout as the former array of lines
+		for (u32 i = 0; i < Lines; i++)
+		{
+			cache_line line{};
+			line.valid = valid[i];
+			line.dirty = dirty[i];
+			line.address = tags[i];
+			memcpy(line.data, lineData[i], sizeof(line.data));
+			ser << line;
+		}
 		ser << writeBackBufferCycles;
 		ser << writeThroughBufferCycles;
 	}
 	void Deserialize(Deserializer& deser)
 	{
-		deser >> lines;
+		for (u32 i = 0; i < Lines; i++)
+		{
+			cache_line line;
+			deser >> line;
+			valid[i] = line.valid;
+			dirty[i] = line.dirty;
+			tags[i] = line.address;
+			memcpy(lineData[i], line.data, sizeof(line.data));
+		}
 		if (deser.version() >= Serializer::V55) {
 			deser >> writeBackBufferCycles;
 			deser >> writeThroughBufferCycles;
 		}
+		resetKeys();
 	}
 
 	u32 ReadAddressArray(u32 addr)
 	{
 		u32 index = (addr >> 5) & 0x1FF;
-		return (u32)lines[index].valid | ((u32)lines[index].dirty << 1) | (lines[index].address << 10);
+		return (u32)valid[index] | ((u32)dirty[index] << 1) | (tags[index] << 10);
 	}
 
 	void WriteAddressArray(u32 addr, u32 data)
 	{
 		u32 index = (addr >> 5) & 0x1FF;
-		cache_line& line = lines[index];
 		bool associative = (addr & 8) != 0;
 		if (!associative)
 		{
-			if (line.valid && line.dirty)
-				doWriteBack(index, line);
-			line.address = (data >> 10) & 0x7ffff;
+			if (valid[index] && dirty[index])
+				doWriteBack(index);
+			tags[index] = (data >> 10) & 0x7ffff;
 		}
 		else
 		{
@@ -431,42 +503,69 @@ public:
 
 			u32 tag = (physAddr >> 10) & 0x7ffff;
 
-			if (!line.valid || tag != line.address)
+			if (!valid[index] || tag != tags[index])
 				// Ignore the write
 				return;
-			if ((data & 3) != 0 && line.dirty)
-				doWriteBack(index, line);
+			if ((data & 3) != 0 && dirty[index])
+				doWriteBack(index);
 		}
-		line.valid = data & 1;
-		line.dirty = (data >> 1) & 1;
+		valid[index] = data & 1;
+		dirty[index] = (data >> 1) & 1;
+		resetKeys(index);
 	}
 
 	u32 ReadDataArray(u32 addr)
 	{
 		u32 index = (addr >> 5) & 0x1FF;
-		cache_line& line = lines[index];
-		return *(u32 *)&line.data[addr & 0x1C];
+		return *(u32 *)&lineData[index][addr & 0x1C];
 	}
 
 	void WriteDataArray(u32 addr, u32 data)
 	{
 		u32 index = (addr >> 5) & 0x1FF;
-		cache_line& line = lines[index];
-		*(u32 *)&line.data[addr & 0x1C] = data;
+		*(u32 *)&lineData[index][addr & 0x1C] = data;
 	}
 
 	void WriteBackAll()
 	{
-		for (cache_line& line : lines)
+		for (u32 index = 0; index < Lines; index++)
 		{
-			if (line.valid && line.dirty)
-				doWriteBack((u32)(&line - &lines[0]), line);
-			line.valid = false;
-			line.dirty = false;
+			if (valid[index] && dirty[index])
+				doWriteBack(index);
+			valid[index] = false;
+			dirty[index] = false;
 		}
+		resetKeys();
 	}
 
+	// Forgets the addresses through which the lines were accessed.
+	// Must be called when CCR changes.
+	void resetKeys()
+	{
+		readKeys.fill(InvalidKey);
+		writeKeys.fill(InvalidKey);
+	}
+
+	// Outside of STRICT_MODE, true if the memory handlers and the dynarec go through the cache
+	bool isEmulated() const {
+		return emulated;
+	}
+	void setEmulated(bool emulated) {
+		this->emulated = emulated;
+	}
+
+	// Tag store. The dynarecs access readKeys, writeKeys, dirty and lineData directly.
+	std::array<u32, Lines> tags {};		// physical address bits 10-28
+	std::array<bool, Lines> valid {};
+	std::array<bool, Lines> dirty {};
+	// Address (& KeyMask) of the last access to each line, or InvalidKey.
+	// writeKeys is only set if the line is in copy-back mode for this address.
+	std::array<u32, Lines> readKeys;
+	std::array<u32, Lines> writeKeys;
+	alignas(32) u8 lineData[Lines][LineSize] {};
+
 private:
+	// Savestate format
 	struct cache_line {
 		bool valid;
 		bool dirty;
@@ -484,35 +583,55 @@ private:
 		return index;
 	}
 
-	void readCacheLine(u32 address, cache_line& line)
+	void setKeys(u32 index, u32 address, bool write)
 	{
-		line.valid = true;
-		line.dirty = false;
+#ifndef STRICT_MODE
+		// keyIndex() is only valid with the default index mode
+		if (CCN_CCR.OIX == 0 && CCN_CCR.ORA == 0)
+		{
+			readKeys[index] = address & KeyMask;
+			if (write)
+				writeKeys[index] = address & KeyMask;
+		}
+#endif
+	}
+
+	void resetKeys(u32 index)
+	{
+		readKeys[index] = InvalidKey;
+		writeKeys[index] = InvalidKey;
+	}
+
+	void readCacheLine(u32 address, u32 index)
+	{
+		resetKeys(index);
+		valid[index] = true;
+		dirty[index] = false;
 		const u32 line_addr = address & ~0x1f;
-		u8* memPtr = GetMemPtr(line_addr, sizeof(line.data));
+		u8* memPtr = GetMemPtr(line_addr, LineSize);
 		if (memPtr != nullptr)
-			memcpy(line.data, memPtr, sizeof(line.data));
+			memcpy(lineData[index], memPtr, LineSize);
 		else
 		{
-			u32 *p = (u32 *)line.data;
-			for (int i = 0; i < 32; i += 4)
+			u32 *p = (u32 *)lineData[index];
+			for (u32 i = 0; i < LineSize; i += 4)
 				*p++ = addrspace::read32(line_addr + i);
 		}
-		sh4cycles.addReadAccessCycles(address, 32);
+		sh4cycles.addReadAccessCycles(address, LineSize);
 	}
 
-	void doWriteBack(u32 index, cache_line& line)
+	void doWriteBack(u32 index)
 	{
 		if (CCN_CCR.ORA && (index & 0x80))
 			return;
-		u32 line_addr = (line.address << 10) | ((index & 0x1F) << 5);
-		u8* memPtr = GetMemPtr(line_addr, sizeof(line.data));
+		u32 line_addr = (tags[index] << 10) | ((index & 0x1F) << 5);
+		u8* memPtr = GetMemPtr(line_addr, LineSize);
 		if (memPtr != nullptr)
-			memcpy(memPtr, line.data, sizeof(line.data));
+			memcpy(memPtr, lineData[index], LineSize);
 		else
 		{
-			u32 *p = (u32 *)line.data;
-			for (int i = 0; i < 32; i += 4)
+			u32 *p = (u32 *)lineData[index];
+			for (u32 i = 0; i < LineSize; i += 4)
 				addrspace::write32(line_addr + i, *p++);
 		}
 		addWriteBackCycles(line_addr);
@@ -521,6 +640,15 @@ private:
 	template<class T, u32 ACCESS>
 	MmuError translateAddress(u32 address, u32& physAddr, bool& cached, bool& copyBack)
 	{
+#ifndef STRICT_MODE
+		// The cache is only emulated without mmu. Like the uncached memory handlers, ignore address errors.
+		const u32 area = address >> 29;
+		physAddr = address;
+		cached = CCN_CCR.OCE == 1 && cachedArea(area);
+		if (ACCESS == MMU_TT_DWRITE)
+			copyBack = area == 4 ? CCN_CCR.CB : !CCN_CCR.WT;
+		return MmuError::NONE;
+#else
 		// Alignment errors
 		if (address & (sizeof(T) - 1))
 			return MmuError::BADADDR;
@@ -584,6 +712,7 @@ private:
 
 		}
 		return MmuError::NONE;
+#endif
 	}
 
 	void addWriteBackCycles(u32 addr)
@@ -605,9 +734,9 @@ private:
 		writeThroughBufferCycles = now + cycles;
 	}
 
-	std::array<cache_line, 512> lines;
 	u64 writeBackBufferCycles = 0;
 	u64 writeThroughBufferCycles = 0;
+	bool emulated = false;
 	Sh4Cycles sh4cycles;
 	Sh4Context *ctx = nullptr;
 };
@@ -626,6 +755,30 @@ void WriteCachedMem(u32 address, T data)
 	ocache.WriteMem<T>(address, data);
 }
 
+// Memory handlers used when the operand cache is emulated outside of STRICT_MODE.
+// Unaligned accesses bypass the cache.
+template<class T>
+T ReadCachedMemNoMmu(u32 address)
+{
+	T value;
+	if (ocache.fastRead(address, value))
+		return value;
+	if (address & (sizeof(T) - 1))
+		return addrspace::readt<T>(address);
+	return ocache.ReadMem<T>(address);
+}
+
+template<class T>
+void WriteCachedMemNoMmu(u32 address, T data)
+{
+	if (ocache.fastWrite(address, data))
+		return;
+	if (address & (sizeof(T) - 1))
+		addrspace::writet<T>(address, data);
+	else
+		ocache.WriteMem<T>(address, data);
+}
+
 static inline u16 IReadCachedMem(u32 address)
 {
 	return icache.ReadMem(address);
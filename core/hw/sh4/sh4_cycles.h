@@ -60,7 +60,7 @@ public:
 	}
 
 	u64 now() {
-		return sh4_sched_now64() + SH4_TIMESLICE - ctx->cycle_counter;
+		return sh4_sched_now64() + ctx->slice_cycles - ctx->cycle_counter;
 	}
 
 	int readAccessCycles(u32 addr, u32 size) const {
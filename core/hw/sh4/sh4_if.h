@@ -167,6 +167,7 @@ struct alignas(64) Sh4Context
 			int cycle_counter;
 
 			SQWriteFunc *doSqWrite;
+			int slice_cycles;	// length of the current timeslice
 		};
 		u64 raw[64];
 	};
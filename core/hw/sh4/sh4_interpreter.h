@@ -1,12 +1,14 @@
 #pragma once
 #include "types.h"
 #include "sh4_cycles.h"
+#include "interpr/sh4_decodecache.h"
 
 class Sh4Interpreter : public Sh4Executor
 {
 public:
+	Sh4Interpreter() = default;
 	void Run() override;
-	void ResetCache() override  {}
+	void ResetCache() override;
 	void Start() override;
 	void Stop() override;
 	void Step() override;
@@ -21,11 +23,20 @@ public:
 	static Sh4Interpreter *Instance;
 
 protected:
+	Sh4Interpreter(int cpuRatio) : sh4cycles(cpuRatio) {}
+	void ExecuteOpcode(u16 op);
+	u16 ReadNexOp();
+	// Runs until the end of the timeslice using the decode cache
+	void ExecuteDecoded();
+
 	Sh4Context *ctx = nullptr;
 
 private:
-	void ExecuteOpcode(u16 op);
-	u16 ReadNexOp();
+	static void decodeOp(Sh4Interpreter *sh4, DecodedOp& dop);
+	static void execOp(Sh4Interpreter *sh4, DecodedOp& dop);
+	static void execFpuOp(Sh4Interpreter *sh4, DecodedOp& dop);
+	static void execPopPair(Sh4Interpreter *sh4, DecodedOp& dop);
+	static void execDtBf(Sh4Interpreter *sh4, DecodedOp& dop);
 
 	Sh4Cycles sh4cycles{CPU_RATIO};
 	// SH4 underclock factor when using the interpreter so that it's somewhat usable
@@ -13,6 +13,7 @@
 #include "sh4_interrupts.h"
 #include "sh4_core.h"
 #include "sh4_mmr.h"
+#include "sh4_sched.h"
 #include "oslib/oslib.h"
 #include "debug/gdb_server.h"
 #include "serialize.h"
@@ -105,6 +106,8 @@ static u32 decoded_srimask; // Vector of interrupts allowed by SR.IMSK (-1 inhib
 static void recalc_pending_itrs()
 {
 	Sh4cntx.interrupt_pend = interrupt_vpend & interrupt_vmask & decoded_srimask;
+	if (Sh4cntx.interrupt_pend)
+		sh4_sched_end_slice();
 }
 
 //Rebuild sorted interrupt id table (priorities were updated)
@@ -12,9 +12,10 @@
 #include "hw/mem/addrspace.h"
 #include "hw/sh4/modules/mmu.h"
 #include "cfg/option.h"
-
-#ifdef STRICT_MODE
 #include "sh4_cache.h"
+#include "emulator.h"
+#if FEAT_SHREC != DYNAREC_NONE
+#include "dyna/ngen.h"
 #endif
 
 //main system mem
@@ -290,6 +291,20 @@ u8* GetMemPtr(u32 addr, u32 size)
 	return nullptr;
 }
 
+#ifndef STRICT_MODE
+// The operand cache is emulated if enabled for the game, without mmu, and if the dynarec supports it
+static bool emulateOCache()
+{
+	if (!config::OperandCacheEmulation || mmu_enabled())
+		return false;
+#if FEAT_SHREC != DYNAREC_NONE
+	if (config::DynarecEnabled)
+		return sh4Dynarec != nullptr && sh4Dynarec->supportsOCacheEmulation();
+#endif
+	return true;
+}
+#endif
+
 void SetMemoryHandlers()
 {
 #ifdef STRICT_MODE
@@ -319,6 +334,34 @@ void SetMemoryHandlers()
 		return;
 	}
 	interpreterRunning = false;
+#else
+	const bool cacheEmulation = emulateOCache();
+	if (!cacheEmulation)
+		// memory is accessed directly. Write back the lines restored by a savestate, if any.
+		ocache.WriteBackAll();
+	if (cacheEmulation != ocache.isEmulated())
+	{
+		ocache.setEmulated(cacheEmulation);
+		// blocks are compiled for one mode or the other
+		Sh4Executor *executor = emu.getSh4Executor();
+		if (config::DynarecEnabled && executor != nullptr)
+			executor->ResetCache();
+	}
+	if (cacheEmulation)
+	{
+		IReadMem16 = &addrspace::read16;
+		ReadMem8 = &ReadCachedMemNoMmu<u8>;
+		ReadMem16 = &ReadCachedMemNoMmu<u16>;
+		ReadMem32 = &ReadCachedMemNoMmu<u32>;
+		ReadMem64 = &ReadCachedMemNoMmu<u64>;
+
+		WriteMem8 = &WriteCachedMemNoMmu<u8>;
+		WriteMem16 = &WriteCachedMemNoMmu<u16>;
+		WriteMem32 = &WriteCachedMemNoMmu<u32>;
+		WriteMem64 = &WriteCachedMemNoMmu<u64>;
+
+		return;
+	}
 #endif
 	if (mmu_enabled())
 	{
@@ -723,6 +723,9 @@ void deserialize(Deserializer& deser)
 		deser.skip<u32>(); // sh4InterpCycles
 	if (deser.version() < Deserializer::V21)
 		p_sh4rcb->cntx.cycle_counter = SH4_TIMESLICE;
+	// not set by older versions
+	if (p_sh4rcb->cntx.slice_cycles < SH4_TIMESLICE)
+		p_sh4rcb->cntx.slice_cycles = SH4_TIMESLICE;
 
 	sh4_sched_deserialize(deser);
 }
@@ -90,10 +90,10 @@ static sh4_opcodelistentry opcodes[]=
 	{dec_i0000_nnnn_0010_0011   ,i0000_nnnn_0010_0011   ,Mask_n         ,0x0023 ,Branch_rel_d   ,"braf <REG_N>"                         ,2,3,CO,4},  //braf <REG_N>
 	{dec_i0000_nnnn_0000_0011   ,i0000_nnnn_0000_0011   ,Mask_n         ,0x0003 ,Branch_rel_d   ,"bsrf <REG_N>"                         ,2,3,CO,24}, //bsrf <REG_N>
 	{0                          ,i0000_nnnn_1100_0011   ,Mask_n         ,0x00C3 ,Normal         ,"movca.l R0, @<REG_N>"                 ,1,4,LS,12   ,dec_MWt(PRM_RN,PRM_R0,4)}, //movca.l R0, @<REG_N>
-	{dec_i0000_0000_0000_1001   ,i0000_nnnn_1001_0011   ,Mask_n         ,0x0093 ,Normal         ,"ocbi @<REG_N>"                        ,1,2,LS,10}, //ocbi @<REG_N>
-	{dec_i0000_0000_0000_1001   ,i0000_nnnn_1010_0011   ,Mask_n         ,0x00A3 ,Normal         ,"ocbp @<REG_N>"                        ,1,3,LS,11}, //ocbp @<REG_N>
-	{dec_i0000_0000_0000_1001   ,i0000_nnnn_1011_0011   ,Mask_n         ,0x00B3 ,Normal         ,"ocbwb @<REG_N>"                       ,1,3,LS,11}, //ocbwb @<REG_N>
-	{0                          ,i0000_nnnn_1000_0011   ,Mask_n         ,0x0083 ,Normal         ,"pref @<REG_N>"                        ,1,1,LS,2    ,dec_Fill(DM_UnaryOp,PRM_RN,PRM_ONE,shop_pref,1)},  //pref @<REG_N>
+	{dec_i0000_nnnn_1001_0011   ,i0000_nnnn_1001_0011   ,Mask_n         ,0x0093 ,Normal         ,"ocbi @<REG_N>"                        ,1,2,LS,10}, //ocbi @<REG_N>
+	{dec_i0000_nnnn_1001_0011   ,i0000_nnnn_1010_0011   ,Mask_n         ,0x00A3 ,Normal         ,"ocbp @<REG_N>"                        ,1,3,LS,11}, //ocbp @<REG_N>
+	{dec_i0000_nnnn_1001_0011   ,i0000_nnnn_1011_0011   ,Mask_n         ,0x00B3 ,Normal         ,"ocbwb @<REG_N>"                       ,1,3,LS,11}, //ocbwb @<REG_N>
+	{dec_i0000_nnnn_1000_0011   ,i0000_nnnn_1000_0011   ,Mask_n         ,0x0083 ,Normal         ,"pref @<REG_N>"                        ,1,1,LS,2}   ,//pref @<REG_N>
 	{0                          ,i0000_nnnn_mmmm_0111   ,Mask_n_m       ,0x0007 ,Normal         ,"mul.l <REG_M>,<REG_N>"                ,2,4,CO,34   ,dec_mul(-32)}, //mul.l <REG_M>,<REG_N>
 	{0                          ,i0000_0000_0010_1000   ,Mask_none      ,0x0028 ,Normal         ,"clrmac"                               ,1,3,CO,28}, //clrmac
 	{0                          ,i0000_0000_0100_1000   ,Mask_none      ,0x0048 ,Normal         ,"clrs"                                 ,1,1,CO,1    ,dec_Fill(DM_BinaryOp, PRM_SR_STATUS, PRM_TWO_INV, shop_and, 1) }, //clrs
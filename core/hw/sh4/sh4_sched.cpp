@@ -28,12 +28,37 @@ struct sched_list
 	int tag;
 	int start;
 	int end;
+	int heapPos;	// position in sch_heap or -1
 };
 
 static u64 sh4_sched_ffb;
 static std::vector<sched_list> sch_list;
 static int sh4_sched_next_id = -1;
 
+/*
+	Ids of the scheduled callbacks, ordered by end time then id, which is the
+	order in which the linear search used to find them.
+	All scheduled callbacks end within SH4_MAIN_CLOCK cycles from now so their
+	end times can be compared with a wrapping difference.
+*/
+static std::vector<int> sch_heap;
+// set when the scheduling data has been changed directly (reset, deserialize)
+static bool sch_heap_dirty;
+
+/*
+	Timeslice batching.
+	A batched timeslice lasts until the next event is due instead of SH4_TIMESLICE
+	cycles, so that the cpu doesn't return to the scheduler when there is nothing
+	to do. Its length is kept in Sh4cntx.slice_cycles and is shortened when an
+	earlier event is requested or when an interrupt becomes pending.
+	The timeslices are never shorter than SH4_TIMESLICE, unless ended early by
+	sh4_sched_end_slice_now().
+*/
+static u64 sh4_sched_slices;
+static u64 sh4_sched_ticks;
+// the scheduler callbacks are running
+static bool sh4_sched_ticking;
+
 static u32 sh4_sched_now();
 
 static u32 sh4_sched_remaining(const sched_list& sched, u32 reference)
@@ -44,21 +69,143 @@ static u32 sh4_sched_remaining(const sched_list& sched, u32 reference)
 		return -1;
 }
 
-void sh4_sched_ffts()
+static bool sh4_sched_before(int id1, int id2)
 {
-	u32 diff = -1;
-	int slot = -1;
+	int diff = sch_list[id1].end - sch_list[id2].end;
+	return diff < 0 || (diff == 0 && id1 < id2);
+}
+
+static void heap_set(u32 pos, int id)
+{
+	sch_heap[pos] = id;
+	sch_list[id].heapPos = pos;
+}
 
-	u32 now = sh4_sched_now();
-	for (const sched_list& sched : sch_list)
+static void heap_up(u32 pos)
+{
+	int id = sch_heap[pos];
+	while (pos > 0)
 	{
-		u32 remaining = sh4_sched_remaining(sched, now);
-		if (remaining < diff)
-		{
-			slot = &sched - &sch_list[0];
-			diff = remaining;
-		}
+		u32 parent = (pos - 1) / 2;
+		if (!sh4_sched_before(id, sch_heap[parent]))
+			break;
+		heap_set(pos, sch_heap[parent]);
+		pos = parent;
+	}
+	heap_set(pos, id);
+}
+
+static void heap_down(u32 pos)
+{
+	int id = sch_heap[pos];
+	const u32 size = sch_heap.size();
+	for (;;)
+	{
+		u32 child = pos * 2 + 1;
+		if (child >= size)
+			break;
+		if (child + 1 < size && sh4_sched_before(sch_heap[child + 1], sch_heap[child]))
+			child++;
+		if (!sh4_sched_before(sch_heap[child], id))
+			break;
+		heap_set(pos, sch_heap[child]);
+		pos = child;
+	}
+	heap_set(pos, id);
+}
+
+static void heap_remove(int id)
+{
+	int pos = sch_list[id].heapPos;
+	if (pos == -1)
+		return;
+	sch_list[id].heapPos = -1;
+	int last = sch_heap.back();
+	sch_heap.pop_back();
+	if (last == id)
+		return;
+	heap_set(pos, last);
+	heap_up(pos);
+	heap_down(sch_list[last].heapPos);
+}
+
+// Inserts, moves or removes the callback after its end time has changed
+static void heap_update(int id)
+{
+	if (sch_list[id].end == -1)
+	{
+		heap_remove(id);
+		return;
+	}
+	int pos = sch_list[id].heapPos;
+	if (pos == -1)
+	{
+		pos = sch_heap.size();
+		sch_heap.push_back(id);
 	}
+	heap_up(pos);
+	heap_down(sch_list[id].heapPos);
+}
+
+static void heap_rebuild()
+{
+	sch_heap.clear();
+	for (sched_list& sched : sch_list)
+		sched.heapPos = -1;
+	for (u32 id = 0; id < sch_list.size(); id++)
+		if (sch_list[id].end != -1 && sch_list[id].cb != nullptr)
+			heap_update(id);
+	sch_heap_dirty = false;
+}
+
+// Ends the current timeslice when the event due in *cycles* from its start is reached
+static void sh4_sched_limit_slice(int cycles)
+{
+	// the event is handled when the timeslice ends strictly after it
+	cycles = std::clamp(cycles, SH4_TIMESLICE - 1, SH4_MAX_TIMESLICE - 1) + 1;
+	if (cycles < Sh4cntx.slice_cycles)
+	{
+		Sh4cntx.cycle_counter -= Sh4cntx.slice_cycles - cycles;
+		Sh4cntx.slice_cycles = cycles;
+	}
+}
+
+int sh4_sched_slice(bool batch)
+{
+	sh4_sched_slices++;
+	if (!batch || Sh4cntx.sh4_sched_next < SH4_TIMESLICE)
+		return SH4_TIMESLICE;
+	return std::min(Sh4cntx.sh4_sched_next + 1, SH4_MAX_TIMESLICE);
+}
+
+void sh4_sched_end_slice() {
+	sh4_sched_limit_slice(0);
+}
+
+void sh4_sched_end_slice_now()
+{
+	// nothing has been executed yet, or the timeslice is already over
+	if (sh4_sched_ticking || Sh4cntx.cycle_counter < 0 || Sh4cntx.cycle_counter >= Sh4cntx.slice_cycles)
+		return;
+	// the dynarecs only end the timeslice when the cycle counter is negative
+	Sh4cntx.slice_cycles -= Sh4cntx.cycle_counter + 1;
+	Sh4cntx.cycle_counter = -1;
+}
+
+u64 sh4_sched_slice_count() {
+	return sh4_sched_slices;
+}
+
+u64 sh4_sched_tick_count() {
+	return sh4_sched_ticks;
+}
+
+void sh4_sched_ffts()
+{
+	if (sch_heap_dirty)
+		heap_rebuild();
+	int slot = sch_heap.empty() ? -1 : sch_heap[0];
+	u32 diff = slot == -1 ? -1 : sh4_sched_remaining(sch_list[slot], sh4_sched_now());
 
 	sh4_sched_ffb -= Sh4cntx.sh4_sched_next;
 
@@ -69,11 +216,12 @@ void sh4_sched_ffts()
 		Sh4cntx.sh4_sched_next = SH4_MAIN_CLOCK;
 
 	sh4_sched_ffb += Sh4cntx.sh4_sched_next;
+	sh4_sched_limit_slice(Sh4cntx.sh4_sched_next);
 }
 
 int sh4_sched_register(int tag, sh4_sched_callback* ssc, void *arg)
 {
-	sched_list t{ ssc, arg, tag, -1, -1};
+	sched_list t{ ssc, arg, tag, -1, -1, -1 };
 	for (sched_list& sched : sch_list)
 		if (sched.cb == nullptr)
 		{
@@ -91,6 +239,8 @@ void sh4_sched_unregister(int id)
 	if (id == -1)
 		return;
 	verify(id < (int)sch_list.size());
+	if (!sch_heap_dirty)
+		heap_remove(id);
 	if (id == (int)sch_list.size() - 1)
 		sch_list.resize(sch_list.size() - 1);
 	else
@@ -117,12 +267,29 @@ u64 sh4_sched_now64()
 	return sh4_sched_ffb - Sh4cntx.sh4_sched_next;
 }
 
+/*
+	Cycles executed by the cpu in the current timeslice.
+	The callbacks run at the end of the timeslice, which is already accounted for.
+*/
+static int sh4_sched_slice_elapsed()
+{
+	if (sh4_sched_ticking)
+		return 0;
+	return Sh4cntx.slice_cycles - Sh4cntx.cycle_counter;
+}
+
+u64 sh4_sched_cpu_now64()
+{
+	return sh4_sched_now64() + sh4_sched_slice_elapsed();
+}
+
 void sh4_sched_request(int id, int cycles)
 {
 	verify(cycles == -1 || (cycles >= 0 && cycles <= SH4_MAIN_CLOCK));
 
 	sched_list& sched = sch_list[id];
-	sched.start = sh4_sched_now();
+	// batched timeslices are long: requests made by the cpu start at its current time
+	sched.start = sh4_sched_now() + sh4_sched_slice_elapsed();
 
 	if (cycles == -1)
 	{
@@ -134,6 +301,8 @@ void sh4_sched_request(int id, int cycles)
 		if (sched.end == -1)
 			sched.end++;
 	}
+	if (!sch_heap_dirty)
+		heap_update(id);
 
 	sh4_sched_ffts();
 }
@@ -156,17 +325,49 @@ static int sh4_sched_elapsed(sched_list& sched)
 		return -1;
 }
 
-static void handle_cb(sched_list& sched)
+static void handle_cb(int id)
 {
+	sched_list& sched = sch_list[id];
 	int remain = sched.end - sched.start;
 	int elapsd = sh4_sched_elapsed(sched);
 	int jitter = elapsd - remain;
 
 	sched.end = -1;
+	heap_remove(id);
 	int re_sch = sched.cb(sched.tag, remain, jitter, sched.arg);
 
 	if (re_sch > 0)
-		sh4_sched_request(&sched - &sch_list[0], std::max(0, re_sch - jitter));
+		sh4_sched_request(id, std::max(0, re_sch - jitter));
+}
+
+static bool sh4_sched_due(const sched_list& sched, u32 fztime, int cycles)
+{
+	int remaining = sh4_sched_remaining(sched, fztime);
+	return remaining >= 0 && remaining <= cycles;
+}
+
+/*
+	Finds the lowest id greater than after of the callbacks due in [fztime, fztime + cycles].
+	Only the top of the heap, up to fztime + cycles, is searched.
+*/
+static void sh4_sched_find_due(u32 pos, int after, u32 fztime, int cycles, int& found)
+{
+	if (pos >= sch_heap.size())
+		return;
+	int id = sch_heap[pos];
+	if ((int)(sch_list[id].end - (fztime + cycles)) > 0)
+		return;
+	if (id > after && (found == -1 || id < found) && sh4_sched_due(sch_list[id], fztime, cycles))
+		found = id;
+	sh4_sched_find_due(pos * 2 + 1, after, fztime, cycles, found);
+	sh4_sched_find_due(pos * 2 + 2, after, fztime, cycles, found);
+}
+
+static int sh4_sched_next_due(int after, u32 fztime, int cycles)
+{
+	int found = -1;
+	sh4_sched_find_due(0, after, fztime, cycles, found);
+	return found;
 }
 
 void sh4_sched_tick(int cycles)
@@ -174,15 +375,18 @@ void sh4_sched_tick(int cycles)
 	if (Sh4cntx.sh4_sched_next >= 0)
 		return;
 
+	sh4_sched_ticks++;
+	if (sch_heap_dirty)
+		heap_rebuild();
 	u32 fztime = sh4_sched_now() - cycles;
 	if (sh4_sched_next_id != -1)
 	{
-		for (sched_list& sched : sch_list)
-		{
-			int remaining = sh4_sched_remaining(sched, fztime);
-			if (remaining >= 0 && remaining <= (int)cycles)
-				handle_cb(sched);
-		}
+		sh4_sched_ticking = true;
+		// Callbacks are called in id order, including those scheduled by a previous callback
+		// with a greater id, as they used to be with a linear search
+		for (int id = sh4_sched_next_due(-1, fztime, cycles); id != -1; id = sh4_sched_next_due(id, fztime, cycles))
+			handle_cb(id);
+		sh4_sched_ticking = false;
 	}
 	sh4_sched_ffts();
 }
@@ -195,8 +399,12 @@ void sh4_sched_reset(bool hard)
 		sh4_sched_next_id = -1;
 		for (sched_list& sched : sch_list)
 			sched.start = sched.end = -1;
+		sch_heap_dirty = true;
 		Sh4cntx.sh4_sched_next = 0;
+		sh4_sched_slices = 0;
+		sh4_sched_ticks = 0;
 	}
+	sh4_sched_ticking = false;
 }
 
 void sh4_sched_serialize(Serializer& ser, int id)
@@ -211,6 +419,7 @@ void sh4_sched_deserialize(Deserializer& deser, int id)
 	deser >> sch_list[id].tag;
 	deser >> sch_list[id].start;
 	deser >> sch_list[id].end;
+	sch_heap_dirty = true;
 }
 
 // FIXME modules should save their scheduling data so that it doesn't depend on their scheduler id
@@ -2,6 +2,7 @@
 #include "types.h"
 
 #define SH4_TIMESLICE 448	// at 112 Bangai-O doesn't start. 224 is ok
+#define SH4_MAX_TIMESLICE (SH4_TIMESLICE * 16)	// when batching timeslices
 
 /*
 	tag, as passed on sh4_sched_register
@@ -27,6 +28,12 @@ void sh4_sched_unregister(int id);
 */
 u64 sh4_sched_now64();
 
+/*
+	current time, including the cycles executed by the cpu in the current timeslice.
+	Used when the cpu reads or writes time-dependent registers.
+*/
+u64 sh4_sched_cpu_now64();
+
 /*
 	Schedule a callback to be called sh4 *cycles* after the
 	invocation of this function. *Cycles* range is (0, 200M].
@@ -49,6 +56,30 @@ void sh4_sched_tick(int cycles);
 void sh4_sched_ffts();
 void sh4_sched_reset(bool hard);
 
+/*
+	Returns the length of the next timeslice: SH4_TIMESLICE or, if *batch* is true,
+	until the next scheduled event is due (within SH4_MAX_TIMESLICE cycles).
+*/
+int sh4_sched_slice(bool batch);
+
+/*
+	Shortens the current timeslice to SH4_TIMESLICE cycles, so that a pending
+	interrupt is handled in time.
+*/
+void sh4_sched_end_slice();
+
+/*
+	Ends the current timeslice after the block being executed, without changing
+	the elapsed time. Does nothing while the scheduler callbacks are running.
+*/
+void sh4_sched_end_slice_now();
+
+/*
+	Number of timeslices and of scheduler ticks since the last hard reset
+*/
+u64 sh4_sched_slice_count();
+u64 sh4_sched_tick_count();
+
 void sh4_sched_serialize(Serializer& ser);
 void sh4_sched_deserialize(Deserializer& deser);
 void sh4_sched_serialize(Serializer& ser, int id);
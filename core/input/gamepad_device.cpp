@@ -24,6 +24,7 @@
 #include "emulator.h"
 #include "hw/maple/maple_devs.h"
 #include "mouse.h"
+#include "rewind.h"
 
 #include <algorithm>
 #include <mutex>
@@ -94,6 +95,9 @@ bool GamepadDevice::handleButtonInput(int port, DreamcastKey key, bool pressed)
 			if (pressed && !gui_is_open())
 				settings.input.fastForwardMode = !settings.input.fastForwardMode && !settings.network.online && !settings.naomi.multiboard;
 			break;
+		case EMU_BTN_REWIND:
+			rewinder::setRewinding(pressed && !gui_is_open());
+			break;
 		case EMU_BTN_LOADSTATE:
 			if (pressed)
 				gui_loadState();
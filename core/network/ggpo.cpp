@@ -84,6 +84,7 @@ static void getLocalInput(MapleInputState inputState[4])
 #include "imgui.h"
 #include "miniupnp.h"
 #include "hw/naomi/naomi_cart.h"
+#include "util/buffer_pool.h"
 
 //#define SYNC_TEST 1
 
@@ -97,6 +98,8 @@ using namespace std::chrono;
 
 constexpr int MAX_PLAYERS = 2;
 constexpr int SERVER_PORT = 19713;
+// states kept by ggpo for rollbacks
+constexpr int ROLLBACK_STATES = GGPO_MAX_PREDICTION_FRAMES + 2;
 
 constexpr u32 BTN_TRIGGER_LEFT	= DC_BTN_BITMAPPED_LAST << 1;
 constexpr u32 BTN_TRIGGER_RIGHT	= DC_BTN_BITMAPPED_LAST << 2;
@@ -129,22 +132,21 @@ static bool mouseGame;
 static int inputSize;
 static void (*chatCallback)(int playerNum, const std::string& msg);
 
-struct MemPages
+// Memory pages saved in memwatch::savedPages from the save of a frame until the next save
+struct FrameDelta
 {
-	void load()
-	{
-		memwatch::ramWatcher.getPages(ram);
-		memwatch::vramWatcher.getPages(vram);
-		memwatch::aramWatcher.getPages(aram);
-		memwatch::elanWatcher.getPages(elanram);
-	}
-	memwatch::PageMap ram;
-	memwatch::PageMap vram;
-	memwatch::PageMap aram;
-	memwatch::PageMap elanram;
+	int frame;
+	u64 start;
+	bool freed;
 };
-static std::unordered_map<int, MemPages> deltaStates;
-static int lastSavedFrame = -1;
+// in frame order
+static std::vector<FrameDelta> frameDeltas;
+
+// Game state buffers only hold the device state and are reused
+static BufferPool statePool;
+// Bytes allocated for saved states in the last frames
+static std::array<u32, 60> allocPerFrame;
+static u64 lastAllocated;
 
 static int timesyncOccurred;
 
@@ -295,21 +297,23 @@ static bool load_game_state(unsigned char *buffer, int len)
 	Deserializer deser(buffer, len, true);
 	int frame;
 	deser >> frame;
+	auto it = std::find_if(frameDeltas.begin(), frameDeltas.end(), [frame](const FrameDelta& delta) {
+		return delta.frame == frame;
+	});
+	verify(it != frameDeltas.end());
 	memwatch::unprotect();
-	for (int f = lastSavedFrame - 1; f >= frame; f--)
+	// restore the oldest contents of the pages saved since this frame
+	memwatch::PageRing& pages = memwatch::savedPages;
+	for (u64 pos = pages.head(); pos > it->start; )
 	{
-		const MemPages& pages = deltaStates[f];
-		for (const auto& pair : pages.ram)
-			memcpy(memwatch::ramWatcher.getMemPage(pair.first), &pair.second.data[0], PAGE_SIZE);
-		for (const auto& pair : pages.vram)
-			memcpy(memwatch::vramWatcher.getMemPage(pair.first), &pair.second.data[0], PAGE_SIZE);
-		for (const auto& pair : pages.aram)
-			memcpy(memwatch::aramWatcher.getMemPage(pair.first), &pair.second.data[0], PAGE_SIZE);
-		for (const auto& pair : pages.elanram)
-			memcpy(memwatch::elanWatcher.getMemPage(pair.first), &pair.second.data[0], PAGE_SIZE);
-		DEBUG_LOG(NETWORK, "Restored frame %d pages: %d ram, %d vram, %d eram, %d aica ram", f, (u32)pages.ram.size(),
-					(u32)pages.vram.size(), (u32)pages.elanram.size(), (u32)pages.aram.size());
+		pos--;
+		const memwatch::PageRing::Page& page = pages.page(pos);
+		memcpy(memwatch::getMemPage(page.region, page.offset), pages.data(pos), PAGE_SIZE);
 	}
+	DEBUG_LOG(NETWORK, "Restored frame %d: %d pages", frame, (int)(pages.head() - it->start));
+	// the next frames will be saved again
+	pages.truncate(it->start);
+	frameDeltas.erase(it + 1, frameDeltas.end());
 	dc_deserialize(deser);
 	if (deser.size() != (u32)len)
 	{
@@ -322,6 +326,33 @@ static bool load_game_state(unsigned char *buffer, int len)
 	return true;
 }
 
+// Size of the device state
+static size_t stateSize(int frame)
+{
+	Serializer ser(nullptr, std::numeric_limits<size_t>::max(), true);
+	ser << frame;
+	dc_serialize(ser);
+	return ser.size();
+}
+
+// Serializes the device state into a pooled buffer
+static u8 *serializeState(int frame, int *len)
+{
+	u8 *buffer = statePool.alloc();
+	if (buffer == nullptr)
+		return nullptr;
+	try {
+		Serializer ser(buffer, statePool.capacity(), true);
+		ser << frame;
+		dc_serialize(ser);
+		*len = ser.size();
+		return buffer;
+	} catch (const Serializer::Exception&) {
+		statePool.release(buffer);
+		throw;
+	}
+}
+
 /*
  * save_game_state - The client should allocate a buffer, copy the
  * entire contents of the current game state into it, and copy the
@@ -331,81 +362,52 @@ static bool load_game_state(unsigned char *buffer, int len)
 static bool save_game_state(unsigned char **buffer, int *len, int *checksum, int frame)
 {
 	verify(!emu.getSh4Executor()->IsCpuRunning());
-	lastSavedFrame = frame;
-	// TODO this is way too much memory
-	size_t allocSize = settings.platform.isNaomi() ? 20_MB : 10_MB;
-	*buffer = (unsigned char *)malloc(allocSize);
-	if (*buffer == nullptr)
-	{
-		WARN_LOG(NETWORK, "Memory alloc failed");
-		*len = 0;
-		return false;
-	}
-	Serializer ser(*buffer, allocSize, true);
+	u8 *state = nullptr;
 	try {
-		ser << frame;
-		dc_serialize(ser);
-		*len = ser.size();
+		if (statePool.capacity() == 0)
+		{
+			// preallocate the states of the rollback window
+			statePool.setCapacity(stateSize(frame));
+			statePool.reserve(ROLLBACK_STATES);
+			memwatch::savedPages.reserve(ROLLBACK_STATES * 256);
+		}
+		try {
+			state = serializeState(frame, len);
+		} catch (const Serializer::Exception&) {
+			// the state outgrew the buffers
+			statePool.setCapacity(stateSize(frame));
+			statePool.reserve(ROLLBACK_STATES);
+			state = serializeState(frame, len);
+		}
 	} catch (const Serializer::Exception& e) {
 		WARN_LOG(NETWORK, "Save state failed: %s", e.what());
 		*len = 0;
 		return false;
 	}
-#ifdef SYNC_TEST
-	*checksum = XXH3_64bits(*buffer, usedSize);
-#endif
-	memwatch::protect();
-	if (frame > 0)
+	if (state == nullptr)
 	{
+		WARN_LOG(NETWORK, "Memory alloc failed");
+		*len = 0;
+		return false;
+	}
+	*buffer = state;
 #ifdef SYNC_TEST
-		if (deltaStates.count(frame - 1) != 0)
-		{
-			MemPages memPages;
-			memPages.load();
-			const MemPages& savedPages = deltaStates[frame - 1];
-			//verify(memPages.ram.size() == savedPages.ram.size());
-			if (memPages.ram.size() != savedPages.ram.size())
-			{
-				ERROR_LOG(NETWORK, "old ram size %d new %d", (u32)savedPages.ram.size(), (u32)memPages.ram.size());
-				if (memPages.ram.size() > savedPages.ram.size())
-					for (const auto& pair : memPages.ram)
-					{
-						if (savedPages.ram.count(pair.first) == 0)
-							ERROR_LOG(NETWORK, "new page @ %x", pair.first);
-						else
-							DEBUG_LOG(NETWORK, "page ok @ %x", pair.first);
-					}
-				die("fatal");
-			}
-			for (const auto& pair : memPages.ram)
-			{
-				verify(savedPages.ram.count(pair.first) == 1);
-				verify(memcmp(&pair.second[0], &savedPages.ram.find(pair.first)->second[0], PAGE_SIZE) == 0);
-			}
-			verify(memPages.vram.size() == savedPages.vram.size());
-			for (const auto& pair : memPages.vram)
-			{
-				verify(savedPages.vram.count(pair.first) == 1);
-				verify(memcmp(&pair.second[0], &savedPages.vram.find(pair.first)->second[0], PAGE_SIZE) == 0);
-			}
-			//verify(memPages.aram.size() == savedPages.aram.size());
-			if (memPages.aram.size() != savedPages.aram.size())
-			{
-				ERROR_LOG(NETWORK, "old aram size %d new %d", (u32)savedPages.aram.size(), (u32)memPages.aram.size());
-				die("fatal");
-			}
-			for (const auto& pair : memPages.aram)
-			{
-				verify(savedPages.aram.count(pair.first) == 1);
-				verify(memcmp(&pair.second[0], &savedPages.aram.find(pair.first)->second[0], PAGE_SIZE) == 0);
-			}
-		}
+	*checksum = XXH3_64bits(*buffer, *len);
 #endif
-		// Save the delta to frame-1
-		deltaStates[frame - 1].load();
-		DEBUG_LOG(NETWORK, "Saved frame %d pages: %d ram, %d vram, %d eram, %d aica ram", frame - 1, (u32)deltaStates[frame - 1].ram.size(),
-				(u32)deltaStates[frame - 1].vram.size(), (u32)deltaStates[frame - 1].elanram.size(), (u32)deltaStates[frame - 1].aram.size());
-	}
+	memwatch::protect();
+	// the pages saved since the previous save belong to the previous frame
+	memwatch::PageRing& pages = memwatch::savedPages;
+	if (frameDeltas.empty())
+		pages.release(pages.head());
+	else
+		DEBUG_LOG(NETWORK, "Saved frame %d: %d pages", frameDeltas.back().frame, (int)(pages.head() - frameDeltas.back().start));
+	frameDeltas.push_back({ frame, pages.head(), false });
+
+	const u64 allocated = statePool.allocatedBytes() + pages.allocatedBytes();
+	if (allocated != lastAllocated)
+		DEBUG_LOG(NETWORK, "Saved frame %d: %d KB allocated", frame, (int)((allocated - lastAllocated) / 1_KB));
+	allocPerFrame[frame % allocPerFrame.size()] = allocated - lastAllocated;
+	lastAllocated = allocated;
 
 	return true;
 }
@@ -448,8 +450,19 @@ static void free_buffer(void *buffer)
 		Deserializer deser(buffer, 1_MB, true);
 		int frame;
 		deser >> frame;
-		deltaStates.erase(frame);
-		free(buffer);
+		for (FrameDelta& delta : frameDeltas)
+			if (delta.frame == frame)
+				delta.freed = true;
+		// the pages of the oldest frames aren't needed anymore
+		size_t count = 0;
+		while (count + 1 < frameDeltas.size() && frameDeltas[count].freed)
+			count++;
+		if (count > 0)
+		{
+			memwatch::savedPages.release(frameDeltas[count].start);
+			frameDeltas.erase(frameDeltas.begin(), frameDeltas.begin() + count);
+		}
+		statePool.release((u8 *)buffer);
 	}
 }
 
@@ -618,6 +631,10 @@ void stopSession()
 	emu.setNetworkState(false);
 	memwatch::unprotect();
 	memwatch::reset();
+	memwatch::savedPages.term();
+	frameDeltas.clear();
+	statePool.clear();
+	allocPerFrame.fill(0);
 }
 
 void getInput(MapleInputState inputState[4])
@@ -891,6 +908,18 @@ void displayStats()
 	ImGui::SameLine(ImGui::GetContentRegionAvail().x - ImGui::CalcTextSize(ping.c_str()).x);
 	ImGui::Text("%s", ping.c_str());
 
+	// Memory used by the saved states
+	ImGui::Text("State");
+	std::string stateMem = std::to_string((statePool.memorySize() + memwatch::savedPages.memorySize()) / 1_MB) + " MB";
+	ImGui::SameLine(ImGui::GetContentRegionAvail().x - ImGui::CalcTextSize(stateMem.c_str()).x);
+	ImGui::Text("%s", stateMem.c_str());
+	// Allocated per frame
+	ImGui::Text("Alloc");
+	u64 allocated = std::accumulate(allocPerFrame.begin(), allocPerFrame.end(), 0ull);
+	std::string allocMem = std::to_string(allocated / allocPerFrame.size() / 1_KB) + " KB";
+	ImGui::SameLine(ImGui::GetContentRegionAvail().x - ImGui::CalcTextSize(allocMem.c_str()).x);
+	ImGui::Text("%s", allocMem.c_str());
+
 	// Predicted Frames
 	if (stats.sync.predicted_frames >= 7)
 		// red
@@ -191,7 +191,7 @@ void dc_savestate(int index, const u8 *pngData, u32 pngSize)
 	std::fwrite(data, 1, ser.size(), f);
 	std::fclose(f);
 #else
-	if (!zipFile.Open(f, true))
+	if (!zipFile.Open(f, true, config::SavestateZstd ? RZipFile::Codec::Zstd : RZipFile::Codec::Zlib))
 		goto fail;
 	if (zipFile.Write(data, ser.size()) != ser.size())
 		goto fail;
@@ -254,6 +254,13 @@ void dc_loadstate(int index)
 	if (zipFile.Open(f, false)) {
 		total_size = (u32)zipFile.Size();
 	}
+	else if (zipFile.Unsupported())
+	{
+		WARN_LOG(SAVESTATE, "Failed to load state - unsupported compression");
+		os_notify("Failed to load state", 5000, "Unsupported compression");
+		std::fclose(f);
+		return;
+	}
 	else
 	{
 		long pos = std::ftell(f);
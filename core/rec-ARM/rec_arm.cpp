@@ -1181,18 +1181,31 @@ void Arm32Assembler::genMmuLookup(RuntimeBlockInfo* block, const shil_opcode& op
 		Label inCache;
 		Label done;
 
-		Lsr(r1, raddr, 12);
-		Ldr(r1, MemOperand(r9, r1, LSL, 2));
-		Cmp(r1, 0);
-		B(ne, &inCache);
 		if (!raddr.Is(r0))
 			Mov(r0, raddr);
+		// kernel addresses aren't translated
+		Tst(r0, 0x80000000);
+		B(ne, &done);
+		// r1 = &mmuTlb.entries[MmuTlb::index(addr)]
+		Lsr(r1, r0, 12);
+		Eor(r1, r1, Operand(r1, LSR, 12));
+		Ubfx(r1, r1, 0, 12);
+		static_assert(MmuTlb::Size == 1 << 12 && sizeof(MmuTlb::Entry) == 16);
+		Add(r1, r9, Operand(r1, LSL, 4));
+		// r2 = MmuTlb::tag(addr)
+		Ldr(r2, MemOperand(r9, offsetof(MmuTlb, asid)));
+		Bic(r3, r0, 0xFFF);
+		Orr(r2, r2, r3);
+		Ldr(r3, MemOperand(r1, offsetof(MmuTlb, entries) + offsetof(MmuTlb::Entry, tag) + write * 4));
+		Cmp(r2, r3);
+		B(eq, &inCache);
 		Mov(r1, write);
 		Mov(r2, block->vaddr + op.guest_offs - (op.delay_slot ? 2 : 0));	// pc
 		call((void *)mmuDynarecLookup);
 		B(&done);
 		Bind(&inCache);
-		And(r0, raddr, 0xFFF);
+		Ldr(r1, MemOperand(r1, offsetof(MmuTlb, entries) + offsetof(MmuTlb::Entry, paddr)));
+		And(r0, r0, 0xFFF);
 		Orr(r0, r0, r1);
 		Bind(&done);
 		raddr = r0;
@@ -2405,7 +2418,7 @@ void Arm32Assembler::genMainLoop()
 		Bind(&longjumpLabel);
 
 		Ldr(r8, MemOperand(sp));					// r8: context
-		Mov(r9, (uintptr_t)mmuAddressLUT);			// r9: mmu LUT
+		Mov(r9, (uintptr_t)&mmuTlb);				// r9: mmu TLB
 	}
 	Ldr(r4, MemOperand(r8, ctxOffset(pc)));			// r4: pc
 	B(&no_updateLabel);								// Go to mainloop !
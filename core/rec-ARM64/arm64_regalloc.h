@@ -18,6 +18,7 @@
  */
 #pragma once
 #include "hw/sh4/dyna/ssa_regalloc.h"
+#include "hw/sh4/dyna/globalregs.h"
 #include <aarch64/macro-assembler-aarch64.h>
 using namespace vixl::aarch64;
 
@@ -33,6 +34,9 @@ enum eFReg {
 };
 
 static eReg alloc_regs[] = { W19, W20, W21, W22, W23, W24, W25, W26, (eReg)-1 };
+// W24-W26 hold the global registers when enabled
+static eReg alloc_regs_global[] = { W19, W20, W21, W22, W23, (eReg)-1 };
+static const eReg global_host_regs[globalregs::MaxRegs] = { W24, W25, W26 };
 static eFReg alloc_fregs[] = { S8, S9, S10, S11, S12, S13, S14, S15, (eFReg)-1 };
 
 class Arm64Assembler;
@@ -43,7 +47,16 @@ struct Arm64RegAlloc : RegAlloc<eReg, eFReg, ALLOC_F64>
 
 	void DoAlloc(RuntimeBlockInfo* block)
 	{
-		RegAlloc::DoAlloc(block, alloc_regs, alloc_fregs);
+		if (globalregs::enabled())
+		{
+			RegAlloc::DoAlloc(block, alloc_regs_global, alloc_fregs);
+			for (u32 i = 0; i < globalregs::count(); i++)
+				SetGlobalReg(globalregs::reg(i), global_host_regs[i]);
+		}
+		else
+		{
+			RegAlloc::DoAlloc(block, alloc_regs, alloc_fregs);
+		}
 	}
 
 	void Preload(u32 reg, eReg nreg) override;
@@ -38,7 +38,10 @@ using namespace vixl::aarch64;
 #include "arm64_unwind.h"
 #include "hw/sh4/sh4_core.h"
 #include "hw/sh4/dyna/ngen.h"
+#include "hw/sh4/dyna/memprofile.h"
+#include "hw/sh4/dyna/fpscrspec.h"
 #include "hw/sh4/sh4_mem.h"
+#include "hw/sh4/sh4_cache.h"
 #include "hw/sh4/sh4_rom.h"
 #include "arm64_regalloc.h"
 #include "hw/mem/addrspace.h"
@@ -67,6 +70,8 @@ struct DynaCode;
 static DynaCode *arm64_intc_sched;
 static DynaCode *arm64_no_update;
 static DynaCode *blockCheckFail;
+static DynaCode *hotBlock;
+static DynaCode *fpscrMismatch;
 static DynaCode *checkBlockAddr;
 static DynaCode *checkBlockFpu;
 static DynaCode *linkBlockGenericStub;
@@ -260,6 +265,31 @@ public:
 		jitWriteProtect(codeBuffer, false);
 		this->block = block;
 		CheckBlock(force_checks, block);
+		if (fpscrspec::guardEntry(block))
+		{
+			// Recompile the block if the fpu mode has changed
+			Ldr(w10, sh4_context_mem_operand(&sh4ctx.fpscr));
+			And(w10, w10, fpscrspec::ModeMask);
+			Cmp(w10, block->fpu_cfg.full & fpscrspec::ModeMask);
+			Label mode_ok;
+			B(&mode_ok, eq);
+			Mov(w0, block->addr);
+			GenBranch(fpscrMismatch);
+			Bind(&mode_ok);
+		}
+		if (block->baseline)
+		{
+			// Recompile the block once it has been executed enough times
+			Label not_hot;
+			Ldr(x9, reinterpret_cast<uintptr_t>(&block->hot_counter));
+			Ldr(w10, MemOperand(x9));
+			Subs(w10, w10, 1);
+			Str(w10, MemOperand(x9));
+			B(&not_hot, ne);
+			Mov(w0, block->addr);
+			GenBranch(hotBlock);
+			Bind(&not_hot);
+		}
 		
 		// run register allocator
 		regalloc.DoAlloc(block);
@@ -277,9 +307,12 @@ public:
 		Sub(w1, w1, block->guest_cycles);
 		Str(w1, sh4_context_mem_operand(&sh4ctx.cycle_counter));
 
+		xmtrxLoaded = false;
 		for (size_t i = 0; i < block->oplist.size(); i++)
 		{
 			shil_opcode& op  = block->oplist[i];
+			if (!op.preservesXmtrx())
+				xmtrxLoaded = false;
 			regalloc.OpBegin(&op, i);
 
 			switch (op.op)
@@ -396,6 +429,30 @@ public:
 				GenCallRuntime(Sh4Context::UpdateFPSCR);
 				break;
 
+			case shop_guard_fpscr:
+				{
+					Label mode_ok;
+					Ldr(w10, sh4_context_mem_operand(&sh4ctx.fpscr));
+					And(w10, w10, op.rs3._imm);
+					Cmp(w10, op.rs2._imm);
+					B(&mode_ok, eq);
+					// All regs have been written back
+					Mov(w0, block->addr);
+					Mov(w1, op.rs1._imm);
+					GenCallRuntime(rdv_FpscrGuardFail);
+					if (op.size != 0)
+					{
+						Ldr(w10, sh4_context_mem_operand(&sh4ctx.cycle_counter));
+						Add(w10, w10, op.size);
+						Str(w10, sh4_context_mem_operand(&sh4ctx.cycle_counter));
+					}
+					Mov(w29, op.rs1._imm);
+					Str(w29, sh4_context_mem_operand(&sh4ctx.pc));
+					GenBranch(arm64_no_update);
+					Bind(&mode_ok);
+				}
+				break;
+
 			case shop_swaplb:
 				{
 					const Register rs1 = regalloc.MapRegister(op.rs1);
@@ -909,38 +966,72 @@ public:
 				}
 				break;
 
-			/* fall back to the canonical implementations for better precision
+#ifndef STRICT_MODE
+			// Same operations as fpu_fipr() and fpu_ftrv() so that the results match the interpreter
 			case shop_fipr:
 				Add(x9, x28, op.rs1.reg_offset());
 				Ld1(v0.V4S(), MemOperand(x9));
-				if (op.rs1._reg != op.rs2._reg)
+				Add(x9, x28, op.rs2.reg_offset());
+				Ld1(v1.V4S(), MemOperand(x9));
+				Fcvtl(v2.V2D(), v0.V2S());
+				Fcvtl2(v3.V2D(), v0.V4S());
+				Fcvtl(v4.V2D(), v1.V2S());
+				Fcvtl2(v5.V2D(), v1.V4S());
+				Fmul(v2.V2D(), v2.V2D(), v4.V2D());
+				Fmul(v3.V2D(), v3.V2D(), v5.V2D());
+				Faddp(d0, v2.V2D());
+				Fadd(d0, d0, d3);
+				Mov(d1, v3.V2D(), 1);
+				Fadd(d0, d0, d1);
+				if (regalloc.IsAllocf(op.rd))
 				{
-					Add(x9, x28, op.rs2.reg_offset());
-					Ld1(v1.V4S(), MemOperand(x9));
-					Fmul(v0.V4S(), v0.V4S(), v1.V4S());
+					Fcvt(regalloc.MapVRegister(op.rd), d0);
 				}
 				else
-					Fmul(v0.V4S(), v0.V4S(), v0.V4S());
-				Faddp(v1.V4S(), v0.V4S(), v0.V4S());
-				Faddp(regalloc.MapVRegister(op.rd), v1.V2S());
+				{
+					Fcvt(s0, d0);
+					Str(s0, sh4_context_mem_operand(op.rd._reg));
+				}
 				break;
 
 			case shop_ftrv:
+				if (!xmtrxLoaded)
+				{
+					// Keep the matrix columns as double pairs in v16-v23 until the xf bank changes
+					// or a function is called
+					Add(x9, x28, op.rs2.reg_offset());
+					Ld1(v4.V4S(), v5.V4S(), v6.V4S(), v7.V4S(), MemOperand(x9));
+					for (int i = 0; i < 4; i++)
+					{
+						Fcvtl(VRegister(16 + i * 2).V2D(), VRegister(4 + i).V2S());
+						Fcvtl2(VRegister(17 + i * 2).V2D(), VRegister(4 + i).V4S());
+					}
+					xmtrxLoaded = true;
+				}
 				Add(x9, x28, op.rs1.reg_offset());
 				Ld1(v0.V4S(), MemOperand(x9));
-				Add(x9, x28, op.rs2.reg_offset());
-				Ld1(v1.V4S(), MemOperand(x9, 16, PostIndex));
-				Ld1(v2.V4S(), MemOperand(x9, 16, PostIndex));
-				Ld1(v3.V4S(), MemOperand(x9, 16, PostIndex));
-				Ld1(v4.V4S(), MemOperand(x9, 16, PostIndex));
-				Fmul(v5.V4S(), v1.V4S(), s0, 0);
-				Fmla(v5.V4S(), v2.V4S(), s0, 1);
-				Fmla(v5.V4S(), v3.V4S(), s0, 2);
-				Fmla(v5.V4S(), v4.V4S(), s0, 3);
+				Fcvtl(v1.V2D(), v0.V2S());
+				Fcvtl2(v2.V2D(), v0.V4S());
+				Fmul(v3.V2D(), v16.V2D(), d1, 0);
+				Fmul(v4.V2D(), v17.V2D(), d1, 0);
+				Fmul(v5.V2D(), v18.V2D(), d1, 1);
+				Fadd(v3.V2D(), v3.V2D(), v5.V2D());
+				Fmul(v5.V2D(), v19.V2D(), d1, 1);
+				Fadd(v4.V2D(), v4.V2D(), v5.V2D());
+				Fmul(v5.V2D(), v20.V2D(), d2, 0);
+				Fadd(v3.V2D(), v3.V2D(), v5.V2D());
+				Fmul(v5.V2D(), v21.V2D(), d2, 0);
+				Fadd(v4.V2D(), v4.V2D(), v5.V2D());
+				Fmul(v5.V2D(), v22.V2D(), d2, 1);
+				Fadd(v3.V2D(), v3.V2D(), v5.V2D());
+				Fmul(v5.V2D(), v23.V2D(), d2, 1);
+				Fadd(v4.V2D(), v4.V2D(), v5.V2D());
+				Fcvtn(v0.V2S(), v3.V2D());
+				Fcvtn2(v0.V4S(), v4.V2D());
 				Add(x9, x28, op.rd.reg_offset());
-				St1(v5.V4S(), MemOperand(x9));
+				St1(v0.V4S(), MemOperand(x9));
 				break;
-			*/
+#endif
 
 			case shop_frswap:
 				Add(x9, x28, op.rs1.reg_offset());
@@ -977,6 +1068,8 @@ public:
 			}
 			regalloc.OpEnd(&op);
 		}
+		if (globalregs::enabled())
+			globalregs::addFillsSaved(regalloc.fills_saved);
 		regalloc.Cleanup();
 
 		block->relink_offset = (u32)GetBuffer()->GetCursorOffset();
@@ -1372,6 +1465,19 @@ public:
 #endif
 	}
 
+	// Loads the global registers before entering a block.
+	// Always the same size since the mainloop may be regenerated while a stub is running.
+	void GenLoadGlobalRegs()
+	{
+		for (u32 i = 0; i < globalregs::MaxRegs; i++)
+		{
+			if (i < globalregs::count())
+				Ldr(Register(global_host_regs[i], kWRegSize), sh4_context_mem_operand(globalregs::reg(i)));
+			else
+				Nop();
+		}
+	}
+
 	void GenMainloop()
 	{
 		Label no_update;
@@ -1394,7 +1500,10 @@ public:
 		{
 			Mov(w0, w29);
 			GenCallRuntime(rdv_FailedToFindBlock);
+			// The block may have been interpreted
+			Ldr(w29, sh4_context_mem_operand(&sh4ctx.pc));
 		}
+		GenLoadGlobalRegs();
 		Br(x0);
 
 		//
@@ -1453,7 +1562,7 @@ public:
 
 			Bind(&reenterLabel);
 			Ldr(x28, MemOperand(sp));	// Set context
-			Mov(x27, reinterpret_cast<uintptr_t>(mmuAddressLUT));
+			Mov(x27, reinterpret_cast<uintptr_t>(&mmuTlb));
 		}
 		else
 		{
@@ -1488,6 +1597,7 @@ public:
 			Mov(w0, w29);
 			GenCallRuntime(bm_GetCodeByVAddr);
 		}
+		GenLoadGlobalRegs();
 		Br(x0);
 
 		Bind(&end_mainloop);
@@ -1578,6 +1688,23 @@ public:
 			GenCallRuntime(bm_GetCodeByVAddr);
 			Bind(&jumpblockLabel);
 		}
+		GenLoadGlobalRegs();
+		Br(x0);
+
+		// Hot baseline block
+		// w0: addr
+		Label hotBlockLabel;
+		Bind(&hotBlockLabel);
+		GenCallRuntime(rdv_HotBlock);
+		GenLoadGlobalRegs();
+		Br(x0);
+
+		// Fpu mode mismatch on block entry
+		// w0: addr
+		Label fpscrMismatchLabel;
+		Bind(&fpscrMismatchLabel);
+		GenCallRuntime(rdv_FpscrMismatch);
+		GenLoadGlobalRegs();
 		Br(x0);
 
 		// Block linking stubs
@@ -1596,6 +1723,9 @@ public:
 		Bind(&linkBlockShared);
 		Sub(x0, lr, 4);	// go before the call
 		GenCallRuntime(rdv_LinkBlock);	// returns an RX addr
+		// Next pc if the block lookup handler is returned
+		Ldr(w29, sh4_context_mem_operand(&sh4ctx.pc));
+		GenLoadGlobalRegs();
 		Br(x0);
 
 		// Store Queue write handlers
@@ -1626,6 +1756,8 @@ public:
 		arm64_no_update = GetLabelAddress<DynaCode *>(&no_update);
 		handleException = (void (*)())CC_RW2RX(GetLabelAddress<uintptr_t>(&handleExceptionLabel));
 		blockCheckFail = GetLabelAddress<DynaCode *>(&blockCheckFailLabel);
+		hotBlock = GetLabelAddress<DynaCode *>(&hotBlockLabel);
+		fpscrMismatch = GetLabelAddress<DynaCode *>(&fpscrMismatchLabel);
 		writeStoreQueue32 = GetLabelAddress<DynaCode *>(&writeStoreQueue32Label);
 		writeStoreQueue64 = GetLabelAddress<DynaCode *>(&writeStoreQueue64Label);
 
@@ -1732,14 +1864,27 @@ private:
 			Label inCache;
 			Label done;
 
+			// kernel addresses aren't translated
+			Tbnz(w0, 31, &done);
+			// x1 = &mmuTlb.entries[MmuTlb::index(addr)]
 			Lsr(w1, w0, 12);
-			Ldr(w1, MemOperand(x27, x1, LSL, 2));
-			Cbnz(w1, &inCache);
+			Eor(w1, w1, Operand(w1, LSR, 12));
+			And(w1, w1, MmuTlb::Size - 1);
+			static_assert(sizeof(MmuTlb::Entry) == 16);
+			Add(x1, x27, Operand(x1, LSL, 4));
+			// w2 = MmuTlb::tag(addr)
+			Ldr(w2, MemOperand(x27, offsetof(MmuTlb, asid)));
+			And(w3, w0, ~0xFFF);
+			Orr(w2, w2, w3);
+			Ldr(w3, MemOperand(x1, offsetof(MmuTlb, entries) + offsetof(MmuTlb::Entry, tag) + write * 4));
+			Cmp(w2, w3);
+			B(&inCache, eq);
 			Mov(w1, write);
 			Mov(w2, block->vaddr + op.guest_offs - (op.delay_slot ? 2 : 0));	// pc
 			GenCallRuntime(mmuDynarecLookup);
 			B(&done);
 			Bind(&inCache);
+			Ldr(w1, MemOperand(x1, offsetof(MmuTlb, entries) + offsetof(MmuTlb::Entry, paddr)));
 			And(w0, w0, 0xFFF);
 			Orr(w0, w0, w1);
 			Bind(&done);
@@ -1754,8 +1899,22 @@ private:
 		GenMemAddr(op, &w0);
 		genMmuLookup(op, 0);
 
-		if (!optimise || !GenReadMemoryFast(op, opid))
-			GenReadMemorySlow(op.size);
+		if (ocache.isEmulated())
+		{
+			GenReadOCache(op);
+		}
+		else if (memprofile::enabled() && block->baseline)
+		{
+			GenReadMemoryProfile(op);
+		}
+		else
+		{
+			Label done;
+			GenReadMemorySpecialized(op, done);
+			if (!optimise || !GenReadMemoryFast(op, opid))
+				GenReadMemorySlow(op.size);
+			Bind(&done);
+		}
 
 		if (op.size < 8)
 			host_reg_to_shil_param(op.rd, w0);
@@ -1940,10 +2099,250 @@ private:
 			shil_param_to_host_reg(op.rs2, w1);
 		else
 			shil_param_to_host_reg(op.rs2, x1);
-		if (optimise && GenWriteMemoryFast(op, opid))
+		if (ocache.isEmulated())
+		{
+			GenWriteOCache(op);
+			return;
+		}
+		if (memprofile::enabled() && block->baseline)
+		{
+			GenWriteMemoryProfile(op);
+			return;
+		}
+		Label done;
+		GenWriteMemorySpecialized(op, done);
+		if (!optimise || !GenWriteMemoryFast(op, opid))
+			GenWriteMemorySlow(op.size);
+		Bind(&done);
+	}
+
+	// Reads from the operand cache line last accessed through the same address range,
+	// or calls the operand cache handler.
+	void GenReadOCache(const shil_opcode& op)
+	{
+		Label miss;
+		Label done;
+
+		// w9 = Sh4OCache::keyIndex(addr)
+		Ubfx(w9, w0, 5, 9);
+		static_assert(Sh4OCache::Lines == 1 << 9);
+		Mov(x10, reinterpret_cast<uintptr_t>(&ocache.readKeys[0]));
+		Ldr(w10, MemOperand(x10, x9, LSL, 2));
+		// w11 = Sh4OCache::key(addr)
+		And(w11, w0, Sh4OCache::KeyMask | (op.size - 1));
+		Cmp(w10, w11);
+		B(&miss, ne);
+		// line index and offset
+		Ubfx(w9, w0, 0, 14);
+		static_assert(Sh4OCache::Lines * Sh4OCache::LineSize == 1 << 14);
+		Mov(x10, reinterpret_cast<uintptr_t>(&ocache.lineData[0][0]));
+		switch (op.size)
+		{
+		case 1:
+			Ldrsb(w0, MemOperand(x10, x9));
+			break;
+		case 2:
+			Ldrsh(w0, MemOperand(x10, x9));
+			break;
+		case 4:
+			Ldr(w0, MemOperand(x10, x9));
+			break;
+		case 8:
+			Ldr(x0, MemOperand(x10, x9));
+			break;
+		default:
+			die("1..8 bytes");
+			break;
+		}
+		B(&done);
+
+		Bind(&miss);
+		switch (op.size)
+		{
+		case 1:
+			GenCallRuntime(ReadCachedMemNoMmu<u8>);
+			Sxtb(w0, w0);
+			break;
+		case 2:
+			GenCallRuntime(ReadCachedMemNoMmu<u16>);
+			Sxth(w0, w0);
+			break;
+		case 4:
+			GenCallRuntime(ReadCachedMemNoMmu<u32>);
+			break;
+		case 8:
+			GenCallRuntime(ReadCachedMemNoMmu<u64>);
+			break;
+		}
+		Bind(&done);
+	}
+
+	// Writes to the operand cache line last written through the same address range in copy-back mode,
+	// or calls the operand cache handler.
+	void GenWriteOCache(const shil_opcode& op)
+	{
+		Label miss;
+		Label done;
+
+		Ubfx(w9, w0, 5, 9);
+		Mov(x10, reinterpret_cast<uintptr_t>(&ocache.writeKeys[0]));
+		Ldr(w10, MemOperand(x10, x9, LSL, 2));
+		And(w11, w0, Sh4OCache::KeyMask | (op.size - 1));
+		Cmp(w10, w11);
+		B(&miss, ne);
+		Mov(x10, reinterpret_cast<uintptr_t>(&ocache.dirty[0]));
+		static_assert(sizeof(bool) == 1);
+		Mov(w11, 1);
+		Strb(w11, MemOperand(x10, x9));
+		Ubfx(w9, w0, 0, 14);
+		Mov(x10, reinterpret_cast<uintptr_t>(&ocache.lineData[0][0]));
+		switch (op.size)
+		{
+		case 1:
+			Strb(w1, MemOperand(x10, x9));
+			break;
+		case 2:
+			Strh(w1, MemOperand(x10, x9));
+			break;
+		case 4:
+			Str(w1, MemOperand(x10, x9));
+			break;
+		case 8:
+			Str(x1, MemOperand(x10, x9));
+			break;
+		default:
+			die("1..8 bytes");
+			break;
+		}
+		B(&done);
+
+		Bind(&miss);
+		switch (op.size)
+		{
+		case 1:
+			Uxtb(w1, w1);
+			GenCallRuntime(WriteCachedMemNoMmu<u8>);
+			break;
+		case 2:
+			Uxth(w1, w1);
+			GenCallRuntime(WriteCachedMemNoMmu<u16>);
+			break;
+		case 4:
+			GenCallRuntime(WriteCachedMemNoMmu<u32>);
+			break;
+		case 8:
+			GenCallRuntime(WriteCachedMemNoMmu<u64>);
+			break;
+		}
+		Bind(&done);
+	}
+
+	// Records the page accessed by the op in its profile slot
+	void GenReadMemoryProfile(const shil_opcode& op)
+	{
+		Mov(x1, reinterpret_cast<uintptr_t>(memprofile::getSlot(block, op)));
+		switch (op.size)
+		{
+		case 1:
+			GenCallRuntime(memprofile::read8);
+			break;
+		case 2:
+			GenCallRuntime(memprofile::read16);
+			break;
+		case 4:
+			GenCallRuntime(memprofile::read32);
+			break;
+		case 8:
+			GenCallRuntime(memprofile::read64);
+			break;
+		default:
+			die("1..8 bytes");
+			break;
+		}
+	}
+
+	void GenWriteMemoryProfile(const shil_opcode& op)
+	{
+		Mov(x2, reinterpret_cast<uintptr_t>(memprofile::getSlot(block, op)));
+		switch (op.size)
+		{
+		case 1:
+			GenCallRuntime(memprofile::write8);
+			break;
+		case 2:
+			GenCallRuntime(memprofile::write16);
+			break;
+		case 4:
+			GenCallRuntime(memprofile::write32);
+			break;
+		case 8:
+			GenCallRuntime(memprofile::write64);
+			break;
+		default:
+			die("1..8 bytes");
+			break;
+		}
+	}
+
+	// Calls the handler of the profiled page directly if the address is in this page
+	void GenReadMemorySpecialized(const shil_opcode& op, Label& done)
+	{
+		if (!memprofile::enabled())
+			return;
+		u32 page;
+		void *handler = memprofile::getHandler(block, op, false, page);
+		if (handler == nullptr)
 			return;
+		Label generic;
+		Lsr(w9, w0, 24);
+		Cmp(w9, page);
+		B(&generic, ne);
+		switch (op.size)
+		{
+		case 1:
+			GenCallRuntime((u8 (*)(u32))handler);
+			Sxtb(w0, w0);
+			break;
+		case 2:
+			GenCallRuntime((u16 (*)(u32))handler);
+			Sxth(w0, w0);
+			break;
+		case 4:
+			GenCallRuntime((u32 (*)(u32))handler);
+			break;
+		}
+		B(&done);
+		Bind(&generic);
+	}
 
-		GenWriteMemorySlow(op.size);
+	void GenWriteMemorySpecialized(const shil_opcode& op, Label& done)
+	{
+		if (!memprofile::enabled())
+			return;
+		u32 page;
+		void *handler = memprofile::getHandler(block, op, true, page);
+		if (handler == nullptr)
+			return;
+		Label generic;
+		Lsr(w9, w0, 24);
+		Cmp(w9, page);
+		B(&generic, ne);
+		switch (op.size)
+		{
+		case 1:
+			Uxtb(w1, w1);
+			GenCallRuntime((void (*)(u32, u8))handler);
+			break;
+		case 2:
+			Uxth(w1, w1);
+			GenCallRuntime((void (*)(u32, u16))handler);
+			break;
+		case 4:
+			GenCallRuntime((void (*)(u32, u32))handler);
+			break;
+		}
+		B(&done);
+		Bind(&generic);
 	}
 
 	bool GenWriteMemoryImmediate(const shil_opcode& op)
@@ -2229,6 +2628,8 @@ private:
 	std::vector<const VRegister*> call_fregs;
 	Arm64RegAlloc regalloc;
 	RuntimeBlockInfo* block = NULL;
+	// The xf matrix is in v16-v23
+	bool xmtrxLoaded = false;
 	const int read_memory_rewrite_size = 5;	// ubfx, add, ldr for fast access. calling a handler can use more than 3 depending on offset
 	const int write_memory_rewrite_size = 5; // ubfx, add, str
 	Sh4Context& sh4ctx;
@@ -2249,6 +2650,22 @@ public:
 		this->codeBuffer = &codeBuffer;
 	}
 
+	bool supportsTieredCompilation() override {
+		return true;
+	}
+
+	bool supportsFpscrSpeculation() override {
+		return true;
+	}
+
+	bool supportsBackgroundCompilation() override {
+		return true;
+	}
+
+	bool supportsOCacheEmulation() override {
+		return true;
+	}
+
 	void reset() override
 	{
 		unwinder.clear();
@@ -11,11 +11,14 @@ using namespace Xbyak::util;
 #include "types.h"
 #include "hw/sh4/sh4_opcode_list.h"
 #include "hw/sh4/dyna/ngen.h"
+#include "hw/sh4/dyna/memprofile.h"
+#include "hw/sh4/dyna/fpscrspec.h"
 #include "hw/sh4/modules/mmu.h"
 #include "hw/sh4/sh4_interrupts.h"
 
 #include "hw/sh4/sh4_core.h"
 #include "hw/sh4/sh4_mem.h"
+#include "hw/sh4/sh4_cache.h"
 #include "x64_regalloc.h"
 #include "xbyak_base.h"
 #include "oslib/unwind_info.h"
@@ -64,6 +67,14 @@ static void ngen_blockcheckfail(u32 pc) {
 	rdv_BlockCheckFail(pc);
 }
 
+static void ngen_hotblock(u32 addr) {
+	rdv_HotBlock(addr);
+}
+
+static void ngen_fpscrmismatch(u32 addr) {
+	rdv_FpscrMismatch(addr);
+}
+
 static void handle_sh4_exception(Sh4Context *ctx, SH4ThrownException& ex, u32 pc)
 {
 	if (pc & 1)
@@ -108,6 +119,10 @@ const std::array<Xbyak::Reg64, 4> call_regs64
 	{ rdi, rsi, rdx, rcx };
 #endif
 const std::array<Xbyak::Xmm, 4> call_regsxmm { xmm0, xmm1, xmm2, xmm3 };
+#ifndef _WIN32
+// xf matrix columns. Not used by the register allocator.
+const std::array<Xbyak::Xmm, 8> xmtrxRegs { xmm4, xmm5, xmm6, xmm7, xmm12, xmm13, xmm14, xmm15 };
+#endif
 
 #ifdef _WIN32
 constexpr u32 STACK_ALIGN = 0x28;	// 32-byte shadow space + 8 byte alignment
@@ -130,6 +145,22 @@ public:
 		current_opid = -1;
 
 		CheckBlock(force_checks, block);
+		if (fpscrspec::guardEntry(block))
+		{
+			mov(rax, (uintptr_t)&sh4ctx.fpscr);
+			mov(edx, dword[rax]);
+			and_(edx, fpscrspec::ModeMask);
+			mov(call_regs[0], block->addr);
+			cmp(edx, block->fpu_cfg.full & fpscrspec::ModeMask);
+			jne(reinterpret_cast<const void*>(&ngen_fpscrmismatch), T_NEAR);
+		}
+		if (block->baseline)
+		{
+			mov(rax, (uintptr_t)&block->hot_counter);
+			mov(call_regs[0], block->addr);
+			sub(dword[rax], 1);
+			jz(reinterpret_cast<const void*>(&ngen_hotblock));
+		}
 
 		sub(rsp, STACK_ALIGN);
 
@@ -150,9 +181,12 @@ public:
 
 		regalloc.DoAlloc(block);
 
+		xmtrxLoaded = false;
 		for (current_opid = 0; current_opid < block->oplist.size(); current_opid++)
 		{
 			shil_opcode& op  = block->oplist[current_opid];
+			if (!op.preservesXmtrx())
+				xmtrxLoaded = false;
 
 			regalloc.OpBegin(&op, current_opid);
 
@@ -233,7 +267,21 @@ public:
 					genMmuLookup(block, op, 0);
 
 					int size = op.size == 1 ? MemSize::S8 : op.size == 2 ? MemSize::S16 : op.size == 4 ? MemSize::S32 : MemSize::S64;
-					GenCall((void (*)())MemHandlers[optimise ? MemType::Fast : MemType::Slow][size][MemOp::R], mmu_enabled());
+					if (ocache.isEmulated())
+					{
+						genReadOCache(op);
+					}
+					else if (memprofile::enabled() && block->baseline)
+					{
+						genReadMemoryProfile(block, op);
+					}
+					else
+					{
+						Xbyak::Label done;
+						genReadMemorySpecialized(block, op, done);
+						GenCall((void (*)())MemHandlers[optimise ? MemType::Fast : MemType::Slow][size][MemOp::R], mmu_enabled());
+						L(done);
+					}
 
 #if ALLOC_F64 == false
 					if (size == MemSize::S64)
@@ -280,7 +328,21 @@ public:
 						shil_param_to_host_reg(op.rs2, call_regs64[1]);
 
 					int size = op.size == 1 ? MemSize::S8 : op.size == 2 ? MemSize::S16 : op.size == 4 ? MemSize::S32 : MemSize::S64;
-					GenCall((void (*)())MemHandlers[optimise ? MemType::Fast : MemType::Slow][size][MemOp::W], mmu_enabled());
+					if (ocache.isEmulated())
+					{
+						genWriteOCache(op);
+					}
+					else if (memprofile::enabled() && block->baseline)
+					{
+						genWriteMemoryProfile(block, op);
+					}
+					else
+					{
+						Xbyak::Label done;
+						genWriteMemorySpecialized(block, op, done);
+						GenCall((void (*)())MemHandlers[optimise ? MemType::Fast : MemType::Slow][size][MemOp::W], mmu_enabled());
+						L(done);
+					}
 				}
 			}
 			break;
@@ -291,6 +353,30 @@ public:
 				genBaseOpcode(op);
 				break;
 
+			case shop_guard_fpscr:
+				{
+					Xbyak::Label mode_ok;
+					mov(rax, (uintptr_t)&sh4ctx.fpscr);
+					mov(edx, dword[rax]);
+					and_(edx, op.rs3._imm);
+					cmp(edx, op.rs2._imm);
+					je(mode_ok, T_NEAR);
+					// All regs have been written back
+					mov(call_regs[0], block->addr);
+					mov(call_regs[1], op.rs1._imm);
+					GenCall(rdv_FpscrGuardFail, true);
+					if (op.size != 0)
+					{
+						mov(rax, (uintptr_t)&sh4ctx.cycle_counter);
+						add(dword[rax], op.size);
+					}
+					mov(rax, (uintptr_t)&sh4ctx.pc);
+					mov(dword[rax], op.rs1._imm);
+					jmp(exit_block, T_NEAR);
+					L(mode_ok);
+				}
+				break;
+
 #ifndef CANONICAL_TEST
 			case shop_sync_sr:
 				GenCall(UpdateSR);
@@ -458,6 +544,73 @@ public:
 					}
 				}
 				break;
+
+#ifndef STRICT_MODE
+			// Same operations as fpu_fipr() and fpu_ftrv() so that the results match the interpreter
+			case shop_fipr:
+				mov(rax, (uintptr_t)op.rs1.reg_ptr(sh4ctx));
+				mov(rcx, (uintptr_t)op.rs2.reg_ptr(sh4ctx));
+				cvtps2pd(xmm0, qword[rax]);
+				cvtps2pd(xmm1, qword[rax + 8]);
+				cvtps2pd(xmm2, qword[rcx]);
+				cvtps2pd(xmm3, qword[rcx + 8]);
+				mulpd(xmm0, xmm2);
+				mulpd(xmm1, xmm3);
+				movapd(xmm2, xmm0);
+				unpckhpd(xmm2, xmm2);
+				addsd(xmm0, xmm2);
+				addsd(xmm0, xmm1);
+				unpckhpd(xmm1, xmm1);
+				addsd(xmm0, xmm1);
+				if (regalloc.IsAllocf(op.rd))
+				{
+					cvtsd2ss(regalloc.MapXRegister(op.rd), xmm0);
+				}
+				else
+				{
+					cvtsd2ss(xmm0, xmm0);
+					mov(rax, (uintptr_t)op.rd.reg_ptr(sh4ctx));
+					movss(dword[rax], xmm0);
+				}
+				break;
+
+			case shop_ftrv:
+				mov(rax, (uintptr_t)op.rs1.reg_ptr(sh4ctx));
+				mov(rcx, (uintptr_t)op.rs2.reg_ptr(sh4ctx));
+#ifndef _WIN32
+				if (!xmtrxLoaded)
+				{
+					// Keep the matrix columns as double pairs until the xf bank changes or a function is called
+					for (int i = 0; i < 8; i++)
+						cvtps2pd(xmtrxRegs[i], qword[rcx + i * 8]);
+					xmtrxLoaded = true;
+				}
+#endif
+				for (int i = 0; i < 4; i++)
+				{
+					cvtss2sd(xmm2, dword[rax + i * 4]);
+					unpcklpd(xmm2, xmm2);
+					for (int j = 0; j < 2; j++)
+					{
+						const Xbyak::Xmm& acc = j == 0 ? xmm0 : xmm1;
+						const Xbyak::Xmm& col = i == 0 ? acc : xmm3;
+#ifdef _WIN32
+						cvtps2pd(col, qword[rcx + (i * 2 + j) * 8]);
+#else
+						movapd(col, xmtrxRegs[i * 2 + j]);
+#endif
+						mulpd(col, xmm2);
+						if (i != 0)
+							addpd(acc, col);
+					}
+				}
+				cvtpd2ps(xmm0, xmm0);
+				cvtpd2ps(xmm1, xmm1);
+				movlhps(xmm0, xmm1);
+				mov(rax, (uintptr_t)op.rd.reg_ptr(sh4ctx));
+				movups(xword[rax], xmm0);
+				break;
+#endif
 #endif
 
 			default:
@@ -810,6 +963,236 @@ public:
 	}
 
 private:
+	// Records the page accessed by the op in its profile slot
+	void genReadMemoryProfile(const RuntimeBlockInfo* block, const shil_opcode& op)
+	{
+		mov(call_regs64[1], (uintptr_t)memprofile::getSlot(block, op));
+		switch (op.size)
+		{
+		case 1:
+			GenCall(memprofile::read8);
+			break;
+		case 2:
+			GenCall(memprofile::read16);
+			break;
+		case 4:
+			GenCall(memprofile::read32);
+			break;
+		case 8:
+			GenCall(memprofile::read64);
+			break;
+		default:
+			die("1..8 bytes");
+			break;
+		}
+	}
+
+	void genWriteMemoryProfile(const RuntimeBlockInfo* block, const shil_opcode& op)
+	{
+		mov(call_regs64[2], (uintptr_t)memprofile::getSlot(block, op));
+		switch (op.size)
+		{
+		case 1:
+			GenCall(memprofile::write8);
+			break;
+		case 2:
+			GenCall(memprofile::write16);
+			break;
+		case 4:
+			GenCall(memprofile::write32);
+			break;
+		case 8:
+			GenCall(memprofile::write64);
+			break;
+		default:
+			die("1..8 bytes");
+			break;
+		}
+	}
+
+	// Calls the handler of the profiled page directly if the address is in this page
+	void genReadMemorySpecialized(const RuntimeBlockInfo* block, const shil_opcode& op, Xbyak::Label& done)
+	{
+		if (!memprofile::enabled())
+			return;
+		u32 page;
+		void *handler = memprofile::getHandler(block, op, false, page);
+		if (handler == nullptr)
+			return;
+		Xbyak::Label generic;
+		mov(eax, call_regs[0]);
+		shr(eax, 24);
+		cmp(eax, page);
+		jne(generic, T_NEAR);
+		switch (op.size)
+		{
+		case 1:
+			GenCall((u8 (*)(u32))handler);
+			movsx(eax, al);
+			break;
+		case 2:
+			GenCall((u16 (*)(u32))handler);
+			movsx(eax, ax);
+			break;
+		case 4:
+			GenCall((u32 (*)(u32))handler);
+			break;
+		}
+		jmp(done, T_NEAR);
+		L(generic);
+	}
+
+	void genWriteMemorySpecialized(const RuntimeBlockInfo* block, const shil_opcode& op, Xbyak::Label& done)
+	{
+		if (!memprofile::enabled())
+			return;
+		u32 page;
+		void *handler = memprofile::getHandler(block, op, true, page);
+		if (handler == nullptr)
+			return;
+		Xbyak::Label generic;
+		mov(eax, call_regs[0]);
+		shr(eax, 24);
+		cmp(eax, page);
+		jne(generic, T_NEAR);
+		switch (op.size)
+		{
+		case 1:
+			GenCall((void (*)(u32, u8))handler);
+			break;
+		case 2:
+			GenCall((void (*)(u32, u16))handler);
+			break;
+		case 4:
+			GenCall((void (*)(u32, u32))handler);
+			break;
+		}
+		jmp(done, T_NEAR);
+		L(generic);
+	}
+
+	// Reads from the operand cache line last accessed through the same address range,
+	// or calls the operand cache handler.
+	void genReadOCache(const shil_opcode& op)
+	{
+		Xbyak::Label miss;
+		Xbyak::Label done;
+
+		// eax = Sh4OCache::keyIndex(addr)
+		mov(eax, call_regs[0]);
+		shr(eax, 5);
+		and_(eax, Sh4OCache::Lines - 1);
+		// r9d = Sh4OCache::key(addr)
+		mov(r9d, call_regs[0]);
+		and_(r9d, Sh4OCache::KeyMask | (op.size - 1));
+		mov(r10, (uintptr_t)&ocache.readKeys[0]);
+		cmp(r9d, dword[r10 + rax * 4]);
+		jne(miss);
+		// line index and offset
+		mov(eax, call_regs[0]);
+		and_(eax, Sh4OCache::Lines * Sh4OCache::LineSize - 1);
+		mov(r10, (uintptr_t)&ocache.lineData[0][0]);
+		switch (op.size)
+		{
+		case 1:
+			movsx(eax, byte[r10 + rax]);
+			break;
+		case 2:
+			movsx(eax, word[r10 + rax]);
+			break;
+		case 4:
+			mov(eax, dword[r10 + rax]);
+			break;
+		case 8:
+			mov(rax, qword[r10 + rax]);
+			break;
+		default:
+			die("1..8 bytes");
+			break;
+		}
+		jmp(done, T_NEAR);
+
+		L(miss);
+		switch (op.size)
+		{
+		case 1:
+			GenCall(ReadCachedMemNoMmu<u8>);
+			movsx(eax, al);
+			break;
+		case 2:
+			GenCall(ReadCachedMemNoMmu<u16>);
+			movsx(eax, ax);
+			break;
+		case 4:
+			GenCall(ReadCachedMemNoMmu<u32>);
+			break;
+		case 8:
+			GenCall(ReadCachedMemNoMmu<u64>);
+			break;
+		}
+		L(done);
+	}
+
+	// Writes to the operand cache line last written through the same address range in copy-back mode,
+	// or calls the operand cache handler.
+	void genWriteOCache(const shil_opcode& op)
+	{
+		Xbyak::Label miss;
+		Xbyak::Label done;
+
+		mov(eax, call_regs[0]);
+		shr(eax, 5);
+		and_(eax, Sh4OCache::Lines - 1);
+		mov(r9d, call_regs[0]);
+		and_(r9d, Sh4OCache::KeyMask | (op.size - 1));
+		mov(r10, (uintptr_t)&ocache.writeKeys[0]);
+		cmp(r9d, dword[r10 + rax * 4]);
+		jne(miss);
+		mov(r10, (uintptr_t)&ocache.dirty[0]);
+		static_assert(sizeof(bool) == 1);
+		mov(byte[r10 + rax], 1);
+		mov(eax, call_regs[0]);
+		and_(eax, Sh4OCache::Lines * Sh4OCache::LineSize - 1);
+		mov(r10, (uintptr_t)&ocache.lineData[0][0]);
+		switch (op.size)
+		{
+		case 1:
+			mov(byte[r10 + rax], call_regs[1].cvt8());
+			break;
+		case 2:
+			mov(word[r10 + rax], call_regs[1].cvt16());
+			break;
+		case 4:
+			mov(dword[r10 + rax], call_regs[1]);
+			break;
+		case 8:
+			mov(qword[r10 + rax], call_regs64[1]);
+			break;
+		default:
+			die("1..8 bytes");
+			break;
+		}
+		jmp(done, T_NEAR);
+
+		L(miss);
+		switch (op.size)
+		{
+		case 1:
+			GenCall(WriteCachedMemNoMmu<u8>);
+			break;
+		case 2:
+			GenCall(WriteCachedMemNoMmu<u16>);
+			break;
+		case 4:
+			GenCall(WriteCachedMemNoMmu<u32>);
+			break;
+		case 8:
+			GenCall(WriteCachedMemNoMmu<u64>);
+			break;
+		}
+		L(done);
+	}
+
 	void genMmuLookup(const RuntimeBlockInfo* block, const shil_opcode& op, u32 write)
 	{
 		if (mmu_enabled())
@@ -818,19 +1201,26 @@ private:
 			Xbyak::Label inCache;
 			Xbyak::Label done;
 
+			// kernel addresses aren't translated
+			test(call_regs[0], call_regs[0]);
+			js(done, T_NEAR);
+			// rax = MmuTlb::index(addr) * sizeof(MmuTlb::Entry)
 			mov(eax, call_regs[0]);
 			shr(eax, 12);
-			if ((uintptr_t)mmuAddressLUT >> 32 != 0)
-			{
-				mov(r9, (uintptr_t)mmuAddressLUT);
-				mov(eax, dword[r9 + rax * 4]);
-			}
-			else
-			{
-				mov(eax, dword[(uintptr_t)mmuAddressLUT + rax * 4]);
-			}
-			test(eax, eax);
-			jne(inCache);
+			mov(call_regs[1], eax);
+			shr(call_regs[1], 12);
+			xor_(eax, call_regs[1]);
+			and_(eax, MmuTlb::Size - 1);
+			shl(eax, 4);
+			static_assert(sizeof(MmuTlb::Entry) == 16);
+			// call_regs[1] = MmuTlb::tag(addr)
+			mov(r9, (uintptr_t)&mmuTlb);
+			mov(call_regs[1], call_regs[0]);
+			and_(call_regs[1], ~0xFFF);
+			or_(call_regs[1], dword[r9 + offsetof(MmuTlb, asid)]);
+			add(r9, rax);
+			cmp(call_regs[1], dword[r9 + offsetof(MmuTlb, entries) + offsetof(MmuTlb::Entry, tag) + write * 4]);
+			je(inCache);
 #endif
 			mov(call_regs[1], write);
 			mov(call_regs[2], block->vaddr + op.guest_offs - (op.delay_slot ? 2 : 0));	// pc
@@ -840,7 +1230,7 @@ private:
 			jmp(done);
 			L(inCache);
 			and_(call_regs[0], 0xFFF);
-			or_(call_regs[0], eax);
+			or_(call_regs[0], dword[r9 + offsetof(MmuTlb, entries) + offsetof(MmuTlb::Entry, paddr)]);
 			L(done);
 #endif
 		}
@@ -1291,6 +1681,8 @@ private:
 	Xbyak::util::Cpu cpu;
 	size_t current_opid;
 	Xbyak::Label exit_block;
+	// The xf matrix is in xmtrxRegs
+	bool xmtrxLoaded = false;
 };
 
 void X64RegAlloc::Preload(u32 reg, Xbyak::Operand::Code nreg)
@@ -1340,6 +1732,22 @@ public:
 		this->codeBuffer = &codeBuffer;
 	}
 
+	bool supportsTieredCompilation() override {
+		return true;
+	}
+
+	bool supportsFpscrSpeculation() override {
+		return true;
+	}
+
+	bool supportsBackgroundCompilation() override {
+		return true;
+	}
+
+	bool supportsOCacheEmulation() override {
+		return true;
+	}
+
 	void mainloop(void *) override
 	{
 		verify(::mainloop != nullptr);
@@ -262,11 +262,24 @@ void X86Compiler::genMmuLookup(RuntimeBlockInfo* block, const shil_opcode& op, u
 		Xbyak::Label inCache;
 		Xbyak::Label done;
 
+		// kernel addresses aren't translated
+		test(ecx, ecx);
+		js(done, T_NEAR);
+		// eax = MmuTlb::index(addr) * sizeof(MmuTlb::Entry)
 		mov(eax, ecx);
 		shr(eax, 12);
-		mov(eax, dword[(uintptr_t)mmuAddressLUT + eax * 4]);
-		test(eax, eax);
-		jne(inCache);
+		mov(edx, eax);
+		shr(edx, 12);
+		xor_(eax, edx);
+		and_(eax, MmuTlb::Size - 1);
+		shl(eax, 4);
+		static_assert(sizeof(MmuTlb::Entry) == 16);
+		// edx = MmuTlb::tag(addr)
+		mov(edx, ecx);
+		and_(edx, ~0xFFF);
+		or_(edx, dword[(uintptr_t)&mmuTlb.asid]);
+		cmp(edx, dword[eax + (uintptr_t)&mmuTlb.entries[0].tag[write]]);
+		je(inCache);
 #endif
 		mov(edx, write);
 		push(block->vaddr + op.guest_offs - (op.delay_slot ? 2 : 0));	// pc
@@ -276,7 +289,7 @@ void X86Compiler::genMmuLookup(RuntimeBlockInfo* block, const shil_opcode& op, u
 		jmp(done);
 		L(inCache);
 		and_(ecx, 0xFFF);
-		or_(ecx, eax);
+		or_(ecx, dword[eax + (uintptr_t)&mmuTlb.entries[0].paddr]);
 		L(done);
 #endif
 	}
@@ -0,0 +1,454 @@
+/*
+	Copyright 2025 flyinghead
+
+	This file is part of Flycast.
+
+    Flycast is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    Flycast is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Flycast.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "rewind.h"
+#include "emulator.h"
+#include "serialize.h"
+#include "cfg/option.h"
+#include "hw/mem/mem_watch.h"
+#include "hw/pvr/Renderer_if.h"
+#include "hw/sh4/sh4_if.h"
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace rewinder
+{
+
+struct Snapshot
+{
+	// Position of the packed snapshot in the arena: the difference of the device state with the
+	// next snapshot, followed by the pages written to until the next snapshot.
+	// The newest snapshot isn't packed. Its device state is in lastState.
+	u64 offset;
+	u32 stateSize;
+	u32 pageCount;
+	// the device state is saved as is if its size differs from the next one
+	bool stateDelta;
+};
+
+// Snapshots from the oldest to the newest. The ring only grows.
+class History
+{
+public:
+	bool empty() const { return _head == _tail; }
+	size_t size() const { return _head - _tail; }
+	Snapshot& operator[](size_t i) { return ring[(_tail + i) % ring.size()]; }
+	Snapshot& front() { return (*this)[0]; }
+	Snapshot& back() { return (*this)[size() - 1]; }
+
+	void push_back(const Snapshot& snapshot)
+	{
+		if (size() == ring.size())
+			grow();
+		ring[_head % ring.size()] = snapshot;
+		_head++;
+	}
+	void pop_front() { _tail++; }
+	void pop_back() { _head--; }
+	void clear() { _tail = _head; }
+
+private:
+	void grow()
+	{
+		std::vector<Snapshot> newRing(std::max<size_t>(ring.size() * 2, 64));
+		const size_t count = size();
+		for (size_t i = 0; i < count; i++)
+			newRing[i] = (*this)[i];
+		ring = std::move(newRing);
+		_tail = 0;
+		_head = count;
+	}
+
+	std::vector<Snapshot> ring;
+	u64 _head = 0;
+	u64 _tail = 0;
+};
+
+static History history;
+/*
+	The packed snapshots are stored contiguously, from the oldest to the newest, in a ring
+	of RewindBudget bytes. A snapshot that doesn't fit before the end of the ring starts
+	at the beginning, and the end of the ring is skipped.
+*/
+static std::unique_ptr<u8[]> arena;
+static size_t arenaSize;
+// position following the newest packed snapshot
+static u64 arenaHead;
+// device state of the newest snapshot
+static std::vector<u8> lastState;
+// device state buffer reused between snapshots
+static std::vector<u8> stateBuffer;
+static std::vector<u8> packBuffer;
+// keys and ring positions of the pages to pack
+static std::vector<std::pair<u32, u64>> pageKeys;
+static u32 framesSinceSnapshot;
+static bool _endOfFrame;
+static bool rewinding;
+static bool muted;
+
+namespace delta
+{
+
+static u32 load(const u8 *p, u32 i)
+{
+	u32 v;
+	memcpy(&v, p + i * 4, sizeof(v));
+	return v;
+}
+
+u32 pack(const u8 *data, const u8 *ref, u32 size, u8 *out)
+{
+	u8 *p = out;
+	const u32 words = size / 4;
+	u32 i = 0;
+	while (i < words)
+	{
+		u16 same = 0;
+		while (i < words && same < 0xffff && load(data, i) == load(ref, i))
+		{
+			same++;
+			i++;
+		}
+		const u32 start = i;
+		u16 diff = 0;
+		while (i < words && diff < 0xffff && load(data, i) != load(ref, i))
+		{
+			diff++;
+			i++;
+		}
+		memcpy(p, &same, sizeof(same));
+		memcpy(p + 2, &diff, sizeof(diff));
+		p += 4;
+		for (u32 j = start; j < i; j++, p += 4)
+		{
+			const u32 v = load(data, j) ^ load(ref, j);
+			memcpy(p, &v, sizeof(v));
+		}
+	}
+	for (u32 j = words * 4; j < size; j++)
+		*p++ = data[j] ^ ref[j];
+
+	return p - out;
+}
+
+u32 unpack(const u8 *packed, u8 *ref, u32 size)
+{
+	const u8 *p = packed;
+	const u32 words = size / 4;
+	u32 i = 0;
+	while (i < words)
+	{
+		u16 same, diff;
+		memcpy(&same, p, sizeof(same));
+		memcpy(&diff, p + 2, sizeof(diff));
+		p += 4;
+		i += same;
+		for (u32 end = i + diff; i < end; i++, p += 4)
+		{
+			u32 v;
+			memcpy(&v, p, sizeof(v));
+			v ^= load(ref, i);
+			memcpy(ref + i * 4, &v, sizeof(v));
+		}
+	}
+	for (u32 j = words * 4; j < size; j++)
+		ref[j] ^= *p++;
+
+	return p - packed;
+}
+
+}
+
+bool active() {
+	return config::Rewind && !config::GGPOEnable;
+}
+
+void endOfFrame()
+{
+	if (active())
+	{
+		_endOfFrame = true;
+		emu.getSh4Executor()->Stop();
+	}
+}
+
+void setRewinding(bool rewinding) {
+	rewinder::rewinding = rewinding;
+}
+
+bool isRewinding() {
+	return rewinding && active();
+}
+
+static void serializeState(std::vector<u8>& state)
+{
+	// reuse the capacity of the buffer
+	state.resize(state.capacity());
+	if (!state.empty())
+	{
+		try {
+			Serializer ser(state.data(), state.size(), true);
+			dc_serialize(ser);
+			state.resize(ser.size());
+			return;
+		} catch (const Serializer::Exception&) {
+			// the state outgrew the buffer
+		}
+	}
+	Serializer dryRun(nullptr, std::numeric_limits<size_t>::max(), true);
+	dc_serialize(dryRun);
+	// leave some room for variable-size data
+	state.resize(dryRun.size() + dryRun.size() / 4);
+	Serializer ser(state.data(), state.size(), true);
+	dc_serialize(ser);
+	state.resize(ser.size());
+}
+
+static void deserializeState(const std::vector<u8>& state)
+{
+	Deserializer deser(state.data(), state.size(), true);
+	dc_deserialize(deser);
+}
+
+static void *memPage(u32 key) {
+	return memwatch::getMemPage((memwatch::Region)(key >> 28), key & 0x0fffffff);
+}
+
+// Size of the packed snapshots, including the skipped end of the arena
+static size_t packedSize() {
+	return history.size() > 1 ? arenaHead - history.front().offset : 0;
+}
+
+// Discards the packed snapshots and allocates the arena if the budget has changed
+static void allocArena()
+{
+	const size_t budget = (size_t)config::RewindBudget * 1_MB;
+	if (arenaSize == budget)
+		return;
+	while (history.size() > 1)
+		history.pop_front();
+	arena.reset(new u8[budget]);
+	arenaSize = budget;
+	arenaHead = 0;
+}
+
+// Copies the packed snapshot to the arena, discarding the oldest snapshots to make room.
+// The snapshot must be the newest one.
+static bool storePacked(Snapshot& snapshot, const u8 *data, size_t size)
+{
+	if (size > arenaSize)
+		return false;
+	u64 pos = arenaHead;
+	if (pos % arenaSize + size > arenaSize)
+		pos += arenaSize - pos % arenaSize;
+	while (history.size() > 1 && pos + size - history.front().offset > arenaSize)
+		history.pop_front();
+	memcpy(&arena[pos % arenaSize], data, size);
+	snapshot.offset = pos;
+	arenaHead = pos + size;
+	return true;
+}
+
+// Discards the oldest snapshots over the memory budget
+static void trimHistory()
+{
+	while (history.size() > 1 && packedSize() + lastState.size() > arenaSize)
+		history.pop_front();
+}
+
+static void saveSnapshot()
+{
+	// collect the pages written to since the last snapshot
+	memwatch::protect();
+	memwatch::PageRing& ring = memwatch::savedPages;
+
+	std::vector<u8> state = std::move(stateBuffer);
+	serializeState(state);
+	allocArena();
+
+	if (!history.empty())
+	{
+		Snapshot& prev = history.back();
+		// a page may be saved more than once if the emulator has been restarted
+		// in the meantime. Only its oldest copy is kept.
+		pageKeys.clear();
+		for (u64 pos = ring.tail(); pos < ring.head(); pos++)
+		{
+			const memwatch::PageRing::Page& page = ring.page(pos);
+			pageKeys.emplace_back(page.offset | ((u32)page.region << 28), pos);
+		}
+		// sorted by key then position
+		std::sort(pageKeys.begin(), pageKeys.end());
+		pageKeys.erase(std::unique(pageKeys.begin(), pageKeys.end(), [](const auto& a, const auto& b) {
+			return a.first == b.first;
+		}), pageKeys.end());
+
+		const size_t maxSize = delta::maxSize(prev.stateSize) + pageKeys.size() * (4 + delta::maxSize(PAGE_SIZE));
+		if (packBuffer.size() < maxSize)
+			packBuffer.resize(maxSize);
+		u8 *p = packBuffer.data();
+		prev.stateDelta = prev.stateSize == state.size();
+		if (prev.stateDelta)
+		{
+			p += delta::pack(lastState.data(), state.data(), prev.stateSize, p);
+		}
+		else
+		{
+			memcpy(p, lastState.data(), prev.stateSize);
+			p += prev.stateSize;
+		}
+		for (const auto& [key, pos] : pageKeys)
+		{
+			memcpy(p, &key, sizeof(key));
+			p += sizeof(key);
+			p += delta::pack(ring.data(pos), (const u8 *)memPage(key), PAGE_SIZE, p);
+		}
+		prev.pageCount = pageKeys.size();
+		if (!storePacked(prev, packBuffer.data(), p - packBuffer.data()))
+			// the older snapshots depend on this one
+			history.clear();
+	}
+	ring.release(ring.head());
+	stateBuffer = std::move(lastState);
+	lastState = std::move(state);
+	history.push_back({ arenaHead, (u32)lastState.size(), 0, false });
+	framesSinceSnapshot = 0;
+	trimHistory();
+}
+
+static void rewindSnapshot()
+{
+	rend_start_rollback();
+	// back to the last snapshot
+	if (memwatch::tracking == memwatch::Tracking::SoftDirty)
+		// the pages written to are only known after protect()
+		memwatch::protect();
+	memwatch::PageRing& ring = memwatch::savedPages;
+	for (u64 pos = ring.head(); pos > ring.tail(); )
+	{
+		pos--;
+		const memwatch::PageRing::Page& page = ring.page(pos);
+		memcpy(memwatch::getMemPage(page.region, page.offset), ring.data(pos), PAGE_SIZE);
+	}
+	// then to the previous one if the last one has just been restored
+	if (framesSinceSnapshot == 0 && history.size() > 1)
+	{
+		Snapshot& prev = history[history.size() - 2];
+		const u8 *p = &arena[prev.offset % arenaSize];
+		if (prev.stateDelta)
+		{
+			stateBuffer.assign(lastState.begin(), lastState.end());
+			p += delta::unpack(p, stateBuffer.data(), prev.stateSize);
+		}
+		else
+		{
+			stateBuffer.assign(p, p + prev.stateSize);
+			p += prev.stateSize;
+		}
+		for (u32 i = 0; i < prev.pageCount; i++)
+		{
+			u32 key;
+			memcpy(&key, p, sizeof(key));
+			p += sizeof(key);
+			p += delta::unpack(p, (u8 *)memPage(key), PAGE_SIZE);
+		}
+		std::swap(lastState, stateBuffer);
+		prev.pageCount = 0;
+		arenaHead = prev.offset;
+		history.pop_back();
+	}
+	deserializeState(lastState);
+	// the pages written to while restoring are already up to date
+	memwatch::protect();
+	ring.release(ring.head());
+	framesSinceSnapshot = 0;
+	rend_allow_rollback();
+}
+
+bool nextFrame()
+{
+	if (!_endOfFrame)
+		return false;
+	_endOfFrame = false;
+	try {
+		if (rewinding && !history.empty() && !settings.network.online && !settings.naomi.multiboard)
+		{
+			if (!muted)
+			{
+				settings.aica.muteAudio = true;
+				muted = true;
+			}
+			rewindSnapshot();
+		}
+		else
+		{
+			if (muted)
+			{
+				settings.aica.muteAudio = false;
+				muted = false;
+			}
+			if (history.empty() || ++framesSinceSnapshot >= (u32)std::max(1, config::RewindInterval.get()))
+				saveSnapshot();
+		}
+	} catch (const Serializer::Exception& e) {
+		WARN_LOG(SAVESTATE, "Rewind snapshot failed: %s", e.what());
+		reset();
+	}
+	return emu.restartCpu();
+}
+
+void reset()
+{
+	history = {};
+	arena.reset();
+	arenaSize = 0;
+	arenaHead = 0;
+	lastState = {};
+	stateBuffer = {};
+	packBuffer = {};
+	pageKeys = {};
+	framesSinceSnapshot = 0;
+	if (muted)
+	{
+		settings.aica.muteAudio = false;
+		muted = false;
+	}
+	if (!config::GGPOEnable)
+	{
+		memwatch::savedPages.term();
+		// no frame is being rendered yet
+		rend_allow_rollback();
+	}
+}
+
+Stats getStats()
+{
+	Stats stats{};
+	stats.snapshots = history.size();
+	if (!history.empty())
+		stats.frames = (history.size() - 1) * std::max(1, config::RewindInterval.get()) + framesSinceSnapshot;
+	stats.size = packedSize() + lastState.size();
+	stats.buffers = stateBuffer.capacity() + packBuffer.capacity() + memwatch::savedPages.memorySize();
+	return stats;
+}
+
+}
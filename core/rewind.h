@@ -0,0 +1,71 @@
+/*
+	Copyright 2025 flyinghead
+
+	This file is part of Flycast.
+
+    Flycast is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    Flycast is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Flycast.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "types.h"
+
+/*
+	Rewind history. A snapshot of the device state is taken every RewindInterval frames.
+	The newest snapshot keeps the whole device state. Older snapshots only keep the
+	difference with the next one, and the previous contents of the memory pages
+	written to until the next snapshot, as tracked by memwatch.
+*/
+namespace rewinder
+{
+
+// Rewinding is enabled and GGPO isn't using the memory watchers
+bool active();
+// Stops the cpu at the end of a frame so that the state can be saved or restored
+void endOfFrame();
+// Saves a snapshot every RewindInterval frames, or goes back to the previous snapshot
+// if rewinding. Returns true if the cpu has been restarted.
+bool nextFrame();
+// Discards the history
+void reset();
+
+// Goes back in time while the rewind button is pressed
+void setRewinding(bool rewinding);
+bool isRewinding();
+
+struct Stats
+{
+	u32 snapshots;
+	// number of frames that can be rewound
+	u32 frames;
+	// memory used by the snapshots
+	size_t size;
+	// memory used by the page ring and work buffers
+	size_t buffers;
+};
+Stats getStats();
+
+// XOR+RLE delta codec: runs of identical 32-bit words are skipped,
+// and the other words are saved xored with the reference.
+namespace delta
+{
+// Maximum packed size of size bytes
+constexpr u32 maxSize(u32 size) {
+	return size + 8 * (size / 4 / 0xffff + 2);
+}
+// Saves the difference between data and ref in out. Returns the packed size.
+u32 pack(const u8 *data, const u8 *ref, u32 size, u8 *out);
+// Applies the packed difference to ref. Returns the number of packed bytes read.
+u32 unpack(const u8 *packed, u8 *ref, u32 size);
+}
+
+}
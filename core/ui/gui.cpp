@@ -46,6 +46,7 @@
 #include "rend/CustomTexture.h"
 #include "hw/mem/addrspace.h"
 #include "hw/maple/maple_if.h"
+#include "rewind.h"
 #if defined(USE_SDL)
 #include "sdl/sdl.h"
 #include "sdl/dreamlink.h"
@@ -1531,6 +1532,7 @@ static float fps = -1;
 
 static std::string getFPSNotification()
 {
+	const char *mode = rewinder::isRewinding() ? "<<" : settings.input.fastForwardMode ? ">>" : "";
 	if (config::ShowFPS)
 	{
 		u64 now = getTimeMs();
@@ -1541,12 +1543,12 @@ static std::string getFPSNotification()
 		}
 		if (fps >= 0.f && fps < 9999.f) {
 			char text[32];
-			snprintf(text, sizeof(text), "F:%4.1f%s", fps, settings.input.fastForwardMode ? " >>" : "");
+			snprintf(text, sizeof(text), "F:%4.1f%s%s", fps, mode[0] != '\0' ? " " : "", mode);
 
 			return std::string(text);
 		}
 	}
-	return std::string(settings.input.fastForwardMode ? ">>" : "");
+	return std::string(mode);
 }
 
 void gui_draw_osd()
@@ -48,6 +48,32 @@ static void gui_settings_advanced()
 		OptionSlider("SH4 Clock", config::Sh4Clock, 100, 300,
 				"Over/Underclock the main SH4 CPU. Default is 200 MHz. Other values may crash, freeze or trigger unexpected nuclear reactions.",
 				"%d MHz");
+		OptionCheckbox("Tiered Compilation", config::DynarecTieredCompilation,
+				"Compile code quickly on first use and fully optimize it once it runs often");
+		OptionCheckbox("Global Register Allocation", config::DynarecGlobalRegAlloc,
+				"Keep the most used SH4 registers in host registers across linked blocks. ARM64 only");
+		OptionCheckbox("Sub-page SMC Detection", config::DynarecSubPageSmc,
+				"Track code writes in 256-byte lines instead of whole pages. Helps games that write data next to their code");
+		OptionCheckbox("Background Compilation", config::DynarecBackgroundCompilation,
+				"Compile new code on a separate thread and interpret it until it is ready. Reduces stuttering. Not used with full MMU");
+		OptionCheckbox("Precompile Game Code", config::DynarecPrecompile,
+				"Compile the code reachable from the game entry point when the game starts");
+		OptionCheckbox("Memory Access Specialization", config::DynarecMemSpecialization,
+				"Profile memory accesses of new code and call hardware register handlers directly once it is optimized. Requires tiered compilation");
+		OptionCheckbox("Code Cache Eviction", config::DynarecCodeEviction,
+				"Discard the oldest code when the code cache is full instead of flushing all of it");
+		OptionCheckbox("FPU Mode Speculation", config::DynarecFpscrSpeculation,
+				"Keep compiling past FPSCR writes using the FPU mode seen before, and check the FPU mode on block entry. x64 and ARM64 only");
+		OptionCheckbox("Idle Loop Detection", config::DynarecIdleLoops,
+				"Skip to the next hardware event when the game is waiting in a loop that only reads memory");
+		OptionCheckbox("Pre-decoded Interpreter", config::InterpreterPredecode,
+				"Keep the decoded instructions of the interpreter in a cache. Faster interpreter. Not used with full MMU");
+		OptionCheckbox("Run Until Next Event", config::EventBatching,
+				"Run the CPU up to the next hardware event instead of returning to the scheduler at fixed intervals");
+		OptionCheckbox("Operand Cache Emulation", config::OperandCacheEmulation,
+				"Emulate the SH4 data cache for the few games that depend on it. Slower. Not used with full MMU or with the ARM32 and x86 dynarecs");
+		OptionCheckbox("Persistent Block Cache", config::DynarecPersistentCache,
+				"Save translated code blocks to disk to speed up the next game launch");
     }
 #ifdef GDB_SERVER
 	ImGui::Spacing();
@@ -360,6 +360,20 @@ void gui_settings_general()
 	ImGui::SameLine();
 	OptionCheckbox("Save", config::AutoSaveState,
 			"Save the state of the game when stopping");
+#ifdef USE_ZSTD
+	OptionCheckbox("Fast Savestate Compression", config::SavestateZstd,
+			"Compress savestates with Zstandard. Faster but these savestates can't be loaded by older versions");
+#endif
+	{
+		DisabledScope scope(game_started);
+		OptionCheckbox("Rewind", config::Rewind,
+				"Keep a history of the game state that can be rewound with the Rewind button. Not available with GGPO");
+		DisabledScope _(!config::Rewind);
+		OptionSlider("Rewind Interval", config::RewindInterval, 1, 30,
+				"Number of frames between snapshots. Lower values rewind more smoothly but shorten the history", "%d frames");
+		OptionSlider("Rewind Memory", config::RewindBudget, 32, 2048,
+				"Memory used to keep the history", "%d MB");
+	}
 	OptionCheckbox("Naomi Free Play", config::ForceFreePlay, "Configure Naomi games in Free Play mode.");
 #if USE_DISCORD
 	OptionCheckbox("Discord Presence", config::DiscordPresence, "Show which game you are playing on Discord");
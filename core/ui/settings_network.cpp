@@ -106,6 +106,10 @@ void gui_settings_network()
 			}
 			OptionCheckbox("Network Statistics", config::NetworkStats,
 					"Display network statistics on screen");
+#if defined(__linux__)
+			OptionCheckbox("Soft-Dirty Page Tracking", config::GGPOSoftDirty,
+					"Find the memory pages written to each frame with the kernel soft-dirty bits instead of memory protection faults. Faster if supported by the kernel");
+#endif
 		}
 		else if (config::NetworkEnable)
 		{
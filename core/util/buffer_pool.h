@@ -0,0 +1,124 @@
+/*
+	Copyright 2025 flyinghead
+
+	This file is part of Flycast.
+
+    Flycast is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    Flycast is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Flycast.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <cstdlib>
+#include <cstdint>
+#include <vector>
+
+/*
+	Pool of same-size buffers, for savestates that are created and freed every frame.
+	Released buffers are kept and reused. Changing the buffer capacity frees
+	the unused buffers, and the buffers in use when they are released.
+*/
+class BufferPool
+{
+public:
+	~BufferPool() {
+		clear();
+	}
+
+	// Returns a buffer of capacity() bytes, or nullptr if out of memory
+	uint8_t *alloc()
+	{
+		if (buffers.empty())
+			return newBuffer();
+		uint8_t *buffer = buffers.back();
+		buffers.pop_back();
+		return buffer;
+	}
+
+	void release(uint8_t *buffer)
+	{
+		if (((Header *)buffer - 1)->capacity == _capacity)
+			buffers.push_back(buffer);
+		else
+			freeBuffer(buffer);
+	}
+
+	size_t capacity() const {
+		return _capacity;
+	}
+
+	// Sets the capacity of the buffers. Some room is left for variable-size data.
+	void setCapacity(size_t size)
+	{
+		_capacity = (size + size / 4 + 0xffff) & ~(size_t)0xffff;
+		clear();
+	}
+
+	// Allocates buffers so that at least count of them are available
+	void reserve(size_t count)
+	{
+		buffers.reserve(count);
+		while (buffers.size() < count)
+		{
+			uint8_t *buffer = newBuffer();
+			if (buffer == nullptr)
+				break;
+			buffers.push_back(buffer);
+		}
+	}
+
+	// Frees the unused buffers
+	void clear()
+	{
+		for (uint8_t *buffer : buffers)
+			freeBuffer(buffer);
+		buffers.clear();
+	}
+
+	// Size of all the buffers, used or not
+	size_t memorySize() const {
+		return allocated;
+	}
+	// Total number of bytes allocated since the pool was created
+	uint64_t allocatedBytes() const {
+		return totalAllocated;
+	}
+
+private:
+	struct Header
+	{
+		size_t capacity;
+		size_t padding;
+	};
+
+	uint8_t *newBuffer()
+	{
+		Header *header = (Header *)malloc(sizeof(Header) + _capacity);
+		if (header == nullptr)
+			return nullptr;
+		header->capacity = _capacity;
+		allocated += _capacity;
+		totalAllocated += _capacity;
+		return (uint8_t *)(header + 1);
+	}
+
+	void freeBuffer(uint8_t *buffer)
+	{
+		Header *header = (Header *)buffer - 1;
+		allocated -= header->capacity;
+		free(header);
+	}
+
+	std::vector<uint8_t *> buffers;
+	size_t _capacity = 0;
+	size_t allocated = 0;
+	uint64_t totalAllocated = 0;
+};
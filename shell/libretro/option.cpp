@@ -24,6 +24,20 @@ namespace config {
 // Dynarec
 
 Option<bool> DynarecEnabled("", true);
+Option<bool> DynarecTieredCompilation("", false);
+Option<bool> DynarecGlobalRegAlloc("", false);
+Option<bool> DynarecSubPageSmc("", false);
+Option<bool> DynarecBackgroundCompilation("", false);
+Option<bool> DynarecPrecompile("", false);
+Option<bool> DynarecMemSpecialization("", false);
+Option<bool> DynarecCodeEviction("", false);
+Option<bool> DynarecFpscrSpeculation("", false);
+Option<bool> DynarecIdleLoops("", false);
+Option<bool> InterpreterPredecode("", false);
+Option<bool> EventBatching("", false);
+Option<bool> OperandCacheEmulation("", false);
+Option<bool> DynarecPersistentCache("", false);
+Option<int> DynarecPersistentCacheSize("", 64);
 IntOption Sh4Clock(CORE_OPTION_NAME "_sh4clock", 200);
 
 // General
@@ -35,6 +49,10 @@ Option<int> Language(CORE_OPTION_NAME "_language", 1);		// English
 Option<bool> AutoLoadState("");
 Option<bool> AutoSaveState("");
 Option<int, false> SavestateSlot("");
+Option<bool> SavestateZstd("");
+Option<bool> Rewind("", false);
+Option<int> RewindInterval("", 4);
+Option<int> RewindBudget("", 256);
 Option<bool> ForceFreePlay(CORE_OPTION_NAME "_force_freeplay", true);
 
 // Sound
@@ -123,6 +141,7 @@ Option<bool> GGPOEnable("", false);
 Option<int> GGPODelay("", 0);
 Option<bool> NetworkStats("", false);
 Option<int> GGPOAnalogAxes("", 0);
+Option<bool> GGPOSoftDirty("", false);
 Option<bool> NetworkOutput(CORE_OPTION_NAME "_network_output", false);
 Option<int> MultiboardSlaves("", 0);
 Option<bool> BattleCableEnable("", false);
@@ -0,0 +1,273 @@
+#include "gtest/gtest.h"
+#include "types.h"
+#include "emulator.h"
+#include "hw/mem/addrspace.h"
+#include "hw/sh4/dyna/blockmanager.h"
+#include "hw/sh4/sh4_if.h"
+#include "hw/sh4/sh4_mem.h"
+#include "cfg/option.h"
+
+#include <chrono>
+#include <vector>
+
+class BlockManagerTest : public ::testing::Test {
+protected:
+	static constexpr u32 BaseAddr = 0x8c100000;
+	static constexpr u32 HostCodeSize = 64;
+	static constexpr u32 MaxBlocks = 8192;
+
+	void SetUp() override
+	{
+		code.resize(MaxBlocks * HostCodeSize);
+		if (!addrspace::reserve())
+			die("addrspace::reserve failed");
+		emu.init();
+		emu.dc_reset(true);
+	}
+
+	void TearDown() override
+	{
+		bm_ResetCache();
+		bm_Reset();
+		config::DynarecSubPageSmc.reset();
+	}
+
+	// Adds a fake block. Its host code is never executed.
+	// dataAddr: optional word of the block pages read when compiling it
+	RuntimeBlockInfo *addBlock(u32 addr, u32 size, u32 index, u32 dataAddr = 0)
+	{
+		RuntimeBlockInfo *block = new RuntimeBlockInfo();
+		block->addr = block->vaddr = addr;
+		block->sh4_code_size = size;
+		block->code = (DynarecCodeEntryPtr)&code[index * HostCodeSize];
+		block->host_code_size = HostCodeSize;
+		if (dataAddr != 0 && !block->AddDataRead(dataAddr, 4))
+			die("Data not in the block pages");
+		block->SetProtectedFlags();
+		bm_AddBlock(block);
+		return block;
+	}
+
+	std::vector<u8> code;
+};
+
+TEST_F(BlockManagerTest, Lookup)
+{
+	RuntimeBlockInfo *blocks[8];
+	// Add them out of order
+	for (u32 i = 0; i < 8; i++)
+	{
+		u32 idx = (i * 5) % 8;
+		blocks[idx] = addBlock(BaseAddr + idx * 0x100, 0x20, idx);
+	}
+	for (u32 i = 0; i < 8; i++)
+	{
+		ASSERT_EQ(blocks[i], bm_GetBlock((void *)blocks[i]->code));
+		ASSERT_EQ(blocks[i], bm_GetBlock((void *)((u8 *)blocks[i]->code + HostCodeSize - 1)));
+		ASSERT_EQ(blocks[i], bm_GetBlock(BaseAddr + i * 0x100));
+	}
+	ASSERT_EQ(nullptr, bm_GetBlock((void *)&code[8 * HostCodeSize]));
+
+	bm_DiscardBlock(blocks[3]);
+	ASSERT_EQ(nullptr, bm_GetBlock((void *)blocks[3]->code));
+	ASSERT_EQ(nullptr, bm_GetBlock(BaseAddr + 3 * 0x100));
+	ASSERT_EQ(blocks[3], bm_GetStaleBlock((void *)blocks[3]->code));
+	ASSERT_EQ(blocks[4], bm_GetBlock((void *)blocks[4]->code));
+	ASSERT_EQ(blocks[2], bm_GetBlock((void *)((u8 *)blocks[2]->code + 1)));
+
+	// Reuse the same host code
+	RuntimeBlockInfo *block = addBlock(BaseAddr + 0x1000, 0x20, 3);
+	ASSERT_EQ(block, bm_GetBlock((void *)block->code));
+	bm_Periodical_1s();
+	ASSERT_EQ(nullptr, bm_GetStaleBlock((void *)block->code));
+}
+
+TEST_F(BlockManagerTest, Links)
+{
+	RuntimeBlockInfo *a = addBlock(BaseAddr, 0x20, 0);
+	RuntimeBlockInfo *b = addBlock(BaseAddr + 0x1000, 0x20, 1);
+	RuntimeBlockInfo *c = addBlock(BaseAddr + 0x2000, 0x20, 2);
+	a->pNextBlock = b;
+	b->AddRef(a);
+	b->pBranchBlock = c;
+	c->AddRef(b);
+
+	// Discarding a block unlinks its predecessors
+	bm_DiscardBlock(b);
+	ASSERT_EQ(nullptr, a->pNextBlock);
+	ASSERT_EQ(nullptr, b->pBranchBlock);
+	ASSERT_TRUE(c->pre_refs.empty());
+	bm_Periodical_1s();
+
+	a->pBranchBlock = c;
+	c->AddRef(a);
+	bm_DiscardBlock(a);
+	ASSERT_TRUE(c->pre_refs.empty());
+	ASSERT_EQ(c, bm_GetBlock(BaseAddr + 0x2000));
+}
+
+TEST_F(BlockManagerTest, PageInvalidation)
+{
+	// Two blocks in the first page, one spanning two pages
+	RuntimeBlockInfo *a = addBlock(BaseAddr, 0x20, 0);
+	RuntimeBlockInfo *b = addBlock(BaseAddr + PAGE_SIZE - 0x10, 0x20, 1);
+	RuntimeBlockInfo *c = addBlock(BaseAddr + PAGE_SIZE + 0x100, 0x20, 2);
+	ASSERT_TRUE(a->read_only);
+	ASSERT_TRUE(b->read_only);
+	ASSERT_TRUE(c->read_only);
+
+	bm_RamWriteAccess(BaseAddr + PAGE_SIZE + 4);
+	ASSERT_EQ(a, bm_GetBlock(BaseAddr));
+	ASSERT_EQ(nullptr, bm_GetBlock(BaseAddr + PAGE_SIZE - 0x10));
+	ASSERT_EQ(nullptr, bm_GetBlock(BaseAddr + PAGE_SIZE + 0x100));
+
+	bm_RamWriteAccess(BaseAddr);
+	ASSERT_EQ(nullptr, bm_GetBlock(BaseAddr));
+	ASSERT_FALSE(bm_IsRamPageProtected(BaseAddr));
+}
+
+// The same physical code executed at two virtual addresses
+TEST_F(BlockManagerTest, VAddrAliases)
+{
+	constexpr u32 VAddr1 = 0x00011000;
+	constexpr u32 VAddr2 = 0x04011000;
+	RuntimeBlockInfo *a = new RuntimeBlockInfo();
+	a->addr = BaseAddr;
+	a->vaddr = VAddr1;
+	a->sh4_code_size = 0x20;
+	a->code = (DynarecCodeEntryPtr)&code[0];
+	a->host_code_size = HostCodeSize;
+	a->SetProtectedFlags();
+	bm_AddBlock(a);
+
+	// a is parked and the block for VAddr2 must be compiled
+	ASSERT_EQ(nullptr, bm_SwapVAddrBlock(a, VAddr2));
+	ASSERT_EQ(nullptr, bm_GetBlock(BaseAddr));
+	ASSERT_EQ(a, bm_GetBlock((void *)a->code));
+	RuntimeBlockInfo *b = addBlock(BaseAddr, 0x20, 1);
+	b->vaddr = VAddr2;
+	ASSERT_EQ(b, bm_GetBlock(BaseAddr));
+
+	// back to VAddr1
+	ASSERT_EQ(a, bm_SwapVAddrBlock(b, VAddr1));
+	ASSERT_EQ(a, bm_GetBlock(BaseAddr));
+	ASSERT_EQ(b, bm_SwapVAddrBlock(a, VAddr2));
+	ASSERT_EQ(b, bm_GetBlock(BaseAddr));
+
+	// parked blocks are discarded with the others
+	bm_RamWriteAccess(BaseAddr);
+	ASSERT_EQ(nullptr, bm_GetBlock(BaseAddr));
+	ASSERT_EQ(nullptr, bm_GetBlock((void *)a->code));
+	ASSERT_EQ(nullptr, bm_GetBlock((void *)b->code));
+}
+
+TEST_F(BlockManagerTest, SubPageInvalidation)
+{
+	config::DynarecSubPageSmc = true;
+	RuntimeBlockInfo *a = addBlock(BaseAddr, 0x20, 0);
+	RuntimeBlockInfo *b = addBlock(BaseAddr + 0x800, 0x20, 1);
+	ASSERT_TRUE(a->read_only);
+	ASSERT_TRUE(b->read_only);
+
+	// Data write next to the code
+	bm_RamWriteAccess(BaseAddr + 0x400);
+	ASSERT_EQ(a, bm_GetBlock(BaseAddr));
+	ASSERT_EQ(b, bm_GetBlock(BaseAddr + 0x800));
+	ASSERT_TRUE(bm_IsRamPageProtected(BaseAddr));
+	bm_ReprotectPages();
+
+	// Write to the code line of b in the middle of a timeslice
+	Sh4cntx.slice_cycles = 10000;
+	Sh4cntx.cycle_counter = 6000;
+	bm_RamWriteAccess(BaseAddr + 0x8f0);
+	ASSERT_EQ(a, bm_GetBlock(BaseAddr));
+	ASSERT_EQ(nullptr, bm_GetBlock(BaseAddr + 0x800));
+	// the timeslice ends after the current block so that the page is protected again
+	ASSERT_LT(Sh4cntx.cycle_counter, 0);
+	ASSERT_EQ(4000, Sh4cntx.slice_cycles - Sh4cntx.cycle_counter);
+
+	// New blocks in the page are still protected
+	RuntimeBlockInfo *c = addBlock(BaseAddr + 0xc00, 0x20, 2);
+	ASSERT_TRUE(c->read_only);
+
+	// Code modified while the page is writable
+	mem_b[(BaseAddr & RAM_MASK) + 2]++;
+	bm_ReprotectPages();
+	ASSERT_EQ(nullptr, bm_GetBlock(BaseAddr));
+	ASSERT_EQ(nullptr, bm_GetBlock(BaseAddr + 0xc00));
+}
+
+// Writes to the constants read by a block discard it
+TEST_F(BlockManagerTest, SubPageDataLines)
+{
+	config::DynarecSubPageSmc = true;
+	RuntimeBlockInfo *a = addBlock(BaseAddr, 0x20, 0, BaseAddr + 0x300);
+	ASSERT_TRUE(a->read_only);
+	// Outside of the block pages
+	ASSERT_FALSE(a->AddDataRead(BaseAddr + PAGE_SIZE, 4));
+
+	bm_RamWriteAccess(BaseAddr + 0x600);
+	ASSERT_EQ(a, bm_GetBlock(BaseAddr));
+	// Data modified while the page is writable
+	mem_b[(BaseAddr & RAM_MASK) + 0x300]++;
+	bm_ReprotectPages();
+	ASSERT_EQ(nullptr, bm_GetBlock(BaseAddr));
+
+	a = addBlock(BaseAddr, 0x20, 0, BaseAddr + 0x300);
+	bm_RamWriteAccess(BaseAddr + 0x304);
+	ASSERT_EQ(nullptr, bm_GetBlock(BaseAddr));
+	bm_ReprotectPages();
+}
+
+// Every page holding code is written to, discarding all its blocks
+class InvalidationStormTest : public BlockManagerTest
+{
+protected:
+	static constexpr u32 Pages = 512;
+	static constexpr u32 BlocksPerPage = 16;
+	static constexpr u32 BlockSize = PAGE_SIZE / BlocksPerPage;
+	static_assert(Pages * BlocksPerPage <= MaxBlocks);
+
+	void run(u32 rounds, std::chrono::nanoseconds& addTime, std::chrono::nanoseconds& stormTime)
+	{
+		for (u32 round = 0; round < rounds; round++)
+		{
+			auto start = std::chrono::steady_clock::now();
+			// Half the blocks straddle two pages
+			for (u32 i = 0; i < Pages * BlocksPerPage; i++)
+				addBlock(BaseAddr + i * BlockSize + (i & 1) * (BlockSize / 2), BlockSize, i);
+			auto added = std::chrono::steady_clock::now();
+
+			for (u32 page = 0; page < Pages; page++)
+				bm_RamWriteAccess(BaseAddr + page * PAGE_SIZE);
+			auto end = std::chrono::steady_clock::now();
+			addTime += added - start;
+			stormTime += end - added;
+
+			for (u32 i = 0; i < Pages * BlocksPerPage; i += 97)
+				ASSERT_EQ(nullptr, bm_GetBlock(BaseAddr + i * BlockSize + (i & 1) * (BlockSize / 2)));
+			bm_Periodical_1s();
+			bm_ResetCache();
+		}
+	}
+};
+
+TEST_F(InvalidationStormTest, Discard)
+{
+	std::chrono::nanoseconds addTime {};
+	std::chrono::nanoseconds stormTime {};
+	run(2, addTime, stormTime);
+}
+
+// Microbenchmark
+TEST_F(InvalidationStormTest, DISABLED_Benchmark)
+{
+	constexpr u32 Rounds = 20;
+	std::chrono::nanoseconds addTime {};
+	std::chrono::nanoseconds stormTime {};
+	run(Rounds, addTime, stormTime);
+	printf("Invalidation storm: %d blocks in %d pages, add %.1f us, discard %.1f us per round\n",
+			Pages * BlocksPerPage, Pages,
+			std::chrono::duration<double, std::micro>(addTime).count() / Rounds,
+			std::chrono::duration<double, std::micro>(stormTime).count() / Rounds);
+}
@@ -0,0 +1,208 @@
+#include "gtest/gtest.h"
+#include "types.h"
+#include "emulator.h"
+#include "hw/mem/addrspace.h"
+#include "hw/mem/mem_watch.h"
+#include "cfg/option.h"
+#include "oslib/oslib.h"
+
+#include <chrono>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+class MemWatchTest : public ::testing::Test {
+protected:
+	// random writes per frame
+	static constexpr u32 RamWrites = 400;
+	static constexpr u32 VramWrites = 100;
+
+	void SetUp() override
+	{
+		if (!addrspace::reserve())
+			die("addrspace::reserve failed");
+		emu.init();
+		emu.dc_reset(true);
+		os_InstallFaultHandler();
+		config::GGPOEnable.override(true);
+	}
+
+	void TearDown() override
+	{
+		memwatch::unprotect();
+		config::GGPOSoftDirty.reset();
+		memwatch::reset();
+		config::GGPOEnable.reset();
+		os_UninstallFaultHandler();
+	}
+
+	struct Result
+	{
+		double msPerFrame;
+		double pagesPerFrame;
+		double faultsPerFrame;
+	};
+
+	static long minorFaults()
+	{
+#ifdef __linux__
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_minflt;
+#else
+		return 0;
+#endif
+	}
+
+	// Writes to random ram and vram pages each frame and checks that the saved pages hold
+	// their contents of the previous frame
+	Result run(bool softDirty, u32 frames)
+	{
+		config::GGPOSoftDirty.override(softDirty);
+		memwatch::unprotect();
+		memwatch::reset();
+		memwatch::protect();
+		memwatch::PageRing& ring = memwatch::savedPages;
+		ring.release(ring.head());
+
+		std::vector<u8> ram(&mem_b[0], &mem_b[RAM_SIZE]);
+		std::vector<u8> vramRef(&vram[0], &vram[VRAM_SIZE]);
+		std::mt19937 rng(42);
+		u64 pages = 0;
+		long faults = minorFaults();
+		std::chrono::steady_clock::duration time{};
+		for (u32 frame = 0; frame < frames; frame++)
+		{
+			std::set<u32> ramPages;
+			std::set<u32> vramPages;
+			auto start = std::chrono::steady_clock::now();
+			for (u32 i = 0; i < RamWrites; i++)
+			{
+				u32 offset = rng() % RAM_SIZE;
+				mem_b[offset]++;
+				ramPages.insert(offset & ~PAGE_MASK);
+			}
+			for (u32 i = 0; i < VramWrites; i++)
+			{
+				u32 offset = rng() % VRAM_SIZE;
+				vram[offset]++;
+				vramPages.insert(offset & ~PAGE_MASK);
+			}
+			memwatch::protect();
+			time += std::chrono::steady_clock::now() - start;
+			std::map<u32, const u8 *> ramDelta;
+			std::map<u32, const u8 *> vramDelta;
+			for (u64 pos = ring.tail(); pos < ring.head(); pos++)
+			{
+				const memwatch::PageRing::Page& page = ring.page(pos);
+				EXPECT_TRUE(page.region == memwatch::Region::Ram || page.region == memwatch::Region::Vram);
+				auto& delta = page.region == memwatch::Region::Ram ? ramDelta : vramDelta;
+				EXPECT_TRUE(delta.emplace(page.offset, ring.data(pos)).second) << "page saved twice";
+			}
+			ring.release(ring.head());
+
+			for (u32 page : ramPages)
+			{
+				auto it = ramDelta.find(page);
+				EXPECT_NE(ramDelta.end(), it) << "ram page " << std::hex << page;
+				if (it != ramDelta.end())
+				{
+					EXPECT_EQ(0, memcmp(it->second, &ram[page], PAGE_SIZE)) << "ram page " << std::hex << page;
+				}
+				memcpy(&ram[page], &mem_b[page], PAGE_SIZE);
+			}
+			for (u32 page : vramPages)
+			{
+				auto it = vramDelta.find(page);
+				EXPECT_NE(vramDelta.end(), it) << "vram page " << std::hex << page;
+				if (it != vramDelta.end())
+				{
+					EXPECT_EQ(0, memcmp(it->second, &vramRef[page], PAGE_SIZE)) << "vram page " << std::hex << page;
+				}
+				memcpy(&vramRef[page], &vram[page], PAGE_SIZE);
+			}
+			if (HasFailure())
+				break;
+			pages += ramDelta.size() + vramDelta.size();
+		}
+		faults = minorFaults() - faults;
+		// one protection fault per page saved
+		if (!softDirty)
+			faults = pages;
+		return { std::chrono::duration<double, std::milli>(time).count() / frames,
+			(double)pages / frames, (double)faults / frames };
+	}
+};
+
+TEST_F(MemWatchTest, PageRing)
+{
+	memwatch::PageRing ring;
+	std::vector<u8> page(PAGE_SIZE);
+	auto add = [&](u32 i) {
+		memset(page.data(), (u8)i, PAGE_SIZE);
+		ring.add(memwatch::Region::Ram, i * PAGE_SIZE, page.data());
+	};
+	auto check = [&](u64 pos, u32 i) {
+		ASSERT_EQ(i * PAGE_SIZE, ring.page(pos).offset);
+		ASSERT_EQ((u8)i, ring.data(pos)[0]);
+		ASSERT_EQ((u8)i, ring.data(pos)[PAGE_SIZE - 1]);
+	};
+	for (u32 i = 0; i < 3000; i++)
+		add(i);
+	const size_t size = ring.memorySize();
+	// discard the oldest pages and wrap around
+	ring.release(2000);
+	for (u32 i = 3000; i < 5000; i++)
+		add(i);
+	ASSERT_EQ(size, ring.memorySize());
+	ASSERT_EQ(2000u, ring.tail());
+	ASSERT_EQ(5000u, ring.head());
+	for (u64 pos = ring.tail(); pos < ring.head(); pos++)
+		check(pos, pos);
+	// rollback
+	ring.truncate(4000);
+	add(10000);
+	check(4000, 10000);
+	// grow while wrapped around
+	for (u32 i = 0; i < 5000; i++)
+		add(i + 20000);
+	ASSERT_GT(ring.memorySize(), size);
+	for (u64 pos = 2000; pos < 4000; pos++)
+		check(pos, pos);
+	check(4000, 10000);
+	for (u32 i = 0; i < 5000; i++)
+		check(4001 + i, i + 20000);
+	ring.term();
+	ASSERT_EQ(0u, ring.memorySize());
+}
+
+TEST_F(MemWatchTest, Mprotect)
+{
+	Result res = run(false, 30);
+	ASSERT_EQ(memwatch::Tracking::Mprotect, memwatch::tracking);
+	ASSERT_GT(res.pagesPerFrame, 0.0);
+}
+
+TEST_F(MemWatchTest, SoftDirty)
+{
+	if (!memwatch::softdirty::available())
+		GTEST_SKIP() << "Soft-dirty bits not supported";
+	Result res = run(true, 30);
+	ASSERT_EQ(memwatch::Tracking::SoftDirty, memwatch::tracking);
+	ASSERT_GT(res.pagesPerFrame, 0.0);
+}
+
+TEST_F(MemWatchTest, DISABLED_Benchmark)
+{
+	constexpr u32 Frames = 300;
+	Result mprotect = run(false, Frames);
+	printf("mprotect: %.3f ms per frame, %.1f pages, %.1f faults\n", mprotect.msPerFrame, mprotect.pagesPerFrame, mprotect.faultsPerFrame);
+	if (!memwatch::softdirty::available())
+		return;
+	Result softDirty = run(true, Frames);
+	printf("soft-dirty: %.3f ms per frame, %.1f pages, %.1f minor faults\n", softDirty.msPerFrame, softDirty.pagesPerFrame, softDirty.faultsPerFrame);
+}
@@ -22,6 +22,10 @@
 #include "emulator.h"
 #include "hw/sh4/modules/mmu.h"
 #include "hw/sh4/sh4_core.h"
+#include "stdclass.h"
+
+#include <random>
+#include <vector>
 
 class MmuTest : public ::testing::Test {
 protected:
@@ -233,3 +237,189 @@ TEST_F(MmuTest, TestErrors)
 	ASSERT_EQ(MmuError::FIRSTWRITE, err);
 #endif
 }
+
+#ifdef FAST_MMU
+// Translation of data accesses by the dynarecs, with and without the software TLB
+class MmuTlbTest : public MmuTest
+{
+protected:
+	void SetUp() override
+	{
+		MmuTest::SetUp();
+		// WinCE-like page tables: 4 KB pages. Each process has its own ASID and 32 MB slot,
+		// and the current one is also mapped in slot 0. DLLs are shared in slot 1.
+		for (u32 p = 1; p <= Processes; p++)
+			for (u32 page = 0; page < ProcessPages; page++)
+			{
+				addEntry(0x00010000 + page * 4096, p, false);
+				addEntry(p * 0x02000000 + 0x00010000 + page * 4096, p, false);
+			}
+		for (u32 page = 0; page < SharedPages; page++)
+			addEntry(0x02000000 + page * 4096, 0, true);
+	}
+
+	struct Access {
+		u32 vaddr;
+		u32 asid;
+		u32 write;
+	};
+
+	// Accesses mostly hit the stack/heap and a few DLL pages, switching process regularly
+	void generateAccesses(u32 count)
+	{
+		accesses.clear();
+		for (u32 i = 0; i < count; i++)
+		{
+			u32 asid = (i / 2000) % Processes + 1;
+			u32 r = rng();
+			u32 vaddr;
+			if (r % 10 < 7)
+				vaddr = 0x00010000 + (r >> 8) % 64 * 4096;
+			else if (r % 10 < 9)
+				vaddr = 0x02000000 + (r >> 8) % 32 * 4096;
+			else if (r % 20 == 9)
+				vaddr = asid * 0x02000000 + 0x00010000 + (r >> 8) % ProcessPages * 4096;
+			else
+				vaddr = 0x00010000 + (r >> 8) % ProcessPages * 4096;
+			vaddr += (r >> 4) & 0xffc;
+			accesses.push_back({ vaddr, asid, (r >> 20) & 1 });
+		}
+	}
+
+	// Translates the accesses with the page tables, then with the TLB, and checks the results match.
+	// Returns the time taken by each pass in ms.
+	void run(int loops, u64& lookupTime, u64& tlbTime)
+	{
+		std::vector<u32> paddrs(accesses.size());
+		u64 start = getTimeMs();
+		for (int loop = 0; loop < loops; loop++)
+			for (size_t i = 0; i < accesses.size(); i++)
+			{
+				setAsid(accesses[i].asid);
+				ASSERT_EQ(MmuError::NONE, translate(accesses[i], paddrs[i]));
+			}
+		lookupTime = getTimeMs() - start;
+
+		misses = 0;
+		start = getTimeMs();
+		for (int loop = 0; loop < loops; loop++)
+			for (size_t i = 0; i < accesses.size(); i++)
+			{
+				const Access& access = accesses[i];
+				setAsid(access.asid);
+				u32 paddr;
+				if (!mmuTlb.lookup(access.vaddr, access.write, paddr))
+				{
+					misses++;
+					ASSERT_EQ(MmuError::NONE, translate(access, paddr));
+					mmuTlb.fill(access.vaddr, access.write, paddr);
+				}
+				ASSERT_EQ(paddrs[i], paddr);
+			}
+		tlbTime = getTimeMs() - start;
+	}
+
+	std::vector<Access> accesses;
+	u32 misses = 0;
+
+private:
+	static constexpr u32 Processes = 4;
+	static constexpr u32 ProcessPages = 512;
+	static constexpr u32 SharedPages = 256;
+
+	void addEntry(u32 vaddr, u32 asid, bool shared)
+	{
+		TLB_Entry& entry = UTLB[0];
+		entry = {};
+		entry.Address.VPN = vaddr >> 10;
+		entry.Address.ASID = asid;
+		entry.Data.SZ0 = 1;
+		entry.Data.V = 1;
+		entry.Data.PR = 3;
+		entry.Data.D = 1;
+		entry.Data.SH = shared;
+		entry.Data.PPN = (0x0C000000 + (rng() % 4096) * 4096) >> 10;
+		UTLB_Sync(0);
+	}
+
+	static void setAsid(u32 asid)
+	{
+		CCN_PTEH.ASID = asid;
+		mmuTlb.asid = asid;
+	}
+
+	static MmuError translate(const Access& access, u32& paddr)
+	{
+		if (access.write)
+			return mmu_data_translation<MMU_TT_DWRITE>(access.vaddr, paddr);
+		else
+			return mmu_data_translation<MMU_TT_DREAD>(access.vaddr, paddr);
+	}
+
+	std::mt19937 rng{1234};
+};
+
+// The TLB returns the same translations as the page tables
+TEST_F(MmuTlbTest, Translations)
+{
+	generateAccesses(100000);
+	u64 lookupTime, tlbTime;
+	run(2, lookupTime, tlbTime);
+}
+
+// A page remapped under the same ASID isn't translated with its previous mapping
+TEST_F(MmuTlbTest, Remap)
+{
+	constexpr u32 vaddr = 0x00010123;
+	mmuTlb.flush(1);
+	CCN_PTEH.ASID = 1;
+	u32 paddr;
+	ASSERT_EQ(MmuError::NONE, mmu_data_translation<MMU_TT_DWRITE>(vaddr, paddr));
+	mmuTlb.fill(vaddr, 1, paddr);
+
+	TLB_Entry& entry = UTLB[1];
+	entry = {};
+	entry.Address.VPN = vaddr >> 10;
+	entry.Address.ASID = 1;
+	entry.Data.SZ0 = 1;
+	entry.Data.V = 1;
+	entry.Data.PR = 3;
+	entry.Data.D = 1;
+	entry.Data.PPN = 0x0C123000 >> 10;
+	UTLB_Sync(1);
+
+	ASSERT_FALSE(mmuTlb.lookup(vaddr, 0, paddr));
+	ASSERT_FALSE(mmuTlb.lookup(vaddr, 1, paddr));
+	ASSERT_EQ(MmuError::NONE, mmu_data_translation<MMU_TT_DREAD>(vaddr, paddr));
+	ASSERT_EQ(0x0C123123u, paddr);
+	mmuTlb.fill(vaddr, 0, paddr);
+	ASSERT_TRUE(mmuTlb.lookup(vaddr, 0, paddr));
+	ASSERT_EQ(0x0C123123u, paddr);
+
+	// Shared pages are invalidated for all ASIDs
+	constexpr u32 sharedVaddr = 0x02000010;
+	ASSERT_EQ(MmuError::NONE, mmu_data_translation<MMU_TT_DREAD>(sharedVaddr, paddr));
+	mmuTlb.fill(sharedVaddr, 0, paddr);
+	entry.Address.VPN = sharedVaddr >> 10;
+	entry.Address.ASID = 2;
+	entry.Data.SH = 1;
+	entry.Data.PPN = 0x0C456000 >> 10;
+	UTLB_Sync(1);
+	ASSERT_FALSE(mmuTlb.lookup(sharedVaddr, 0, paddr));
+	CCN_PTEH.ASID = 2;
+	ASSERT_EQ(MmuError::NONE, mmu_data_translation<MMU_TT_DREAD>(sharedVaddr, paddr));
+	ASSERT_EQ(0x0C456010u, paddr);
+}
+
+TEST_F(MmuTlbTest, DISABLED_Benchmark)
+{
+	generateAccesses(1000000);
+	constexpr int Loops = 10;
+	u64 lookupTime, tlbTime;
+	run(Loops, lookupTime, tlbTime);
+	const double count = (double)accesses.size() * Loops;
+	printf("MMU lookups: %.1f ns, with TLB: %.1f ns, TLB hit rate %.2f%%\n",
+			lookupTime * 1e6 / count, tlbTime * 1e6 / count, 100.0 * (1.0 - misses / count));
+	ASSERT_LT(misses, count / 10);
+}
+#endif
@@ -0,0 +1,193 @@
+#include "gtest/gtest.h"
+#include "types.h"
+#include "archive/rzip.h"
+#include <zlib.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+class RZipTest : public ::testing::Test
+{
+protected:
+	void SetUp() override
+	{
+		path = ::testing::TempDir() + "rzip_test.bin";
+		// savestate-like data: zeroed areas, repeated patterns and noise
+		data.resize(10_MB + 12345);
+		std::mt19937 rng(42);
+		for (size_t i = 0; i < data.size(); i += 4096)
+		{
+			const size_t end = std::min(data.size(), i + 4096);
+			switch (rng() % 3)
+			{
+			case 0:
+				break;
+			case 1:
+				for (size_t j = i; j < end; j++)
+					data[j] = (u8)(j / 16);
+				break;
+			default:
+				for (size_t j = i; j < end; j++)
+					data[j] = rng() % 16;
+				break;
+			}
+		}
+	}
+
+	void TearDown() override {
+		std::remove(path.c_str());
+	}
+
+	std::vector<u8> readFile() const
+	{
+		std::vector<u8> content;
+		FILE *f = std::fopen(path.c_str(), "rb");
+		if (f == nullptr)
+			return content;
+		std::fseek(f, 0, SEEK_END);
+		content.resize(std::ftell(f));
+		std::fseek(f, 0, SEEK_SET);
+		if (std::fread(content.data(), 1, content.size(), f) != content.size())
+			content.clear();
+		std::fclose(f);
+		return content;
+	}
+
+	// Writes and reads back the data. Returns the compression and decompression times in seconds.
+	void roundTrip(RZipFile::Codec codec, double& writeTime, double& readTime)
+	{
+		auto start = std::chrono::steady_clock::now();
+		RZipFile zip;
+		ASSERT_TRUE(zip.Open(path, true, codec));
+		ASSERT_EQ(data.size(), zip.Write(data.data(), data.size()));
+		zip.Close();
+		writeTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		start = std::chrono::steady_clock::now();
+		ASSERT_TRUE(zip.Open(path, false));
+		ASSERT_EQ(data.size(), zip.Size());
+		std::vector<u8> out(data.size());
+		ASSERT_EQ(out.size(), zip.Read(out.data(), out.size()));
+		zip.Close();
+		readTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		ASSERT_EQ(0, memcmp(data.data(), out.data(), data.size()));
+	}
+
+	void benchmark(RZipFile::Codec codec)
+	{
+		double writeTime, readTime;
+		roundTrip(codec, writeTime, readTime);
+		printf("%s: %zu KB, compression %.0f MB/s, decompression %.0f MB/s\n", codec == RZipFile::Codec::Zlib ? "zlib" : "zstd",
+				readFile().size() / 1024, data.size() / 1e6 / writeTime, data.size() / 1e6 / readTime);
+	}
+
+	std::string path;
+	std::vector<u8> data;
+};
+
+// Files must be identical to the ones written by the sequential implementation
+TEST_F(RZipTest, ZlibFormat)
+{
+	const u8 header[8] = { '#', 'R', 'Z', 'I', 'P', 'v', 1, '#' };
+	const u32 maxChunkSize = 1_MB;
+	const u64 size = data.size();
+	std::vector<u8> reference(header, header + sizeof(header));
+	reference.insert(reference.end(), (const u8 *)&maxChunkSize, (const u8 *)(&maxChunkSize + 1));
+	reference.insert(reference.end(), (const u8 *)&size, (const u8 *)(&size + 1));
+	std::vector<u8> zipped(maxChunkSize + maxChunkSize / 1000 + 12);
+	for (size_t offset = 0; offset < data.size(); offset += maxChunkSize)
+	{
+		uLongf zippedSize = zipped.size();
+		ASSERT_EQ(Z_OK, compress(zipped.data(), &zippedSize, &data[offset], std::min<size_t>(maxChunkSize, data.size() - offset)));
+		const u32 sz = (u32)zippedSize;
+		reference.insert(reference.end(), (const u8 *)&sz, (const u8 *)(&sz + 1));
+		reference.insert(reference.end(), zipped.data(), zipped.data() + zippedSize);
+	}
+
+	RZipFile zip;
+	ASSERT_TRUE(zip.Open(path, true));
+	ASSERT_EQ(data.size(), zip.Write(data.data(), data.size()));
+	zip.Close();
+	ASSERT_EQ(reference, readFile());
+}
+
+TEST_F(RZipTest, Zlib)
+{
+	double writeTime, readTime;
+	roundTrip(RZipFile::Codec::Zlib, writeTime, readTime);
+}
+
+#ifdef USE_ZSTD
+TEST_F(RZipTest, Zstd)
+{
+	double writeTime, readTime;
+	roundTrip(RZipFile::Codec::Zstd, writeTime, readTime);
+}
+#else
+// zstd files can't be opened and mustn't be mistaken for uncompressed data
+TEST_F(RZipTest, Unsupported)
+{
+	RZipFile zip;
+	ASSERT_TRUE(zip.Open(path, true));
+	ASSERT_EQ(100u, zip.Write(data.data(), 100));
+	zip.Close();
+	std::vector<u8> content = readFile();
+	content[6] |= 0x80;
+	FILE *f = std::fopen(path.c_str(), "wb");
+	ASSERT_NE(nullptr, f);
+	ASSERT_EQ(content.size(), std::fwrite(content.data(), 1, content.size(), f));
+	std::fclose(f);
+
+	f = std::fopen(path.c_str(), "rb");
+	ASSERT_NE(nullptr, f);
+	ASSERT_FALSE(zip.Open(f, false));
+	ASSERT_TRUE(zip.Unsupported());
+	// the caller gets the file back at its original position
+	ASSERT_EQ(0, std::ftell(f));
+	std::fclose(f);
+}
+#endif
+
+TEST_F(RZipTest, DISABLED_Benchmark)
+{
+	benchmark(RZipFile::Codec::Zlib);
+#ifdef USE_ZSTD
+	benchmark(RZipFile::Codec::Zstd);
+#endif
+}
+
+// Several writes of various sizes, read back in different pieces
+TEST_F(RZipTest, Pieces)
+{
+	const size_t sizes[] = { 1, 100, 1_MB - 1, 3_MB + 5, 1_MB, 7 };
+	RZipFile zip;
+	ASSERT_TRUE(zip.Open(path, true));
+	size_t offset = 0;
+	for (size_t size : sizes)
+	{
+		ASSERT_EQ(size, zip.Write(&data[offset], size));
+		offset += size;
+	}
+	zip.Close();
+
+	ASSERT_TRUE(zip.Open(path, false));
+	ASSERT_EQ(offset, zip.Size());
+	std::vector<u8> out(offset);
+	const size_t reads[] = { 3, 2_MB + 1, 50, 4_MB };
+	size_t readOffset = 0;
+	for (size_t size : reads)
+	{
+		size = std::min(size, offset - readOffset);
+		ASSERT_EQ(size, zip.Read(&out[readOffset], size));
+		readOffset += size;
+	}
+	ASSERT_EQ(offset, readOffset);
+	// end of file
+	u8 b;
+	ASSERT_EQ(0u, zip.Read(&b, 1));
+	zip.Close();
+	ASSERT_EQ(0, memcmp(data.data(), out.data(), offset));
+}
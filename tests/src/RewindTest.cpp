@@ -0,0 +1,163 @@
+#include "gtest/gtest.h"
+#include "types.h"
+#include "emulator.h"
+#include "rewind.h"
+#include "hw/mem/addrspace.h"
+#include "hw/mem/mem_watch.h"
+#include "hw/sh4/sh4_if.h"
+#include "cfg/option.h"
+#include "oslib/oslib.h"
+#include <xxhash.h>
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+class RewindTest : public ::testing::Test {
+protected:
+	static constexpr u32 Interval = 4;
+	// random writes per frame
+	static constexpr u32 RamWrites = 400;
+	static constexpr u32 VramWrites = 100;
+
+	void SetUp() override
+	{
+		if (!addrspace::reserve())
+			die("addrspace::reserve failed");
+		config::Rewind.override(true);
+		config::RewindInterval.override(Interval);
+		emu.init();
+		emu.dc_reset(true);
+		os_InstallFaultHandler();
+	}
+
+	void TearDown() override
+	{
+		rewinder::setRewinding(false);
+		memwatch::unprotect();
+		memwatch::reset();
+		rewinder::reset();
+		config::RewindBudget.reset();
+		config::RewindInterval.reset();
+		config::Rewind.reset();
+		os_UninstallFaultHandler();
+	}
+
+	void frame()
+	{
+		for (u32 i = 0; i < RamWrites; i++)
+			mem_b[rng() % RAM_SIZE] = rng();
+		for (u32 i = 0; i < VramWrites; i++)
+			vram[rng() % VRAM_SIZE] = rng();
+		rewinder::endOfFrame();
+		rewinder::nextFrame();
+	}
+
+	static u64 hash() {
+		return XXH3_64bits(&mem_b[0], RAM_SIZE) ^ XXH3_64bits(&vram[0], VRAM_SIZE);
+	}
+
+	std::mt19937 rng{42};
+};
+
+TEST_F(RewindTest, Delta)
+{
+	std::vector<u8> ref(0x50003);
+	for (size_t i = 0; i < ref.size(); i++)
+		ref[i] = rng();
+	for (u32 changes : { 0, 1, 100, 10000, 0x50003 })
+	{
+		std::vector<u8> data = ref;
+		for (u32 i = 0; i < changes; i++)
+			data[rng() % data.size()] = rng();
+		for (u32 size : { 0u, 1u, 7u, (u32)PAGE_SIZE, (u32)data.size() })
+		{
+			std::vector<u8> packed(rewinder::delta::maxSize(size));
+			const u32 packedSize = rewinder::delta::pack(data.data(), ref.data(), size, packed.data());
+			ASSERT_LE(packedSize, packed.size());
+			std::vector<u8> unpacked = ref;
+			ASSERT_EQ(packedSize, rewinder::delta::unpack(packed.data(), unpacked.data(), size));
+			ASSERT_EQ(0, memcmp(data.data(), unpacked.data(), size)) << changes << " changes, size " << size;
+		}
+	}
+}
+
+// Runs some frames and rewinds them, checking the memory and cpu state at each snapshot
+TEST_F(RewindTest, History)
+{
+	constexpr u32 Snapshots = 100;
+	memwatch::unprotect();
+	memwatch::reset();
+	memwatch::protect();
+
+	std::vector<u64> hashes;
+	std::vector<u32> regs;
+	for (u32 i = 0; i <= (Snapshots - 1) * Interval; i++)
+	{
+		Sh4cntx.r[0] = i;
+		frame();
+		// a snapshot is taken at the end of the frame
+		if (i % Interval == 0)
+		{
+			hashes.push_back(hash());
+			regs.push_back(i);
+		}
+	}
+	rewinder::Stats stats = rewinder::getStats();
+	ASSERT_EQ(Snapshots, stats.snapshots);
+	ASSERT_EQ((Snapshots - 1) * Interval, stats.frames);
+
+	rewinder::setRewinding(true);
+	for (int i = Snapshots - 2; i >= 0; i--)
+	{
+		// run a frame and go back to the previous snapshot
+		frame();
+		ASSERT_EQ(hashes[i], hash()) << "snapshot " << i;
+		ASSERT_EQ(regs[i], Sh4cntx.r[0]) << "snapshot " << i;
+	}
+	ASSERT_EQ(1u, rewinder::getStats().snapshots);
+	// the oldest snapshot is kept
+	frame();
+	ASSERT_EQ(hashes[0], hash());
+}
+
+TEST_F(RewindTest, Budget)
+{
+	config::RewindBudget.override(2);
+	memwatch::unprotect();
+	memwatch::reset();
+	memwatch::protect();
+	for (u32 i = 0; i < 200 * Interval; i++)
+		frame();
+	rewinder::Stats stats = rewinder::getStats();
+	ASSERT_LT(stats.snapshots, 200u);
+	// the newest snapshot is always kept
+	ASSERT_TRUE(stats.size <= 2_MB || stats.snapshots == 1);
+}
+
+TEST_F(RewindTest, DISABLED_Benchmark)
+{
+	constexpr u32 Snapshots = 100;
+	memwatch::unprotect();
+	memwatch::reset();
+	memwatch::protect();
+
+	std::chrono::steady_clock::duration snapshotTime{};
+	for (u32 i = 0; i <= (Snapshots - 1) * Interval; i++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		frame();
+		if (i % Interval == 0)
+			snapshotTime += std::chrono::steady_clock::now() - start;
+	}
+	rewinder::Stats stats = rewinder::getStats();
+
+	rewinder::setRewinding(true);
+	auto start = std::chrono::steady_clock::now();
+	for (u32 i = 0; i < Snapshots - 1; i++)
+		frame();
+	std::chrono::steady_clock::duration rewindTime = std::chrono::steady_clock::now() - start;
+	printf("Rewind: %.3f ms per snapshot, %.3f ms per rewind, %.1f KB per second of history\n",
+			std::chrono::duration<double, std::milli>(snapshotTime).count() / Snapshots, std::chrono::duration<double, std::milli>(rewindTime).count() / (Snapshots - 1),
+			stats.size / 1024.0 / (stats.frames / 60.0));
+}
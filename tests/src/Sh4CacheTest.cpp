@@ -0,0 +1,189 @@
+#include "gtest/gtest.h"
+#include "types.h"
+#include "emulator.h"
+#include "hw/mem/addrspace.h"
+#include "hw/sh4/sh4_cache.h"
+#include "hw/sh4/sh4_mmr.h"
+
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <vector>
+
+class Sh4CacheTest : public ::testing::Test {
+protected:
+	static constexpr u32 RamOffset = 0x100000;
+	// twice the size of the cache
+	static constexpr u32 Size = 0x8000;
+
+	void SetUp() override
+	{
+		if (!addrspace::reserve())
+			die("addrspace::reserve failed");
+		emu.init();
+		emu.dc_reset(true);
+		CCN_CCR.OCE = 1;
+		CCN_CCR.CB = 1;
+		CCN_CCR.WT = 0;
+		ocache.Reset(true);
+		memory.resize(Size);
+		for (u32 i = 0; i < Size; i++)
+		{
+			memory[i] = (u8)(i * 7);
+			addrspace::write8(0xac000000 + RamOffset + i, memory[i]);
+		}
+	}
+
+	void TearDown() override
+	{
+		CCN_CCR.reg_data = 0;
+		ocache.Reset(true);
+	}
+
+	template<class T>
+	static u64 read(u32 addr) {
+		return ReadCachedMemNoMmu<T>(addr);
+	}
+	template<class T>
+	static void write(u32 addr, u64 value) {
+		WriteCachedMemNoMmu<T>(addr, (T)value);
+	}
+
+	// Random accesses through P0 and P1. hits is the number of reads that hit by address key.
+	void randomAccesses(u32 count, u32& hits)
+	{
+		std::mt19937 rng(42);
+		std::mt19937_64 data(7);
+		hits = 0;
+		for (u32 i = 0; i < count; i++)
+		{
+			const u32 r = rng();
+			const u32 size = 1 << (r & 3);
+			const u32 offset = ((r >> 2) % Size) & ~(size - 1);
+			const u32 addr = ((r >> 18) & 1 ? 0x8c000000 : 0x0c000000) + RamOffset + offset;
+			const u32 action = (r >> 19) % 64;
+			if (action < 36)
+			{
+				u64 ref = 0;
+				memcpy(&ref, &memory[offset], size);
+				u64 value;
+				if (ocache.readKeys[Sh4OCache::keyIndex(addr)] == (addr & Sh4OCache::KeyMask))
+					hits++;
+				switch (size)
+				{
+				case 1:
+					value = (u8)read<u8>(addr);
+					break;
+				case 2:
+					value = (u16)read<u16>(addr);
+					break;
+				case 4:
+					value = read<u32>(addr);
+					break;
+				default:
+					value = read<u64>(addr);
+					break;
+				}
+				ASSERT_EQ(ref, value) << "access " << i << " address " << std::hex << addr;
+			}
+			else if (action < 62)
+			{
+				const u64 value = data();
+				memcpy(&memory[offset], &value, size);
+				switch (size)
+				{
+				case 1:
+					write<u8>(addr, value);
+					break;
+				case 2:
+					write<u16>(addr, value);
+					break;
+				case 4:
+					write<u32>(addr, value);
+					break;
+				default:
+					write<u64>(addr, value);
+					break;
+				}
+			}
+			else if (action == 62)
+			{
+				// ocbwb or ocbp
+				ocache.WriteBack(addr, true, (r >> 25) & 1);
+			}
+			else
+			{
+				// switch P0 between copy-back and write-through
+				CCN_CCR.WT ^= 1;
+				ocache.resetKeys();
+			}
+		}
+		ocache.WriteBackAll();
+		ASSERT_EQ(0, memcmp(GetMemPtr(0x8c000000 + RamOffset, Size), memory.data(), Size));
+	}
+
+	// what the cpu should see
+	std::vector<u8> memory;
+};
+
+TEST_F(Sh4CacheTest, Keys)
+{
+	const u32 p1 = 0x8c000000 + RamOffset + 0x124;
+	const u32 p0 = p1 & 0x1fffffff;
+	const u32 p2 = p0 | 0xa0000000;
+	const u32 index = Sh4OCache::keyIndex(p1);
+
+	read<u32>(p1);
+	ASSERT_EQ(p1 & Sh4OCache::KeyMask, ocache.readKeys[index]);
+	ASSERT_EQ(Sh4OCache::InvalidKey, ocache.writeKeys[index]);
+	// copy-back
+	write<u32>(p1, 0x12345678);
+	ASSERT_EQ(p1 & Sh4OCache::KeyMask, ocache.writeKeys[index]);
+	ASSERT_TRUE(ocache.dirty[index]);
+	// same line through another area
+	ASSERT_EQ(0x12345678u, read<u32>(p0));
+	ASSERT_EQ(p0 & Sh4OCache::KeyMask, ocache.readKeys[index]);
+	// uncached area
+	ASSERT_NE(0x12345678u, read<u32>(p2));
+	// unaligned accesses never hit
+	ASSERT_NE(Sh4OCache::key<u32>(p0 + 1), ocache.readKeys[index]);
+
+	// write-through
+	CCN_CCR.WT = 1;
+	ocache.resetKeys();
+	write<u32>(p0, 1);
+	ASSERT_EQ(Sh4OCache::InvalidKey, ocache.writeKeys[index]);
+	ASSERT_EQ(1u, read<u32>(p2));
+	ASSERT_EQ(1u, read<u32>(p0));
+	ASSERT_EQ(p0 & Sh4OCache::KeyMask, ocache.readKeys[index]);
+
+	// ocbp
+	ocache.WriteBack(p1, true, true);
+	ASSERT_EQ(Sh4OCache::InvalidKey, ocache.readKeys[index]);
+	ASSERT_FALSE(ocache.valid[index]);
+
+	// other index modes don't use keys
+	CCN_CCR.OIX = 1;
+	ocache.resetKeys();
+	read<u32>(p1);
+	for (u32 key : ocache.readKeys)
+		ASSERT_EQ(Sh4OCache::InvalidKey, key);
+}
+
+// Random accesses through P0 and P1 return the last data written, with or without keys
+TEST_F(Sh4CacheTest, Coherency)
+{
+	u32 hits;
+	randomAccesses(100000, hits);
+	ASSERT_GT(hits, 0u);
+}
+
+TEST_F(Sh4CacheTest, DISABLED_Benchmark)
+{
+	constexpr u32 Accesses = 1000000;
+	u32 hits;
+	auto start = std::chrono::steady_clock::now();
+	randomAccesses(Accesses, hits);
+	const double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	printf("Operand cache: %.1f ns per access, %.1f%% of reads hit by address key\n", ns / Accesses, hits * 100.0 / (Accesses * 36 / 64));
+}
@@ -19,6 +19,10 @@
 #include "sh4_ops.h"
 #include "emulator.h"
 #include "hw/sh4/sh4_mem.h"
+#include "hw/sh4/sh4_interpreter.h"
+#include "oslib/oslib.h"
+
+#include <chrono>
 
 class Sh4InterpreterTest : public Sh4OpTest {
 protected:
@@ -102,3 +106,167 @@ TEST_F(Sh4InterpreterTest, DoubleFloatingPointTest)
 {
 	Sh4OpTest::DoubleFloatingPointTest();
 }
+TEST_F(Sh4InterpreterTest, VectorTest)
+{
+	Sh4OpTest::VectorTest();
+}
+
+class Sh4BenchInterpreter : public Sh4Interpreter
+{
+public:
+	void runSlice(bool predecode)
+	{
+		if (predecode)
+			ExecuteDecoded();
+		else
+			do
+				ExecuteOpcode(ReadNexOp());
+			while (ctx->cycle_counter > 0);
+		ctx->cycle_counter += SH4_TIMESLICE;
+	}
+
+	// Executes the instruction or fused pair at pc as ExecuteDecoded does
+	void stepDecoded()
+	{
+		DecodedOp *dop = decodeCache.get(ctx->pc);
+		if (dop != nullptr)
+			dop->handler(this, *dop);
+		else
+			ExecuteOpcode(ReadNexOp());
+	}
+};
+
+class Sh4PredecodeTest : public Sh4InterpreterTest
+{
+protected:
+	// Runs the same loop with and without the decode cache and checks they reach the same state.
+	// Returns the MIPS of both paths.
+	void runLoop(u32 slices, double mips[2])
+	{
+		constexpr u32 CodeAddr = 0x8c100000;
+		constexpr u32 StackAddr = 0x8c200000;
+		const u16 program[] = {
+			0xe064,	// start: mov #100,r0
+			0x2f16,	// loop: mov.l r1,@-r15
+			0x2f26,	// mov.l r2,@-r15
+			0x7301,	// add #1,r3
+			0x6433,	// mov r3,r4
+			0x4400,	// shll r4
+			0x62f6,	// mov.l @r15+,r2
+			0x61f6,	// mov.l @r15+,r1
+			0x4010,	// dt r0
+			0x8bf6,	// bf loop
+			0xaff4,	// bra start
+			0x0009,	// nop
+		};
+		for (u32 i = 0; i < std::size(program); i++)
+			addrspace::write16(CodeAddr + i * 2, program[i]);
+
+		Sh4BenchInterpreter interp;
+		interp.Init();
+		Sh4Interpreter::Instance = &interp;
+		u32 regs[2][16];
+		u32 pc[2];
+		for (int predecode = 0; predecode < 2; predecode++)
+		{
+			interp.Reset(false);
+			ctx->r[15] = StackAddr;
+			ctx->pc = CodeAddr;
+			auto start = std::chrono::steady_clock::now();
+			for (u32 i = 0; i < slices; i++)
+				interp.runSlice(predecode);
+			std::chrono::duration<double, std::micro> time = std::chrono::steady_clock::now() - start;
+			// 9 instructions per iteration and 3 more every 100 iterations
+			u32 instructions = ctx->r[3] * 9 + ctx->r[3] / 100 * 3;
+			mips[predecode] = instructions / time.count();
+			std::copy(std::begin(ctx->r), std::end(ctx->r), regs[predecode]);
+			pc[predecode] = ctx->pc;
+		}
+		// unlock the code page
+		interp.ResetCache();
+		Sh4Interpreter::Instance = nullptr;
+
+		for (int i = 0; i < 16; i++)
+			ASSERT_EQ(regs[0][i], regs[1][i]);
+		ASSERT_EQ(pc[0], pc[1]);
+	}
+};
+
+// The interpreter reaches the same state with and without the decode cache
+TEST_F(Sh4PredecodeTest, SameState)
+{
+	double mips[2];
+	runLoop(2000, mips);
+}
+
+// Microbenchmark: the same loop run by the interpreter with and without the decode cache.
+TEST_F(Sh4PredecodeTest, DISABLED_Benchmark)
+{
+	double mips[2];
+	runLoop(200000, mips);
+	printf("Interpreter: %.1f MIPS, pre-decoded: %.1f MIPS\n", mips[0], mips[1]);
+}
+
+#if FEAT_SHREC != DYNAREC_NONE
+// Writing to a decoded page, including to the second instruction of a fused pair, discards its decoded instructions
+TEST_F(Sh4PredecodeTest, CodeWrite)
+{
+	constexpr u32 CodeAddr = 0x8c100000;
+	constexpr u32 StackAddr = 0x8c200000;
+	os_InstallFaultHandler();
+	const u16 program[] = {
+		0x61f6,	// mov.l @r15+,r1
+		0x62f6,	// mov.l @r15+,r2
+		0x4010,	// dt r0
+		0x8b05,	// bf +5
+	};
+	for (u32 i = 0; i < std::size(program); i++)
+		addrspace::write16(CodeAddr + i * 2, program[i]);
+	addrspace::write32(StackAddr, 1);
+	addrspace::write32(StackAddr + 4, 2);
+
+	Sh4BenchInterpreter interp;
+	interp.Init();
+	Sh4Interpreter::Instance = &interp;
+	interp.Reset(false);
+	ctx->cycle_counter = SH4_TIMESLICE;
+	auto run = [&](u32 pc, u32 r0) {
+		ctx->pc = pc;
+		ctx->r[0] = r0;
+		ctx->r[1] = ctx->r[2] = 0;
+		ctx->r[3] = 3;
+		ctx->r[15] = StackAddr;
+		interp.stepDecoded();
+	};
+	// fused pop pair
+	run(CodeAddr, 0);
+	ASSERT_NE(nullptr, decodeCache.get(CodeAddr));
+	ASSERT_EQ(CodeAddr + 4, ctx->pc);
+	ASSERT_EQ(1u, ctx->r[1]);
+	ASSERT_EQ(2u, ctx->r[2]);
+	// fused dt/bf, branch taken
+	run(CodeAddr + 4, 2);
+	ASSERT_EQ(CodeAddr + 6 + 4 + 5 * 2, ctx->pc);
+	ASSERT_EQ(1u, ctx->r[0]);
+
+	// mov r3,r2
+	addrspace::write16(CodeAddr + 2, 0x6233);
+	run(CodeAddr, 0);
+	ASSERT_EQ(1u, ctx->r[1]);
+	interp.stepDecoded();
+	ASSERT_EQ(CodeAddr + 4, ctx->pc);
+	ASSERT_EQ(3u, ctx->r[2]);
+
+	// add #5,r3
+	addrspace::write16(CodeAddr + 6, 0x7305);
+	run(CodeAddr + 4, 2);
+	ASSERT_EQ(1u, ctx->r[0]);
+	interp.stepDecoded();
+	ASSERT_EQ(CodeAddr + 8, ctx->pc);
+	ASSERT_EQ(8u, ctx->r[3]);
+
+	interp.ResetCache();
+	Sh4Interpreter::Instance = nullptr;
+	os_UninstallFaultHandler();
+}
+#endif
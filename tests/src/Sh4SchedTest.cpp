@@ -0,0 +1,476 @@
+#include "gtest/gtest.h"
+#include "types.h"
+#include "hw/mem/addrspace.h"
+#include "hw/sh4/sh4_if.h"
+#include "hw/sh4/sh4_sched.h"
+#include "hw/sh4/dyna/idleloop.h"
+#include "cfg/option.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+class Scheduler
+{
+public:
+	virtual ~Scheduler() = default;
+	virtual int registerCallback(int tag, sh4_sched_callback *cb, void *arg) = 0;
+	virtual void unregister(int id) = 0;
+	virtual void request(int id, int cycles) = 0;
+	virtual u64 now() = 0;
+	// Same as UpdateSystem_INTC
+	virtual void runSlice() = 0;
+};
+
+class Sh4Scheduler : public Scheduler
+{
+public:
+	int registerCallback(int tag, sh4_sched_callback *cb, void *arg) override
+	{
+		int id = sh4_sched_register(tag, cb, arg);
+		ids.push_back(id);
+		return id;
+	}
+	void unregister(int id) override {
+		sh4_sched_unregister(id);
+	}
+	void request(int id, int cycles) override {
+		sh4_sched_request(id, cycles);
+	}
+	u64 now() override {
+		return sh4_sched_now64();
+	}
+	void runSlice() override
+	{
+		Sh4cntx.sh4_sched_next -= SH4_TIMESLICE;
+		if (Sh4cntx.sh4_sched_next < 0)
+			sh4_sched_tick(SH4_TIMESLICE);
+		// the cpu requests are made at the start of the timeslice
+		Sh4cntx.cycle_counter = Sh4cntx.slice_cycles;
+	}
+
+	// ids returned by sh4_sched_register
+	std::vector<int> ids;
+};
+
+// Timeslices last until the next event, as with config::EventBatching
+class BatchedScheduler : public Sh4Scheduler
+{
+public:
+	void runSlice() override
+	{
+		// the cpu runs the whole timeslice
+		const int cycles = Sh4cntx.slice_cycles;
+		Sh4cntx.slice_cycles = SH4_TIMESLICE;
+		Sh4cntx.sh4_sched_next -= cycles;
+		if (Sh4cntx.sh4_sched_next < 0)
+			sh4_sched_tick(cycles);
+		Sh4cntx.slice_cycles = sh4_sched_slice(true);
+		Sh4cntx.cycle_counter = Sh4cntx.slice_cycles;
+	}
+};
+
+// The cpu runs an idle loop, which fast-forwards to the next event
+class IdleScheduler : public Sh4Scheduler
+{
+public:
+	void runSlice() override
+	{
+		// first iteration of the loop
+		Sh4cntx.cycle_counter = Sh4cntx.slice_cycles - 12;
+		idleloop::fastForward(0x8c001000);
+		// same as UpdateSystem_INTC
+		const int cycles = Sh4cntx.slice_cycles;
+		Sh4cntx.slice_cycles = SH4_TIMESLICE;
+		Sh4cntx.sh4_sched_next -= cycles;
+		if (Sh4cntx.sh4_sched_next < 0)
+			sh4_sched_tick(cycles);
+		Sh4cntx.slice_cycles = sh4_sched_slice(config::EventBatching);
+		Sh4cntx.cycle_counter = Sh4cntx.slice_cycles;
+	}
+};
+
+// The scheduler as it was before the callbacks were indexed by end time
+class LinearScheduler : public Scheduler
+{
+public:
+	// ids are assigned in the given order so that they match the ones of the sh4 scheduler
+	LinearScheduler(const std::vector<int>& ids) : ids(ids) {}
+
+	int registerCallback(int tag, sh4_sched_callback *cb, void *arg) override
+	{
+		int id = ids[nextRegistration++];
+		if (id >= (int)list.size())
+			list.resize(id + 1, { nullptr, nullptr, 0, -1, -1 });
+		list[id] = { cb, arg, tag, -1, -1 };
+		return id;
+	}
+
+	void unregister(int id) override
+	{
+		if (id == (int)list.size() - 1)
+			list.resize(list.size() - 1);
+		else
+		{
+			list[id].cb = nullptr;
+			list[id].end = -1;
+		}
+		ffts();
+	}
+
+	void request(int id, int cycles) override
+	{
+		Entry& sched = list[id];
+		sched.start = now32();
+		if (cycles == -1)
+		{
+			sched.end = -1;
+		}
+		else
+		{
+			sched.end = sched.start + cycles;
+			if (sched.end == -1)
+				sched.end++;
+		}
+		ffts();
+	}
+
+	u64 now() override {
+		return ffb - next;
+	}
+
+	void runSlice() override
+	{
+		next -= SH4_TIMESLICE;
+		if (next < 0)
+			tick(SH4_TIMESLICE);
+	}
+
+private:
+	struct Entry
+	{
+		sh4_sched_callback* cb;
+		void *arg;
+		int tag;
+		int start;
+		int end;
+	};
+
+	u32 now32() {
+		return ffb - next;
+	}
+
+	static u32 remaining(const Entry& sched, u32 reference)
+	{
+		if (sched.end != -1)
+			return sched.end - reference;
+		else
+			return -1;
+	}
+
+	void ffts()
+	{
+		u32 diff = -1;
+		int slot = -1;
+
+		u32 now = now32();
+		for (const Entry& sched : list)
+		{
+			u32 rem = remaining(sched, now);
+			if (rem < diff)
+			{
+				slot = &sched - &list[0];
+				diff = rem;
+			}
+		}
+		ffb -= next;
+		nextId = slot;
+		if (slot != -1)
+			next = diff;
+		else
+			next = SH4_MAIN_CLOCK;
+		ffb += next;
+	}
+
+	void handleCallback(int id)
+	{
+		Entry& sched = list[id];
+		int remain = sched.end - sched.start;
+		int elapsed = now32() - sched.start;
+		sched.start = now32();
+		int jitter = elapsed - remain;
+
+		sched.end = -1;
+		int reschedule = sched.cb(sched.tag, remain, jitter, sched.arg);
+		if (reschedule > 0)
+			request(id, std::max(0, reschedule - jitter));
+	}
+
+	void tick(int cycles)
+	{
+		u32 fztime = now32() - cycles;
+		if (nextId != -1)
+		{
+			for (u32 id = 0; id < list.size(); id++)
+			{
+				int rem = remaining(list[id], fztime);
+				if (rem >= 0 && rem <= cycles)
+					handleCallback(id);
+			}
+		}
+		ffts();
+	}
+
+	std::vector<Entry> list;
+	u64 ffb = 0;
+	int next = 0;
+	int nextId = -1;
+	std::vector<int> ids;
+	size_t nextRegistration = 0;
+};
+
+/*
+	Simulated devices with various periods. Their callbacks randomly schedule,
+	reschedule or cancel other devices.
+*/
+class Workload
+{
+public:
+	struct Call
+	{
+		int tag;
+		int cycles;
+		int jitter;
+		u64 now;
+
+		bool operator==(const Call& other) const {
+			return tag == other.tag && cycles == other.cycles && jitter == other.jitter && now == other.now;
+		}
+	};
+
+	static constexpr int Devices = 12;
+	static constexpr int Periods[Devices] { 448, 1000, 2500, 7000, 13000, 33333, 64, 895, 12345, 100000, 200000, 3300000 };
+
+	Workload(Scheduler& sched) : sched(sched)
+	{
+		for (int i = 0; i < Devices; i++)
+			ids[i] = sched.registerCallback(i, callback, this);
+	}
+
+	~Workload()
+	{
+		for (int i = Devices - 1; i >= 0; i--)
+			sched.unregister(ids[i]);
+	}
+
+	void run(u32 slices)
+	{
+		for (int i = 0; i < Devices; i += 2)
+			sched.request(ids[i], Periods[i]);
+		for (u32 slice = 0; slice < slices; slice++)
+		{
+			u32 r = cpuRng();
+			// requests from the cpu
+			if (r % 16 == 0)
+				sched.request(ids[(r >> 4) % Devices], (r >> 8) % 20000);
+			// a device is replaced by another one
+			if (r % 4096 == 1)
+			{
+				int i = (r >> 12) % Devices;
+				sched.unregister(ids[i]);
+				ids[i] = sched.registerCallback(i, callback, this);
+			}
+			sched.runSlice();
+		}
+	}
+
+	// Runs until the given time without requests from the cpu. Returns the number of timeslices.
+	u32 runIdle(u64 endTime)
+	{
+		for (int i = 0; i < Devices; i += 2)
+			sched.request(ids[i], Periods[i]);
+		u32 slices = 0;
+		for (; sched.now() < endTime; slices++)
+			sched.runSlice();
+		// the last timeslice may end after endTime
+		while (!calls.empty() && calls.back().now >= endTime)
+			calls.pop_back();
+		return slices;
+	}
+
+	std::vector<Call> calls;
+
+private:
+	static int callback(int tag, int cycles, int jitter, void *arg)
+	{
+		Workload& w = *(Workload *)arg;
+		w.calls.push_back({ tag, cycles, jitter, w.sched.now() });
+		u32 r = w.rng();
+		int other = w.ids[(r >> 8) % Devices];
+		switch (r % 8)
+		{
+		case 0:
+			w.sched.request(other, 0);
+			break;
+		case 1:
+			w.sched.request(other, (r >> 16) % 5000);
+			break;
+		case 2:
+			w.sched.request(other, -1);
+			break;
+		case 3:
+			// one-shot
+			return 0;
+		default:
+			break;
+		}
+		return Periods[tag];
+	}
+
+	Scheduler& sched;
+	int ids[Devices];
+	std::mt19937 rng{ 42 };
+	// independent from the callbacks so that devices are registered in the same order
+	std::mt19937 cpuRng{ 7 };
+};
+
+class Sh4SchedTest : public ::testing::Test {
+protected:
+	void SetUp() override
+	{
+		if (!addrspace::reserve())
+			die("addrspace::reserve failed");
+		sh4_sched_reset(true);
+		Sh4cntx.slice_cycles = SH4_TIMESLICE;
+		Sh4cntx.cycle_counter = SH4_TIMESLICE;
+	}
+};
+
+// The callbacks are called in the same order and at the same time as with a linear search
+TEST_F(Sh4SchedTest, ReplayOrder)
+{
+	constexpr u32 Slices = 500000;
+	Sh4Scheduler sh4Sched;
+	std::vector<Workload::Call> calls;
+	{
+		Workload workload(sh4Sched);
+		workload.run(Slices);
+		calls = std::move(workload.calls);
+	}
+	LinearScheduler linearSched(sh4Sched.ids);
+	Workload workload(linearSched);
+	workload.run(Slices);
+
+	ASSERT_EQ(workload.calls.size(), calls.size());
+	for (size_t i = 0; i < calls.size(); i++)
+		ASSERT_TRUE(workload.calls[i] == calls[i]) << "call " << i << " tag " << calls[i].tag << " expected tag " << workload.calls[i].tag;
+	printf("Scheduler replay: %zd callbacks\n", calls.size());
+	sh4_sched_reset(true);
+}
+
+// Batched timeslices end when the next event is due
+TEST_F(Sh4SchedTest, BatchedSlices)
+{
+	constexpr u32 Slices = 100000;
+	u64 time;
+	size_t callbacks;
+	{
+		Sh4Scheduler sh4Sched;
+		Workload workload(sh4Sched);
+		workload.run(Slices);
+		time = sh4Sched.now();
+		callbacks = workload.calls.size();
+	}
+	sh4_sched_reset(true);
+	BatchedScheduler batchedSched;
+	Workload workload(batchedSched);
+	workload.run(Slices);
+
+	for (const Workload::Call& call : workload.calls)
+		ASSERT_TRUE(call.jitter >= 0 && call.jitter <= SH4_TIMESLICE) << "tag " << call.tag << " jitter " << call.jitter;
+	const double frameCycles = SH4_MAIN_CLOCK / 60.0;
+	const double batchedTime = batchedSched.now();
+	ASSERT_GT(batchedTime, time);
+	printf("Slices per frame: %.1f -> %.1f, callbacks per frame: %.1f -> %.1f\n",
+			Slices * frameCycles / time, Slices * frameCycles / batchedTime,
+			callbacks * frameCycles / time, workload.calls.size() * frameCycles / batchedTime);
+	sh4_sched_reset(true);
+}
+
+// Idle loops skip timeslices but the callbacks are called at the same time
+TEST_F(Sh4SchedTest, IdleLoop)
+{
+	constexpr u64 EndTime = SH4_MAIN_CLOCK / 10;
+	config::DynarecIdleLoops.override(true);
+	for (bool batch : { false, true })
+	{
+		config::EventBatching.override(batch);
+		std::vector<Workload::Call> calls;
+		u32 slices;
+		{
+			Sh4Scheduler sh4Sched;
+			BatchedScheduler batchedSched;
+			Workload workload(batch ? batchedSched : sh4Sched);
+			slices = workload.runIdle(EndTime);
+			calls = std::move(workload.calls);
+		}
+		sh4_sched_reset(true);
+		Sh4cntx.slice_cycles = SH4_TIMESLICE;
+		Sh4cntx.cycle_counter = SH4_TIMESLICE;
+		IdleScheduler idleSched;
+		u32 idleSlices;
+		{
+			Workload workload(idleSched);
+			idleSlices = workload.runIdle(EndTime);
+
+			ASSERT_EQ(calls.size(), workload.calls.size()) << "batch " << batch;
+			for (size_t i = 0; i < calls.size(); i++)
+				ASSERT_TRUE(workload.calls[i] == calls[i]) << "batch " << batch << " call " << i << " tag " << calls[i].tag;
+		}
+		if (batch)
+			ASSERT_EQ(slices, idleSlices);
+		else
+			ASSERT_LT(idleSlices, slices);
+		sh4_sched_reset(true);
+		Sh4cntx.slice_cycles = SH4_TIMESLICE;
+		Sh4cntx.cycle_counter = SH4_TIMESLICE;
+	}
+	config::EventBatching.reset();
+	config::DynarecIdleLoops.reset();
+}
+
+// The time of the cpu requests and timer reads includes the cycles executed in the current batched timeslice
+TEST_F(Sh4SchedTest, MidSliceRequest)
+{
+	static u64 callTime;
+	auto callback = [](int tag, int cycles, int jitter, void *arg) {
+		callTime = sh4_sched_now64();
+		// the callbacks run at the end of the timeslice
+		EXPECT_EQ(callTime, sh4_sched_cpu_now64());
+		return 0;
+	};
+	BatchedScheduler sched;
+	const int farId = sched.registerCallback(0, callback, nullptr);
+	const int id = sched.registerCallback(1, callback, nullptr);
+	sched.request(farId, SH4_MAIN_CLOCK / 100);
+	Sh4cntx.slice_cycles = sh4_sched_slice(true);
+	Sh4cntx.cycle_counter = Sh4cntx.slice_cycles;
+	ASSERT_EQ(SH4_MAX_TIMESLICE, Sh4cntx.slice_cycles);
+
+	// the cpu executes 5000 cycles then requests an event in 1000 cycles
+	Sh4cntx.cycle_counter -= 5000;
+	const u64 requestTime = sh4_sched_cpu_now64();
+	ASSERT_EQ(sched.now() + 5000, requestTime);
+	callTime = 0;
+	sched.request(id, 1000);
+	// the elapsed time is unchanged
+	ASSERT_EQ(requestTime, sh4_sched_cpu_now64());
+	ASSERT_LT(Sh4cntx.slice_cycles, SH4_MAX_TIMESLICE);
+
+	sched.runSlice();
+	ASSERT_GE(callTime, requestTime + 1000);
+	ASSERT_LE(callTime, requestTime + 1000 + SH4_TIMESLICE);
+	sched.unregister(id);
+	sched.unregister(farId);
+	sh4_sched_reset(true);
+}
@@ -0,0 +1,206 @@
+#include "gtest/gtest.h"
+#include "types.h"
+#include "emulator.h"
+#include "hw/mem/addrspace.h"
+#include "hw/sh4/dyna/blockmanager.h"
+#include "hw/sh4/dyna/ssa.h"
+#include "hw/sh4/dyna/fpscrspec.h"
+#include "cfg/option.h"
+
+#include <algorithm>
+
+class SsaTest : public ::testing::Test {
+protected:
+	void SetUp() override
+	{
+		if (!addrspace::reserve())
+			die("addrspace::reserve failed");
+		emu.init();
+		emu.dc_reset(true);
+		block.vaddr = block.addr = 0x8c010000;
+		block.BlockType = BET_DynamicRet;
+	}
+
+	void TearDown() override
+	{
+		// Not registered in the block manager
+		block.sh4_code_size = 0;
+		config::DynarecIdleLoops.reset();
+	}
+
+	void emit(shilop op, shil_param rd, shil_param rs1, shil_param rs2 = shil_param(), u32 size = 0)
+	{
+		shil_opcode sp;
+		sp.op = op;
+		sp.rd = rd;
+		sp.rs1 = rs1;
+		sp.rs2 = rs2;
+		sp.size = size;
+		sp.guest_offs = block.oplist.size() * 2;
+		block.oplist.push_back(sp);
+	}
+	// mov.l rm,@-r15 as emitted by the decoder
+	void push(Sh4RegType reg)
+	{
+		emit(shop_sub, reg_r15, reg_r15, shil_param(4));
+		emit(shop_writem, shil_param(), reg_r15, reg, 4);
+	}
+	// mov.l @r15+,rn
+	void pop(Sh4RegType reg)
+	{
+		emit(shop_readm, reg, reg_r15, shil_param(), 4);
+		emit(shop_add, reg_r15, reg_r15, shil_param(4));
+	}
+
+	// Loops while the value read by the first op is 0
+	bool isIdleLoop()
+	{
+		config::DynarecIdleLoops.override(true);
+		emit(shop_seteq, reg_sr_T, reg_r0, shil_param(0));
+		block.BlockType = BET_Cond_1;
+		block.BranchBlock = block.vaddr;
+		block.guest_opcodes = 3;
+		SSAOptimizer(&block).Optimize();
+		return block.oplist.back().op == shop_idle;
+	}
+
+	// Returns the last op writing to reg
+	const shil_opcode *lastWrite(Sh4RegType reg) const
+	{
+		for (auto it = block.oplist.rbegin(); it != block.oplist.rend(); ++it)
+			if (it->rd.is_reg() && it->rd._reg == reg)
+				return &*it;
+		return nullptr;
+	}
+
+	RuntimeBlockInfo block {};
+};
+
+// The same stack slot is reused by consecutive push/pop pairs
+TEST_F(SsaTest, StackSlotReuse)
+{
+	push(reg_r1);
+	pop(reg_r3);
+	push(reg_r2);
+	pop(reg_r4);
+	SSAOptimizer::resetMemStats();
+	SSAOptimizer(&block).Optimize();
+
+	ASSERT_EQ(2u, SSAOptimizer::getMemStats().forwardedLoads);
+	const shil_opcode *op = lastWrite(reg_r3);
+	ASSERT_NE(nullptr, op);
+	ASSERT_EQ(shop_mov32, op->op);
+	ASSERT_EQ(reg_r1, op->rs1._reg);
+	op = lastWrite(reg_r4);
+	ASSERT_NE(nullptr, op);
+	ASSERT_EQ(shop_mov32, op->op);
+	ASSERT_EQ(reg_r2, op->rs1._reg);
+}
+
+// A store to an overlapping location invalidates the stored value
+TEST_F(SsaTest, StackOverlap)
+{
+	push(reg_r1);
+	// mov.w r2,@r15
+	emit(shop_writem, shil_param(), reg_r15, reg_r2, 2);
+	pop(reg_r3);
+	SSAOptimizer::resetMemStats();
+	SSAOptimizer(&block).Optimize();
+
+	ASSERT_EQ(0u, SSAOptimizer::getMemStats().forwardedLoads);
+	const shil_opcode *op = lastWrite(reg_r3);
+	ASSERT_NE(nullptr, op);
+	ASSERT_EQ(shop_readm, op->op);
+}
+
+// Stores through a mirror of the same memory update the forwarded value
+TEST_F(SsaTest, AliasedStore)
+{
+	emit(shop_writem, shil_param(), shil_param(0x8c001000), reg_r1, 4);
+	// P2 and another area 3 mirror
+	emit(shop_writem, shil_param(), shil_param(0xad001000), reg_r2, 4);
+	emit(shop_readm, reg_r3, shil_param(0x0c001000), shil_param(), 4);
+	SSAOptimizer(&block).Optimize();
+
+	const shil_opcode *op = lastWrite(reg_r3);
+	ASSERT_NE(nullptr, op);
+	ASSERT_EQ(shop_mov32, op->op);
+	ASSERT_EQ(reg_r2, op->rs1._reg);
+}
+
+// Constants read from the block pages are folded and their line is protected with the code
+TEST_F(SsaTest, ConstantRead)
+{
+	block.read_only = true;
+	block.sh4_code_size = 0x20;
+	addrspace::write32(0x8c010404, 42);
+	emit(shop_readm, reg_r0, shil_param(0x8c010404), shil_param(), 4);
+	// Not in the block pages
+	emit(shop_readm, reg_r1, shil_param(0x8c011000), shil_param(), 4);
+	SSAOptimizer(&block).Optimize();
+
+	const shil_opcode *op = lastWrite(reg_r0);
+	ASSERT_NE(nullptr, op);
+	ASSERT_EQ(shop_mov32, op->op);
+	ASSERT_EQ(42u, op->rs1.imm_value());
+	op = lastWrite(reg_r1);
+	ASSERT_NE(nullptr, op);
+	ASSERT_EQ(shop_readm, op->op);
+	ASSERT_EQ(1ull << 4, block.data_lines[0]);
+	ASSERT_EQ(0u, block.data_lines[1]);
+}
+
+// A block compiled for another fpu mode exits at the fpscr guard with the registers written before it
+TEST_F(SsaTest, FpscrGuardExit)
+{
+	constexpr u32 exitPc = 0x8c010004;
+	emit(shop_mov32, reg_r1, shil_param(1));
+	emit(shop_add, reg_r2, reg_r2, shil_param(4));
+	// predicted PR=0, given back 3 cycles on exit
+	emit(shop_guard_fpscr, shil_param(), shil_param(exitPc), shil_param(0), 3);
+	block.oplist.back().rs3 = shil_param(fpscrspec::ModeMask);
+	emit(shop_mov32, reg_r1, shil_param(2));
+	emit(shop_add, reg_r2, reg_r2, shil_param(4));
+	SSAOptimizer(&block).Optimize();
+
+	auto guard = std::find_if(block.oplist.begin(), block.oplist.end(), [](const shil_opcode& op) {
+		return op.op == shop_guard_fpscr;
+	});
+	ASSERT_NE(block.oplist.end(), guard);
+	ASSERT_EQ(exitPc, guard->rs1.imm_value());
+	ASSERT_EQ(0u, guard->rs2.imm_value());
+	ASSERT_EQ(fpscrspec::ModeMask, guard->rs3.imm_value());
+	ASSERT_EQ(3u, guard->size);
+	// r1 and r2 are up to date when the guard exits the block
+	bool r1Written = false;
+	int r2Writes = 0;
+	for (auto it = block.oplist.begin(); it != guard; ++it)
+	{
+		if (it->rd.is_reg() && it->rd._reg == reg_r1)
+			r1Written = it->op == shop_mov32 && it->rs1.is_imm() && it->rs1.imm_value() == 1;
+		if (it->rd.is_reg() && it->rd._reg == reg_r2)
+			r2Writes++;
+	}
+	ASSERT_TRUE(r1Written);
+	ASSERT_EQ(1, r2Writes);
+}
+
+TEST_F(SsaTest, IdleLoopRam)
+{
+	emit(shop_readm, reg_r0, shil_param(0x8c001000), shil_param(), 4);
+	ASSERT_TRUE(isIdleLoop());
+}
+
+TEST_F(SsaTest, IdleLoopTimer)
+{
+	// TMU TCNT0
+	emit(shop_readm, reg_r0, shil_param(0xffd8000c), shil_param(), 4);
+	ASSERT_FALSE(isIdleLoop());
+}
+
+TEST_F(SsaTest, IdleLoopRegisterAddress)
+{
+	// The address is loaded outside of the loop and may point to a timer
+	emit(shop_readm, reg_r0, reg_r4, shil_param(), 4);
+	ASSERT_FALSE(isIdleLoop());
+}
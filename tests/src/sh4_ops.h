@@ -23,6 +23,9 @@
 #include "types.h"
 #include "hw/sh4/sh4_if.h"
 #include "hw/mem/addrspace.h"
+#include "hw/sh4/dyna/fpu_vector.h"
+#include <cmath>
+#include <random>
 
 constexpr u32 REG_MAGIC = 0xbaadf00d;
 
@@ -77,6 +80,7 @@ protected:
 	u32& macl() { return ctx->mac.h; }
 	sr_t& sr() { return ctx->sr; }
 	f32& fr(int regNum) { checkedRegs.insert((u32 *)&ctx->fr[regNum]); return ctx->fr[regNum]; }
+	f32& xf(int regNum) { checkedRegs.insert((u32 *)&ctx->xf[regNum]); return ctx->xf[regNum]; }
 	double getDr(int regNum) {
 		checkedRegs.insert((u32 *)&ctx->fr[regNum * 2]);
 		checkedRegs.insert((u32 *)&ctx->fr[regNum * 2 + 1]);
@@ -1463,4 +1467,56 @@ protected:
 		ASSERT_EQ(*(float *)&ctx->fpul, 0.25f);
 		AssertState();
 	}
+
+	// The dynarecs and the canonical implementation use fpu_fipr() and fpu_ftrv(),
+	// whose results must be identical to the interpreter's.
+	void VectorTest()
+	{
+		ctx->fpscr.PR = 0;
+		ctx->fpscr.SZ = 0;
+		std::mt19937 gen(42);
+		std::uniform_real_distribution<float> mantissa(-1.f, 1.f);
+		// wide exponent range to exercise the rounding of the sums
+		std::uniform_int_distribution<int> exponent(-24, 24);
+		const auto random = [&]() { return std::ldexp(mantissa(gen), exponent(gen)); };
+
+		for (int i = 0; i < 100; i++)
+		{
+			ClearRegs();
+			for (int j = 0; j < 8; j++)
+				fr(j) = random();
+			f32 expected = fpu_fipr(&ctx->fr[4], &ctx->fr[0]);
+			PrepareOp(0xF4ED);	// fipr fv0, fv4
+			RunOp();
+			ASSERT_EQ(fr(7), expected);
+			AssertState();
+
+			ClearRegs();
+			for (int j = 8; j < 12; j++)
+				fr(j) = random();
+			expected = fpu_fipr(&ctx->fr[8], &ctx->fr[8]);
+			PrepareOp(0xFAED);	// fipr fv8, fv8
+			RunOp();
+			ASSERT_EQ(fr(11), expected);
+			AssertState();
+
+			ClearRegs();
+			for (int j = 0; j < 16; j++)
+				xf(j) = random();
+			for (int j = 4; j < 12; j++)
+				fr(j) = random();
+			f32 expected4[4], expected8[4];
+			fpu_ftrv(expected4, &ctx->fr[4], ctx->xf);
+			fpu_ftrv(expected8, &ctx->fr[8], ctx->xf);
+			PrepareOp(0xF5FD,	// ftrv xmtrx, fv4
+					0xF9FD);	// ftrv xmtrx, fv8
+			RunOp(2);
+			for (int j = 0; j < 4; j++)
+			{
+				ASSERT_EQ(fr(4 + j), expected4[j]);
+				ASSERT_EQ(fr(8 + j), expected8[j]);
+			}
+			AssertState();
+		}
+	}
 };
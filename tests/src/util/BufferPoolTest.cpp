@@ -0,0 +1,58 @@
+#include "gtest/gtest.h"
+#include "util/buffer_pool.h"
+#include <algorithm>
+#include <cstring>
+
+class BufferPoolTest : public ::testing::Test
+{
+};
+
+TEST_F(BufferPoolTest, Reuse)
+{
+	BufferPool pool;
+	pool.setCapacity(100000);
+	ASSERT_GE(pool.capacity(), 100000u);
+	pool.reserve(10);
+	const uint64_t allocated = pool.allocatedBytes();
+	ASSERT_EQ(10 * pool.capacity(), allocated);
+	ASSERT_EQ(allocated, pool.memorySize());
+
+	// a rollback window of 10 states
+	std::vector<uint8_t *> states;
+	for (int frame = 0; frame < 1000; frame++)
+	{
+		if (states.size() == 10)
+		{
+			pool.release(states.front());
+			states.erase(states.begin());
+		}
+		uint8_t *buffer = pool.alloc();
+		ASSERT_NE(nullptr, buffer);
+		memset(buffer, frame, pool.capacity());
+		states.push_back(buffer);
+	}
+	ASSERT_EQ(allocated, pool.allocatedBytes());
+	for (uint8_t *buffer : states)
+		pool.release(buffer);
+	ASSERT_EQ(allocated, pool.memorySize());
+	pool.clear();
+	ASSERT_EQ(0u, pool.memorySize());
+}
+
+TEST_F(BufferPoolTest, Grow)
+{
+	BufferPool pool;
+	pool.setCapacity(1000);
+	uint8_t *small = pool.alloc();
+	pool.reserve(2);
+	pool.setCapacity(1000000);
+	// only the buffer in use is left
+	ASSERT_EQ(65536u, pool.memorySize());
+	uint8_t *big = pool.alloc();
+	memset(big, 0, pool.capacity());
+	pool.release(small);
+	pool.release(big);
+	ASSERT_EQ(pool.capacity(), pool.memorySize());
+	ASSERT_EQ(big, pool.alloc());
+	pool.release(big);
+}